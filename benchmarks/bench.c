@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/* Latency samples kept per measurement; later operations are only counted. */
+#define BENCH_MAX_SAMPLES (1 << 20)
+
+static const char *out_suite;
+static const char *out_path;
+static char **results;
+static size_t nr_results;
+
+static uint64_t default_max_ops = 1000000;
+static uint64_t default_max_ns = 1000000000ULL;
+
+void
+bench_set_output(const char *suite, const char *path)
+{
+    out_suite = suite;
+    out_path = path;
+}
+
+void
+bench_set_limits(uint64_t max_ops, uint64_t max_ms)
+{
+    if (max_ops != 0) {
+        default_max_ops = max_ops;
+    }
+    if (max_ms != 0) {
+        default_max_ns = max_ms * 1000000ULL;
+    }
+}
+
+void
+bench_start(bench_t *b)
+{
+    memset(b, 0, sizeof(*b));
+
+    b->max_ops = default_max_ops;
+    b->max_ns = default_max_ns;
+    b->max_lat = b->max_ops < BENCH_MAX_SAMPLES ? b->max_ops
+                                                : BENCH_MAX_SAMPLES;
+    b->lat = malloc(b->max_lat * sizeof(*b->lat));
+    if (b->lat == NULL) {
+        err(EXIT_FAILURE, "failed to allocate latency samples");
+    }
+    b->start_ns = bench_now_ns();
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const uint64_t *sorted, size_t n, unsigned int per_mille)
+{
+    size_t i = (n * per_mille) / 1000;
+
+    return sorted[i < n ? i : n - 1];
+}
+
+static void
+add_result(char *json)
+{
+    char **r = realloc(results, (nr_results + 1) * sizeof(*results));
+
+    if (r == NULL) {
+        err(EXIT_FAILURE, "failed to record result");
+    }
+    results = r;
+    results[nr_results++] = json;
+}
+
+void
+bench_report(bench_t *b, const char *name, const char *params, ...)
+{
+    char pbuf[256] = "";
+    double secs, ops_per_sec, mb_per_sec;
+    char *json;
+    va_list ap;
+    int ret;
+
+    b->elapsed_ns = bench_now_ns() - b->start_ns;
+    secs = b->elapsed_ns / 1e9;
+    ops_per_sec = secs > 0 ? b->ops / secs : 0;
+    mb_per_sec = secs > 0 ? b->bytes / secs / (1 << 20) : 0;
+
+    if (params != NULL) {
+        va_start(ap, params);
+        vsnprintf(pbuf, sizeof(pbuf), params, ap);
+        va_end(ap);
+    }
+
+    if (b->nr_lat > 0) {
+        uint64_t *s = b->lat;
+        size_t n = b->nr_lat;
+
+        qsort(s, n, sizeof(*s), cmp_u64);
+
+        printf("%-24s %-28s ops=%-9lu ops/s=%-11.0f MB/s=%-9.1f "
+               "p50=%luns p99=%luns p99.9=%luns\n", name, pbuf,
+               (unsigned long)b->ops, ops_per_sec, mb_per_sec,
+               (unsigned long)percentile(s, n, 500),
+               (unsigned long)percentile(s, n, 990),
+               (unsigned long)percentile(s, n, 999));
+
+        ret = asprintf(&json,
+            "{\"name\":\"%s\",\"params\":\"%s\",\"ops\":%lu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+            "\"lat_ns\":{\"min\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+            "\"p999\":%lu,\"max\":%lu}}",
+            name, pbuf, (unsigned long)b->ops, secs, ops_per_sec, mb_per_sec,
+            (unsigned long)s[0],
+            (unsigned long)percentile(s, n, 500),
+            (unsigned long)percentile(s, n, 900),
+            (unsigned long)percentile(s, n, 990),
+            (unsigned long)percentile(s, n, 999),
+            (unsigned long)s[n - 1]);
+    } else {
+        printf("%-24s %-28s ops=%-9lu ops/s=%-11.0f MB/s=%-9.1f\n", name,
+               pbuf, (unsigned long)b->ops, ops_per_sec, mb_per_sec);
+
+        ret = asprintf(&json,
+            "{\"name\":\"%s\",\"params\":\"%s\",\"ops\":%lu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f}",
+            name, pbuf, (unsigned long)b->ops, secs, ops_per_sec, mb_per_sec);
+    }
+    fflush(stdout);
+
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to format result");
+    }
+    add_result(json);
+
+    free(b->lat);
+    b->lat = NULL;
+}
+
+void
+bench_skip(const char *name, const char *reason)
+{
+    char *json;
+
+    printf("%-24s skipped: %s\n", name, reason);
+    fflush(stdout);
+
+    if (asprintf(&json, "{\"name\":\"%s\",\"params\":\"\",\"skipped\":\"%s\"}",
+                 name, reason) < 0) {
+        err(EXIT_FAILURE, "failed to format result");
+    }
+    add_result(json);
+}
+
+void
+bench_finish(void)
+{
+    FILE *fp;
+    size_t i;
+
+    if (out_path != NULL) {
+        if ((fp = fopen(out_path, "w")) == NULL) {
+            err(EXIT_FAILURE, "failed to open %s", out_path);
+        }
+
+        fprintf(fp, "{\"suite\":\"%s\",\"time\":%ld,\"results\":[\n",
+                out_suite, (long)time(NULL));
+        for (i = 0; i < nr_results; i++) {
+            fprintf(fp, "  %s%s\n", results[i], i + 1 < nr_results ? "," : "");
+        }
+        fprintf(fp, "]}\n");
+
+        if (fclose(fp) != 0) {
+            err(EXIT_FAILURE, "failed to write %s", out_path);
+        }
+    }
+
+    for (i = 0; i < nr_results; i++) {
+        free(results[i]);
+    }
+    free(results);
+    results = NULL;
+    nr_results = 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Shared benchmark harness: timing, latency percentiles and result output.
+ *
+ * A benchmark collects samples in a bench_t and calls bench_report(). Each
+ * result is printed as a line of text and, if an output file was given with
+ * bench_set_output(), also recorded in a JSON document written by
+ * bench_finish(), which benchmarks/compare.py can diff against another run.
+ */
+
+#ifndef LIB_VFIO_USER_BENCH_H
+#define LIB_VFIO_USER_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    /* Per-operation latencies, in nanoseconds. */
+    uint64_t *lat;
+    size_t nr_lat;
+    size_t max_lat;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+    /* Limits: stop after either. */
+    uint64_t max_ops;
+    uint64_t max_ns;
+} bench_t;
+
+static inline uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sets the file the JSON results are written to by bench_finish().
+ */
+void
+bench_set_output(const char *suite, const char *path);
+
+/*
+ * Sets the default limits applied by bench_start(): at most @max_ops
+ * operations and at most @max_ms milliseconds, whichever comes first.
+ */
+void
+bench_set_limits(uint64_t max_ops, uint64_t max_ms);
+
+/*
+ * Starts a measurement.
+ */
+void
+bench_start(bench_t *b);
+
+/*
+ * Returns whether another operation should be run.
+ */
+static inline bool
+bench_next(bench_t *b)
+{
+    return b->ops < b->max_ops &&
+           ((b->ops & 63) != 0 || bench_now_ns() - b->start_ns < b->max_ns);
+}
+
+/*
+ * Records @nr_ops operations that took @ns nanoseconds altogether and moved
+ * @bytes bytes. For batches, every operation is accounted the mean latency.
+ */
+static inline void
+bench_record(bench_t *b, uint64_t ns, uint64_t nr_ops, uint64_t bytes)
+{
+    if (b->nr_lat < b->max_lat) {
+        b->lat[b->nr_lat++] = ns / (nr_ops != 0 ? nr_ops : 1);
+    }
+    b->ops += nr_ops;
+    b->bytes += bytes;
+}
+
+/*
+ * Ends a measurement, prints it and records it under @name, with @params
+ * (a printf format) distinguishing variants of the same benchmark.
+ */
+void
+bench_report(bench_t *b, const char *name, const char *params, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+ * Records that benchmark @name could not run in this environment.
+ */
+void
+bench_skip(const char *name, const char *reason);
+
+/*
+ * Writes the JSON results, if requested.
+ */
+void
+bench_finish(void);
+
+#endif /* LIB_VFIO_USER_BENCH_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2022, Nutanix Inc. All rights reserved.
+ *     Author: Thanos Makatos <thanos@nutanix.com>
+ *             Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *             Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+
+/*
+ * Round-trip latency of a config space read against a blocking context, with
+ * and without vfu_setup_busy_poll(). Reports latency percentiles for both.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "libvfio-user.h"
+
+struct req {
+    struct vfio_user_header hdr;
+    struct vfio_user_region_access access;
+} __attribute__((packed));
+
+struct rsp {
+    struct vfio_user_header hdr;
+    struct vfio_user_region_access access;
+    uint32_t val;
+} __attribute__((packed));
+
+static void *
+server_thread(void *arg)
+{
+    vfu_ctx_t *vfu_ctx = arg;
+
+    if (vfu_attach_ctx(vfu_ctx) < 0) {
+        err(EXIT_FAILURE, "vfu_attach_ctx");
+    }
+
+    /* Returns once the client disconnects. */
+    (void) vfu_run_ctx(vfu_ctx);
+    return NULL;
+}
+
+static int
+connect_ctx(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct {
+        struct vfio_user_header hdr;
+        struct vfio_user_version version;
+    } __attribute__((packed)) msg = {
+        .hdr = {
+            .cmd = VFIO_USER_VERSION,
+            .msg_size = sizeof(msg),
+        },
+        .version = {
+            .major = LIB_VFIO_USER_MAJOR,
+            .minor = LIB_VFIO_USER_MINOR,
+        },
+    };
+    char buf[4096];
+    struct vfio_user_header *rhdr = (void *)buf;
+    int sock;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        err(EXIT_FAILURE, "socket");
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errx(EXIT_FAILURE, "socket path too long: %s", path);
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    /* The server thread may not be listening yet. */
+    while (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            err(EXIT_FAILURE, "connect %s", path);
+        }
+        usleep(1000);
+    }
+
+    if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        err(EXIT_FAILURE, "send version");
+    }
+    if (recv(sock, buf, sizeof(*rhdr), MSG_WAITALL) != sizeof(*rhdr) ||
+        rhdr->flags.error) {
+        errx(EXIT_FAILURE, "bad version reply");
+    }
+    if (recv(sock, buf + sizeof(*rhdr), rhdr->msg_size - sizeof(*rhdr),
+             MSG_WAITALL) < 0) {
+        err(EXIT_FAILURE, "recv version");
+    }
+
+    return sock;
+}
+
+static void
+run(const char *path, uint32_t idle_us, useconds_t gap_us)
+{
+    vfu_ctx_t *vfu_ctx;
+    pthread_t tid;
+    bench_t b;
+    int sock;
+
+    unlink(path);
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, path, 0, NULL, VFU_DEV_TYPE_PCI);
+    if (vfu_ctx == NULL) {
+        err(EXIT_FAILURE, "vfu_create_ctx");
+    }
+    if (vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                     PCI_HEADER_TYPE_NORMAL, 0) < 0) {
+        err(EXIT_FAILURE, "vfu_pci_init");
+    }
+    if (vfu_realize_ctx(vfu_ctx) < 0) {
+        err(EXIT_FAILURE, "vfu_realize_ctx");
+    }
+    if (vfu_setup_busy_poll(vfu_ctx, idle_us) < 0) {
+        err(EXIT_FAILURE, "vfu_setup_busy_poll");
+    }
+
+    if ((errno = pthread_create(&tid, NULL, server_thread, vfu_ctx)) != 0) {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    sock = connect_ctx(path);
+
+    bench_start(&b);
+    while (bench_next(&b)) {
+        struct req req = {
+            .hdr = {
+                .msg_id = b.ops,
+                .cmd = VFIO_USER_REGION_READ,
+                .msg_size = sizeof(req),
+            },
+            .access = {
+                .region = VFU_PCI_DEV_CFG_REGION_IDX,
+                .count = sizeof(uint32_t),
+            },
+        };
+        struct rsp rsp;
+        uint64_t start = bench_now_ns();
+
+        if (send(sock, &req, sizeof(req), 0) != sizeof(req)) {
+            err(EXIT_FAILURE, "send");
+        }
+        if (recv(sock, &rsp, sizeof(rsp), MSG_WAITALL) != sizeof(rsp) ||
+            rsp.hdr.flags.error) {
+            errx(EXIT_FAILURE, "bad reply");
+        }
+
+        bench_record(&b, bench_now_ns() - start, 1, 0);
+
+        /* Think time, so the server has a chance to go idle. */
+        if (gap_us != 0) {
+            usleep(gap_us);
+        }
+    }
+
+    bench_report(&b, "cfg_read_rtt", "busy_poll_us=%u gap_us=%u", idle_us,
+                 gap_us);
+
+    close(sock);
+    pthread_join(tid, NULL);
+    vfu_destroy_ctx(vfu_ctx);
+    unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char path[] = "/tmp/vfu-busy-poll-XXXXXX";
+    uint32_t idle_us = 100;
+    useconds_t gap_us = 0;
+    size_t iters = 100000;
+    int opt;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "b:g:n:j:")) != -1) {
+        switch (opt) {
+        case 'b':
+            idle_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            gap_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iters = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            bench_set_output("busy-poll", optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b busy_poll_us] [-g gap_us] "
+                    "[-n iterations] [-j results.json]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (iters == 0) {
+        errx(EXIT_FAILURE, "need at least one iteration");
+    }
+
+    if ((fd = mkstemp(path)) < 0) {
+        err(EXIT_FAILURE, "mkstemp");
+    }
+    close(fd);
+
+    /* A fixed number of iterations, however long they take. */
+    bench_set_limits(iters, UINT32_MAX);
+
+    /* Baseline: plain blocking vfu_run_ctx(). */
+    run(path, 0, gap_us);
+    run(path, idle_us, gap_us);
+
+    bench_finish();
+
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
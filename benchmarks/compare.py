@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+#
+# Compares two sets of benchmark results, as written by the -j option of the
+# benchmarks, and flags regressions: a benchmark whose throughput dropped, or
+# whose p99 latency rose, by more than the threshold. Exits with status 1 if
+# there are any.
+#
+#   compare.py [-t percent] base.json new.json
+#
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        doc = json.load(f)
+    return {(r["name"], r["params"]): r for r in doc["results"]
+            if "skipped" not in r}
+
+
+def change(old, new):
+    if old == 0:
+        return 0.0
+    return (new - old) * 100.0 / old
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare benchmark results")
+    parser.add_argument("-t", "--threshold", type=float, default=10.0,
+                        help="regression threshold in percent (default 10)")
+    parser.add_argument("base")
+    parser.add_argument("new")
+    args = parser.parse_args()
+
+    base = load(args.base)
+    new = load(args.new)
+    regressions = 0
+
+    print("%-20s %-32s %12s %8s %10s %8s" %
+          ("name", "params", "ops/s", "change", "p99 ns", "change"))
+
+    for key in sorted(base.keys() & new.keys()):
+        old, cur = base[key], new[key]
+        ops = change(old["ops_per_sec"], cur["ops_per_sec"])
+        p99 = None
+        if "lat_ns" in old and "lat_ns" in cur:
+            p99 = change(old["lat_ns"]["p99"], cur["lat_ns"]["p99"])
+
+        flag = ""
+        if ops < -args.threshold or (p99 is not None and p99 > args.threshold):
+            flag = "  REGRESSION"
+            regressions += 1
+
+        print("%-20s %-32s %12.0f %+7.1f%% %10s %8s%s" %
+              (key[0], key[1], cur["ops_per_sec"], ops,
+               cur["lat_ns"]["p99"] if p99 is not None else "-",
+               "%+7.1f%%" % p99 if p99 is not None else "-", flag))
+
+    for key in sorted(base.keys() ^ new.keys()):
+        print("%-20s %-32s only in %s" %
+              (key[0], key[1], args.base if key in base else args.new))
+
+    if regressions:
+        print("%d regression(s) beyond %.1f%%" % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
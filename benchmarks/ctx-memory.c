@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Measures the memory an idle device costs: for each device count, creates
+ * and realizes that many PCI devices with a BAR, an interrupt and a
+ * capability, none of them connected, and reports the bytes per device both
+ * as accounted by vfu_ctx_memory_usage() and as seen by malloc, which also
+ * includes the transport.
+ */
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <err.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "libvfio-user.h"
+#include "pci_caps/pm.h"
+
+static ssize_t
+bar0_access(vfu_ctx_t *vfu_ctx UNUSED, char *buf UNUSED, size_t count,
+            loff_t offset UNUSED, bool is_write UNUSED)
+{
+    return count;
+}
+
+static void
+raise_fd_limit(size_t needed)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        err(EXIT_FAILURE, "getrlimit");
+    }
+    if (rl.rlim_cur < needed) {
+        rl.rlim_cur = MIN(needed, rl.rlim_max);
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static vfu_ctx_t *
+create_device(const char *path)
+{
+    struct pmcap pm = { .hdr.id = PCI_CAP_ID_PM };
+    vfu_ctx_t *vfu_ctx;
+
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, path, LIBVFIO_USER_FLAG_ATTACH_NB,
+                             NULL, VFU_DEV_TYPE_PCI);
+    if (vfu_ctx == NULL) {
+        err(EXIT_FAILURE, "vfu_create_ctx");
+    }
+    if (vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_CONVENTIONAL,
+                     PCI_HEADER_TYPE_NORMAL, 0) < 0) {
+        err(EXIT_FAILURE, "vfu_pci_init");
+    }
+    if (vfu_setup_region(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX, 0x1000,
+                         bar0_access, VFU_REGION_FLAG_RW, NULL, 0, -1, 0) < 0) {
+        err(EXIT_FAILURE, "vfu_setup_region");
+    }
+    if (vfu_setup_device_nr_irqs(vfu_ctx, VFU_DEV_INTX_IRQ, 1) < 0) {
+        err(EXIT_FAILURE, "vfu_setup_device_nr_irqs");
+    }
+    if (vfu_pci_add_capability(vfu_ctx, 0, 0, &pm) < 0) {
+        err(EXIT_FAILURE, "vfu_pci_add_capability");
+    }
+    if (vfu_realize_ctx(vfu_ctx) < 0) {
+        err(EXIT_FAILURE, "vfu_realize_ctx");
+    }
+    return vfu_ctx;
+}
+
+static void
+run(size_t nr_ctxs)
+{
+    char dir[] = "/tmp/vfu-ctx-memory-XXXXXX";
+    size_t accounted = 0;
+    size_t heap_before;
+    size_t heap_after;
+    vfu_ctx_t **ctxs;
+    bench_t b;
+    size_t i;
+
+    if (mkdtemp(dir) == NULL) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+
+    ctxs = calloc(nr_ctxs, sizeof(*ctxs));
+    if (ctxs == NULL) {
+        err(EXIT_FAILURE, "calloc");
+    }
+
+    /* after bench_start(), which allocates the latency samples */
+    bench_start(&b);
+    heap_before = mallinfo2().uordblks;
+
+    for (i = 0; i < nr_ctxs; i++) {
+        uint64_t start = bench_now_ns();
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%zu", dir, i);
+        ctxs[i] = create_device(path);
+        bench_record(&b, bench_now_ns() - start, 1, 0);
+    }
+
+    heap_after = mallinfo2().uordblks;
+
+    bench_report(&b, "ctx_create", "devices=%zu", nr_ctxs);
+
+    for (i = 0; i < nr_ctxs; i++) {
+        accounted += vfu_ctx_memory_usage(ctxs[i]);
+    }
+
+    printf("%-24s devices=%-20zu accounted=%zuB/device heap=%zuB/device\n",
+           "ctx_memory", nr_ctxs, accounted / nr_ctxs,
+           (heap_after - heap_before) / nr_ctxs);
+    fflush(stdout);
+
+    for (i = 0; i < nr_ctxs; i++) {
+        char path[PATH_MAX];
+
+        vfu_destroy_ctx(ctxs[i]);
+        snprintf(path, sizeof(path), "%s/%zu", dir, i);
+        unlink(path);
+    }
+
+    rmdir(dir);
+    free(ctxs);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const size_t counts[] = { 1, 10, 100, 1000 };
+    size_t max_ctxs = 1000;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_ctxs = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            bench_set_output("ctx-memory", optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n max_devices] [-j results.json]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* a listening socket per device, plus slack */
+    raise_fd_limit(max_ctxs + 64);
+
+    for (i = 0; i < ARRAY_SIZE(counts) && counts[i] <= max_ctxs; i++) {
+        run(counts[i]);
+    }
+
+    bench_finish();
+
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
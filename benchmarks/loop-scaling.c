@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2022, Nutanix Inc. All rights reserved.
+ *     Author: Thanos Makatos <thanos@nutanix.com>
+ *             Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *             Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+
+/*
+ * Measures how request throughput of a vfu_loop_t scales with the number of
+ * hosted contexts. For each context count a single client thread keeps one
+ * config space read in flight per context.
+ */
+
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "libvfio-user.h"
+
+struct req {
+    struct vfio_user_header hdr;
+    struct vfio_user_region_access access;
+} __attribute__((packed));
+
+struct rsp {
+    struct vfio_user_header hdr;
+    struct vfio_user_region_access access;
+    uint32_t val;
+} __attribute__((packed));
+
+static void
+raise_fd_limit(size_t needed)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        err(EXIT_FAILURE, "getrlimit");
+    }
+    if (rl.rlim_cur < needed) {
+        rl.rlim_cur = MIN(needed, rl.rlim_max);
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int
+connect_ctx(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct {
+        struct vfio_user_header hdr;
+        struct vfio_user_version version;
+    } __attribute__((packed)) msg = {
+        .hdr = {
+            .cmd = VFIO_USER_VERSION,
+            .msg_size = sizeof(msg),
+        },
+        .version = {
+            .major = LIB_VFIO_USER_MAJOR,
+            .minor = LIB_VFIO_USER_MINOR,
+        },
+    };
+    char buf[4096];
+    struct vfio_user_header *rhdr = (void *)buf;
+    int sock;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        err(EXIT_FAILURE, "socket");
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errx(EXIT_FAILURE, "socket path too long: %s", path);
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err(EXIT_FAILURE, "connect %s", path);
+    }
+
+    if (send(sock, &msg, sizeof(msg), 0) != sizeof(msg)) {
+        err(EXIT_FAILURE, "send version");
+    }
+    if (recv(sock, buf, sizeof(*rhdr), MSG_WAITALL) != sizeof(*rhdr) ||
+        rhdr->flags.error) {
+        errx(EXIT_FAILURE, "bad version reply");
+    }
+    if (recv(sock, buf + sizeof(*rhdr), rhdr->msg_size - sizeof(*rhdr),
+             MSG_WAITALL) < 0) {
+        err(EXIT_FAILURE, "recv version");
+    }
+
+    return sock;
+}
+
+static void
+run(size_t nr_ctxs, const vfu_loop_attr_t *attr, size_t rounds)
+{
+    char dir[] = "/tmp/vfu-loop-scaling-XXXXXX";
+    vfu_ctx_t **ctxs;
+    vfu_loop_t *loop;
+    bench_t b;
+    int *socks;
+    size_t i, r;
+
+    if (mkdtemp(dir) == NULL) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+
+    ctxs = calloc(nr_ctxs, sizeof(*ctxs));
+    socks = calloc(nr_ctxs, sizeof(*socks));
+    if (ctxs == NULL || socks == NULL) {
+        err(EXIT_FAILURE, "calloc");
+    }
+
+    if ((loop = vfu_loop_create(attr)) == NULL) {
+        err(EXIT_FAILURE, "vfu_loop_create");
+    }
+
+    for (i = 0; i < nr_ctxs; i++) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%zu", dir, i);
+        ctxs[i] = vfu_create_ctx(VFU_TRANS_SOCK, path,
+                                 LIBVFIO_USER_FLAG_ATTACH_NB, NULL,
+                                 VFU_DEV_TYPE_PCI);
+        if (ctxs[i] == NULL) {
+            err(EXIT_FAILURE, "vfu_create_ctx");
+        }
+        if (vfu_pci_init(ctxs[i], VFU_PCI_TYPE_CONVENTIONAL,
+                         PCI_HEADER_TYPE_NORMAL, 0) < 0) {
+            err(EXIT_FAILURE, "vfu_pci_init");
+        }
+        if (vfu_realize_ctx(ctxs[i]) < 0) {
+            err(EXIT_FAILURE, "vfu_realize_ctx");
+        }
+        if (vfu_loop_add_ctx(loop, ctxs[i]) < 0) {
+            err(EXIT_FAILURE, "vfu_loop_add_ctx");
+        }
+    }
+
+    if (vfu_loop_start(loop) < 0) {
+        err(EXIT_FAILURE, "vfu_loop_start");
+    }
+
+    for (i = 0; i < nr_ctxs; i++) {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%zu", dir, i);
+        socks[i] = connect_ctx(path);
+    }
+
+    bench_start(&b);
+
+    for (r = 0; r < rounds; r++) {
+        uint64_t start = bench_now_ns();
+
+        for (i = 0; i < nr_ctxs; i++) {
+            struct req req = {
+                .hdr = {
+                    .msg_id = r,
+                    .cmd = VFIO_USER_REGION_READ,
+                    .msg_size = sizeof(req),
+                },
+                .access = {
+                    .region = VFU_PCI_DEV_CFG_REGION_IDX,
+                    .count = sizeof(uint32_t),
+                },
+            };
+
+            if (send(socks[i], &req, sizeof(req), 0) != sizeof(req)) {
+                err(EXIT_FAILURE, "send");
+            }
+        }
+
+        for (i = 0; i < nr_ctxs; i++) {
+            struct rsp rsp;
+
+            if (recv(socks[i], &rsp, sizeof(rsp), MSG_WAITALL) != sizeof(rsp) ||
+                rsp.hdr.flags.error) {
+                errx(EXIT_FAILURE, "bad reply from context %zu", i);
+            }
+        }
+
+        bench_record(&b, bench_now_ns() - start, nr_ctxs, 0);
+    }
+
+    bench_report(&b, "loop_cfg_read", "contexts=%zu threads=%u max_reqs=%u",
+                 nr_ctxs, attr->nr_threads, attr->max_reqs_per_turn);
+
+    for (i = 0; i < nr_ctxs; i++) {
+        char path[PATH_MAX];
+
+        close(socks[i]);
+        vfu_destroy_ctx(ctxs[i]);
+        snprintf(path, sizeof(path), "%s/%zu", dir, i);
+        unlink(path);
+    }
+
+    vfu_loop_destroy(loop);
+    rmdir(dir);
+    free(socks);
+    free(ctxs);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const size_t counts[] = { 1, 10, 100, 1000 };
+    vfu_loop_attr_t attr = { .nr_threads = 1 };
+    size_t max_ctxs = 1000;
+    size_t ops = 100000;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:m:n:o:j:")) != -1) {
+        switch (opt) {
+        case 't':
+            attr.nr_threads = atoi(optarg);
+            break;
+        case 'm':
+            attr.max_reqs_per_turn = atoi(optarg);
+            break;
+        case 'n':
+            max_ctxs = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            bench_set_output("loop-scaling", optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-m max_reqs_per_turn] "
+                    "[-n max_contexts] [-o ops] [-j results.json]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* listen + connection + client end per context, plus slack */
+    raise_fd_limit(3 * max_ctxs + 64);
+
+    for (i = 0; i < ARRAY_SIZE(counts) && counts[i] <= max_ctxs; i++) {
+        run(counts[i], &attr, MAX(ops / counts[i], 1));
+    }
+
+    bench_finish();
+
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,980 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Benchmark suite for the library's hot paths.
+ *
+ * A server context runs in a thread of this process, on a UNIX socket, and is
+ * driven through libvfio-user-client. Server-side APIs that don't involve the
+ * client (vfu_addr_to_sgl(), vfu_irq_trigger(), ...) are called directly from
+ * the main thread while the server thread is blocked waiting for the next
+ * request.
+ *
+ * The vsock and shmem MMIO benchmarks use fixed, system-wide resources (vsock
+ * port VSOCK_PORT and /dev/shm/ivshmem) and their server threads never exit,
+ * so they only run when explicitly selected with -f.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/vm_sockets.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "common.h"
+#include "libvfio-user.h"
+#include "libvfio-user-client.h"
+
+#define BAR0_SIZE (1 << 20)
+#define MIGR_CHUNK_MAX (1 << 20)
+#define MIGR_TOTAL (64 << 20)
+#define DMA_IOVA (1ULL << 32)
+#define SGL_BATCH 64
+
+/* As used by the vsock and shmem MMIO paths, see lib/tran_sock.c. */
+#define MMIO_BAR0_ADDR 0x100000ULL
+#define MMIO_VSOCK_PORT 31337
+#define MMIO_SHMEM_FILE "/dev/shm/ivshmem"
+#define MMIO_SHMEM_DOORBELLS 2
+
+#define MMIO_OP_READ 1
+
+struct mmio_header {
+    uint8_t operation;
+    uint64_t address;
+    uint32_t length;
+} __attribute__((packed));
+
+static char bar0[BAR0_SIZE];
+
+static vfu_ctx_t *vfu_ctx;
+static vfu_client_t *client;
+static const char *filter;
+
+static struct {
+    uint64_t remaining;
+    uint64_t chunk;
+    uint64_t prepared;
+    char data[MIGR_CHUNK_MAX];
+} migr;
+
+/*
+ * Without a filter, every benchmark except the opt-in ones runs. Otherwise,
+ * those that have one of the comma-separated filter words in their name.
+ */
+static bool
+selected(const char *name, bool opt_in)
+{
+    const char *word = filter;
+
+    if (filter == NULL) {
+        return !opt_in;
+    }
+
+    while (*word != '\0') {
+        size_t len = strcspn(word, ",");
+
+        if (len > 0 && memmem(name, strlen(name), word, len) != NULL) {
+            return true;
+        }
+        word += len + (word[len] == ',');
+    }
+    return false;
+}
+
+static ssize_t
+bar0_access(vfu_ctx_t *ctx UNUSED, char *buf, size_t count, loff_t offset,
+            bool is_write)
+{
+    if (offset < 0 || (size_t)offset + count > sizeof(bar0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (is_write) {
+        memcpy(bar0 + offset, buf, count);
+    } else {
+        memcpy(buf, bar0 + offset, count);
+    }
+    return count;
+}
+
+static int
+migr_transition(vfu_ctx_t *ctx UNUSED, vfu_migr_state_t state)
+{
+    if (state == VFU_MIGR_STATE_STOP_AND_COPY) {
+        migr.remaining = MIGR_TOTAL;
+        migr.prepared = 0;
+    }
+    return 0;
+}
+
+static uint64_t
+migr_get_pending_bytes(vfu_ctx_t *ctx UNUSED)
+{
+    /* Data made available last time around has been read. */
+    migr.remaining -= migr.prepared;
+    migr.prepared = 0;
+    return migr.remaining;
+}
+
+static int
+migr_prepare_data(vfu_ctx_t *ctx UNUSED, uint64_t *offset, uint64_t *size)
+{
+    *offset = 0;
+    *size = migr.prepared = MIN(migr.chunk, migr.remaining);
+    return 0;
+}
+
+static ssize_t
+migr_read_data(vfu_ctx_t *ctx UNUSED, void *buf, uint64_t count,
+               uint64_t offset)
+{
+    if (offset + count > sizeof(migr.data)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(buf, migr.data + offset, count);
+    return count;
+}
+
+static ssize_t
+migr_write_data(vfu_ctx_t *ctx UNUSED, void *buf UNUSED, uint64_t count,
+                uint64_t offset UNUSED)
+{
+    return count;
+}
+
+static int
+migr_data_written(vfu_ctx_t *ctx UNUSED, uint64_t count UNUSED)
+{
+    return 0;
+}
+
+static const vfu_migration_callbacks_t migr_callbacks = {
+    .version = VFU_MIGR_CALLBACKS_VERS,
+    .transition = migr_transition,
+    .get_pending_bytes = migr_get_pending_bytes,
+    .prepare_data = migr_prepare_data,
+    .read_data = migr_read_data,
+    .write_data = migr_write_data,
+    .data_written = migr_data_written,
+};
+
+/* vfu_sgl_get() is only available if DMA callbacks are registered. */
+static void
+dma_register(vfu_ctx_t *ctx UNUSED, vfu_dma_info_t *info UNUSED)
+{
+}
+
+static void
+dma_unregister(vfu_ctx_t *ctx UNUSED, vfu_dma_info_t *info UNUSED)
+{
+}
+
+static void *
+server_thread(void *arg UNUSED)
+{
+    if (vfu_attach_ctx(vfu_ctx) < 0) {
+        err(EXIT_FAILURE, "vfu_attach_ctx");
+    }
+
+    /* Returns once the client disconnects. */
+    while (vfu_run_ctx(vfu_ctx) >= 0) {
+        ;
+    }
+    return NULL;
+}
+
+static void
+server_create(const char *path)
+{
+    size_t migr_size = vfu_get_migr_register_area_size() + MIGR_CHUNK_MAX;
+
+    vfu_ctx = vfu_create_ctx(VFU_TRANS_SOCK, path, 0, NULL, VFU_DEV_TYPE_PCI);
+    if (vfu_ctx == NULL) {
+        err(EXIT_FAILURE, "vfu_create_ctx");
+    }
+    if (vfu_pci_init(vfu_ctx, VFU_PCI_TYPE_EXPRESS,
+                     PCI_HEADER_TYPE_NORMAL, 0) < 0) {
+        err(EXIT_FAILURE, "vfu_pci_init");
+    }
+    if (vfu_setup_region(vfu_ctx, VFU_PCI_DEV_BAR0_REGION_IDX, BAR0_SIZE,
+                         bar0_access, VFU_REGION_FLAG_RW, NULL, 0,
+                         -1, 0) < 0) {
+        err(EXIT_FAILURE, "failed to setup BAR0");
+    }
+    if (vfu_setup_region(vfu_ctx, VFU_PCI_DEV_MIGR_REGION_IDX, migr_size,
+                         NULL, VFU_REGION_FLAG_RW, NULL, 0, -1, 0) < 0) {
+        err(EXIT_FAILURE, "failed to setup migration region");
+    }
+    if (vfu_setup_device_migration_callbacks(vfu_ctx, &migr_callbacks,
+            vfu_get_migr_register_area_size()) < 0) {
+        err(EXIT_FAILURE, "failed to setup migration");
+    }
+    if (vfu_setup_device_dma(vfu_ctx, dma_register, dma_unregister) < 0) {
+        err(EXIT_FAILURE, "vfu_setup_device_dma");
+    }
+    if (vfu_setup_device_nr_irqs(vfu_ctx, VFU_DEV_MSIX_IRQ, 1) < 0) {
+        err(EXIT_FAILURE, "vfu_setup_device_nr_irqs");
+    }
+    if (vfu_realize_ctx(vfu_ctx) < 0) {
+        err(EXIT_FAILURE, "vfu_realize_ctx");
+    }
+}
+
+static int
+memfd_of_size(uint64_t size)
+{
+    int fd = memfd_create("vfu-bench", MFD_CLOEXEC);
+
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        err(EXIT_FAILURE, "failed to create %#lx-byte memfd", size);
+    }
+    return fd;
+}
+
+static void
+bench_region(uint32_t region, const char *name, uint64_t offset,
+             size_t size, bool is_write)
+{
+    void *buf = calloc(1, size);
+    bench_t b;
+
+    if (buf == NULL) {
+        err(EXIT_FAILURE, NULL);
+    }
+
+    bench_start(&b);
+    while (bench_next(&b)) {
+        uint64_t start = bench_now_ns();
+        int ret;
+
+        if (is_write) {
+            ret = vfu_client_region_write(client, region, offset, buf, size);
+        } else {
+            ret = vfu_client_region_read(client, region, offset, buf, size);
+        }
+        if (ret < 0) {
+            err(EXIT_FAILURE, "%s of %zu bytes failed", name, size);
+        }
+        bench_record(&b, bench_now_ns() - start, 1, size);
+    }
+    bench_report(&b, name, "size=%zu", size);
+    free(buf);
+}
+
+static void
+bench_regions(void)
+{
+    static const size_t sizes[] = { 4, 64, 512, 4096, 65536, 1 << 20 };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        if (selected("region_read", false)) {
+            bench_region(VFU_PCI_DEV_BAR0_REGION_IDX, "region_read", 0,
+                         sizes[i], false);
+        }
+        if (selected("region_write", false)) {
+            bench_region(VFU_PCI_DEV_BAR0_REGION_IDX, "region_write", 0,
+                         sizes[i], true);
+        }
+    }
+
+    if (selected("cfg_read", false)) {
+        bench_region(VFU_PCI_DEV_CFG_REGION_IDX, "cfg_read", 0, 4, false);
+    }
+    if (selected("cfg_write", false)) {
+        /* The interrupt line register: plain storage, no side effects. */
+        bench_region(VFU_PCI_DEV_CFG_REGION_IDX, "cfg_write",
+                     PCI_INTERRUPT_LINE, 1, true);
+    }
+}
+
+static void
+bench_dma_map(void)
+{
+    static const uint64_t sizes[] = { 1 << 12, 1 << 21, 1 << 30 };
+    size_t i;
+
+    if (!selected("dma_map_unmap", false)) {
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        int fd = memfd_of_size(sizes[i]);
+        bench_t b;
+
+        bench_start(&b);
+        while (bench_next(&b)) {
+            uint64_t start = bench_now_ns();
+
+            if (vfu_client_dma_map(client, fd, 0, DMA_IOVA, sizes[i],
+                                   VFIO_USER_F_DMA_REGION_READ |
+                                   VFIO_USER_F_DMA_REGION_WRITE, NULL) < 0 ||
+                vfu_client_dma_unmap(client, DMA_IOVA, sizes[i]) < 0) {
+                err(EXIT_FAILURE, "DMA map/unmap failed");
+            }
+            bench_record(&b, bench_now_ns() - start, 1, 0);
+        }
+        bench_report(&b, "dma_map_unmap", "size=%lu", sizes[i]);
+        close(fd);
+    }
+}
+
+/*
+ * Runs a batch of @nr calls to vfu_addr_to_sgl(), and optionally
+ * vfu_sgl_get()/vfu_sgl_put(), for 4K pages spread over @size bytes.
+ */
+static void
+sgl_batch(dma_sg_t *sg, uint64_t size, size_t nr, uint64_t *pos, bool get)
+{
+    size_t i;
+
+    for (i = 0; i < nr; i++) {
+        struct iovec iov;
+
+        if (vfu_addr_to_sgl(vfu_ctx, (vfu_dma_addr_t)(DMA_IOVA + *pos), 4096,
+                            sg, 1, PROT_READ | PROT_WRITE) != 1) {
+            err(EXIT_FAILURE, "vfu_addr_to_sgl");
+        }
+        if (get) {
+            if (vfu_sgl_get(vfu_ctx, sg, &iov, 1, 0) < 0) {
+                err(EXIT_FAILURE, "vfu_sgl_get");
+            }
+            vfu_sgl_put(vfu_ctx, sg, &iov, 1);
+        }
+        *pos = (*pos + 4096 * 17) % size;
+    }
+}
+
+/*
+ * As sgl_batch(), for the same addresses, with a single call to
+ * vfu_addrs_to_sgl() or vfu_addrs_to_iov() and vfu_sgl_put().
+ */
+static void
+sgl_batch_bulk(dma_sg_t *sgl, struct iovec *iov, uint64_t size, size_t nr,
+               uint64_t *pos, bool get)
+{
+    vfu_dma_desc_t descs[SGL_BATCH];
+    size_t i;
+    int ret;
+
+    assert(nr <= SGL_BATCH);
+
+    for (i = 0; i < nr; i++) {
+        descs[i].dma_addr = (vfu_dma_addr_t)(DMA_IOVA + *pos);
+        descs[i].len = 4096;
+        descs[i].prot = PROT_READ | PROT_WRITE;
+        *pos = (*pos + 4096 * 17) % size;
+    }
+
+    if (get) {
+        ret = vfu_addrs_to_iov(vfu_ctx, descs, nr, sgl, iov, nr);
+        if (ret != (int)nr) {
+            err(EXIT_FAILURE, "vfu_addrs_to_iov");
+        }
+        vfu_sgl_put(vfu_ctx, sgl, iov, nr);
+    } else if (vfu_addrs_to_sgl(vfu_ctx, descs, nr, sgl, nr) != (int)nr) {
+        err(EXIT_FAILURE, "vfu_addrs_to_sgl");
+    }
+}
+
+/*
+ * Descriptor translation, one call per descriptor against one call per batch
+ * of SGL_BATCH descriptors, as a device would do per ring kick.
+ */
+static void
+bench_sgl(void)
+{
+    const uint64_t size = 1ULL << 30;
+    struct iovec iov[SGL_BATCH];
+    dma_sg_t *sg;
+    uint64_t pos = 0;
+    bench_t b;
+    int fd;
+
+    if (!selected("addr_to_sgl", false) && !selected("sgl_get_put", false) &&
+        !selected("addrs_to_sgl", false) && !selected("addrs_to_iov", false)) {
+        return;
+    }
+
+    if ((sg = calloc(SGL_BATCH, dma_sg_size())) == NULL) {
+        err(EXIT_FAILURE, NULL);
+    }
+
+    fd = memfd_of_size(size);
+    if (vfu_client_dma_map(client, fd, 0, DMA_IOVA, size,
+                           VFIO_USER_F_DMA_REGION_READ |
+                           VFIO_USER_F_DMA_REGION_WRITE, NULL) < 0) {
+        err(EXIT_FAILURE, "vfu_client_dma_map");
+    }
+
+    if (selected("addr_to_sgl", false)) {
+        bench_start(&b);
+        while (bench_next(&b)) {
+            uint64_t start = bench_now_ns();
+
+            sgl_batch(sg, size, SGL_BATCH, &pos, false);
+            bench_record(&b, bench_now_ns() - start, SGL_BATCH, 0);
+        }
+        bench_report(&b, "addr_to_sgl", "len=4096");
+    }
+
+    if (selected("sgl_get_put", false)) {
+        bench_start(&b);
+        while (bench_next(&b)) {
+            uint64_t start = bench_now_ns();
+
+            sgl_batch(sg, size, SGL_BATCH, &pos, true);
+            bench_record(&b, bench_now_ns() - start, SGL_BATCH,
+                         SGL_BATCH * 4096);
+        }
+        bench_report(&b, "sgl_get_put", "len=4096");
+    }
+
+    if (selected("addrs_to_sgl", false)) {
+        bench_start(&b);
+        while (bench_next(&b)) {
+            uint64_t start = bench_now_ns();
+
+            sgl_batch_bulk(sg, iov, size, SGL_BATCH, &pos, false);
+            bench_record(&b, bench_now_ns() - start, SGL_BATCH, 0);
+        }
+        bench_report(&b, "addrs_to_sgl", "len=4096 batch=%d", SGL_BATCH);
+    }
+
+    if (selected("addrs_to_iov", false)) {
+        bench_start(&b);
+        while (bench_next(&b)) {
+            uint64_t start = bench_now_ns();
+
+            sgl_batch_bulk(sg, iov, size, SGL_BATCH, &pos, true);
+            bench_record(&b, bench_now_ns() - start, SGL_BATCH,
+                         SGL_BATCH * 4096);
+        }
+        bench_report(&b, "addrs_to_iov", "len=4096 batch=%d", SGL_BATCH);
+    }
+
+    if (vfu_client_dma_unmap(client, DMA_IOVA, size) < 0) {
+        err(EXIT_FAILURE, "vfu_client_dma_unmap");
+    }
+    close(fd);
+    free(sg);
+}
+
+static void
+bench_irq(void)
+{
+    struct {
+        struct vfio_irq_set irq_set;
+        int pad;
+    } __attribute__((packed)) set = {
+        .irq_set = {
+            .argsz = sizeof(struct vfio_irq_set),
+            .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
+            .index = VFIO_PCI_MSIX_IRQ_INDEX,
+            .start = 0,
+            .count = 1,
+        },
+    };
+    uint64_t val;
+    bench_t b;
+    int efd;
+
+    if (!selected("irq_trigger", false)) {
+        return;
+    }
+
+    if ((efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        err(EXIT_FAILURE, "eventfd");
+    }
+    if (vfu_client_call(client, VFIO_USER_DEVICE_SET_IRQS, &set.irq_set,
+                        sizeof(set.irq_set), &efd, 1, NULL, NULL,
+                        NULL, NULL) < 0) {
+        err(EXIT_FAILURE, "failed to set up MSI-X eventfd");
+    }
+
+    bench_start(&b);
+    while (bench_next(&b)) {
+        uint64_t start = bench_now_ns();
+        int i;
+
+        for (i = 0; i < 64; i++) {
+            if (vfu_irq_trigger(vfu_ctx, 0) < 0) {
+                err(EXIT_FAILURE, "vfu_irq_trigger");
+            }
+        }
+        bench_record(&b, bench_now_ns() - start, 64, 0);
+
+        /* Keep the counter from saturating. */
+        if (read(efd, &val, sizeof(val)) != sizeof(val)) {
+            err(EXIT_FAILURE, "failed to read eventfd");
+        }
+    }
+    bench_report(&b, "irq_trigger", "vector=0");
+    close(efd);
+}
+
+static void
+dirty_pages(uint32_t flags)
+{
+    struct vfio_user_dirty_pages dp = {
+        .argsz = sizeof(dp),
+        .flags = flags,
+    };
+
+    if (vfu_client_call(client, VFIO_USER_DIRTY_PAGES, &dp, sizeof(dp),
+                        NULL, 0, NULL, NULL, NULL, NULL) < 0) {
+        err(EXIT_FAILURE, "VFIO_USER_DIRTY_PAGES %#x", flags);
+    }
+}
+
+/*
+ * Harvests the dirty bitmap of a DMA region in which every @stride-th page has
+ * been dirtied since the previous harvest.
+ */
+static void
+bench_dirty(void)
+{
+    static const uint64_t sizes[] = { 1ULL << 26, 1ULL << 30 };
+    const size_t pgsize = PAGE_SIZE;
+    const size_t stride = 8;
+    size_t i;
+
+    if (!selected("dirty_bitmap", false)) {
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        size_t bitmap_size = sizes[i] / pgsize / CHAR_BIT;
+        size_t len = sizeof(struct vfio_user_dirty_pages) +
+                     sizeof(struct vfio_user_bitmap_range);
+        struct vfio_user_dirty_pages *dp;
+        struct vfio_user_bitmap_range *range;
+        dma_sg_t *sg;
+        void *reply;
+        bench_t b;
+        int fd;
+
+        dp = calloc(1, len);
+        reply = malloc(len + bitmap_size);
+        sg = calloc(1, dma_sg_size());
+        if (dp == NULL || reply == NULL || sg == NULL) {
+            err(EXIT_FAILURE, NULL);
+        }
+
+        range = (void *)(dp + 1);
+        dp->argsz = len + bitmap_size;
+        dp->flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP;
+        range->iova = DMA_IOVA;
+        range->size = sizes[i];
+        range->bitmap.pgsize = pgsize;
+        range->bitmap.size = bitmap_size;
+
+        fd = memfd_of_size(sizes[i]);
+        if (vfu_client_dma_map(client, fd, 0, DMA_IOVA, sizes[i],
+                               VFIO_USER_F_DMA_REGION_READ |
+                               VFIO_USER_F_DMA_REGION_WRITE, NULL) < 0) {
+            err(EXIT_FAILURE, "vfu_client_dma_map");
+        }
+        dirty_pages(VFIO_IOMMU_DIRTY_PAGES_FLAG_START);
+
+        bench_start(&b);
+        while (bench_next(&b)) {
+            size_t reply_len = len + bitmap_size;
+            uint64_t start;
+            uint64_t off;
+
+            for (off = 0; off < sizes[i]; off += pgsize * stride) {
+                struct iovec iov;
+
+                if (vfu_addr_to_sgl(vfu_ctx, (vfu_dma_addr_t)(DMA_IOVA + off),
+                                    pgsize, sg, 1, PROT_WRITE) != 1 ||
+                    vfu_sgl_get(vfu_ctx, sg, &iov, 1, 0) < 0) {
+                    err(EXIT_FAILURE, "failed to dirty page");
+                }
+                vfu_sgl_put(vfu_ctx, sg, &iov, 1);
+            }
+
+            start = bench_now_ns();
+            if (vfu_client_call(client, VFIO_USER_DIRTY_PAGES, dp, len,
+                                NULL, 0, reply, &reply_len, NULL, NULL) < 0) {
+                err(EXIT_FAILURE, "failed to get dirty bitmap");
+            }
+            bench_record(&b, bench_now_ns() - start, 1, bitmap_size);
+        }
+        bench_report(&b, "dirty_bitmap", "size=%lu dirty=1/%zu", sizes[i],
+                     stride);
+
+        dirty_pages(VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP);
+        if (vfu_client_dma_unmap(client, DMA_IOVA, sizes[i]) < 0) {
+            err(EXIT_FAILURE, "vfu_client_dma_unmap");
+        }
+        close(fd);
+        free(sg);
+        free(reply);
+        free(dp);
+    }
+}
+
+static uint64_t
+migr_reg(size_t offset)
+{
+    uint64_t val;
+
+    if (vfu_client_region_read(client, VFU_PCI_DEV_MIGR_REGION_IDX, offset,
+                               &val, sizeof(val)) < 0) {
+        err(EXIT_FAILURE, "failed to read migration register %#zx", offset);
+    }
+    return val;
+}
+
+static void
+migr_set_state(uint32_t state)
+{
+    if (vfu_client_region_write(client, VFU_PCI_DEV_MIGR_REGION_IDX,
+            offsetof(struct vfio_user_migration_info, device_state),
+            &state, sizeof(state)) < 0) {
+        err(EXIT_FAILURE, "failed to set migration state %u", state);
+    }
+}
+
+/*
+ * Stop-and-copy of MIGR_TOTAL bytes of device state, in chunks of a given
+ * size, using the register protocol of the migration region.
+ */
+static void
+bench_migration(void)
+{
+    static const uint64_t chunks[] = { 1 << 16, 1 << 20 };
+    void *buf;
+    size_t i;
+
+    if (!selected("migration_data", false)) {
+        return;
+    }
+
+    if ((buf = malloc(MIGR_CHUNK_MAX)) == NULL) {
+        err(EXIT_FAILURE, NULL);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+        bench_t b;
+
+        migr.chunk = chunks[i];
+
+        bench_start(&b);
+        while (bench_next(&b)) {
+            migr_set_state(VFIO_DEVICE_STATE_V1_SAVING);
+
+            while (migr_reg(offsetof(struct vfio_user_migration_info,
+                                     pending_bytes)) > 0) {
+                uint64_t start = bench_now_ns();
+                uint64_t offset, size;
+
+                offset = migr_reg(offsetof(struct vfio_user_migration_info,
+                                           data_offset));
+                size = migr_reg(offsetof(struct vfio_user_migration_info,
+                                         data_size));
+                if (vfu_client_region_read(client,
+                                           VFU_PCI_DEV_MIGR_REGION_IDX,
+                                           offset, buf, size) < 0) {
+                    err(EXIT_FAILURE, "failed to read migration data");
+                }
+                bench_record(&b, bench_now_ns() - start, 1, size);
+            }
+
+            migr_set_state(VFIO_DEVICE_STATE_V1_RUNNING);
+        }
+        bench_report(&b, "migration_data", "chunk=%lu", chunks[i]);
+    }
+
+    free(buf);
+}
+
+static disagg_pci_dev_info *
+mmio_info(void)
+{
+    static uint64_t bar0_addr = MMIO_BAR0_ADDR;
+    static uint64_t bar0_size = BAR0_SIZE;
+    static uint64_t zero;
+    static disagg_pci_dev_info info;
+    size_t i;
+
+    info.vctx = vfu_ctx;
+    for (i = 0; i < PCI_NUM_REGIONS_LIBVFIO; i++) {
+        info.regions[i].addr = &zero;
+        info.regions[i].size = &zero;
+    }
+    info.regions[0].addr = &bar0_addr;
+    info.regions[0].size = &bar0_size;
+    return &info;
+}
+
+static void
+bench_vsock_mmio(void)
+{
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_LOCAL,
+        .svm_port = MMIO_VSOCK_PORT,
+    };
+    struct mmio_header hdr = {
+        .operation = MMIO_OP_READ,
+        .address = MMIO_BAR0_ADDR,
+        .length = sizeof(uint32_t),
+    };
+    uint32_t val;
+    bench_t b;
+    int sock;
+    int i;
+
+    if (!selected("vsock_mmio", true)) {
+        return;
+    }
+
+    if ((sock = socket(AF_VSOCK, SOCK_STREAM, 0)) == -1) {
+        bench_skip("vsock_mmio", "AF_VSOCK not available");
+        return;
+    }
+    close(sock);
+
+    if (vfu_run_vsock(vfu_ctx, mmio_info()) != 0) {
+        errx(EXIT_FAILURE, "vfu_run_vsock failed");
+    }
+
+    /*
+     * The server thread may not be listening yet, or may have failed to: give
+     * it a second.
+     */
+    for (i = 0; ; i++) {
+        struct timeval tv = { .tv_usec = 10000 };
+
+        if ((sock = socket(AF_VSOCK, SOCK_STREAM, 0)) == -1) {
+            err(EXIT_FAILURE, "socket");
+        }
+        setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_CONNECT_TIMEOUT, &tv,
+                   sizeof(tv));
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(sock);
+        if (i == 100) {
+            bench_skip("vsock_mmio", "no vsock loopback listener");
+            return;
+        }
+        usleep(10000);
+    }
+
+    bench_start(&b);
+    while (bench_next(&b)) {
+        uint64_t start = bench_now_ns();
+
+        if (send(sock, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            recv(sock, &val, sizeof(val), MSG_WAITALL) != sizeof(val)) {
+            err(EXIT_FAILURE, "vsock MMIO read failed");
+        }
+        bench_record(&b, bench_now_ns() - start, 1, sizeof(val));
+    }
+    bench_report(&b, "vsock_mmio", "op=read size=4");
+    close(sock);
+}
+
+static void
+bench_shmem_mmio(void)
+{
+    volatile uint8_t *read_db, *write_db;
+    struct mmio_header hdr = {
+        .operation = MMIO_OP_READ,
+        .address = MMIO_BAR0_ADDR,
+        .length = sizeof(uint32_t),
+    };
+    struct stat st;
+    char *shmem;
+    uint32_t val;
+    bench_t b;
+    int fd;
+    int i;
+
+    if (!selected("shmem_mmio", true)) {
+        return;
+    }
+
+    if (vfu_run_shmem(vfu_ctx, mmio_info()) != 0) {
+        errx(EXIT_FAILURE, "vfu_run_shmem failed");
+    }
+
+    /* Wait for the server thread to create and size the file. */
+    for (i = 0; ; i++) {
+        fd = open(MMIO_SHMEM_FILE, O_RDWR);
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            break;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        if (i == 100) {
+            bench_skip("shmem_mmio", "no " MMIO_SHMEM_FILE);
+            return;
+        }
+        usleep(10000);
+    }
+    /* ... and for it to clear the doorbells. */
+    usleep(100000);
+
+    shmem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shmem == MAP_FAILED) {
+        err(EXIT_FAILURE, "failed to map " MMIO_SHMEM_FILE);
+    }
+    read_db = (volatile uint8_t *)shmem;
+    write_db = (volatile uint8_t *)shmem + 1;
+
+    bench_start(&b);
+    while (bench_next(&b)) {
+        uint64_t start = bench_now_ns();
+
+        while (__atomic_load_n(write_db, __ATOMIC_ACQUIRE) != 0) {
+            ;
+        }
+        memcpy(shmem + MMIO_SHMEM_DOORBELLS, &hdr, sizeof(hdr));
+        __atomic_store_n(write_db, 1, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(read_db, __ATOMIC_ACQUIRE) == 0) {
+            ;
+        }
+        memcpy(&val, shmem + MMIO_SHMEM_DOORBELLS, sizeof(val));
+        __atomic_store_n(read_db, 0, __ATOMIC_RELEASE);
+
+        bench_record(&b, bench_now_ns() - start, 1, sizeof(val));
+    }
+    bench_report(&b, "shmem_mmio", "op=read size=4");
+    munmap(shmem, st.st_size);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j results.json] [-f filter] [-n max_ops] "
+            "[-t ms_per_benchmark]\n"
+            "\n"
+            "vsock_mmio and shmem_mmio only run when named in the filter.\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/vfu-bench-XXXXXX";
+    char path[PATH_MAX];
+    uint64_t max_ops = 0;
+    uint64_t max_ms = 0;
+    pthread_t tid;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:f:n:t:")) != -1) {
+        switch (opt) {
+        case 'j':
+            bench_set_output("vfu-bench", optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'n':
+            max_ops = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            max_ms = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    bench_set_limits(max_ops, max_ms != 0 ? max_ms : 500);
+    memset(migr.data, 0xa5, sizeof(migr.data));
+
+    if (mkdtemp(dir) == NULL) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    snprintf(path, sizeof(path), "%s/sock", dir);
+
+    server_create(path);
+
+    if ((errno = pthread_create(&tid, NULL, server_thread, NULL)) != 0) {
+        err(EXIT_FAILURE, "pthread_create");
+    }
+
+    /* The server thread may not be listening yet. */
+    while ((client = vfu_client_connect(path, NULL)) == NULL) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            err(EXIT_FAILURE, "vfu_client_connect %s", path);
+        }
+        usleep(1000);
+    }
+
+    bench_regions();
+    bench_dma_map();
+    bench_sgl();
+    bench_irq();
+    bench_dirty();
+    bench_migration();
+    bench_vsock_mmio();
+
+    /* Last: its server thread spins on the doorbell for good. */
+    bench_shmem_mmio();
+
+    vfu_client_close(client);
+
+    bench_finish();
+
+    if (!selected("shmem_mmio", true) && !selected("vsock_mmio", true)) {
+        pthread_join(tid, NULL);
+        vfu_destroy_ctx(vfu_ctx);
+    }
+    unlink(path);
+    rmdir(dir);
+
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Defines the libvfio-user-client API: the client (VMM) side of the vfio-user
+ * protocol over a UNIX socket.
+ *
+ * Requests are asynchronous: vfu_client_send() queues a request on the
+ * connection and returns immediately; its reply is matched by message ID and
+ * delivered to a completion callback from vfu_client_run(). Any number of
+ * requests (up to the in-flight limit) may be outstanding at once. While
+ * waiting for replies, vfu_client_run() also services DMA_READ/DMA_WRITE
+ * requests issued by the server against regions registered with
+ * vfu_client_dma_map(), so a server may access guest memory in the middle of
+ * handling a client request.
+ *
+ * vfu_client_send() may be called from any thread. vfu_client_run() and the
+ * synchronous helpers built on it must only be called from one thread at a
+ * time; completion callbacks run on that thread.
+ *
+ * This is not currently a stable API or ABI, and may change at any time.
+ */
+
+#ifndef LIB_VFIO_USER_CLIENT_H
+#define LIB_VFIO_USER_CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "vfio-user.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct vfu_client vfu_client_t;
+
+#define VFU_CLIENT_DEFAULT_MAX_INFLIGHT 256
+
+typedef struct {
+    /*
+     * Maximum number of requests that may be outstanding at once; 0 selects
+     * VFU_CLIENT_DEFAULT_MAX_INFLIGHT. Rounded up to a power of two.
+     */
+    uint32_t max_inflight;
+    /*
+     * Largest DMA_READ/DMA_WRITE the server may send us; 0 selects
+     * VFIO_USER_DEFAULT_MAX_DATA_XFER_SIZE.
+     */
+    size_t max_data_xfer_size;
+} vfu_client_attr_t;
+
+/*
+ * Completion callback for a request.
+ *
+ * @client: the client
+ * @arg: the argument passed when the request was submitted
+ * @err: 0 on success, otherwise the errno reported by the server, or
+ *       ECONNRESET if the connection was lost before the reply arrived
+ * @data: the reply payload (after the header), only valid for the duration of
+ *        the callback
+ * @len: size of @data
+ * @fds: file descriptors received with the reply; the callback takes
+ *       ownership of them
+ * @nr_fds: number of entries in @fds
+ */
+typedef void (vfu_client_cb_t)(vfu_client_t *client, void *arg, int err,
+                               void *data, size_t len, int *fds,
+                               size_t nr_fds);
+
+/*
+ * Connects to the server listening at @path and negotiates the protocol
+ * version. This call blocks until negotiation completes.
+ *
+ * @path: path to the server's UNIX socket
+ * @attr: connection attributes, or NULL for the defaults
+ *
+ * @returns the client on success, NULL on error. Sets errno.
+ */
+vfu_client_t *
+vfu_client_connect(const char *path, const vfu_client_attr_t *attr);
+
+/*
+ * Closes the connection. Outstanding requests are completed with ECONNRESET,
+ * DMA registrations are dropped and the client is freed.
+ */
+void
+vfu_client_close(vfu_client_t *client);
+
+/*
+ * Returns the file descriptor to poll for POLLIN before calling
+ * vfu_client_run(), for integration with an external event loop.
+ */
+int
+vfu_client_get_poll_fd(vfu_client_t *client);
+
+/*
+ * Returns the largest payload the server accepts in a single region access,
+ * as negotiated at connect time.
+ */
+size_t
+vfu_client_max_data_xfer_size(vfu_client_t *client);
+
+/*
+ * Returns the maximum number of file descriptors the server accepts in a
+ * single message, as negotiated at connect time.
+ */
+int
+vfu_client_max_msg_fds(vfu_client_t *client);
+
+/*
+ * Submits a request without waiting for its reply.
+ *
+ * @client: the client
+ * @cmd: the vfio-user command
+ * @iov: payload, sent in order after the header
+ * @nr_iov: number of entries in @iov
+ * @fds: file descriptors to pass with the request, or NULL
+ * @nr_fds: number of entries in @fds
+ * @cb: completion callback, or NULL to discard the reply
+ * @arg: argument passed to @cb
+ *
+ * @returns the message ID of the request on success, -1 on error. Sets errno;
+ * EAGAIN means the in-flight limit was reached and vfu_client_run() must be
+ * called to reap completions first.
+ */
+int
+vfu_client_send(vfu_client_t *client, enum vfio_user_command cmd,
+                const struct iovec *iov, size_t nr_iov,
+                const int *fds, size_t nr_fds,
+                vfu_client_cb_t *cb, void *arg);
+
+/*
+ * Processes incoming messages: replies are dispatched to their completion
+ * callbacks and server-initiated DMA requests are serviced.
+ *
+ * @client: the client
+ * @timeout_ms: how long to wait for the first message; 0 returns immediately
+ *              if nothing is pending, -1 waits indefinitely
+ *
+ * @returns the number of messages processed (0 on timeout), or -1 on error.
+ * Sets errno; ENOTCONN means the server closed the connection.
+ */
+int
+vfu_client_run(vfu_client_t *client, int timeout_ms);
+
+/*
+ * Returns the number of requests still waiting for a reply.
+ */
+uint32_t
+vfu_client_inflight(vfu_client_t *client);
+
+/*
+ * Sends a request and waits for its reply, servicing DMA requests in the
+ * meantime.
+ *
+ * @reply: buffer for the reply payload, or NULL
+ * @reply_len: in: size of @reply; out: size of the payload received (which is
+ *             truncated to the buffer size)
+ * @reply_fds: buffer for file descriptors received with the reply, or NULL;
+ *             unwanted descriptors are closed
+ * @nr_reply_fds: in: size of @reply_fds; out: number of fds received
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_call(vfu_client_t *client, enum vfio_user_command cmd,
+                const void *data, size_t len, const int *fds, size_t nr_fds,
+                void *reply, size_t *reply_len,
+                int *reply_fds, size_t *nr_reply_fds);
+
+/*
+ * Submits a single region access without waiting for its reply. @count must
+ * not exceed vfu_client_max_data_xfer_size(). For reads, the data is copied
+ * into @buf before @cb is called; for writes, @buf is only used for the
+ * duration of this call. @cb receives the vfio_user_region_access reply.
+ *
+ * @returns the message ID on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_region_access_async(vfu_client_t *client, uint32_t region,
+                               uint64_t offset, void *buf, size_t count,
+                               bool is_write, vfu_client_cb_t *cb, void *arg);
+
+/*
+ * Reads @count bytes at @offset of @region, split into as many pipelined
+ * requests as the negotiated transfer size requires.
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_region_read(vfu_client_t *client, uint32_t region,
+                       uint64_t offset, void *buf, size_t count);
+
+/*
+ * Writes @count bytes at @offset of @region, split into as many pipelined
+ * requests as the negotiated transfer size requires.
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_region_write(vfu_client_t *client, uint32_t region,
+                        uint64_t offset, const void *buf, size_t count);
+
+/*
+ * Retrieves the device info.
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_get_device_info(vfu_client_t *client,
+                           struct vfio_user_device_info *info);
+
+/*
+ * Retrieves the region info for @index, including any capabilities.
+ *
+ * @infop: set to a malloc()ed vfio_region_info; the caller must free() it
+ * @fds: buffer for the file descriptors backing the region, or NULL
+ * @nr_fds: in: size of @fds; out: number of fds received
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_get_region_info(vfu_client_t *client, uint32_t index,
+                           struct vfio_region_info **infop,
+                           int *fds, size_t *nr_fds);
+
+/*
+ * Maps the mappable parts of region @index into the caller's address space:
+ * either the sparse areas advertised by the server, or the whole region if it
+ * has none.
+ *
+ * @prot: PROT_* flags for mmap()
+ * @areasp: set to a malloc()ed array describing each mapping
+ * @nr_areasp: set to the number of entries in @areasp
+ *
+ * @returns 0 on success, -1 on error. Sets errno; ENOTSUP means the region is
+ * not mappable.
+ */
+int
+vfu_client_region_mmap(vfu_client_t *client, uint32_t index, int prot,
+                       struct iovec **areasp, size_t *nr_areasp);
+
+/*
+ * Unmaps and frees areas returned by vfu_client_region_mmap().
+ */
+void
+vfu_client_region_munmap(struct iovec *areas, size_t nr_areas);
+
+/*
+ * Registers a DMA region with the server and records it locally so that the
+ * server's DMA_READ/DMA_WRITE requests can be serviced.
+ *
+ * @fd: file descriptor backing the region, passed to the server, or -1 to
+ *      force the server to access the region via messages
+ * @offset: offset of the region within @fd
+ * @iova: start of the region in the device's address space
+ * @size: size of the region
+ * @prot: VFIO_USER_F_DMA_REGION_{READ,WRITE}
+ * @vaddr: local mapping of the region, or NULL, in which case DMA requests are
+ *         serviced with pread()/pwrite() on @fd
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_dma_map(vfu_client_t *client, int fd, uint64_t offset,
+                   uint64_t iova, uint64_t size, uint32_t prot, void *vaddr);
+
+/*
+ * Unregisters a DMA region previously registered with vfu_client_dma_map().
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_client_dma_unmap(vfu_client_t *client, uint64_t iova, uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIB_VFIO_USER_CLIENT_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -92,6 +92,12 @@ typedef enum {
     VFU_TRANS_SOCK,
     // For internal testing only
     VFU_TRANS_PIPE,
+    /*
+     * UNIX socket for the handshake and fd-carrying commands; the client may
+     * then move all other messages to shared-memory rings, see
+     * VFIO_USER_SHM_SETUP.
+     */
+    VFU_TRANS_SHM,
     VFU_TRANS_MAX
 } vfu_trans_t;
 
@@ -115,6 +121,29 @@ vfu_ctx_t *
 vfu_create_ctx(vfu_trans_t trans, const char *path,
                int flags, void *pvt, vfu_dev_type_t dev_type);
 
+/**
+ * Creates a context set up exactly like @template, for bringing up many
+ * identical devices without repeating the setup calls for each. Config space,
+ * capabilities, regions and their register files and shadow ranges, IRQs,
+ * DMA, migration and all callbacks are copied; the clone is realized if
+ * @template is. The template must not have a client with DMA regions mapped
+ * or a request in progress, otherwise EBUSY.
+ *
+ * The clone starts out as if just set up: registers at their initial values,
+ * shadow ranges invalid, MSI-X vectors masked. Mappable regions refer to the
+ * same files as the template's, so they're shared by all the clones. Neither
+ * ioeventfds, the vsock/shmem listeners nor the logger thread of
+ * vfu_setup_log_async() are copied.
+ *
+ * @template: the libvfio-user context to copy
+ * @path: path to the clone's socket file
+ * @pvt: the clone's private data
+ *
+ * @returns the vfu_ctx to be used or NULL on error. Sets errno.
+ */
+vfu_ctx_t *
+vfu_clone_ctx(vfu_ctx_t *template, const char *path, void *pvt);
+
 /*
  * Finalizes the device making it ready for vfu_attach_ctx(). This function is
  * mandatory to be called before vfu_attach_ctx().
@@ -165,12 +194,199 @@ vfu_get_poll_fd(vfu_ctx_t *vfu_ctx);
  *          with errno set as follows:
  *
  * ENOTCONN: client closed connection, vfu_attach_ctx() should be called again
- * EBUSY: the device was asked to quiesce and is still quiescing
+ * EBUSY: the device was asked to quiesce and is still quiescing, or is
+ *        completing a migration state transition, see vfu_migr_done()
  * Other errno values are also possible.
  */
 int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx);
 
+/**
+ * Enables adaptive busy polling for a blocking context. While requests keep
+ * arriving, vfu_run_ctx() spins on a cheap readiness check of the transport
+ * (MSG_PEEK on the socket, or the request ring for VFU_TRANS_SHM) with an
+ * exponential backoff between checks, instead of sleeping in the kernel.
+ * Once no request has arrived for @idle_us microseconds it falls back to
+ * blocking until the next one, and starts spinning again after serving it.
+ *
+ * @vfu_ctx: the libvfio-user context, not created with
+ *           LIBVFIO_USER_FLAG_ATTACH_NB
+ * @idle_us: spin period in microseconds, 0 disables busy polling
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_busy_poll(vfu_ctx_t *vfu_ctx, uint32_t idle_us);
+
+/*
+ * Attributes of the threads the library creates for a context: the
+ * ioregionfd, dirty page tracking and migration stream threads, and those of
+ * vfu_run_vsock() and vfu_run_shmem(). The threads of a vfu_loop_t serve many
+ * contexts and take their affinity from vfu_loop_attr_t instead.
+ */
+typedef struct {
+    /* Optional CPUs the threads may run on, NULL for no affinity. */
+    const int       *cpus;
+    size_t          nr_cpus;
+    /*
+     * NUMA node the threads allocate their memory on, -1 for none. Unless
+     * cpus is set, this also confines the threads to the node's CPUs.
+     */
+    int             numa_node;
+    /*
+     * Optional prefix for the thread names, which are suffixed with the
+     * thread's role; the result is truncated to 15 characters.
+     */
+    const char      *name;
+    /*
+     * Scheduling policy, see sched(7), and priority for SCHED_FIFO and
+     * SCHED_RR. 0 (SCHED_OTHER) leaves the default. Real-time policies
+     * usually need CAP_SYS_NICE, without which the threads fail to start.
+     */
+    int             sched_policy;
+    int             sched_priority;
+} vfu_thread_attr_t;
+
+/**
+ * Sets the attributes of threads the library creates for the context from now
+ * on; threads already running are not changed.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @attr: thread attributes, or NULL to go back to the defaults
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_setup_thread_attr(vfu_ctx_t *vfu_ctx, const vfu_thread_attr_t *attr);
+
+/**
+ * Hands a connected client over to another process, such as an upgraded
+ * device server, without the client noticing. The connection state is sent
+ * over @sock, a connected UNIX stream socket, and the file descriptors it
+ * refers to are passed along with SCM_RIGHTS: the listening and connected
+ * sockets, the DMA regions and the IRQ eventfds, along with the negotiated
+ * transport parameters, PCI config space, emulated MSI-X state and migration
+ * device state. The successor picks it up with vfu_ctx_import_state().
+ *
+ * The device must be idle: not in a callback, with no request pending, not
+ * migrating and not logging dirty pages, otherwise EBUSY. Device state kept
+ * outside the library, including register file values, is for the
+ * application to hand over itself. On success the context lets go of the
+ * connection: its DMA regions are removed with the dma_unregister callback,
+ * but the device isn't reset, and it should just be destroyed.
+ *
+ * @vfu_ctx: the libvfio-user context, attached
+ * @sock: the socket to send the state over
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_ctx_export_state(vfu_ctx_t *vfu_ctx, int sock);
+
+/**
+ * Takes over a client from a predecessor that called vfu_ctx_export_state().
+ * The context must be set up exactly as the predecessor's was (regions, IRQs,
+ * migration, DMA and capabilities) and realized, but not attached. The DMA
+ * regions are mapped and passed to the dma_register callback, and the context
+ * is left attached to the client, listening on the predecessor's socket for
+ * later reconnects: carry on with vfu_run_ctx(), not vfu_attach_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context, realized but not attached
+ * @sock: the socket to receive the state from
+ *
+ * @returns 0 on success, -1 on error, sets errno: EINVAL if the state doesn't
+ * match how the context was set up.
+ */
+int
+vfu_ctx_import_state(vfu_ctx_t *vfu_ctx, int sock);
+
+/*
+ * Event loop hosting many non-blocking contexts on a small pool of threads.
+ *
+ * Contexts added to a loop are attached and run by the loop's threads; the
+ * application must not call vfu_attach_ctx() or vfu_run_ctx() on them itself.
+ * A context is only ever serviced by one thread at a time. When a device
+ * quiesces asynchronously the context is parked until vfu_device_quiesced() is
+ * called, which may be done from any thread; likewise for vfu_migr_done().
+ */
+typedef struct vfu_loop vfu_loop_t;
+
+typedef struct {
+    /* Number of threads servicing the loop, 0 means 1. */
+    unsigned int    nr_threads;
+    /*
+     * Maximum number of requests handled for a single context before moving
+     * on to the next ready one, 0 means VFU_LOOP_DEFAULT_MAX_REQS.
+     */
+    unsigned int    max_reqs_per_turn;
+    /*
+     * Optional CPUs to pin the threads to: thread i runs on
+     * cpus[i % nr_cpus]. Leave NULL for no affinity.
+     */
+    const int       *cpus;
+    size_t          nr_cpus;
+} vfu_loop_attr_t;
+
+#define VFU_LOOP_DEFAULT_MAX_REQS 8
+
+/**
+ * Creates an event loop. The loop is idle until vfu_loop_start() is called.
+ *
+ * @attr: loop attributes, or NULL for the defaults
+ *
+ * @returns the loop, or NULL on error. Sets errno.
+ */
+vfu_loop_t *
+vfu_loop_create(const vfu_loop_attr_t *attr);
+
+/**
+ * Adds a context to the loop. The context must have been created with
+ * LIBVFIO_USER_FLAG_ATTACH_NB and must already be realized. It may be added
+ * whether or not the loop is running, and may belong to only one loop.
+ *
+ * @loop: the loop
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_loop_add_ctx(vfu_loop_t *loop, vfu_ctx_t *vfu_ctx);
+
+/**
+ * Removes a context from the loop, waiting for any thread currently servicing
+ * it. Must not be called from a device callback of that context.
+ * vfu_destroy_ctx() removes the context from its loop implicitly.
+ *
+ * @loop: the loop
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_loop_remove_ctx(vfu_loop_t *loop, vfu_ctx_t *vfu_ctx);
+
+/**
+ * Starts the loop's threads.
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ */
+int
+vfu_loop_start(vfu_loop_t *loop);
+
+/**
+ * Stops the loop's threads and waits for them to exit. Contexts stay in the
+ * loop and are serviced again by a subsequent vfu_loop_start().
+ */
+void
+vfu_loop_stop(vfu_loop_t *loop);
+
+/**
+ * Stops the loop if needed, removes all contexts and frees the loop. The
+ * contexts themselves are not destroyed.
+ */
+void
+vfu_loop_destroy(vfu_loop_t *loop);
+
 /**
  * Destroys libvfio-user context. During this call the device must already be
  * in quiesced state; the quiesce callback is not called. Any other device
@@ -187,6 +403,21 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx);
 void *
 vfu_get_private(vfu_ctx_t *vfu_ctx);
 
+/**
+ * Returns the number of bytes of heap memory the library holds for the
+ * context: the context itself, regions, PCI configuration space and
+ * capabilities, interrupts, DMA regions and dirty bitmaps, and migration
+ * state. Memory that belongs to the device, such as region fds and DMA
+ * mappings, and transient message buffers are not counted.
+ *
+ * Capability tables and the DMA region array are only allocated once used, so
+ * this is a measure of what an idle device costs when hosting many of them.
+ *
+ * @vfu_ctx: the libvfio-user context
+ */
+size_t
+vfu_ctx_memory_usage(vfu_ctx_t *vfu_ctx);
+
 /**
  * Callback function signature for log function
  * @vfu_ctx: the libvfio-user context
@@ -204,6 +435,44 @@ void
 vfu_log(vfu_ctx_t *vfu_ctx, int level, const char *fmt, ...) \
     __attribute__((format(printf, 3, 4)));
 
+/**
+ * Starts recording library events, for all contexts: receiving and handling
+ * requests, quiesce callbacks and asynchronous quiesces, DMA map and unmap,
+ * DMA transfers through the client, migration state transitions and IRQ
+ * triggers. Each event is a timestamped binary record in a ring of the thread
+ * it happened on; once a ring is full the oldest events are overwritten.
+ *
+ * While tracing is off, recording costs a single predicted branch per trace
+ * point.
+ *
+ * @nr_events: size of each thread's ring in events, rounded up to a power of
+ *             two; 0 means 65536
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ * EBUSY: tracing is already on
+ */
+int
+vfu_trace_start(size_t nr_events);
+
+/**
+ * Stops recording events; those recorded are kept for vfu_trace_export().
+ */
+void
+vfu_trace_stop(void);
+
+/**
+ * Writes the events recorded since the last vfu_trace_start() to @path in the
+ * Chrome trace event JSON format, which chrome://tracing and Perfetto load.
+ * Tracing must be stopped.
+ *
+ * @path: file to write
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ * EBUSY: tracing is on
+ */
+int
+vfu_trace_export(const char *path);
+
 /**
  * Set up logging information.
  * @vfu_ctx: the libvfio-user context
@@ -216,6 +485,27 @@ vfu_log(vfu_ctx_t *vfu_ctx, int level, const char *fmt, ...) \
 int
 vfu_setup_log(vfu_ctx_t *vfu_ctx, vfu_log_fn_t *log, int level);
 
+/**
+ * Moves calls to the log function onto a thread of its own, so that threads
+ * handling requests never wait for it. Messages are still formatted by the
+ * thread logging them and then queued; if the queue is full they are dropped,
+ * and the number dropped is logged once there is room.
+ *
+ * The log function is called from the logger thread, one message at a time.
+ * The thread is set up as for vfu_setup_thread_attr(), and stops in
+ * vfu_destroy_ctx(), once the messages queued so far are logged.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @nr_msgs: size of the queue in messages, rounded up to a power of two, at
+ *           most 65536; 0 stops the logger thread, and messages are logged
+ *           directly again. No other thread may be logging meanwhile.
+ *
+ * @returns 0 on success, -1 on error. Sets errno.
+ * EBUSY: the logger thread is already running
+ */
+int
+vfu_setup_log_async(vfu_ctx_t *vfu_ctx, size_t nr_msgs);
+
 /**
  * Prototype for region access callback. When a region is accessed, libvfio-user
  * calls the previously registered callback with the following arguments:
@@ -323,6 +613,147 @@ vfu_setup_region(vfu_ctx_t *vfu_ctx, int region_idx, size_t size,
                  struct iovec *mmap_areas, uint32_t nr_mmap_areas,
                  int fd, uint64_t offset);
 
+typedef enum {
+    VFU_REG_RO,     /* writes are ignored */
+    VFU_REG_RW,     /* writes replace the value */
+    VFU_REG_W1C,    /* bits written as 1 are cleared */
+} vfu_reg_type_t;
+
+/*
+ * Register read handler: returns the value to read, in place of the value
+ * the library holds.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @offset: offset of the register within the region
+ */
+typedef uint64_t (vfu_reg_read_cb_t)(vfu_ctx_t *vfu_ctx, loff_t offset);
+
+/*
+ * Register write handler, called after the write has been applied to the
+ * value the library holds (so not for VFU_REG_RO registers).
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @offset: offset of the register within the region
+ * @val: the value written
+ */
+typedef void (vfu_reg_write_cb_t)(vfu_ctx_t *vfu_ctx, loff_t offset,
+                                  uint64_t val);
+
+typedef struct {
+    /* offset within the region, a multiple of @width */
+    loff_t              offset;
+    /* 1, 2, 4 or 8 bytes */
+    uint32_t            width;
+    vfu_reg_type_t      type;
+    /* initial value */
+    uint64_t            value;
+    /* optional handlers */
+    vfu_reg_read_cb_t   *read;
+    vfu_reg_write_cb_t  *write;
+} vfu_reg_t;
+
+/**
+ * Describes the registers of a region, which libvfio-user keeps sorted by
+ * offset to dispatch accesses. An access of exactly one register's width
+ * at its offset is then handled by the library: it holds the register's value,
+ * applies the write semantics of @type, and calls the register's handlers with
+ * the value as an integer. Any other access to the region is passed to the
+ * region's callback, if it has one, and fails otherwise.
+ *
+ * Must be called after vfu_setup_region(), and not for the config space or
+ * migration regions. The register values may be accessed concurrently with
+ * vfu_reg_get(), vfu_reg_set() and vfu_reg_set_bits().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: region index
+ * @regs: the registers, which must not overlap; the array is copied
+ * @nr_regs: number of registers
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_region_regs(vfu_ctx_t *vfu_ctx, int region_idx, const vfu_reg_t *regs,
+                      size_t nr_regs);
+
+/**
+ * Returns the value held for the register at @offset of region @region_idx,
+ * set up with vfu_setup_region_regs(), in @val.
+ *
+ * @returns 0 on success, -1 on error (ENOENT if there's no such register),
+ * sets errno.
+ */
+int
+vfu_reg_get(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset, uint64_t *val);
+
+/**
+ * Sets the value held for a register, say to update a read-only status
+ * register.
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_reg_set(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset, uint64_t val);
+
+/**
+ * Atomically sets @bits in the value held for a register, typically for the
+ * device to raise bits of a VFU_REG_W1C register that the guest clears.
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_reg_set_bits(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                 uint64_t bits);
+
+/**
+ * Marks [@offset, @offset + @size) of a region as cacheable: once the device
+ * has filled it in with vfu_region_shadow_write(), the library answers client
+ * reads that fall entirely within the range from this shadow copy, without
+ * calling the region's access callback. This suits read-mostly registers such
+ * as IDs, versions and status words.
+ *
+ * A client write overlapping the range invalidates it before the callback is
+ * called, so reads go to the callback until the device writes the whole range
+ * again. Ranges must not overlap, and must be set up before
+ * vfu_realize_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: region index, not the config space or migration region
+ * @offset: offset of the range within the region
+ * @size: size of the range
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_region_shadow_range(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                        size_t size);
+
+/**
+ * Updates the shadow copy of a cacheable range, see vfu_region_shadow_range().
+ * [@offset, @offset + @count) must lie within a single range. A write
+ * covering the whole range makes it valid; a partial write only updates a
+ * range that is already valid.
+ *
+ * May be called from any thread, concurrently with client accesses: each
+ * range carries a version number, bumped on every update and invalidation,
+ * that readers check so as never to return a torn or invalidated value.
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_region_shadow_write(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                        const void *data, size_t count);
+
+/**
+ * Invalidates the shadow copies of all cacheable ranges overlapping
+ * [@offset, @offset + @size) of a region, so that reads go to the region's
+ * callback again. May be called from any thread.
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_region_shadow_invalidate(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                             size_t size);
+
 typedef enum vfu_reset_type {
     /*
      * Client requested a device reset (for example, as part of a guest VM
@@ -417,6 +848,10 @@ vfu_setup_device_quiesce_cb(vfu_ctx_t *vfu_ctx,
  * Called by the device to complete a pending quiesce operation. After the
  * function returns the device is unquiesced.
  *
+ * It may be called from another thread as soon as the quiesce callback has
+ * started, even before it has returned EBUSY; the operation is then completed
+ * by the thread running the callback, as if it had quiesced synchronously.
+ *
  * @vfu_ctx: the libvfio-user context
  * @quiesce_errno: 0 for success or errno in case the device fails to quiesce,
  *                 in which case the operation requiring the quiesce is failed
@@ -530,6 +965,65 @@ int
 vfu_setup_device_dma(vfu_ctx_t *vfu_ctx, vfu_dma_register_cb_t *dma_register,
                      vfu_dma_unregister_cb_t *dma_unregister);
 
+typedef enum {
+    /*
+     * Pages are reported dirty only when the device marks them, via
+     * vfu_sgl_mark_dirty() or vfu_sgl_put(). This is the default.
+     */
+    VFU_DIRTY_TRACKING_MANUAL,
+    /*
+     * In addition, the library write-protects guest memory while dirty page
+     * logging is on and records every write made through the local mappings,
+     * including writes the device makes outside vfu_sgl_get()/vfu_sgl_put().
+     * The first write to each page after the client fetches the bitmap takes
+     * a fault serviced by a library thread; later ones cost nothing.
+     */
+    VFU_DIRTY_TRACKING_WP,
+} vfu_dirty_tracking_t;
+
+/**
+ * Selects how pages written by the device are found for the dirty page
+ * bitmap. VFU_DIRTY_TRACKING_WP uses userfaultfd write-protection of shared
+ * mappings, which needs Linux 5.19 or later, and either the privilege to
+ * create a userfaultfd or access to /dev/userfaultfd. Guest memory must then
+ * be shared memory (memfd, tmpfs or hugetlbfs): DMA regions backed by other
+ * files can't be protected and fail to map while dirty page logging is on.
+ *
+ * Must be called after vfu_setup_device_dma(), and not while dirty page
+ * logging is on.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @mode: the tracking mode
+ *
+ * @returns 0 on success, -1 on error, sets errno (ENOTSUP if the kernel lacks
+ * support).
+ */
+int
+vfu_setup_dirty_tracking(vfu_ctx_t *vfu_ctx, vfu_dirty_tracking_t mode);
+
+/**
+ * Keeps the DMA regions across a client reconnect, such as a QEMU restarted
+ * by live update. When the client goes away, its DMA regions stay mapped and
+ * registered instead of being unmapped with the @dma_unregister callback. If
+ * the next client maps a region again with the same address, size, offset,
+ * protection and file, within @grace_ms milliseconds of the disconnect, the
+ * existing region is taken over as is, without calling @dma_register.
+ *
+ * Regions that aren't mapped again in time are removed as usual, at the next
+ * request after the grace period, or when a new client maps a region that
+ * overlaps them. The device reset callback is still called with
+ * VFU_RESET_LOST_CONN on disconnect, and must stop DMA as usual.
+ *
+ * Must be called after vfu_setup_device_dma().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @grace_ms: how long regions are kept, 0 to disable
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_dma_reconnect(vfu_ctx_t *vfu_ctx, uint32_t grace_ms);
+
 enum vfu_dev_irq_type {
     VFU_DEV_INTX_IRQ,
     VFU_DEV_MSI_IRQ,
@@ -608,7 +1102,9 @@ typedef struct {
     /*
      * Migration state transition callback.
      *
-     * The callback should return -1 on error, setting errno.
+     * The callback should return -1 on error, setting errno. If the device
+     * cannot transition immediately it can return -1 with errno set to EBUSY
+     * and later call vfu_migr_done() to complete the transition.
      *
      *
      * TODO rename to vfu_migration_state_transition_callback
@@ -669,7 +1165,9 @@ typedef struct {
      * errno.
      *
      * This function can be called even if the migration data can be memory
-     * mapped.
+     * mapped. It can be NULL if the data section is memory mappable (see
+     * vfu_setup_device_migration_callbacks()), in which case the library reads
+     * the data from its own mapping.
      */
     ssize_t (*read_data)(vfu_ctx_t *vfu_ctx, void *buf,
                          uint64_t count, uint64_t offset);
@@ -680,6 +1178,8 @@ typedef struct {
      * Fuction that is called for writing previously stored device state. The
      * function must return the amount of data written or -1 on error, setting
      * errno.
+     *
+     * Like read_data, it can be NULL if the data section is memory mappable.
      */
     ssize_t (*write_data)(vfu_ctx_t *vfu_ctx, void *buf, uint64_t count,
                           uint64_t offset);
@@ -737,6 +1237,16 @@ struct vfio_user_migration_info {
     uint64_t data_size;
 };
 
+/*
+ * Framing of migration data streamed to or from a file descriptor, see
+ * vfu_setup_device_migration_callbacks(): each chunk prepared by the device is
+ * preceded by its size.
+ */
+struct vfio_user_migr_stream_chunk {
+    uint64_t size;
+    uint8_t data[];
+} __attribute__((packed));
+
 /*
  * Returns the size of the area needed to hold the migration registers at the
  * beginning of the migration region; guaranteed to be page aligned.
@@ -751,6 +1261,29 @@ vfu_get_migr_register_area_size(void);
  * callbacks are not called after this function call. Offsets in callbacks are
  * relative to @data_offset.
  *
+ * If the migration region was set up with a file descriptor and a sparse mmap
+ * area that covers everything from @data_offset to the end of the region, the
+ * client can read and write migration data directly through a mapping, and the
+ * read_data and write_data callbacks become optional: the device places the
+ * data at the offset returned by prepare_data in its own mapping of the file.
+ *
+ * Besides the standard register protocol, the library supports:
+ *
+ *  - reading pending_bytes, data_offset and data_size with a single 24-byte
+ *    access at the offset of pending_bytes while saving, which is equivalent
+ *    to reading them one after the other; if no data are pending, data_offset
+ *    and data_size read as zero.
+ *
+ *  - streaming: writing data_size with a file descriptor (e.g. a pipe or a
+ *    socket) attached to the VFIO_USER_REGION_WRITE message. When saving, the
+ *    library runs save iterations until get_pending_bytes returns 0 or at
+ *    least the written number of bytes (if non-zero) have been sent, writing
+ *    each chunk of data to the file descriptor as a struct
+ *    vfio_user_migr_stream_chunk. When resuming, it reads such chunks until
+ *    end of file and writes each to the device. The file descriptor is closed
+ *    before the reply is sent, so the client must drain (or feed) it while
+ *    waiting for the reply.
+ *
  * @vfu_ctx: the libvfio-user context
  * @callbacks: migration callbacks
  * @data_offset: offset in the migration region where data begins.
@@ -762,12 +1295,248 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
                                      const vfu_migration_callbacks_t *callbacks,
                                      uint64_t data_offset);
 
+#define VFU_MIGR_V2_CALLBACKS_VERS 1
+
+/*
+ * Callbacks for VFIO migration v2, where the client drives the device through
+ * the states of enum vfio_user_device_mig_state with VFIO_USER_DEVICE_FEATURE,
+ * and device state is a stream of bytes transferred with
+ * VFIO_USER_MIG_DATA_READ/WRITE rather than through a migration region.
+ */
+typedef struct {
+
+    /*
+     * Set it to VFU_MIGR_V2_CALLBACKS_VERS.
+     */
+    int version;
+
+    /*
+     * Migration state transition callback. A client request that spans
+     * several states (e.g. running to stop-and-copy) results in one call per
+     * intermediate state.
+     *
+     * The callback should return -1 on error, setting errno, which puts the
+     * device in the error state. Returning -1 with errno set to EBUSY instead
+     * defers the transition until the device calls vfu_migr_done().
+     */
+    int (*transition)(vfu_ctx_t *vfu_ctx, vfu_migr_state_t state);
+
+    /*
+     * Function that is called to read up to @count bytes of device state, in
+     * the pre-copy and stop-and-copy states. It must return the number of
+     * bytes read, 0 if there are no more data (in pre-copy: for now), or -1
+     * on error, setting errno.
+     */
+    ssize_t (*read_data)(vfu_ctx_t *vfu_ctx, void *buf, uint64_t count);
+
+    /*
+     * Function that is called with @count bytes of device state, previously
+     * read on the source, in the resuming state. It must return the number of
+     * bytes consumed or -1 on error, setting errno.
+     */
+    ssize_t (*write_data)(vfu_ctx_t *vfu_ctx, void *buf, uint64_t count);
+
+    /*
+     * Optional function that is called in pre-copy to estimate the amount of
+     * data still to be read: @initial_bytes for the initial device state, and
+     * @dirty_bytes for state that has changed since. Clients use it to decide
+     * when pre-copy has converged, so that stop-and-copy only transfers the
+     * residual.
+     *
+     * The callback should return -1 on error, setting errno.
+     */
+    int (*precopy_info)(vfu_ctx_t *vfu_ctx, uint64_t *initial_bytes,
+                        uint64_t *dirty_bytes);
+
+} vfu_migration_v2_callbacks_t;
+
+/* The device supports the pre-copy state. */
+#define VFU_MIGR_V2_FLAG_PRE_COPY (1 << 0)
+
+/**
+ * Sets up VFIO migration v2 for the device, as an alternative to
+ * vfu_setup_device_migration_callbacks(); a device can use one or the other.
+ * No migration region is needed. The device starts in the running state, and
+ * returns to it on reset.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @flags: VFU_MIGR_V2_FLAG_*
+ * @callbacks: migration callbacks
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_device_migration_v2(vfu_ctx_t *vfu_ctx, uint64_t flags,
+                              const vfu_migration_v2_callbacks_t *callbacks);
+
+/* Send all-zero pages of migration data as a short record. */
+#define VFU_MIGR_ENC_ZERO_PAGES         (1 << 0)
+/* Send pages unchanged since they were last sent as a short record. */
+#define VFU_MIGR_ENC_UNCHANGED_PAGES    (1 << 1)
+
+/**
+ * Has the library encode the migration data of the device, so that devices
+ * whose state is mostly idle memory migrate in a fraction of the bytes. Each
+ * chunk returned by read_data() is split into pages, and pages that are all
+ * zero or, if the device state offset of the chunk is page aligned, that
+ * haven't changed since the previous iteration, are replaced by short
+ * records. The destination must set up the same encoding, its library expands
+ * the records before handing the chunk to write_data().
+ *
+ * Encoding takes place once per iteration: read_data() is called for the
+ * whole chunk, after prepare_data(), and write_data() with the whole chunk
+ * once data_size is written. Tracking unchanged pages costs a copy of the
+ * data section on each side. As a chunk with nothing to elide grows a little
+ * when encoded, the data section must have room for a small header and a
+ * record per page beyond the largest chunk.
+ *
+ * Only for migration set up with vfu_setup_device_migration_callbacks(), with
+ * read_data and write_data callbacks.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @flags: VFU_MIGR_ENC_*
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_migration_encoding(vfu_ctx_t *vfu_ctx, uint32_t flags);
+
+/*
+ * Function that is called to read up to @count bytes of migration stream
+ * @stream. It must return the number of bytes read, 0 if there are no more
+ * data, or -1 on error, setting errno.
+ */
+typedef ssize_t (vfu_migr_stream_read_cb_t)(vfu_ctx_t *vfu_ctx,
+                                            uint32_t stream, void *buf,
+                                            uint64_t count);
+
+/*
+ * Function that is called with frame @seq of migration stream @stream, which
+ * the client may deliver in any order. It must return the number of bytes
+ * consumed, or -1 on error, setting errno.
+ */
+typedef ssize_t (vfu_migr_stream_write_cb_t)(vfu_ctx_t *vfu_ctx,
+                                             uint32_t stream, uint64_t seq,
+                                             void *buf, uint64_t count);
+
+/**
+ * Splits the migration data of the device into @nr_streams independent
+ * streams, e.g. one per queue or memory bank, in addition to the data of the
+ * main migration callbacks. With VFIO_USER_MIG_STREAMS the client has them
+ * transferred concurrently over a file descriptor each, while saving (in the
+ * pre-copy or stop-and-copy states) or resuming, so that transfer isn't bound
+ * by a single thread and socket.
+ *
+ * The library runs a thread per file descriptor, and the callbacks are called
+ * from these threads concurrently. While saving each stream is read by a
+ * single thread; while resuming frames of the same stream may be written from
+ * different threads, if the client sent them over different file descriptors.
+ * vfu_run_ctx() keeps handling requests meanwhile, and the threads are joined
+ * before the next migration state transition, so the transition callback never
+ * runs concurrently with the stream callbacks.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @nr_streams: number of streams
+ * @read_cb: function called to read a stream when saving
+ * @write_cb: function called with a frame of a stream when resuming
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_migration_streams(vfu_ctx_t *vfu_ctx, uint32_t nr_streams,
+                            vfu_migr_stream_read_cb_t *read_cb,
+                            vfu_migr_stream_write_cb_t *write_cb);
+
+/**
+ * Completes a migration state transition the device deferred by returning -1
+ * with errno set to EBUSY from its transition callback.
+ *
+ * As with asynchronous quiescing, vfu_run_ctx() returns -1 with errno set to
+ * EBUSY until the transition completes, and a context in a vfu_loop_t is
+ * parked, so the other contexts keep being serviced. Meanwhile the device may
+ * keep accessing mappable DMA regions with vfu_addr_to_sgl(), vfu_sgl_get(),
+ * vfu_sgl_put(), vfu_sgl_copy_to() and vfu_sgl_copy_from(), but must not use
+ * vfu_sgl_read() or vfu_sgl_write(), or copy to or from a region that is not
+ * mappable, as those need to message the client. Once vfu_migr_done() returns
+ * the client has been replied to and the device is no longer quiesced.
+ *
+ * With migration v2 a transition may take several steps; the library carries
+ * on with the remaining ones from here, each of which may be deferred again.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @reply_errno: 0 if the device is now in the new state, otherwise the error
+ *               the transition failed with, returned to the client
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_migr_done(vfu_ctx_t *vfu_ctx, int reply_errno);
+
+/* Number of iterations vfu_migr_get_stats() returns pending bytes for. */
+#define VFU_MIGR_PENDING_HISTORY 16
+
+typedef struct {
+    /* pages reported dirty to the client since dirty page logging started */
+    uint64_t dirty_pages;
+    /*
+     * bytes per second reported dirty over the last few rounds of bitmap
+     * fetches, each covering every logged DMA region
+     */
+    uint64_t dirty_rate;
+    /*
+     * Pending bytes reported by the device at the start of each of the last
+     * nr_pending iterations of the current migration, oldest first.
+     */
+    uint64_t pending_bytes[VFU_MIGR_PENDING_HISTORY];
+    uint32_t nr_pending;
+    /* total number of iterations of the current migration */
+    uint64_t nr_iterations;
+    /* time spent in each state, in nanoseconds, including the current one */
+    uint64_t state_ns[VFU_MIGR_STATE_RESUME + 1];
+} vfu_migr_stats_t;
+
+/**
+ * Returns migration convergence statistics: how fast the device dirties guest
+ * memory, how much data it has had pending in each iteration, and how long it
+ * spent in each migration state. Meant to help decide when to switch to
+ * stop-and-copy or to throttle the device.
+ *
+ * The dirty page fields are zero if dirty page logging is off; the rest are
+ * zero if migration has not been set up. Must be called from the same thread
+ * as vfu_run_ctx().
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @stats: filled in with the statistics
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_migr_get_stats(vfu_ctx_t *vfu_ctx, vfu_migr_stats_t *stats);
+
+/**
+ * Returns the number of pages reported dirty to the client for the DMA region
+ * containing @dma_addr, since dirty page logging started.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @dma_addr: an address within the DMA region
+ * @dirty_pages: filled in with the number of pages
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_dma_get_dirty_pages(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr,
+                        uint64_t *dirty_pages);
+
 /**
  * Triggers an interrupt.
  *
  * libvfio-user takes care of using the correct IRQ type (IRQ index: INTx or
  * MSI/X), the caller only needs to specify the sub-index.
  *
+ * With vfu_setup_msix_table(), triggering a masked MSI-X vector sets its
+ * pending bit instead, and the interrupt is fired once the guest unmasks it.
+ * This is lock-free and may be called from any thread.
+ *
  * @vfu_ctx: the libvfio-user context to trigger interrupt
  * @subindex: vector subindex to trigger interrupt on
  *
@@ -776,6 +1545,25 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
 int
 vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex);
 
+/**
+ * Lets libvfio-user emulate the MSI-X table and Pending Bit Array, as located
+ * by the MSI-X capability, which must already have been added with
+ * vfu_pci_add_capability(), as must the BAR regions holding them. Accesses to
+ * the table and PBA are then served by the library without calling the region
+ * callback, mask bits are honoured by vfu_irq_trigger(), and pending vectors
+ * are fired when unmasked. Changes to a vector's mask bit are reported to the
+ * VFU_DEV_MSIX_IRQ state callback, if any.
+ *
+ * The table and PBA must not be in a sparse mmap area. All vectors start out
+ * masked, as they do again when the client disconnects.
+ *
+ * @vfu_ctx: the libvfio-user context
+ *
+ * @returns 0 on success, -1 on error, sets errno.
+ */
+int
+vfu_setup_msix_table(vfu_ctx_t *vfu_ctx);
+
 /**
  * Takes a guest physical address range and populates an array of scatter/gather
  * entries than can be individually mapped in the program's virtual memory.  A
@@ -802,6 +1590,61 @@ int
 vfu_addr_to_sgl(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr, size_t len,
                 dma_sg_t *sgl, size_t max_nr_sgs, int prot);
 
+/*
+ * A guest physical address range, as found in a descriptor ring, for the
+ * bulk translation functions below.
+ */
+typedef struct {
+    vfu_dma_addr_t  dma_addr;
+    size_t          len;
+    int             prot;
+} vfu_dma_desc_t;
+
+/**
+ * Like vfu_addr_to_sgl(), for a whole array of address ranges at once, such as
+ * the descriptors of a virtqueue or NVMe submission queue. The scatter/gather
+ * entries of all ranges are stored one after the other in @sgl; a range spans
+ * more than one entry only if it crosses DMA regions.
+ *
+ * The state checks are made once for the whole array, and consecutive ranges
+ * in the same DMA region, as is usual for rings, are translated without
+ * searching the regions again.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @descs: the address ranges to translate
+ * @nr_descs: number of elements in above array
+ * @sgl: array that receives the scatter/gather entries
+ * @max_nr_sgs: maximum number of elements in above array
+ *
+ * @returns the number of scatter/gather entries created on success, and on
+ * failure:
+ *  -1:         if any address span is invalid (errno=ENOENT) or a protection
+ *              violation (errno=EACCES)
+ *  (-x - 1):   if @max_nr_sgs is too small, where x is the number of SG
+ *              entries necessary to complete this request (errno=0).
+ */
+int
+vfu_addrs_to_sgl(vfu_ctx_t *vfu_ctx, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, size_t max_nr_sgs);
+
+/**
+ * vfu_addrs_to_sgl() followed by vfu_sgl_get() in a single pass: also fills in
+ * @iov with the mapping of each scatter/gather entry. The iovecs must be
+ * released with vfu_sgl_put() on @sgl, as for vfu_sgl_get().
+ *
+ * This is only supported when a @dma_unregister callback is provided to
+ * vfu_setup_device_dma().
+ *
+ * @iov: array of at least @max_nr_sgs iovec structures
+ *
+ * @returns as vfu_addrs_to_sgl(), and also -1 with errno=EFAULT if a DMA
+ * region isn't mappable.
+ */
+int
+vfu_addrs_to_iov(vfu_ctx_t *vfu_ctx, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, struct iovec *iov,
+                 size_t max_nr_sgs);
+
 /**
  * Populate the given iovec array (accessible in the process's virtual memory),
  * based upon the SGL previously built via vfu_addr_to_sgl().
@@ -878,6 +1721,39 @@ vfu_sgl_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data);
 int
 vfu_sgl_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sg, size_t cnt, void *data);
 
+/**
+ * Copies @data into the guest memory described by @sgl, as obtained from
+ * vfu_addr_to_sgl(): the segments are filled in order, each with the next
+ * sg->length bytes of @data.
+ *
+ * Segments that are mapped in this process are written directly, with
+ * non-temporal stores if large enough that the data is better kept out of the
+ * cache, and marked dirty if dirty page logging is on. The others are written
+ * with VFIO_USER_DMA_WRITE messages, as vfu_sgl_write() does, so this may only
+ * be called when that's allowed.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @sgl: array of writeable scatter/gather entries
+ * @cnt: number of entries
+ * @data: the data to copy
+ *
+ * @returns 0 on success, -1 on failure (EPERM if an entry isn't writeable),
+ * sets errno.
+ */
+int
+vfu_sgl_copy_to(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt,
+                const void *data);
+
+/**
+ * Copies the guest memory described by @sgl into @data, directly for the
+ * segments mapped in this process, and with VFIO_USER_DMA_READ messages for
+ * the others. See vfu_sgl_copy_to().
+ *
+ * @returns 0 on success, -1 on failure, sets errno.
+ */
+int
+vfu_sgl_copy_from(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data);
+
 /*
  * Supported PCI regions.
  *
@@ -1075,6 +1951,31 @@ vfu_create_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
                      size_t offset, uint32_t size, uint32_t flags,
                      uint64_t datamatch);
 
+/*
+ * Creates an ioregionfd for @size bytes at @offset of BAR region @region_idx.
+ * The library creates a socket pair and hands one end to the client with
+ * VFIO_USER_DEVICE_GET_REGION_IO_FDS; the client then sends each access to
+ * the subregion as a fixed-size frame (struct vfio_user_ioregionfd_cmd)
+ * instead of a VFIO_USER_REGION_READ/WRITE message.
+ *
+ * The frames are serviced by a thread the library starts for the context,
+ * which calls the region's callback directly: the callback can therefore be
+ * called from that thread at the same time as vfu_run_ctx() runs, and also
+ * while the device is quiesced. Accesses that fail, or that arrive while the
+ * device is in stop-and-copy, read as all ones and are otherwise dropped.
+ *
+ * Returns 0 on success and -1 on failure with errno set.
+ *
+ * @vfu_ctx: the libvfio-user context
+ * @region_idx: the BAR region, which must have an access callback
+ * @offset: the offset into the region
+ * @size: size of the subregion
+ * @user_data: passed back by the client in each frame
+ */
+int
+vfu_create_ioregionfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, size_t offset,
+                      uint32_t size, uint64_t user_data);
+
 #ifdef __cplusplus
 }
 #endif
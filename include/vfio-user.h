@@ -68,6 +68,24 @@ enum vfio_user_command {
     VFIO_USER_DEVICE_RESET              = 13,
     VFIO_USER_DIRTY_PAGES               = 14,
     VFIO_USER_MAX,
+
+    /*
+     * Commands specific to this library. The vfio-user specification numbers
+     * its commands sequentially, and the values following
+     * VFIO_USER_DIRTY_PAGES are already assigned there (15 is
+     * VFIO_USER_REGION_WRITE_MULTI), so these extensions are numbered from
+     * VFIO_USER_EXT_BASE, in the top half of the 16-bit command space, where
+     * they cannot collide with commands the specification adds later. A
+     * client that doesn't know about an extension never sends it, and a
+     * server that doesn't implement one replies EINVAL.
+     */
+    VFIO_USER_EXT_BASE                  = 0x8000,
+    VFIO_USER_SHM_SETUP                 = VFIO_USER_EXT_BASE,
+    VFIO_USER_DEVICE_FEATURE            = 0x8001,
+    VFIO_USER_MIG_DATA_READ             = 0x8002,
+    VFIO_USER_MIG_DATA_WRITE            = 0x8003,
+    VFIO_USER_MIG_STREAMS               = 0x8004,
+    VFIO_USER_EXT_MAX,
 };
 
 enum vfio_user_message_type {
@@ -200,6 +218,33 @@ typedef struct vfio_user_region_io_fds_reply {
     } sub_regions[];
 } __attribute__((packed)) vfio_user_region_io_fds_reply_t;
 
+/*
+ * Frames exchanged over an ioregionfd, as in the KVM ioregionfd proposal. The
+ * client sends a command for each access to the subregion; the server replies
+ * to every read, and to writes that have VFIO_USER_IOREGIONFD_RESP set.
+ */
+struct vfio_user_ioregionfd_cmd {
+    uint32_t info;
+    uint32_t padding;
+    uint64_t user_data;
+    /* offset of the access within the subregion */
+    uint64_t offset;
+    uint64_t data;
+} __attribute__((packed));
+
+struct vfio_user_ioregionfd_resp {
+    uint64_t data;
+    uint8_t pad[24];
+} __attribute__((packed));
+
+#define VFIO_USER_IOREGIONFD_CMD_READ   0
+#define VFIO_USER_IOREGIONFD_CMD_WRITE  1
+#define VFIO_USER_IOREGIONFD_CMD_MASK   0xf
+/* log2 of the access size in bytes */
+#define VFIO_USER_IOREGIONFD_SIZE_SHIFT 4
+#define VFIO_USER_IOREGIONFD_SIZE_MASK  (0x3 << VFIO_USER_IOREGIONFD_SIZE_SHIFT)
+#define VFIO_USER_IOREGIONFD_RESP       (1 << 6)
+
 
 /* Analogous to vfio_iommu_type1_dirty_bitmap. */
 struct vfio_user_dirty_pages {
@@ -219,6 +264,177 @@ struct vfio_user_bitmap_range {
     struct vfio_user_bitmap bitmap;
 } __attribute__((packed));
 
+/*
+ * Payload of VFIO_USER_SHM_SETUP. The message carries three file descriptors:
+ * a memfd holding the two rings, an eventfd the client signals after producing
+ * into the client-to-server ring, and an eventfd the server signals after
+ * producing into the server-to-client ring.
+ *
+ * Once the server has replied, every message that does not carry file
+ * descriptors travels through the rings; the socket is only used for commands
+ * such as VFIO_USER_DMA_MAP and VFIO_USER_DEVICE_SET_IRQS and their replies.
+ */
+struct vfio_user_shm_setup {
+    uint32_t    argsz;
+    uint32_t    flags;
+    /* Size of each ring's data area, must be a power of two. */
+    uint64_t    ring_size;
+} __attribute__((packed));
+
+/*
+ * A single-producer, single-consumer ring of vfio-user messages. @head and
+ * @tail are free-running byte counters; an entry is a complete message (header
+ * followed by payload) that may wrap around the end of @data. The producer
+ * only publishes @tail once the whole message has been written.
+ */
+struct vfio_user_shm_ring {
+    uint32_t    head;       /* written by the consumer */
+    uint8_t     pad0[60];
+    uint32_t    tail;       /* written by the producer */
+    uint8_t     pad1[60];
+    uint8_t     data[];
+};
+
+#define VFIO_USER_SHM_RING_C2S  0
+#define VFIO_USER_SHM_RING_S2C  1
+
+/* Offset of the given ring within the memfd. */
+#define VFIO_USER_SHM_RING_OFFSET(ring_size, idx) \
+    ((idx) * (sizeof(struct vfio_user_shm_ring) + (ring_size)))
+
+/* Analogous to struct vfio_device_feature. */
+struct vfio_user_device_feature {
+    uint32_t    argsz;
+    uint32_t    flags;
+#ifndef VFIO_DEVICE_FEATURE_MASK
+#define VFIO_DEVICE_FEATURE_MASK    (0xffff)
+#define VFIO_DEVICE_FEATURE_GET     (1 << 16)
+#define VFIO_DEVICE_FEATURE_SET     (1 << 17)
+#define VFIO_DEVICE_FEATURE_PROBE   (1 << 18)
+#endif
+    uint8_t     data[];
+} __attribute__((packed));
+
+/* Analogous to struct vfio_device_feature_migration. */
+struct vfio_user_device_feature_migration {
+    uint64_t    flags;
+#ifndef VFIO_MIGRATION_STOP_COPY
+#define VFIO_MIGRATION_STOP_COPY    (1 << 0)
+#define VFIO_MIGRATION_P2P          (1 << 1)
+#endif
+#ifndef VFIO_MIGRATION_PRE_COPY
+#define VFIO_MIGRATION_PRE_COPY     (1 << 2)
+#endif
+} __attribute__((packed));
+
+#ifndef VFIO_DEVICE_FEATURE_MIGRATION
+#define VFIO_DEVICE_FEATURE_MIGRATION 1
+#endif
+
+/*
+ * Analogous to struct vfio_device_feature_mig_state. Migration data don't
+ * travel through a file descriptor returned here, @data_fd is always -1:
+ * see VFIO_USER_MIG_DATA_READ.
+ */
+struct vfio_user_device_feature_mig_state {
+    uint32_t    device_state; /* VFIO_USER_DEVICE_STATE_* */
+    uint32_t    data_fd;
+} __attribute__((packed));
+
+#ifndef VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE
+#define VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE 2
+#endif
+
+/*
+ * Analogous to struct vfio_precopy_info, which VFIO returns from an ioctl on
+ * the data fd; vfio-user gets it as a device feature instead. While in
+ * pre-copy, @initial_bytes is an estimate of the data still to be read before
+ * the device's initial state has been sent, and @dirty_bytes of the data for
+ * state changed since.
+ */
+struct vfio_user_precopy_info {
+    uint64_t    initial_bytes;
+    uint64_t    dirty_bytes;
+} __attribute__((packed));
+
+/* Outside the range of features defined by VFIO. */
+#define VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO 0x8000
+
+/*
+ * Analogous to enum vfio_device_mig_state, including the pre-copy states not
+ * yet in all kernel headers.
+ */
+enum vfio_user_device_mig_state {
+    VFIO_USER_DEVICE_STATE_ERROR        = 0,
+    VFIO_USER_DEVICE_STATE_STOP         = 1,
+    VFIO_USER_DEVICE_STATE_RUNNING      = 2,
+    VFIO_USER_DEVICE_STATE_STOP_COPY    = 3,
+    VFIO_USER_DEVICE_STATE_RESUMING     = 4,
+    VFIO_USER_DEVICE_STATE_RUNNING_P2P  = 5,
+    VFIO_USER_DEVICE_STATE_PRE_COPY     = 6,
+    VFIO_USER_DEVICE_STATE_PRE_COPY_P2P = 7,
+    VFIO_USER_DEVICE_NUM_STATES         = 8,
+};
+
+/*
+ * Payload of VFIO_USER_MIG_DATA_READ and VFIO_USER_MIG_DATA_WRITE. A read
+ * request asks for up to @size bytes of migration data, which the reply
+ * carries in @data with @size set to the amount returned; zero means there are
+ * no more data for now. A write request carries @size bytes in @data.
+ *
+ * If the request carries a file descriptor, the data are streamed through it
+ * instead: a read writes data to it until the device has no more, or @size
+ * bytes (if non-zero) have been written; a write reads @size bytes from it.
+ * The reply then has no @data, and @size is the amount transferred.
+ */
+struct vfio_user_mig_data {
+    uint32_t    argsz;
+    uint32_t    size;
+    uint8_t     data[];
+} __attribute__((packed));
+
+/*
+ * Payload of VFIO_USER_MIG_STREAMS, for devices whose state is split into
+ * independent streams. The reply always tells how many streams there are in
+ * @nr_streams.
+ *
+ * A request with file descriptors starts a transfer: while saving there must
+ * be one file descriptor per stream, and the server writes each stream to its
+ * own one concurrently, then closes it; while resuming, the server reads
+ * streams from all of them concurrently until end of file. The server replies
+ * straight away, without waiting for the transfer to finish, and fails with
+ * EALREADY if a transfer is still in flight.
+ *
+ * A request without file descriptors queries the transfer: while it runs, the
+ * reply has VFIO_USER_MIG_STREAMS_F_BUSY set in @flags, and @size is the
+ * amount of data transferred so far. Once it has finished, @size is the total
+ * amount, or the request fails with the error the transfer failed with. The
+ * next migration state transition waits for a transfer in flight to finish.
+ *
+ * The data of a stream are sent as frames, each preceded by a struct
+ * vfio_user_mig_stream_hdr. As the frames say which stream they belong to and
+ * where in it, a client may send them back over any file descriptor, in any
+ * order.
+ */
+struct vfio_user_mig_streams {
+    uint32_t    argsz;
+    uint32_t    flags;
+    uint32_t    nr_streams;
+    uint32_t    reserved;
+    uint64_t    size;
+} __attribute__((packed));
+
+#define VFIO_USER_MIG_STREAMS_F_BUSY    (1 << 0)
+
+struct vfio_user_mig_stream_hdr {
+    uint32_t    stream;
+    uint32_t    reserved;
+    /* frame number in the stream, from 0 */
+    uint64_t    seq;
+    uint64_t    size;
+    uint8_t     data[];
+} __attribute__((packed));
+
 #ifndef VFIO_REGION_TYPE_MIGRATION
 
 #define VFIO_REGION_TYPE_MIGRATION (3)
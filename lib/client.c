@@ -0,0 +1,1297 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Client side of the vfio-user protocol, see libvfio-user-client.h.
+ *
+ * Each outstanding request owns a slot in a power-of-two table indexed by the
+ * low bits of its message ID, so matching a reply is a single lookup. The
+ * socket is written under client->lock by any thread; it is only read by the
+ * thread calling vfu_client_run().
+ */
+
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <json.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libvfio-user.h"
+#include "libvfio-user-client.h"
+#include "private.h"
+
+#define CLIENT_MAX_FDS (32)
+
+/* Upper bound on any message we are prepared to receive. */
+#define CLIENT_MAX_MSG_SIZE (64UL << 20)
+
+#define CLIENT_MAX_INFLIGHT (UINT16_MAX + 1)
+
+struct client_req {
+    bool busy;
+    uint16_t msg_id;
+    vfu_client_cb_t *cb;
+    void *arg;
+    /* If set, the reply payload past @dst_skip is copied here. */
+    void *dst;
+    size_t dst_skip;
+    size_t dst_len;
+};
+
+struct client_dma {
+    uint64_t iova;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t prot;
+    void *vaddr;
+    int fd;
+};
+
+struct vfu_client {
+    int fd;
+    bool connected;
+
+    /* Protects the socket's send side and the request table. */
+    pthread_mutex_t lock;
+    struct client_req *reqs;
+    uint32_t nr_reqs;
+    uint32_t inflight;
+    uint16_t next_msg_id;
+
+    int server_max_fds;
+    size_t server_max_data_xfer_size;
+    size_t max_data_xfer_size;
+
+    /* Only touched by the thread calling vfu_client_run(). */
+    struct client_dma *dma;
+    size_t nr_dma;
+    void *rx_buf;
+    size_t rx_buf_size;
+    void *tx_buf;
+};
+
+static void
+close_fds(int *fds, size_t nr_fds)
+{
+    size_t i;
+
+    for (i = 0; i < nr_fds; i++) {
+        close(fds[i]);
+    }
+}
+
+/*
+ * Writes a message to the socket. The header goes in iov[0], which the caller
+ * must leave empty. Called with client->lock held.
+ */
+static int
+client_send_locked(vfu_client_t *client, uint16_t msg_id, bool is_reply,
+                   uint16_t cmd, struct iovec *iov, size_t nr_iov,
+                   const int *fds, size_t nr_fds, int error)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * CLIENT_MAX_FDS)];
+    struct vfio_user_header hdr = {
+        .msg_id = msg_id,
+        .cmd = cmd,
+    };
+    struct msghdr msg = { 0 };
+    size_t i;
+
+    assert(nr_iov > 0);
+
+    if (nr_fds > CLIENT_MAX_FDS || (int)nr_fds > client->server_max_fds) {
+        return ERROR_INT(EINVAL);
+    }
+
+    hdr.msg_size = sizeof(hdr);
+    for (i = 1; i < nr_iov; i++) {
+        hdr.msg_size += iov[i].iov_len;
+    }
+    if (is_reply) {
+        hdr.flags.type = VFIO_USER_F_TYPE_REPLY;
+        if (error != 0) {
+            hdr.flags.error = 1;
+            hdr.error_no = error;
+        }
+    } else {
+        hdr.flags.type = VFIO_USER_F_TYPE_COMMAND;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nr_iov;
+
+    if (nr_fds > 0) {
+        struct cmsghdr *cmsg;
+
+        msg.msg_control = cmsgbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+    }
+
+    /* Stream socket: keep going on short writes, fds go with the first. */
+    while (msg.msg_iovlen > 0) {
+        ssize_t ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+
+        while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len) {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+static int
+client_send_reply(vfu_client_t *client, uint16_t msg_id, uint16_t cmd,
+                  void *data, size_t len, int error)
+{
+    struct iovec iov[2] = { { 0 }, { .iov_base = data, .iov_len = len } };
+    int ret;
+
+    pthread_mutex_lock(&client->lock);
+    ret = client_send_locked(client, msg_id, true, cmd, iov,
+                             len > 0 ? 2 : 1, NULL, 0, error);
+    pthread_mutex_unlock(&client->lock);
+    return ret;
+}
+
+/*
+ * Allocates a request slot and sends the request. @iov[0] is reserved for the
+ * header. If @dst is set, the reply payload past @skip is copied there before
+ * the callback runs; it has to be recorded before the request goes out, as
+ * the reply may be read by another thread as soon as it does.
+ */
+static int
+client_submit(vfu_client_t *client, enum vfio_user_command cmd,
+              struct iovec *iov, size_t nr_iov, const int *fds, size_t nr_fds,
+              void *dst, size_t skip, size_t dst_len,
+              vfu_client_cb_t *cb, void *arg)
+{
+    struct client_req *req = NULL;
+    uint16_t msg_id = 0;
+    uint32_t i;
+    int ret;
+
+    pthread_mutex_lock(&client->lock);
+
+    if (!client->connected) {
+        pthread_mutex_unlock(&client->lock);
+        return ERROR_INT(ENOTCONN);
+    }
+
+    if (client->inflight == client->nr_reqs) {
+        pthread_mutex_unlock(&client->lock);
+        return ERROR_INT(EAGAIN);
+    }
+
+    /* A free slot exists, so this terminates within nr_reqs steps. */
+    for (i = 0; i < client->nr_reqs; i++) {
+        msg_id = client->next_msg_id++;
+        req = &client->reqs[msg_id & (client->nr_reqs - 1)];
+        if (!req->busy) {
+            break;
+        }
+    }
+    assert(req != NULL && !req->busy);
+
+    req->busy = true;
+    req->msg_id = msg_id;
+    req->cb = cb;
+    req->arg = arg;
+    req->dst = dst;
+    req->dst_skip = skip;
+    req->dst_len = dst_len;
+    client->inflight++;
+
+    ret = client_send_locked(client, msg_id, false, cmd, iov, nr_iov,
+                             fds, nr_fds, 0);
+    if (ret < 0) {
+        int err = errno;
+
+        req->busy = false;
+        client->inflight--;
+        pthread_mutex_unlock(&client->lock);
+        return ERROR_INT(err);
+    }
+
+    pthread_mutex_unlock(&client->lock);
+    return msg_id;
+}
+
+EXPORT int
+vfu_client_send(vfu_client_t *client, enum vfio_user_command cmd,
+                const struct iovec *iov, size_t nr_iov,
+                const int *fds, size_t nr_fds,
+                vfu_client_cb_t *cb, void *arg)
+{
+    struct iovec *iovecs;
+
+    assert(client != NULL);
+
+    if (nr_iov > IOV_MAX - 1 || (iov == NULL && nr_iov > 0)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    iovecs = alloca(sizeof(*iovecs) * (nr_iov + 1));
+    if (nr_iov > 0) {
+        memcpy(&iovecs[1], iov, sizeof(*iovecs) * nr_iov);
+    }
+
+    return client_submit(client, cmd, iovecs, nr_iov + 1, fds, nr_fds,
+                         NULL, 0, 0, cb, arg);
+}
+
+/*
+ * Completes every outstanding request with @err. Used when the connection
+ * goes away.
+ */
+static void
+client_fail_all(vfu_client_t *client, int err)
+{
+    uint32_t i;
+
+    for (i = 0; i < client->nr_reqs; i++) {
+        struct client_req *req = &client->reqs[i];
+        vfu_client_cb_t *cb;
+        void *arg;
+
+        pthread_mutex_lock(&client->lock);
+        if (!req->busy) {
+            pthread_mutex_unlock(&client->lock);
+            continue;
+        }
+        cb = req->cb;
+        arg = req->arg;
+        req->busy = false;
+        client->inflight--;
+        pthread_mutex_unlock(&client->lock);
+
+        if (cb != NULL) {
+            cb(client, arg, err, NULL, 0, NULL, 0);
+        }
+    }
+}
+
+static struct client_dma *
+client_dma_find(vfu_client_t *client, uint64_t addr, uint64_t count)
+{
+    size_t i;
+
+    for (i = 0; i < client->nr_dma; i++) {
+        struct client_dma *dma = &client->dma[i];
+
+        if (addr >= dma->iova && count <= dma->size &&
+            addr - dma->iova <= dma->size - count) {
+            return dma;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Services a DMA_READ or DMA_WRITE from the server against the registered
+ * DMA regions.
+ */
+static int
+client_handle_dma(vfu_client_t *client, struct vfio_user_header *hdr,
+                  void *data, size_t len)
+{
+    struct vfio_user_dma_region_access *req = data;
+    struct vfio_user_dma_region_access *reply = client->tx_buf;
+    struct client_dma *dma;
+    size_t reply_len = 0;
+    uint64_t offset;
+    int err = 0;
+
+    if (len < sizeof(*req) || req->count > client->max_data_xfer_size ||
+        (hdr->cmd == VFIO_USER_DMA_WRITE && len - sizeof(*req) < req->count)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    dma = client_dma_find(client, req->addr, req->count);
+    if (dma == NULL) {
+        err = EFAULT;
+        goto out;
+    }
+
+    if (hdr->cmd == VFIO_USER_DMA_WRITE &&
+        !(dma->prot & VFIO_USER_F_DMA_REGION_WRITE)) {
+        err = EPERM;
+        goto out;
+    }
+
+    offset = req->addr - dma->iova;
+    reply->addr = req->addr;
+    reply->count = req->count;
+    reply_len = sizeof(*reply);
+
+    if (hdr->cmd == VFIO_USER_DMA_WRITE) {
+        if (dma->vaddr != NULL) {
+            memcpy((char *)dma->vaddr + offset, req->data, req->count);
+        } else if (pwrite(dma->fd, req->data, req->count,
+                          dma->offset + offset) != (ssize_t)req->count) {
+            err = errno != 0 ? errno : EIO;
+        }
+    } else {
+        if (dma->vaddr != NULL) {
+            memcpy(reply->data, (char *)dma->vaddr + offset, req->count);
+        } else if (pread(dma->fd, reply->data, req->count,
+                         dma->offset + offset) != (ssize_t)req->count) {
+            err = errno != 0 ? errno : EIO;
+        }
+        reply_len += req->count;
+    }
+
+out:
+    if (err != 0) {
+        return client_send_reply(client, hdr->msg_id, hdr->cmd, NULL, 0, err);
+    }
+    return client_send_reply(client, hdr->msg_id, hdr->cmd, reply,
+                             reply_len, 0);
+}
+
+static void
+client_handle_reply(vfu_client_t *client, struct vfio_user_header *hdr,
+                    void *data, size_t len, int *fds, size_t nr_fds)
+{
+    struct client_req *req;
+    vfu_client_cb_t *cb;
+    void *arg;
+    int err = 0;
+
+    pthread_mutex_lock(&client->lock);
+    req = &client->reqs[hdr->msg_id & (client->nr_reqs - 1)];
+    if (!req->busy || req->msg_id != hdr->msg_id) {
+        /* Unsolicited reply: nothing to complete. */
+        pthread_mutex_unlock(&client->lock);
+        close_fds(fds, nr_fds);
+        return;
+    }
+
+    if (hdr->flags.error) {
+        err = hdr->error_no != 0 ? (int)hdr->error_no : EINVAL;
+    } else if (req->dst != NULL) {
+        if (len < req->dst_skip) {
+            err = EINVAL;
+        } else {
+            memcpy(req->dst, (char *)data + req->dst_skip,
+                   MIN(len - req->dst_skip, req->dst_len));
+        }
+    }
+
+    cb = req->cb;
+    arg = req->arg;
+    req->busy = false;
+    client->inflight--;
+    pthread_mutex_unlock(&client->lock);
+
+    if (cb != NULL) {
+        cb(client, arg, err, data, len, fds, nr_fds);
+    } else {
+        close_fds(fds, nr_fds);
+    }
+}
+
+/*
+ * Reads one message. The sender writes each message with a single sendmsg(),
+ * so once the header is readable the rest follows promptly and is read with
+ * MSG_WAITALL.
+ */
+static int
+client_recv_one(vfu_client_t *client)
+{
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * CLIENT_MAX_FDS)];
+    int fds[CLIENT_MAX_FDS];
+    size_t nr_fds = 0;
+    struct vfio_user_header hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsgbuf,
+        .msg_controllen = sizeof(cmsgbuf),
+    };
+    struct cmsghdr *cmsg;
+    size_t len;
+    ssize_t ret;
+
+    do {
+        ret = recvmsg(client->fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            n = MIN(n, ARRAY_SIZE(fds) - nr_fds);
+            memcpy(&fds[nr_fds], CMSG_DATA(cmsg), n * sizeof(int));
+            nr_fds += n;
+        }
+    }
+
+    if (ret == 0) {
+        close_fds(fds, nr_fds);
+        return ERROR_INT(ENOTCONN);
+    }
+
+    if ((size_t)ret != sizeof(hdr) || hdr.msg_size < sizeof(hdr) ||
+        hdr.msg_size > CLIENT_MAX_MSG_SIZE || (msg.msg_flags & MSG_CTRUNC)) {
+        close_fds(fds, nr_fds);
+        return ERROR_INT(EPROTO);
+    }
+
+    len = hdr.msg_size - sizeof(hdr);
+    if (len > client->rx_buf_size) {
+        void *buf = realloc(client->rx_buf, len);
+
+        if (buf == NULL) {
+            close_fds(fds, nr_fds);
+            return ERROR_INT(ENOMEM);
+        }
+        client->rx_buf = buf;
+        client->rx_buf_size = len;
+    }
+
+    if (len > 0) {
+        do {
+            ret = recv(client->fd, client->rx_buf, len, MSG_WAITALL);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 || (size_t)ret != len) {
+            close_fds(fds, nr_fds);
+            return ERROR_INT(ret == -1 ? errno : ENOTCONN);
+        }
+    }
+
+    if (hdr.flags.type == VFIO_USER_F_TYPE_REPLY) {
+        client_handle_reply(client, &hdr, client->rx_buf, len, fds, nr_fds);
+        return 0;
+    }
+
+    close_fds(fds, nr_fds);
+
+    if (hdr.cmd == VFIO_USER_DMA_READ || hdr.cmd == VFIO_USER_DMA_WRITE) {
+        return client_handle_dma(client, &hdr, client->rx_buf, len);
+    }
+
+    if (hdr.flags.no_reply) {
+        return 0;
+    }
+    return client_send_reply(client, hdr.msg_id, hdr.cmd, NULL, 0, ENOTSUP);
+}
+
+EXPORT int
+vfu_client_run(vfu_client_t *client, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+    int nr = 0;
+
+    assert(client != NULL);
+
+    if (!client->connected) {
+        return ERROR_INT(ENOTCONN);
+    }
+
+    for (;;) {
+        int ret = poll(&pfd, 1, nr == 0 ? timeout_ms : 0);
+
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            return nr;
+        }
+
+        /*
+         * Once a message has been partially consumed the stream can't be
+         * resynchronized, so any failure here ends the connection.
+         */
+        if (client_recv_one(client) < 0) {
+            pthread_mutex_lock(&client->lock);
+            client->connected = false;
+            pthread_mutex_unlock(&client->lock);
+            client_fail_all(client, ECONNRESET);
+            return ERROR_INT(ENOTCONN);
+        }
+        nr++;
+    }
+}
+
+EXPORT uint32_t
+vfu_client_inflight(vfu_client_t *client)
+{
+    uint32_t inflight;
+
+    pthread_mutex_lock(&client->lock);
+    inflight = client->inflight;
+    pthread_mutex_unlock(&client->lock);
+    return inflight;
+}
+
+struct client_call {
+    bool done;
+    int err;
+    void *reply;
+    size_t *reply_len;
+    int *reply_fds;
+    size_t *nr_reply_fds;
+};
+
+static void
+client_call_done(vfu_client_t *client UNUSED, void *arg, int err,
+                 void *data, size_t len, int *fds, size_t nr_fds)
+{
+    struct client_call *call = arg;
+    size_t nr = 0;
+
+    call->done = true;
+    call->err = err;
+
+    if (call->reply_len != NULL) {
+        if (call->reply != NULL && data != NULL) {
+            memcpy(call->reply, data, MIN(len, *call->reply_len));
+        }
+        *call->reply_len = len;
+    }
+
+    if (call->reply_fds != NULL) {
+        nr = MIN(nr_fds, *call->nr_reply_fds);
+        if (nr > 0) {
+            memcpy(call->reply_fds, fds, nr * sizeof(int));
+        }
+        *call->nr_reply_fds = nr;
+    }
+    if (nr_fds > nr) {
+        close_fds(fds + nr, nr_fds - nr);
+    }
+}
+
+/* Runs the client until @done becomes true. */
+static int
+client_wait(vfu_client_t *client, bool *done)
+{
+    while (!*done) {
+        if (vfu_client_run(client, -1) < 0 && !*done) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_client_call(vfu_client_t *client, enum vfio_user_command cmd,
+                const void *data, size_t len, const int *fds, size_t nr_fds,
+                void *reply, size_t *reply_len,
+                int *reply_fds, size_t *nr_reply_fds)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    struct client_call call = {
+        .reply = reply,
+        .reply_len = reply_len,
+        .reply_fds = reply_fds,
+        .nr_reply_fds = nr_reply_fds,
+    };
+
+    if (reply_fds != NULL && nr_reply_fds == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+    if (nr_reply_fds != NULL && reply_fds == NULL) {
+        *nr_reply_fds = 0;
+    }
+
+    if (vfu_client_send(client, cmd, &iov, len > 0 ? 1 : 0, fds, nr_fds,
+                        client_call_done, &call) < 0) {
+        return -1;
+    }
+
+    if (client_wait(client, &call.done) < 0) {
+        return -1;
+    }
+
+    if (call.err != 0) {
+        return ERROR_INT(call.err);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_client_region_access_async(vfu_client_t *client, uint32_t region,
+                               uint64_t offset, void *buf, size_t count,
+                               bool is_write, vfu_client_cb_t *cb, void *arg)
+{
+    struct vfio_user_region_access access = {
+        .offset = offset,
+        .region = region,
+        .count = count,
+    };
+    struct iovec iov[3] = {
+        { 0 },
+        { .iov_base = &access, .iov_len = sizeof(access) },
+        { .iov_base = buf, .iov_len = count },
+    };
+
+    assert(client != NULL);
+
+    if (count == 0 || count > client->server_max_data_xfer_size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (is_write) {
+        return client_submit(client, VFIO_USER_REGION_WRITE, iov, 3, NULL, 0,
+                             NULL, 0, 0, cb, arg);
+    }
+    return client_submit(client, VFIO_USER_REGION_READ, iov, 2, NULL, 0,
+                         buf, sizeof(access), count, cb, arg);
+}
+
+struct client_batch {
+    size_t pending;
+    int err;
+};
+
+static void
+client_batch_done(vfu_client_t *client UNUSED, void *arg, int err,
+                  void *data UNUSED, size_t len UNUSED, int *fds,
+                  size_t nr_fds)
+{
+    struct client_batch *batch = arg;
+
+    close_fds(fds, nr_fds);
+    if (err != 0 && batch->err == 0) {
+        batch->err = err;
+    }
+    batch->pending--;
+}
+
+/*
+ * Splits a region access into chunks of the negotiated transfer size and keeps
+ * as many of them in flight as the request table allows.
+ */
+static int
+client_region_rw(vfu_client_t *client, uint32_t region, uint64_t offset,
+                 void *buf, size_t count, bool is_write)
+{
+    struct client_batch batch = { 0 };
+    size_t done = 0;
+
+    while (done < count || batch.pending > 0) {
+        if (done < count && batch.err == 0) {
+            size_t len = MIN(count - done, client->server_max_data_xfer_size);
+            int ret;
+
+            ret = vfu_client_region_access_async(client, region, offset + done,
+                                                 (char *)buf + done, len,
+                                                 is_write, client_batch_done,
+                                                 &batch);
+            if (ret >= 0) {
+                batch.pending++;
+                done += len;
+                continue;
+            }
+            if (errno != EAGAIN) {
+                if (batch.pending == 0) {
+                    return -1;
+                }
+                batch.err = errno;
+            }
+        } else if (batch.pending == 0) {
+            break;
+        }
+
+        if (vfu_client_run(client, -1) < 0 && batch.pending > 0) {
+            return -1;
+        }
+    }
+
+    if (batch.err != 0) {
+        return ERROR_INT(batch.err);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_client_region_read(vfu_client_t *client, uint32_t region,
+                       uint64_t offset, void *buf, size_t count)
+{
+    return client_region_rw(client, region, offset, buf, count, false);
+}
+
+EXPORT int
+vfu_client_region_write(vfu_client_t *client, uint32_t region,
+                        uint64_t offset, const void *buf, size_t count)
+{
+    return client_region_rw(client, region, offset, (void *)buf, count, true);
+}
+
+EXPORT int
+vfu_client_get_device_info(vfu_client_t *client,
+                           struct vfio_user_device_info *info)
+{
+    size_t len = sizeof(*info);
+
+    memset(info, 0, sizeof(*info));
+    info->argsz = sizeof(*info);
+
+    if (vfu_client_call(client, VFIO_USER_DEVICE_GET_INFO, info, sizeof(*info),
+                        NULL, 0, info, &len, NULL, NULL) < 0) {
+        return -1;
+    }
+    if (len < sizeof(*info)) {
+        return ERROR_INT(EPROTO);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_client_get_region_info(vfu_client_t *client, uint32_t index,
+                           struct vfio_region_info **infop,
+                           int *fds, size_t *nr_fds)
+{
+    struct vfio_region_info *info;
+    size_t size = sizeof(*info);
+    size_t len;
+
+    for (;;) {
+        size_t want_fds = nr_fds != NULL ? *nr_fds : 0;
+
+        info = calloc(1, size);
+        if (info == NULL) {
+            return -1;
+        }
+        info->argsz = size;
+        info->index = index;
+        len = size;
+
+        if (vfu_client_call(client, VFIO_USER_DEVICE_GET_REGION_INFO,
+                            info, size, NULL, 0, info, &len,
+                            fds, fds != NULL ? &want_fds : NULL) < 0) {
+            int err = errno;
+
+            free(info);
+            return ERROR_INT(err);
+        }
+
+        if (len < sizeof(*info)) {
+            if (fds != NULL) {
+                close_fds(fds, want_fds);
+            }
+            free(info);
+            return ERROR_INT(EPROTO);
+        }
+
+        if (info->argsz <= size) {
+            if (nr_fds != NULL) {
+                *nr_fds = want_fds;
+            }
+            *infop = info;
+            return 0;
+        }
+
+        /* Capabilities didn't fit: retry with the size the server wants. */
+        if (fds != NULL) {
+            close_fds(fds, want_fds);
+        }
+        size = info->argsz;
+        free(info);
+    }
+}
+
+static struct vfio_region_info_cap_sparse_mmap *
+region_info_sparse(struct vfio_region_info *info)
+{
+    uint32_t off;
+
+    if (!(info->flags & VFIO_REGION_INFO_FLAG_CAPS)) {
+        return NULL;
+    }
+
+    for (off = info->cap_offset;
+         off != 0 && off + sizeof(struct vfio_info_cap_header) <= info->argsz;) {
+        struct vfio_info_cap_header *hdr = (void *)((char *)info + off);
+
+        if (hdr->id == VFIO_REGION_INFO_CAP_SPARSE_MMAP) {
+            struct vfio_region_info_cap_sparse_mmap *sparse = (void *)hdr;
+
+            if (off + sizeof(*sparse) +
+                sparse->nr_areas * sizeof(sparse->areas[0]) > info->argsz) {
+                return NULL;
+            }
+            return sparse;
+        }
+        if (hdr->next <= off) {
+            break;
+        }
+        off = hdr->next;
+    }
+    return NULL;
+}
+
+EXPORT int
+vfu_client_region_mmap(vfu_client_t *client, uint32_t index, int prot,
+                       struct iovec **areasp, size_t *nr_areasp)
+{
+    struct vfio_region_info_cap_sparse_mmap *sparse;
+    struct vfio_region_info *info;
+    int fds[CLIENT_MAX_FDS];
+    size_t nr_fds = ARRAY_SIZE(fds);
+    struct iovec *areas = NULL;
+    size_t i;
+    int err = 0;
+
+    assert(areasp != NULL);
+    assert(nr_areasp != NULL);
+
+    if (vfu_client_get_region_info(client, index, &info, fds, &nr_fds) < 0) {
+        return -1;
+    }
+
+    sparse = region_info_sparse(info);
+
+    /*
+     * The server only hands out the region's fd along with the sparse mmap
+     * capability, so without it there is nothing we can map.
+     */
+    if (!(info->flags & VFIO_REGION_INFO_FLAG_MMAP) || sparse == NULL ||
+        sparse->nr_areas == 0 || nr_fds == 0) {
+        err = ENOTSUP;
+        goto out;
+    }
+
+    areas = calloc(sparse->nr_areas, sizeof(*areas));
+    if (areas == NULL) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < sparse->nr_areas; i++) {
+        int fd = fds[MIN(i, nr_fds - 1)];
+        void *addr;
+
+        addr = mmap(NULL, sparse->areas[i].size, prot, MAP_SHARED, fd,
+                    info->offset + sparse->areas[i].offset);
+        if (addr == MAP_FAILED) {
+            err = errno;
+            vfu_client_region_munmap(areas, i);
+            areas = NULL;
+            goto out;
+        }
+        areas[i].iov_base = addr;
+        areas[i].iov_len = sparse->areas[i].size;
+    }
+
+    *areasp = areas;
+    *nr_areasp = sparse->nr_areas;
+
+out:
+    close_fds(fds, nr_fds);
+    free(info);
+    return err != 0 ? ERROR_INT(err) : 0;
+}
+
+EXPORT void
+vfu_client_region_munmap(struct iovec *areas, size_t nr_areas)
+{
+    size_t i;
+
+    for (i = 0; i < nr_areas; i++) {
+        munmap(areas[i].iov_base, areas[i].iov_len);
+    }
+    free(areas);
+}
+
+EXPORT int
+vfu_client_dma_map(vfu_client_t *client, int fd, uint64_t offset,
+                   uint64_t iova, uint64_t size, uint32_t prot, void *vaddr)
+{
+    struct vfio_user_dma_map dma_map = {
+        .argsz = sizeof(dma_map),
+        .flags = prot,
+        .offset = offset,
+        .addr = iova,
+        .size = size,
+    };
+    struct client_dma *dma;
+    int dupfd = -1;
+
+    assert(client != NULL);
+
+    if (size == 0 || iova + size < iova || (fd == -1 && vaddr == NULL)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    dma = realloc(client->dma, (client->nr_dma + 1) * sizeof(*dma));
+    if (dma == NULL) {
+        return -1;
+    }
+    client->dma = dma;
+
+    if (vaddr == NULL) {
+        dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dupfd == -1) {
+            return -1;
+        }
+    }
+
+    if (vfu_client_call(client, VFIO_USER_DMA_MAP, &dma_map, sizeof(dma_map),
+                        fd != -1 ? &fd : NULL, fd != -1 ? 1 : 0,
+                        NULL, NULL, NULL, NULL) < 0) {
+        int err = errno;
+
+        if (dupfd != -1) {
+            close(dupfd);
+        }
+        return ERROR_INT(err);
+    }
+
+    dma = &client->dma[client->nr_dma++];
+    dma->iova = iova;
+    dma->size = size;
+    dma->offset = offset;
+    dma->prot = prot;
+    dma->vaddr = vaddr;
+    dma->fd = dupfd;
+    return 0;
+}
+
+EXPORT int
+vfu_client_dma_unmap(vfu_client_t *client, uint64_t iova, uint64_t size)
+{
+    struct vfio_user_dma_unmap dma_unmap = {
+        .argsz = sizeof(dma_unmap),
+        .addr = iova,
+        .size = size,
+    };
+    size_t i;
+
+    assert(client != NULL);
+
+    if (vfu_client_call(client, VFIO_USER_DMA_UNMAP, &dma_unmap,
+                        sizeof(dma_unmap), NULL, 0, NULL, NULL,
+                        NULL, NULL) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < client->nr_dma; i++) {
+        if (client->dma[i].iova == iova && client->dma[i].size == size) {
+            if (client->dma[i].fd != -1) {
+                close(client->dma[i].fd);
+            }
+            client->dma[i] = client->dma[--client->nr_dma];
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parses the server's capabilities. Absent fields keep their defaults.
+ */
+static int
+client_parse_caps(vfu_client_t *client, const char *json_str)
+{
+    struct json_object *jo_caps = NULL;
+    struct json_object *jo_top;
+    struct json_object *jo;
+    int ret = 0;
+
+    jo_top = json_tokener_parse(json_str);
+    if (jo_top == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (json_object_object_get_ex(jo_top, "capabilities", &jo_caps)) {
+        if (json_object_get_type(jo_caps) != json_type_object) {
+            ret = ERROR_INT(EINVAL);
+            goto out;
+        }
+
+        if (json_object_object_get_ex(jo_caps, "max_msg_fds", &jo)) {
+            if (json_object_get_type(jo) != json_type_int) {
+                ret = ERROR_INT(EINVAL);
+                goto out;
+            }
+            client->server_max_fds = json_object_get_int64(jo);
+        }
+
+        if (json_object_object_get_ex(jo_caps, "max_data_xfer_size", &jo)) {
+            if (json_object_get_type(jo) != json_type_int) {
+                ret = ERROR_INT(EINVAL);
+                goto out;
+            }
+            client->server_max_data_xfer_size = json_object_get_int64(jo);
+        }
+    }
+
+out:
+    json_object_put(jo_top);
+    return ret;
+}
+
+static int
+client_negotiate(vfu_client_t *client)
+{
+    struct vfio_user_version *sversion;
+    struct vfio_user_version cversion = {
+        .major = LIB_VFIO_USER_MAJOR,
+        .minor = LIB_VFIO_USER_MINOR,
+    };
+    char caps[256];
+    struct iovec iov[2];
+    size_t len = 4096;
+    struct client_call call = { .reply_len = &len };
+    int slen;
+    int ret = 0;
+
+    slen = snprintf(caps, sizeof(caps),
+        "{"
+            "\"capabilities\":{"
+                "\"max_msg_fds\":%u,"
+                "\"max_data_xfer_size\":%zu,"
+                "\"migration\":{"
+                    "\"pgsize\":%zu"
+                "}"
+            "}"
+         "}", CLIENT_MAX_FDS, client->max_data_xfer_size, PAGE_SIZE);
+    assert(slen > 0 && (size_t)slen < sizeof(caps));
+
+    sversion = calloc(1, len + 1);
+    if (sversion == NULL) {
+        return -1;
+    }
+    call.reply = sversion;
+
+    iov[0].iov_base = &cversion;
+    iov[0].iov_len = sizeof(cversion);
+    iov[1].iov_base = caps;
+    /* Include the NUL. */
+    iov[1].iov_len = slen + 1;
+
+    if (vfu_client_send(client, VFIO_USER_VERSION, iov, 2, NULL, 0,
+                        client_call_done, &call) < 0 ||
+        client_wait(client, &call.done) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (call.err != 0) {
+        ret = ERROR_INT(call.err);
+        goto out;
+    }
+
+    if (len < sizeof(*sversion) || len > 4096 ||
+        sversion->major != LIB_VFIO_USER_MAJOR ||
+        sversion->minor > LIB_VFIO_USER_MINOR) {
+        ret = ERROR_INT(EPROTO);
+        goto out;
+    }
+
+    if (len > sizeof(*sversion)) {
+        const char *json_str = (const char *)sversion->data;
+
+        if (json_str[len - sizeof(*sversion) - 1] != '\0' ||
+            client_parse_caps(client, json_str) < 0) {
+            ret = ERROR_INT(EPROTO);
+            goto out;
+        }
+    }
+
+    if (client->server_max_fds < 0 || client->server_max_data_xfer_size == 0) {
+        ret = ERROR_INT(EPROTO);
+    }
+
+out:
+    free(sversion);
+    return ret;
+}
+
+EXPORT vfu_client_t *
+vfu_client_connect(const char *path, const vfu_client_attr_t *attr)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    vfu_client_t *client;
+    uint32_t nr_reqs = VFU_CLIENT_DEFAULT_MAX_INFLIGHT;
+    int err;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    if (attr != NULL && attr->max_inflight != 0) {
+        if (attr->max_inflight > CLIENT_MAX_INFLIGHT) {
+            return ERROR_PTR(EINVAL);
+        }
+        for (nr_reqs = 1; nr_reqs < attr->max_inflight; nr_reqs <<= 1) {
+            ;
+        }
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+
+    client->fd = -1;
+    client->nr_reqs = nr_reqs;
+    client->server_max_fds = 1;
+    client->server_max_data_xfer_size = VFIO_USER_DEFAULT_MAX_DATA_XFER_SIZE;
+    client->max_data_xfer_size = VFIO_USER_DEFAULT_MAX_DATA_XFER_SIZE;
+    if (attr != NULL && attr->max_data_xfer_size != 0) {
+        client->max_data_xfer_size = attr->max_data_xfer_size;
+    }
+
+    if ((err = pthread_mutex_init(&client->lock, NULL)) != 0) {
+        free(client);
+        return ERROR_PTR(err);
+    }
+
+    client->reqs = calloc(nr_reqs, sizeof(*client->reqs));
+    client->tx_buf = malloc(sizeof(struct vfio_user_dma_region_access) +
+                            client->max_data_xfer_size);
+    if (client->reqs == NULL || client->tx_buf == NULL) {
+        err = ENOMEM;
+        goto fail;
+    }
+
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd == -1) {
+        err = errno;
+        goto fail;
+    }
+
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        err = errno;
+        goto fail;
+    }
+    client->connected = true;
+
+    if (client_negotiate(client) < 0) {
+        err = errno;
+        goto fail;
+    }
+
+    return client;
+
+fail:
+    vfu_client_close(client);
+    return ERROR_PTR(err);
+}
+
+EXPORT void
+vfu_client_close(vfu_client_t *client)
+{
+    size_t i;
+
+    if (client == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    client->connected = false;
+    pthread_mutex_unlock(&client->lock);
+
+    if (client->reqs != NULL) {
+        client_fail_all(client, ECONNRESET);
+    }
+
+    if (client->fd != -1) {
+        close(client->fd);
+    }
+
+    for (i = 0; i < client->nr_dma; i++) {
+        if (client->dma[i].fd != -1) {
+            close(client->dma[i].fd);
+        }
+    }
+
+    pthread_mutex_destroy(&client->lock);
+    free(client->dma);
+    free(client->reqs);
+    free(client->rx_buf);
+    free(client->tx_buf);
+    free(client);
+}
+
+EXPORT int
+vfu_client_get_poll_fd(vfu_client_t *client)
+{
+    return client->fd;
+}
+
+EXPORT size_t
+vfu_client_max_data_xfer_size(vfu_client_t *client)
+{
+    return client->server_max_data_xfer_size;
+}
+
+EXPORT int
+vfu_client_max_msg_fds(vfu_client_t *client)
+{
+    return client->server_max_fds;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
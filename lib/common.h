@@ -39,6 +39,7 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <time.h>
 
 #define UNUSED __attribute__((unused))
 #define EXPORT __attribute__((visibility("default")))
@@ -66,6 +67,16 @@ satadd_u64(uint64_t a, uint64_t b)
     return (res < a) ? UINT64_MAX : res;
 }
 
+/* CLOCK_MONOTONIC in nanoseconds. */
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /*
  * The size, in bytes, of the bitmap that represents the given range with the
  * given page size.
@@ -41,8 +41,13 @@
 #include <errno.h>
 
 #include "dma.h"
+#include "dma_wp.h"
 #include "private.h"
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 EXPORT size_t
 dma_sg_size(void)
 {
@@ -85,8 +90,7 @@ dma_controller_create(vfu_ctx_t *vfu_ctx, size_t max_regions, size_t max_size)
 {
     dma_controller_t *dma;
 
-    dma = malloc(offsetof(dma_controller_t, regions) +
-                 max_regions * sizeof(dma->regions[0]));
+    dma = malloc(sizeof(*dma));
 
     if (dma == NULL) {
         return dma;
@@ -96,8 +100,14 @@ dma_controller_create(vfu_ctx_t *vfu_ctx, size_t max_regions, size_t max_size)
     dma->max_regions = (int)max_regions;
     dma->max_size = max_size;
     dma->nregions = 0;
-    memset(dma->regions, 0, max_regions * sizeof(dma->regions[0]));
+    dma->nr_alloced = 0;
+    dma->regions = NULL;
     dma->dirty_pgsize = 0;
+    dma->wp = NULL;
+    dma->retain_ns = 0;
+    dma->retain_deadline_ns = 0;
+    dma->nr_retained = 0;
+    memset(&dma->dirty_stats, 0, sizeof(dma->dirty_stats));
 
     return dma;
 }
@@ -170,13 +180,15 @@ MOCK_DEFINE(dma_controller_remove_region)(dma_controller_t *dma,
             dma->vfu_ctx->in_cb = CB_NONE;
         }
 
+        dma_wp_lock(dma->wp);
         if (region->info.vaddr != NULL) {
             dma_controller_unmap_region(dma, region);
         } else {
             assert(region->fd == -1);
         }
 
-        array_remove(&dma->regions, sizeof (*region), idx, &dma->nregions);
+        array_remove(dma->regions, sizeof (*region), idx, &dma->nregions);
+        dma_wp_unlock(dma->wp);
         return 0;
     }
     return ERROR_INT(ENOENT);
@@ -206,21 +218,122 @@ dma_controller_remove_all_regions(dma_controller_t *dma,
             dma->vfu_ctx->in_cb = CB_NONE;
         }
 
+        dma_wp_lock(dma->wp);
         if (region->info.vaddr != NULL) {
             dma_controller_unmap_region(dma, region);
         } else {
             assert(region->fd == -1);
         }
+        /* don't let the fault thread find it again */
+        region->info.mapping.iov_len = 0;
+        dma_wp_unlock(dma->wp);
     }
 
-    memset(dma->regions, 0, dma->max_regions * sizeof(dma->regions[0]));
+    dma_wp_lock(dma->wp);
+    free(dma->regions);
+    dma->regions = NULL;
+    dma->nr_alloced = 0;
     dma->nregions = 0;
+    dma->nr_retained = 0;
+    dma_wp_unlock(dma->wp);
+}
+
+void
+dma_controller_retain_all_regions(dma_controller_t *dma)
+{
+    int i;
+
+    assert(dma != NULL);
+
+    for (i = 0; i < dma->nregions; i++) {
+        dma->regions[i].retained = true;
+    }
+    dma->nr_retained = dma->nregions;
+    dma->retain_deadline_ns = now_ns() + dma->retain_ns;
+
+    vfu_log(dma->vfu_ctx, LOG_INFO, "retaining %d DMA regions for %lums",
+            dma->nr_retained, dma->retain_ns / 1000000);
+}
+
+static void
+dma_controller_remove_retained(dma_controller_t *dma, int idx,
+                               vfu_dma_unregister_cb_t *dma_unregister,
+                               void *data)
+{
+    dma_memory_region_t *region = &dma->regions[idx];
+
+    vfu_log(dma->vfu_ctx, LOG_DEBUG, "dropping retained DMA region [%p, %p)",
+            region->info.iova.iov_base, iov_end(&region->info.iova));
+
+    dma->nr_retained--;
+    dma_controller_remove_region(dma, region->info.iova.iov_base,
+                                 region->info.iova.iov_len, dma_unregister,
+                                 data);
+}
+
+int
+dma_controller_readopt_region(dma_controller_t *dma, vfu_dma_addr_t dma_addr,
+                              size_t size, int fd, off_t offset, uint32_t prot,
+                              vfu_dma_unregister_cb_t *dma_unregister,
+                              void *data)
+{
+    int idx;
+
+    assert(dma != NULL);
+
+    /* backwards, as removing a region moves the following ones down */
+    for (idx = dma->nregions - 1; idx >= 0; idx--) {
+        dma_memory_region_t *region = &dma->regions[idx];
+
+        if (!region->retained) {
+            continue;
+        }
+
+        if (region->info.iova.iov_base == dma_addr &&
+            region->info.iova.iov_len == size && region->offset == offset &&
+            region->info.prot == prot && fds_are_same_file(region->fd, fd)) {
+            region->retained = false;
+            dma->nr_retained--;
+            return idx;
+        }
+
+        if (dma_addr < iov_end(&region->info.iova) &&
+            region->info.iova.iov_base < dma_addr + size) {
+            dma_controller_remove_retained(dma, idx, dma_unregister, data);
+        }
+    }
+
+    return ERROR_INT(ENOENT);
+}
+
+void
+dma_controller_expire_regions(dma_controller_t *dma,
+                              vfu_dma_unregister_cb_t *dma_unregister,
+                              void *data, bool force)
+{
+    int idx;
+
+    assert(dma != NULL);
+
+    if (dma->nr_retained == 0 ||
+        (!force && now_ns() < dma->retain_deadline_ns)) {
+        return;
+    }
+
+    for (idx = dma->nregions - 1; idx >= 0; idx--) {
+        if (dma->regions[idx].retained) {
+            dma_controller_remove_retained(dma, idx, dma_unregister, data);
+        }
+    }
+    assert(dma->nr_retained == 0);
 }
 
 void
 dma_controller_destroy(dma_controller_t *dma)
 {
     assert(dma->nregions == 0);
+    dma_wp_destroy(dma->wp);
+    free(dma->regions);
     free(dma);
 }
 
@@ -288,6 +401,35 @@ dirty_page_logging_start_on_region(dma_memory_region_t *region, size_t pgsize)
     return 0;
 }
 
+/*
+ * Doubles the region array, capped at max_regions. The fault thread walks the
+ * array, so it can only move with the tracker locked.
+ */
+static int
+grow_regions(dma_controller_t *dma)
+{
+    dma_memory_region_t *regions;
+    int nr = MIN(MAX(dma->nr_alloced * 2, 4), dma->max_regions);
+
+    dma_wp_lock(dma->wp);
+    regions = realloc(dma->regions, nr * sizeof(*regions));
+    if (regions == NULL) {
+        dma_wp_unlock(dma->wp);
+        return ERROR_INT(ENOMEM);
+    }
+    memset(regions + dma->nr_alloced, 0,
+           (nr - dma->nr_alloced) * sizeof(*regions));
+    dma->regions = regions;
+    dma->nr_alloced = nr;
+    dma_wp_unlock(dma->wp);
+    return 0;
+}
+
+/* Describes the region being added in log messages. */
+#define REGION_FMT "[%p, %p) fd=%d offset=%#lx prot=%#x"
+#define REGION_ARGS \
+    dma_addr, (char *)dma_addr + size, fd, offset, prot
+
 int
 MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
                                        vfu_dma_addr_t dma_addr, size_t size,
@@ -295,14 +437,10 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
 {
     dma_memory_region_t *region;
     int page_size = 0;
-    char rstr[1024];
     int idx;
 
     assert(dma != NULL);
 
-    snprintf(rstr, sizeof(rstr), "[%p, %p) fd=%d offset=%#lx prot=%#x",
-             dma_addr, (char *)dma_addr + size, fd, offset, prot);
-
     if (size > dma->max_size) {
         vfu_log(dma->vfu_ctx, LOG_ERR, "DMA region size %zu > max %zu",
                 size, dma->max_size);
@@ -317,7 +455,8 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
             region->info.iova.iov_len == size) {
             if (offset != region->offset) {
                 vfu_log(dma->vfu_ctx, LOG_ERR, "bad offset for new DMA region "
-                        "%s; existing=%#lx", rstr, region->offset);
+                        REGION_FMT "; existing=%#lx", REGION_ARGS,
+                        region->offset);
                 return ERROR_INT(EINVAL);
             }
             if (!fds_are_same_file(region->fd, fd)) {
@@ -327,13 +466,14 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
                  * the same file, however in the majority of cases we'll be
                  * using a single fd.
                  */
-                vfu_log(dma->vfu_ctx, LOG_ERR, "bad fd for new DMA region %s; "
-                        "existing=%d", rstr, region->fd);
+                vfu_log(dma->vfu_ctx, LOG_ERR, "bad fd for new DMA region "
+                        REGION_FMT "; existing=%d", REGION_ARGS, region->fd);
                 return ERROR_INT(EINVAL);
             }
             if (region->info.prot != prot) {
                 vfu_log(dma->vfu_ctx, LOG_ERR, "bad prot for new DMA region "
-                        "%s; existing=%#x", rstr, region->info.prot);
+                        REGION_FMT "; existing=%#x", REGION_ARGS,
+                        region->info.prot);
                 return ERROR_INT(EINVAL);
             }
             return idx;
@@ -344,9 +484,9 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
              dma_addr < iov_end(&region->info.iova)) ||
             (region->info.iova.iov_base >= dma_addr &&
              region->info.iova.iov_base < dma_addr + size)) {
-            vfu_log(dma->vfu_ctx, LOG_INFO, "new DMA region %s overlaps with "
-                    "DMA region [%p, %p)", rstr, region->info.iova.iov_base,
-                    iov_end(&region->info.iova));
+            vfu_log(dma->vfu_ctx, LOG_INFO, "new DMA region " REGION_FMT
+                    " overlaps with DMA region [%p, %p)", REGION_ARGS,
+                    region->info.iova.iov_base, iov_end(&region->info.iova));
             return ERROR_INT(EINVAL);
         }
     }
@@ -356,6 +496,11 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
         return ERROR_INT(EINVAL);
     }
 
+    if (dma->nregions == dma->nr_alloced && grow_regions(dma) < 0) {
+        vfu_log(dma->vfu_ctx, LOG_ERR, "failed to grow DMA regions: %m");
+        return -1;
+    }
+
     idx = dma->nregions;
     region = &dma->regions[idx];
 
@@ -399,7 +544,8 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
         if (ret != 0) {
             ret = errno;
             vfu_log(dma->vfu_ctx, LOG_ERR,
-                   "failed to memory map DMA region %s: %m", rstr);
+                   "failed to memory map DMA region " REGION_FMT ": %m",
+                   REGION_ARGS);
 
             if (close(region->fd) == -1) {
                 vfu_log(dma->vfu_ctx, LOG_WARNING,
@@ -410,7 +556,17 @@ MOCK_DEFINE(dma_controller_add_region)(dma_controller_t *dma,
         }
     }
 
+    dma_wp_lock(dma->wp);
+    if (dma->wp != NULL && dma_wp_add_region(dma->wp, region) == -1) {
+        /* we'd miss writes to it, so this has to fail the map */
+        int _errno = errno;
+        dma_wp_unlock(dma->wp);
+        dma_controller_unmap_region(dma, region);
+        free(region->dirty_bitmap);
+        return ERROR_INT(_errno);
+    }
     dma->nregions++;
+    dma_wp_unlock(dma->wp);
     return idx;
 }
 
@@ -467,10 +623,278 @@ out:
     return cnt;
 }
 
+/*
+ * How many descriptors ahead dma_addrs_to_sgl() prefetches: enough to cover
+ * the latency of a cache miss on a ring that's just been written by the guest.
+ */
+#define DESC_PREFETCH_DIST 8
+
+static int
+dma_region_find(const dma_controller_t *dma, vfu_dma_addr_t dma_addr)
+{
+    int idx;
+
+    for (idx = 0; idx < dma->nregions; idx++) {
+        const struct iovec *iova = &dma->regions[idx].info.iova;
+
+        if (dma_addr >= iova->iov_base && dma_addr < iov_end(iova)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
 int
-dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize)
+dma_addrs_to_sgl(const dma_controller_t *dma, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, struct iovec *iov,
+                 size_t max_nr_sgs)
 {
+    const dma_memory_region_t *region = NULL;
+    size_t cnt = 0;
     size_t i;
+    int idx = -1;
+
+    for (i = 0; i < nr_descs; i++) {
+        vfu_dma_addr_t dma_addr = descs[i].dma_addr;
+        uint64_t len = descs[i].len;
+        int prot = descs[i].prot;
+
+        /* Prefetching beyond the end of the array can't fault. */
+        __builtin_prefetch(&descs[i + DESC_PREFETCH_DIST]);
+
+        while (len > 0) {
+            uint64_t sg_len;
+
+            /* Ring descriptors are mostly in the same region as the last. */
+            if (region == NULL || dma_addr < region->info.iova.iov_base ||
+                dma_addr >= iov_end(&region->info.iova)) {
+                idx = dma_region_find(dma, dma_addr);
+                if (unlikely(idx == -1)) {
+                    return ERROR_INT(ENOENT);
+                }
+                region = &dma->regions[idx];
+            }
+
+            if (unlikely((prot & PROT_WRITE) &&
+                         !(region->info.prot & PROT_WRITE))) {
+                return ERROR_INT(EACCES);
+            }
+
+            sg_len = MIN((uint64_t)(iov_end(&region->info.iova) - dma_addr),
+                         len);
+
+            if (cnt < max_nr_sgs) {
+                dma_sg_t *sg = &sgl[cnt];
+
+                sg->dma_addr = region->info.iova.iov_base;
+                sg->region = idx;
+                sg->offset = dma_addr - region->info.iova.iov_base;
+                sg->length = sg_len;
+                sg->writeable = prot & PROT_WRITE;
+
+                if (iov != NULL) {
+                    if (unlikely(region->info.vaddr == NULL)) {
+                        return ERROR_INT(EFAULT);
+                    }
+                    iov[cnt].iov_base = region->info.vaddr + sg->offset;
+                    iov[cnt].iov_len = sg_len;
+                }
+            }
+
+            cnt++;
+            dma_addr += sg_len;
+            len -= sg_len;
+        }
+    }
+
+    if (cnt > max_nr_sgs) {
+        errno = 0;
+        return -(int)cnt - 1;
+    }
+    return cnt;
+}
+
+#if defined(__x86_64__)
+/*
+ * SSE2 is part of the x86-64 baseline, so there's no need for a run-time
+ * check; anything wider isn't worth it for a copy bound by memory bandwidth.
+ */
+static void
+memcpy_nt(void *dst, const void *src, size_t len)
+{
+    size_t head = MIN(-(uintptr_t)dst & 15, len);
+    char *d = dst;
+    const char *s = src;
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= 64; d += 64, s += 64, len -= 64) {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)s);
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+
+        _mm_stream_si128((__m128i *)d, x0);
+        _mm_stream_si128((__m128i *)(d + 16), x1);
+        _mm_stream_si128((__m128i *)(d + 32), x2);
+        _mm_stream_si128((__m128i *)(d + 48), x3);
+    }
+    /* order the streaming stores before anything that signals completion */
+    _mm_sfence();
+
+    memcpy(d, s, len);
+}
+#else
+#define memcpy_nt memcpy
+#endif
+
+void
+dma_sg_copy_to(dma_controller_t *dma, dma_sg_t *sg, const void *data)
+{
+    dma_memory_region_t *region = &dma->regions[sg->region];
+    void *dst = region->info.vaddr + sg->offset;
+
+    assert(region->info.vaddr != NULL);
+
+    if (sg->length >= DMA_COPY_NT_THRESHOLD) {
+        memcpy_nt(dst, data, sg->length);
+    } else {
+        memcpy(dst, data, sg->length);
+    }
+
+    if (dma->dirty_pgsize > 0) {
+        _dma_mark_dirty(dma, region, sg);
+    }
+}
+
+void
+dma_sg_copy_from(dma_controller_t *dma, dma_sg_t *sg, void *data)
+{
+    dma_memory_region_t *region = &dma->regions[sg->region];
+
+    assert(region->info.vaddr != NULL);
+
+    memcpy(data, region->info.vaddr + sg->offset, sg->length);
+}
+
+static void
+dirty_rate_add_sample(dma_controller_t *dma, uint64_t ts_ns, uint64_t bytes)
+{
+    struct dirty_rate_sample *s = &dma->dirty_stats.samples[dma->dirty_stats.next];
+
+    s->ts_ns = ts_ns;
+    s->bytes = bytes;
+    dma->dirty_stats.next = (dma->dirty_stats.next + 1) % DIRTY_RATE_SAMPLES;
+    if (dma->dirty_stats.nr < DIRTY_RATE_SAMPLES) {
+        dma->dirty_stats.nr++;
+    }
+}
+
+static void
+dirty_rate_end_round(dma_controller_t *dma, uint64_t ts_ns)
+{
+    int i;
+
+    dirty_rate_add_sample(dma, ts_ns, dma->dirty_stats.round_bytes);
+    dma->dirty_stats.round_bytes = 0;
+    for (i = 0; i < dma->nregions; i++) {
+        dma->regions[i].rate_fetched = false;
+    }
+}
+
+/*
+ * Accounts for a fetch of @region's dirty bitmap. Each region reports what was
+ * dirtied since its own previous fetch, so a sample only covers the window
+ * between two rounds once every region has been fetched in between.
+ */
+static void
+dirty_rate_add_fetch(dma_controller_t *dma, dma_memory_region_t *region,
+                     uint64_t bytes)
+{
+    uint64_t ts_ns = now_ns();
+    int i;
+
+    if (region->rate_fetched) {
+        /* the client has gone round again without fetching every region */
+        dirty_rate_end_round(dma, dma->dirty_stats.round_last_ns);
+    }
+
+    region->rate_fetched = true;
+    dma->dirty_stats.round_bytes += bytes;
+    dma->dirty_stats.round_last_ns = ts_ns;
+
+    for (i = 0; i < dma->nregions; i++) {
+        if (dma->regions[i].dirty_bitmap != NULL &&
+            !dma->regions[i].rate_fetched) {
+            return;
+        }
+    }
+    dirty_rate_end_round(dma, ts_ns);
+}
+
+uint64_t
+dma_controller_dirty_rate(const dma_controller_t *dma)
+{
+    const struct dirty_rate_sample *oldest, *newest;
+    uint64_t bytes = 0;
+    unsigned int i;
+
+    assert(dma != NULL);
+
+    if (dma->dirty_pgsize == 0 || dma->dirty_stats.nr < 2) {
+        return 0;
+    }
+
+    /*
+     * Each sample holds what was dirtied since the previous round, so the
+     * oldest one falls before the window and isn't counted.
+     */
+    oldest = &dma->dirty_stats.samples[(dma->dirty_stats.next +
+                                        DIRTY_RATE_SAMPLES -
+                                        dma->dirty_stats.nr) %
+                                       DIRTY_RATE_SAMPLES];
+    newest = &dma->dirty_stats.samples[(dma->dirty_stats.next +
+                                        DIRTY_RATE_SAMPLES - 1) %
+                                       DIRTY_RATE_SAMPLES];
+    for (i = 0; i < dma->dirty_stats.nr; i++) {
+        const struct dirty_rate_sample *s = &dma->dirty_stats.samples[i];
+
+        if (s != oldest) {
+            bytes += s->bytes;
+        }
+    }
+
+    if (newest->ts_ns <= oldest->ts_ns) {
+        return 0;
+    }
+    return (bytes * 1000000000ULL) / (newest->ts_ns - oldest->ts_ns);
+}
+
+size_t
+dma_controller_memory_usage(const dma_controller_t *dma)
+{
+    size_t size = sizeof(*dma) + dma->nr_alloced * sizeof(dma->regions[0]);
+    int i;
+
+    for (i = 0; i < dma->nregions; i++) {
+        const dma_memory_region_t *region = &dma->regions[i];
+
+        if (region->dirty_bitmap != NULL) {
+            size += _get_bitmap_size(region->info.iova.iov_len,
+                                     dma->dirty_pgsize);
+        }
+    }
+    return size;
+}
+
+int
+dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize)
+{
+    size_t i, j;
+    int _errno;
 
     assert(dma != NULL);
 
@@ -485,6 +909,8 @@ dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize)
         return 0;
     }
 
+    dma_wp_lock(dma->wp);
+
     for (i = 0; i < (size_t)dma->nregions; i++) {
         dma_memory_region_t *region = &dma->regions[i];
 
@@ -492,23 +918,39 @@ dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize)
             continue;
         }
 
-        if (dirty_page_logging_start_on_region(region, pgsize) < 0) {
-            int _errno = errno;
-            size_t j;
+        region->dirty_pages = 0;
+        region->rate_fetched = false;
 
-            for (j = 0; j < i; j++) {
-                region = &dma->regions[j];
-                free(region->dirty_bitmap);
-                region->dirty_bitmap = NULL;
-            }
-            return ERROR_INT(_errno);
+        if (dirty_page_logging_start_on_region(region, pgsize) < 0) {
+            goto fail;
         }
     }
     dma->dirty_pgsize = pgsize;
 
+    if (dma->wp != NULL && dma_wp_start(dma->wp) < 0) {
+        dma->dirty_pgsize = 0;
+        i = dma->nregions;
+        goto fail;
+    }
+
+    dma_wp_unlock(dma->wp);
+
+    /* the rate is measured from now on */
+    memset(&dma->dirty_stats, 0, sizeof(dma->dirty_stats));
+    dirty_rate_add_sample(dma, now_ns(), 0);
+
     vfu_log(dma->vfu_ctx, LOG_DEBUG, "dirty pages: started logging");
 
     return 0;
+
+fail:
+    _errno = errno;
+    for (j = 0; j < i; j++) {
+        free(dma->regions[j].dirty_bitmap);
+        dma->regions[j].dirty_bitmap = NULL;
+    }
+    dma_wp_unlock(dma->wp);
+    return ERROR_INT(_errno);
 }
 
 void
@@ -522,11 +964,16 @@ dma_controller_dirty_page_logging_stop(dma_controller_t *dma)
         return;
     }
 
+    dma_wp_lock(dma->wp);
+    if (dma->wp != NULL) {
+        dma_wp_stop(dma->wp);
+    }
     for (i = 0; i < dma->nregions; i++) {
         free(dma->regions[i].dirty_bitmap);
         dma->regions[i].dirty_bitmap = NULL;
     }
     dma->dirty_pgsize = 0;
+    dma_wp_unlock(dma->wp);
 
     vfu_log(dma->vfu_ctx, LOG_DEBUG, "dirty pages: stopped logging");
 }
@@ -555,6 +1002,7 @@ dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
 {
     dma_memory_region_t *region;
     ssize_t bitmap_size;
+    uint64_t dirty_pages = 0;
     dma_sg_t sg;
     size_t i;
     int ret;
@@ -600,6 +1048,18 @@ dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
         return ERROR_INT(EINVAL);
     }
 
+    dma_wp_lock(dma->wp);
+
+    /*
+     * Pages about to be reported are protected again first: a write racing
+     * with us then faults, and the fault thread can only mark it dirty once
+     * we're done below, so it shows up in the next bitmap.
+     */
+    if (dma->wp != NULL) {
+        memcpy(bitmap, region->dirty_bitmap, size);
+        dma_wp_protect_dirty(dma->wp, region, bitmap, size);
+    }
+
     for (i = 0; i < (size_t)bitmap_size; i++) {
         uint8_t val = region->dirty_bitmap[i];
         uint8_t *outp = (uint8_t *)&bitmap[i];
@@ -620,9 +1080,16 @@ dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
             uint8_t zero = 0;
             __atomic_exchange(&region->dirty_bitmap[i], &zero,
                               outp, __ATOMIC_SEQ_CST);
+            dirty_pages += __builtin_popcount(*outp);
         }
     }
 
+    dma_wp_unlock(dma->wp);
+
+    region->dirty_pages += dirty_pages;
+    dma->dirty_stats.dirty_pages += dirty_pages;
+    dirty_rate_add_fetch(dma, region, dirty_pages * pgsize);
+
 #ifdef DEBUG
     log_dirty_bitmap(dma->vfu_ctx, region, bitmap, size);
 #endif
@@ -83,6 +83,7 @@
 #define iov_end(iov) ((iov)->iov_base + (iov)->iov_len)
 
 struct vfu_ctx;
+struct dma_wp;
 
 struct dma_sg {
     vfu_dma_addr_t dma_addr;
@@ -97,15 +98,47 @@ typedef struct {
     int fd;                     // File descriptor to mmap
     off_t offset;               // File offset
     uint8_t *dirty_bitmap;         // Dirty page bitmap
+    uint64_t dirty_pages;       // Pages reported dirty since logging started
+    bool rate_fetched;          // Fetched in the current dirty rate round
+    bool retained;              // Kept from a previous client
 } dma_memory_region_t;
 
+/*
+ * Number of rounds of dirty bitmap fetches the dirty rate is averaged over.
+ * Clients fetch regions one at a time, so a round ends once every logged
+ * region has been fetched, or one is fetched again before that.
+ */
+#define DIRTY_RATE_SAMPLES 8
+
+struct dirty_rate_sample {
+    uint64_t ts_ns;
+    uint64_t bytes;
+};
+
 typedef struct dma_controller {
     int max_regions;
     size_t max_size;
     int nregions;
     struct vfu_ctx *vfu_ctx;
     size_t dirty_pgsize;        // Dirty page granularity
-    dma_memory_region_t regions[0];
+    struct dma_wp *wp;          // Automatic dirty tracking, see dma_wp.h
+    uint64_t retain_ns;         // See vfu_setup_dma_reconnect()
+    uint64_t retain_deadline_ns;
+    int nr_retained;
+    struct {
+        uint64_t dirty_pages;   // Pages reported dirty since logging started
+        struct dirty_rate_sample samples[DIRTY_RATE_SAMPLES];
+        unsigned int next;
+        unsigned int nr;
+        uint64_t round_bytes;   // Reported so far in the current round
+        uint64_t round_last_ns; // Last fetch of the current round
+    } dirty_stats;
+    /*
+     * Allocated on the first map and grown as needed, up to max_regions; an
+     * idle controller holds none. Changes with the tracker locked.
+     */
+    int nr_alloced;
+    dma_memory_region_t *regions;
 } dma_controller_t;
 
 dma_controller_t *
@@ -128,6 +161,32 @@ MOCK_DECLARE(int, dma_controller_add_region, dma_controller_t *dma,
              vfu_dma_addr_t dma_addr, size_t size, int fd, off_t offset,
              uint32_t prot);
 
+/*
+ * Marks all regions as retained until dma->retain_ns from now, when the client
+ * goes away.
+ */
+void
+dma_controller_retain_all_regions(dma_controller_t *dma);
+
+/*
+ * If a retained region is the same as the one given, takes it over for the
+ * new client and returns its index. Otherwise, removes any retained regions
+ * overlapping the one given and returns -1 with errno set to ENOENT.
+ */
+int
+dma_controller_readopt_region(dma_controller_t *dma, vfu_dma_addr_t dma_addr,
+                              size_t size, int fd, off_t offset, uint32_t prot,
+                              vfu_dma_unregister_cb_t *dma_unregister,
+                              void *data);
+
+/*
+ * Removes the retained regions if their grace period is over, or if @force.
+ */
+void
+dma_controller_expire_regions(dma_controller_t *dma,
+                              vfu_dma_unregister_cb_t *dma_unregister,
+                              void *data, bool force);
+
 MOCK_DECLARE(int, dma_controller_remove_region, dma_controller_t *dma,
              vfu_dma_addr_t dma_addr, size_t size,
              vfu_dma_unregister_cb_t *dma_unregister, void *data);
@@ -141,6 +200,15 @@ _dma_addr_sg_split(const dma_controller_t *dma,
                    vfu_dma_addr_t dma_addr, uint64_t len,
                    dma_sg_t *sg, int max_nr_sgs, int prot);
 
+/*
+ * Translates @nr_descs address ranges into consecutive entries of @sgl and,
+ * if @iov isn't NULL, their mappings into @iov. Returns as dma_addr_to_sgl().
+ */
+int
+dma_addrs_to_sgl(const dma_controller_t *dma, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, struct iovec *iov,
+                 size_t max_nr_sgs);
+
 /* Convert a start address and length to its containing page numbers. */
 static inline void
 range_to_pages(size_t start, size_t len, size_t pgsize,
@@ -240,16 +308,16 @@ dma_addr_to_sgl(const dma_controller_t *dma,
                 dma_sg_t *sgl, size_t max_nr_sgs, int prot)
 {
     static __thread int region_hint;
+    const dma_memory_region_t *region;
     int cnt, ret;
 
-    const dma_memory_region_t *const region = &dma->regions[region_hint];
-    const void *region_end = iov_end(&region->info.iova);
+    /* The array is sized on demand, so check the hint before using it. */
+    region = region_hint < dma->nregions ? &dma->regions[region_hint] : NULL;
 
     // Fast path: single region.
-    if (likely(max_nr_sgs > 0 && len > 0 &&
+    if (likely(region != NULL && max_nr_sgs > 0 && len > 0 &&
                dma_addr >= region->info.iova.iov_base &&
-               dma_addr + len <= region_end &&
-               region_hint < dma->nregions)) {
+               dma_addr + len <= iov_end(&region->info.iova))) {
         ret = dma_init_sg(dma, sgl, dma_addr, len, prot, region_hint);
         if (ret < 0) {
             return ret;
@@ -365,6 +433,23 @@ dma_sgl_put(dma_controller_t *dma, dma_sg_t *sgl, size_t cnt)
     } while (--cnt > 0);
 }
 
+/*
+ * Copies from @data into the mapped segment @sg and marks it dirty. Copies at
+ * least this large use non-temporal stores: the device won't read back what
+ * it's just written to guest memory, so there's no point evicting its own
+ * working set for it.
+ */
+#define DMA_COPY_NT_THRESHOLD (256 << 10)
+
+void
+dma_sg_copy_to(dma_controller_t *dma, dma_sg_t *sg, const void *data);
+
+/*
+ * Copies the mapped segment @sg into @data.
+ */
+void
+dma_sg_copy_from(dma_controller_t *dma, dma_sg_t *sg, void *data);
+
 int
 dma_controller_dirty_page_logging_start(dma_controller_t *dma, size_t pgsize);
 
@@ -375,6 +460,21 @@ int
 dma_controller_dirty_page_get(dma_controller_t *dma, vfu_dma_addr_t addr,
                               uint64_t len, size_t pgsize, size_t size,
                               char *bitmap);
+
+/*
+ * Returns the bytes per second reported dirty over the last
+ * DIRTY_RATE_SAMPLES bitmap fetches, or 0 if dirty page logging is off.
+ */
+uint64_t
+dma_controller_dirty_rate(const dma_controller_t *dma);
+
+/*
+ * Bytes allocated for @dma: the controller, its region array and any dirty
+ * bitmaps.
+ */
+size_t
+dma_controller_memory_usage(const dma_controller_t *dma);
+
 bool
 dma_sg_is_mappable(const dma_controller_t *dma, const dma_sg_t *sg);
 
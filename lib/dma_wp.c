@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "dma_wp.h"
+#include "thread.h"
+
+#ifdef UFFDIO_WRITEPROTECT
+
+#ifndef UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+#define UFFD_FEATURE_WP_HUGETLBFS_SHMEM (1 << 12)
+#endif
+
+#define DMA_WP_MAX_MSGS 64
+
+struct dma_wp {
+    dma_controller_t    *dma;
+    int                 uffd;
+    int                 stop_fd;
+    pthread_mutex_t     lock;
+    pthread_t           thread;
+    bool                running;
+};
+
+static int
+uffd_open(void)
+{
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP |
+                    UFFD_FEATURE_WP_HUGETLBFS_SHMEM,
+    };
+    int fd;
+
+    /*
+     * Writes by the kernel on our behalf (say, a read() into guest memory)
+     * must be tracked too, so a user-mode only userfaultfd won't do. Without
+     * the privilege for that, fall back to /dev/userfaultfd if we can open it.
+     */
+    fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#ifdef USERFAULTFD_IOC_NEW
+    if (fd == -1 && errno == EPERM) {
+        int devfd = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+
+        if (devfd != -1) {
+            fd = ioctl(devfd, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+            close(devfd);
+        } else {
+            errno = EPERM;
+        }
+    }
+#endif
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (ioctl(fd, UFFDIO_API, &api) == -1) {
+        int _errno = errno;
+        close(fd);
+        return ERROR_INT(_errno == EINVAL ? ENOTSUP : _errno);
+    }
+
+    if ((api.features & UFFD_FEATURE_WP_HUGETLBFS_SHMEM) == 0 ||
+        (api.ioctls & (1ULL << _UFFDIO_REGISTER)) == 0) {
+        close(fd);
+        return ERROR_INT(ENOTSUP);
+    }
+
+    return fd;
+}
+
+struct dma_wp *
+dma_wp_create(dma_controller_t *dma)
+{
+    struct dma_wp *wp;
+    int _errno;
+
+    assert(dma != NULL);
+
+    wp = calloc(1, sizeof(*wp));
+    if (wp == NULL) {
+        return NULL;
+    }
+
+    wp->dma = dma;
+    wp->stop_fd = -1;
+
+    wp->uffd = uffd_open();
+    if (wp->uffd == -1) {
+        _errno = errno;
+        vfu_log(dma->vfu_ctx, LOG_ERR, "failed to set up userfaultfd "
+                "write-protection: %m");
+        free(wp);
+        return ERROR_PTR(_errno);
+    }
+
+    wp->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wp->stop_fd == -1) {
+        _errno = errno;
+        close(wp->uffd);
+        free(wp);
+        return ERROR_PTR(_errno);
+    }
+
+    pthread_mutex_init(&wp->lock, NULL);
+
+    return wp;
+}
+
+void
+dma_wp_destroy(struct dma_wp *wp)
+{
+    if (wp == NULL) {
+        return;
+    }
+
+    dma_wp_lock(wp);
+    dma_wp_stop(wp);
+    dma_wp_unlock(wp);
+
+    pthread_mutex_destroy(&wp->lock);
+    close(wp->stop_fd);
+    close(wp->uffd);
+    free(wp);
+}
+
+void
+dma_wp_lock(struct dma_wp *wp)
+{
+    if (wp != NULL) {
+        pthread_mutex_lock(&wp->lock);
+    }
+}
+
+void
+dma_wp_unlock(struct dma_wp *wp)
+{
+    if (wp != NULL) {
+        pthread_mutex_unlock(&wp->lock);
+    }
+}
+
+/*
+ * Sets or lifts write-protection on [start, end) of @region, widened to the
+ * pages the region is mapped with, which are what the kernel tracks.
+ */
+static int
+wp_range(struct dma_wp *wp, dma_memory_region_t *region, char *start,
+         char *end, bool protect)
+{
+    char *map_start = region->info.mapping.iov_base;
+    char *map_end = iov_end(&region->info.mapping);
+    size_t pgsize = region->info.page_size;
+    struct uffdio_writeprotect uwp = { 0 };
+
+    start = map_start + ROUND_DOWN((size_t)(start - map_start), pgsize);
+    end = map_start + ROUND_UP((size_t)(end - map_start), pgsize);
+    end = MIN(end, map_end);
+
+    if (start >= end) {
+        return 0;
+    }
+
+    uwp.range.start = (uintptr_t)start;
+    uwp.range.len = end - start;
+    uwp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(wp->uffd, UFFDIO_WRITEPROTECT, &uwp) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+wp_register(struct dma_wp *wp, dma_memory_region_t *region)
+{
+    struct uffdio_register reg = { 0 };
+
+    reg.range.start = (uintptr_t)region->info.mapping.iov_base;
+    reg.range.len = region->info.mapping.iov_len;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(wp->uffd, UFFDIO_REGISTER, &reg) == -1) {
+        vfu_log(wp->dma->vfu_ctx, LOG_ERR, "failed to register DMA region "
+                "[%p, %p) for write-protection: %m",
+                region->info.iova.iov_base, iov_end(&region->info.iova));
+        return -1;
+    }
+
+    if (wp_range(wp, region, region->info.mapping.iov_base,
+                 iov_end(&region->info.mapping), true) == -1) {
+        int _errno = errno;
+        vfu_log(wp->dma->vfu_ctx, LOG_ERR, "failed to write-protect DMA "
+                "region [%p, %p): %m", region->info.iova.iov_base,
+                iov_end(&region->info.iova));
+        ioctl(wp->uffd, UFFDIO_UNREGISTER, &reg.range);
+        return ERROR_INT(_errno);
+    }
+
+    return 0;
+}
+
+static void
+wp_unregister(struct dma_wp *wp, dma_memory_region_t *region)
+{
+    struct uffdio_range range = {
+        .start = (uintptr_t)region->info.mapping.iov_base,
+        .len = region->info.mapping.iov_len,
+    };
+
+    /* this also wakes any thread still waiting on a fault in the range */
+    (void) ioctl(wp->uffd, UFFDIO_UNREGISTER, &range);
+}
+
+static void
+wp_handle_fault(struct dma_wp *wp, char *addr)
+{
+    dma_controller_t *dma = wp->dma;
+    struct uffdio_writeprotect uwp = { 0 };
+    struct uffdio_range range;
+    size_t pgsize = getpagesize();
+    bool found = false;
+    int i;
+
+    for (i = 0; i < dma->nregions; i++) {
+        dma_memory_region_t *region = &dma->regions[i];
+        char *map_start = region->info.mapping.iov_base;
+        char *vaddr = region->info.vaddr;
+        char *start, *end;
+
+        if (addr < map_start ||
+            addr >= (char *)iov_end(&region->info.mapping)) {
+            continue;
+        }
+        found = true;
+        pgsize = region->info.page_size;
+
+        /*
+         * The whole page becomes writable, so all of it has to be reported:
+         * it may span several dirty pages.
+         */
+        start = map_start + ROUND_DOWN((size_t)(addr - map_start), pgsize);
+        end = MIN(start + pgsize, (char *)iov_end(&region->info.mapping));
+        start = MAX(start, vaddr);
+        end = MIN(end, vaddr + region->info.iova.iov_len);
+
+        if (region->dirty_bitmap != NULL && start < end) {
+            dma_sg_t sg = {
+                .region = i,
+                .offset = start - vaddr,
+                .length = end - start,
+            };
+            _dma_mark_dirty(dma, region, &sg);
+        }
+
+        if (wp_range(wp, region, addr, addr + 1, false) == 0) {
+            return;
+        }
+        vfu_log(dma->vfu_ctx, LOG_ERR, "failed to lift write-protection of "
+                "DMA region [%p, %p) at %p: %m", region->info.iova.iov_base,
+                iov_end(&region->info.iova), addr);
+        break;
+    }
+
+    /*
+     * Either the region has gone, in which case there's nothing to record, or
+     * lifting write-protection failed. Try once more on just the faulting
+     * page, else the thread would fault on it again as soon as it's woken.
+     */
+    range.start = ROUND_DOWN((uintptr_t)addr, (uintptr_t)pgsize);
+    range.len = pgsize;
+    uwp.range = range;
+    uwp.mode = 0;
+    if (ioctl(wp->uffd, UFFDIO_WRITEPROTECT, &uwp) == -1 && found) {
+        vfu_log(dma->vfu_ctx, LOG_ERR, "failed to lift write-protection of "
+                "page %#llx: %m", range.start);
+    }
+    (void) ioctl(wp->uffd, UFFDIO_WAKE, &range);
+}
+
+static void *
+wp_thread_run(void *arg)
+{
+    struct dma_wp *wp = arg;
+    struct uffd_msg msgs[DMA_WP_MAX_MSGS];
+
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { .fd = wp->uffd, .events = POLLIN },
+            { .fd = wp->stop_fd, .events = POLLIN },
+        };
+        ssize_t ret;
+        ssize_t i;
+
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            vfu_log(wp->dma->vfu_ctx, LOG_ERR, "userfaultfd poll failed: %m");
+            break;
+        }
+
+        if (pfds[1].revents != 0) {
+            break;
+        }
+
+        ret = read(wp->uffd, msgs, sizeof(msgs));
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            vfu_log(wp->dma->vfu_ctx, LOG_ERR, "userfaultfd read failed: %m");
+            break;
+        }
+
+        pthread_mutex_lock(&wp->lock);
+        for (i = 0; i < ret / (ssize_t)sizeof(msgs[0]); i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT ||
+                !(msgs[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+                continue;
+            }
+            wp_handle_fault(wp, (char *)(uintptr_t)msgs[i].arg.pagefault.address);
+        }
+        pthread_mutex_unlock(&wp->lock);
+    }
+
+    return NULL;
+}
+
+int
+dma_wp_start(struct dma_wp *wp)
+{
+    dma_controller_t *dma;
+    eventfd_t val;
+    int ret;
+    int i;
+
+    assert(wp != NULL);
+    assert(!wp->running);
+
+    dma = wp->dma;
+
+    /* drain any stop request left over from last time */
+    (void) eventfd_read(wp->stop_fd, &val);
+
+    ret = thread_create(dma->vfu_ctx, &wp->thread, "dirty", wp_thread_run, wp);
+    if (ret != 0) {
+        return ERROR_INT(ret);
+    }
+    wp->running = true;
+
+    for (i = 0; i < dma->nregions; i++) {
+        if (dma_wp_add_region(wp, &dma->regions[i]) == -1) {
+            int _errno = errno;
+            dma_wp_stop(wp);
+            return ERROR_INT(_errno);
+        }
+    }
+
+    return 0;
+}
+
+void
+dma_wp_stop(struct dma_wp *wp)
+{
+    dma_controller_t *dma;
+    int i;
+
+    assert(wp != NULL);
+
+    if (!wp->running) {
+        return;
+    }
+
+    dma = wp->dma;
+
+    for (i = 0; i < dma->nregions; i++) {
+        if (dma->regions[i].info.vaddr != NULL) {
+            wp_unregister(wp, &dma->regions[i]);
+        }
+    }
+
+    /*
+     * Nothing can fault any more, but the thread may be waiting for the lock
+     * to handle faults read before the unregister; drop it while joining.
+     */
+    (void) eventfd_write(wp->stop_fd, 1);
+    pthread_mutex_unlock(&wp->lock);
+    pthread_join(wp->thread, NULL);
+    pthread_mutex_lock(&wp->lock);
+
+    wp->running = false;
+}
+
+int
+dma_wp_add_region(struct dma_wp *wp, dma_memory_region_t *region)
+{
+    assert(wp != NULL);
+    assert(region != NULL);
+
+    if (!wp->running || region->info.vaddr == NULL) {
+        return 0;
+    }
+
+    return wp_register(wp, region);
+}
+
+void
+dma_wp_protect_dirty(struct dma_wp *wp, dma_memory_region_t *region,
+                     const char *bitmap, size_t size)
+{
+    size_t pgsize = wp->dma->dirty_pgsize;
+    size_t nr_bits = size * CHAR_BIT;
+    char *vaddr = region->info.vaddr;
+    size_t i = 0;
+
+    if (!wp->running || vaddr == NULL) {
+        return;
+    }
+
+    /* protect each run of dirty pages with a single call */
+    while (i < nr_bits) {
+        size_t run;
+
+        if (!(bitmap[bit_to_u8(i)] & (1 << bit_to_u8off(i)))) {
+            i++;
+            continue;
+        }
+
+        for (run = i + 1; run < nr_bits; run++) {
+            if (!(bitmap[bit_to_u8(run)] & (1 << bit_to_u8off(run)))) {
+                break;
+            }
+        }
+
+        if (wp_range(wp, region, vaddr + i * pgsize,
+                     vaddr + MIN(run * pgsize, region->info.iova.iov_len),
+                     true) == -1) {
+            vfu_log(wp->dma->vfu_ctx, LOG_WARNING, "failed to write-protect "
+                    "[%p, %p): %m", vaddr + i * pgsize, vaddr + run * pgsize);
+        }
+
+        i = run;
+    }
+}
+
+#else /* UFFDIO_WRITEPROTECT */
+
+struct dma_wp *
+dma_wp_create(dma_controller_t *dma UNUSED)
+{
+    return ERROR_PTR(ENOTSUP);
+}
+
+void
+dma_wp_destroy(struct dma_wp *wp UNUSED)
+{
+}
+
+void
+dma_wp_lock(struct dma_wp *wp UNUSED)
+{
+}
+
+void
+dma_wp_unlock(struct dma_wp *wp UNUSED)
+{
+}
+
+int
+dma_wp_start(struct dma_wp *wp UNUSED)
+{
+    return ERROR_INT(ENOTSUP);
+}
+
+void
+dma_wp_stop(struct dma_wp *wp UNUSED)
+{
+}
+
+int
+dma_wp_add_region(struct dma_wp *wp UNUSED,
+                  dma_memory_region_t *region UNUSED)
+{
+    return 0;
+}
+
+void
+dma_wp_protect_dirty(struct dma_wp *wp UNUSED,
+                     dma_memory_region_t *region UNUSED,
+                     const char *bitmap UNUSED, size_t size UNUSED)
+{
+}
+
+#endif /* UFFDIO_WRITEPROTECT */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
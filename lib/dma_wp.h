@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_DMA_WP_H
+#define LIB_VFIO_USER_DMA_WP_H
+
+/*
+ * Automatic dirty page tracking, see vfu_setup_dirty_tracking().
+ *
+ * While dirty page logging is on, every mapped DMA region is registered with
+ * a userfaultfd and write-protected. The first write to a page faults; a
+ * library thread marks the page dirty and lifts the protection, so further
+ * writes to it run at full speed until the client fetches the bitmap, when
+ * the pages reported are protected again. Nothing is registered while logging
+ * is off, so there's no cost at all outside of migration.
+ *
+ * The region array is only changed with the tracker locked (dma_wp_lock()),
+ * so that the fault thread can look regions up safely.
+ */
+
+#include <stddef.h>
+
+#include "dma.h"
+
+struct dma_wp;
+
+/*
+ * Checks that the kernel supports write-protecting shared mappings and
+ * creates the tracker; it does nothing until dma_wp_start().
+ */
+struct dma_wp *
+dma_wp_create(dma_controller_t *dma);
+
+void
+dma_wp_destroy(struct dma_wp *wp);
+
+void
+dma_wp_lock(struct dma_wp *wp);
+
+void
+dma_wp_unlock(struct dma_wp *wp);
+
+/*
+ * Write-protects all mapped regions and starts the fault thread. Called with
+ * the tracker locked, once the dirty bitmaps are allocated.
+ */
+int
+dma_wp_start(struct dma_wp *wp);
+
+/* Stops tracking, all regions become writable again. Called locked. */
+void
+dma_wp_stop(struct dma_wp *wp);
+
+/* Write-protects a region mapped while tracking. Called locked. */
+int
+dma_wp_add_region(struct dma_wp *wp, dma_memory_region_t *region);
+
+/*
+ * Write-protects the pages set in @bitmap, the region's dirty bits that are
+ * about to be handed out. Called locked, before the bits are cleared: any
+ * write from then on faults and is recorded for the next fetch.
+ */
+void
+dma_wp_protect_dirty(struct dma_wp *wp, dma_memory_region_t *region,
+                     const char *bitmap, size_t size);
+
+#endif /* LIB_VFIO_USER_DMA_WP_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Live upgrade: vfu_ctx_export_state() and vfu_ctx_import_state().
+ *
+ * The state is sent as a fixed header, then a body with the DMA regions, IRQ
+ * eventfds, config space and MSI-X state, then the file descriptors in batches
+ * of up to HANDOVER_FDS_PER_MSG, each batch riding on a single byte. File
+ * descriptors are referred to by their index in that sequence, the first two
+ * being the listening and connected sockets.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dma.h"
+#include "irq.h"
+#include "migration.h"
+#include "msix.h"
+#include "pci.h"
+#include "private.h"
+#include "tran.h"
+
+#define HANDOVER_MAGIC 0x68756676 /* "vfuh" */
+#define HANDOVER_VERSION 1
+
+/* SCM_MAX_FD */
+#define HANDOVER_FDS_PER_MSG 253
+
+/* Sanity bound on the body a predecessor may send us. */
+#define HANDOVER_MAX_BODY_SIZE (64 << 20)
+
+#define HANDOVER_F_QUIESCED (1U << 0)
+#define HANDOVER_F_MIGR     (1U << 1)
+#define HANDOVER_F_MIGR_V2  (1U << 2)
+
+#define HANDOVER_FD_LISTEN  0
+#define HANDOVER_FD_CONN    1
+
+struct handover_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nr_fds;
+    uint32_t body_size;
+    int32_t client_max_fds;
+    uint64_t client_max_data_xfer_size;
+    uint64_t migr_pgsize;
+    uint32_t migr_state;
+    uint32_t nr_dma;
+    /* number of entries in the IRQ fd table: err, req, then max_ivs vectors */
+    uint32_t nr_irq_fds;
+    uint32_t config_size;
+    uint32_t msix_size;
+    uint32_t reserved;
+};
+
+struct handover_dma {
+    uint64_t iova;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t prot;
+    /* fd index, or -1 if the region isn't mappable */
+    int32_t fd;
+};
+
+static size_t
+body_size(const struct handover_hdr *hdr)
+{
+    return (size_t)hdr->nr_dma * sizeof(struct handover_dma) +
+           (size_t)hdr->nr_irq_fds * sizeof(int32_t) +
+           hdr->config_size + hdr->msix_size;
+}
+
+static size_t
+nr_irq_fds(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->irqs == NULL ? 0 : 2 + vfu_ctx->irqs->max_ivs;
+}
+
+static int *
+irq_fd(vfu_ctx_t *vfu_ctx, size_t i)
+{
+    if (i == 0) {
+        return &vfu_ctx->irqs->err_efd;
+    }
+    if (i == 1) {
+        return &vfu_ctx->irqs->req_efd;
+    }
+    return &vfu_ctx->irqs->efds[i - 2];
+}
+
+static size_t
+config_size(vfu_ctx_t *vfu_ctx)
+{
+    return vfu_ctx->pci.config_space == NULL ? 0 :
+           pci_config_space_size(vfu_ctx);
+}
+
+static int
+send_all(int sock, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = send(sock, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int
+recv_all(int sock, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = recv(sock, p, len, MSG_WAITALL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            return ERROR_INT(ECONNRESET);
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int
+send_fds(int sock, const int *fds, size_t nr_fds)
+{
+    char cbuf[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+
+    while (nr_fds > 0) {
+        size_t n = nr_fds < HANDOVER_FDS_PER_MSG ? nr_fds : HANDOVER_FDS_PER_MSG;
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = cbuf,
+            .msg_controllen = CMSG_SPACE(n * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        ssize_t ret;
+
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+        do {
+            ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            return -1;
+        }
+
+        fds += n;
+        nr_fds -= n;
+    }
+    return 0;
+}
+
+/* On error, the fds received so far are closed. */
+static int
+recv_fds(int sock, int *fds, size_t nr_fds)
+{
+    char cbuf[CMSG_SPACE(HANDOVER_FDS_PER_MSG * sizeof(int))];
+    size_t got = 0;
+    int err = 0;
+
+    while (got < nr_fds) {
+        size_t n = nr_fds - got;
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = cbuf,
+            .msg_controllen = sizeof(cbuf),
+        };
+        struct cmsghdr *cmsg;
+        size_t nr = 0;
+        ssize_t ret;
+
+        n = n < HANDOVER_FDS_PER_MSG ? n : HANDOVER_FDS_PER_MSG;
+
+        do {
+            ret = recvmsg(sock, &msg, MSG_WAITALL);
+        } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+            err = ret == 0 ? ECONNRESET : errno;
+            break;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nr > n) {
+                /* can't happen with our buffer size, but don't overflow */
+                nr = n;
+            }
+            memcpy(fds + got, CMSG_DATA(cmsg), nr * sizeof(int));
+            break;
+        }
+        got += nr;
+
+        if (nr != n || (msg.msg_flags & MSG_CTRUNC)) {
+            err = EPROTO;
+            break;
+        }
+    }
+
+    if (err != 0) {
+        while (got > 0) {
+            close(fds[--got]);
+        }
+        return ERROR_INT(err);
+    }
+    return 0;
+}
+
+static void
+close_fds(int *fds, size_t nr_fds)
+{
+    size_t i;
+
+    for (i = 0; i < nr_fds; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+}
+
+/* Returns the body to send, with the fds it refers to in @fds. */
+static char *
+export_body(vfu_ctx_t *vfu_ctx, struct handover_hdr *hdr, int *fds)
+{
+    struct handover_dma *dma;
+    int32_t *irq_fds;
+    char *body, *p;
+    size_t i;
+
+    body = calloc(1, body_size(hdr) == 0 ? 1 : body_size(hdr));
+    if (body == NULL) {
+        return NULL;
+    }
+
+    dma = (struct handover_dma *)body;
+    for (i = 0; i < hdr->nr_dma; i++) {
+        dma_memory_region_t *region = &vfu_ctx->dma->regions[i];
+
+        dma[i].iova = (uintptr_t)region->info.iova.iov_base;
+        dma[i].size = region->info.iova.iov_len;
+        dma[i].offset = region->offset;
+        dma[i].prot = region->info.prot;
+        dma[i].fd = -1;
+        if (region->fd != -1) {
+            dma[i].fd = hdr->nr_fds;
+            fds[hdr->nr_fds++] = region->fd;
+        }
+    }
+
+    irq_fds = (int32_t *)(dma + hdr->nr_dma);
+    for (i = 0; i < hdr->nr_irq_fds; i++) {
+        int fd = *irq_fd(vfu_ctx, i);
+
+        irq_fds[i] = -1;
+        if (fd != -1) {
+            irq_fds[i] = hdr->nr_fds;
+            fds[hdr->nr_fds++] = fd;
+        }
+    }
+
+    p = (char *)(irq_fds + hdr->nr_irq_fds);
+    memcpy(p, vfu_ctx->pci.config_space, hdr->config_size);
+    p += hdr->config_size;
+    if (hdr->msix_size != 0) {
+        msix_save_state(vfu_ctx, p);
+    }
+
+    hdr->body_size = body_size(hdr);
+    return body;
+}
+
+EXPORT int
+vfu_ctx_export_state(vfu_ctx_t *vfu_ctx, int sock)
+{
+    struct handover_hdr hdr = {
+        .magic = HANDOVER_MAGIC,
+        .version = HANDOVER_VERSION,
+        .nr_fds = 2,
+    };
+    int *fds = NULL;
+    char *body = NULL;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (!vfu_ctx->realized) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->tran->export_fds == NULL) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    if (vfu_ctx->in_cb != CB_NONE ||
+        vfu_ctx->pending.state != VFU_CTX_PENDING_NONE ||
+        vfu_ctx->loop_entry != NULL) {
+        return ERROR_INT(EBUSY);
+    }
+
+    if (vfu_ctx->migration != NULL) {
+        bool is_v2;
+
+        if (migration_is_saving(vfu_ctx->migration) ||
+            migration_is_resuming(vfu_ctx->migration)) {
+            return ERROR_INT(EBUSY);
+        }
+        hdr.flags |= HANDOVER_F_MIGR;
+        hdr.migr_state = migration_get_device_state(vfu_ctx->migration,
+                                                    &is_v2);
+        if (is_v2) {
+            hdr.flags |= HANDOVER_F_MIGR_V2;
+        }
+        hdr.migr_pgsize = migration_get_pgsize(vfu_ctx->migration);
+    }
+
+    if (vfu_ctx->dma != NULL) {
+        /* the bitmaps and the retention deadline aren't worth handing over */
+        if (vfu_ctx->dma->dirty_pgsize != 0 || vfu_ctx->dma->nr_retained != 0) {
+            return ERROR_INT(EBUSY);
+        }
+        hdr.nr_dma = vfu_ctx->dma->nregions;
+    }
+
+    if (vfu_ctx->quiesced) {
+        hdr.flags |= HANDOVER_F_QUIESCED;
+    }
+    hdr.client_max_fds = vfu_ctx->client_max_fds;
+    hdr.client_max_data_xfer_size = vfu_ctx->client_max_data_xfer_size;
+    hdr.nr_irq_fds = nr_irq_fds(vfu_ctx);
+    hdr.config_size = config_size(vfu_ctx);
+    hdr.msix_size = msix_state_size(vfu_ctx);
+
+    fds = malloc((2 + hdr.nr_dma + hdr.nr_irq_fds) * sizeof(int));
+    if (fds == NULL) {
+        return -1;
+    }
+
+    body = export_body(vfu_ctx, &hdr, fds);
+    if (body == NULL) {
+        ret = errno;
+        free(fds);
+        return ERROR_INT(ret);
+    }
+
+    ret = vfu_ctx->tran->export_fds(vfu_ctx, &fds[HANDOVER_FD_LISTEN],
+                                    &fds[HANDOVER_FD_CONN]);
+    if (ret < 0) {
+        ret = errno;
+        goto out;
+    }
+
+    if (send_all(sock, &hdr, sizeof(hdr)) < 0 ||
+        send_all(sock, body, hdr.body_size) < 0 ||
+        send_fds(sock, fds, hdr.nr_fds) < 0) {
+        ret = errno;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to export state: %m");
+        /* we're still serving the client */
+        ret = vfu_ctx->tran->import_fds(vfu_ctx, fds[HANDOVER_FD_LISTEN],
+                                        fds[HANDOVER_FD_CONN]) < 0 ?
+              errno : ret;
+        goto out;
+    }
+
+    vfu_log(vfu_ctx, LOG_INFO, "handed over client with %u DMA regions",
+            hdr.nr_dma);
+
+    /*
+     * The successor has its own copies of everything now: let go of ours
+     * without resetting the device.
+     */
+    if (vfu_ctx->dma != NULL) {
+        dma_controller_remove_all_regions(vfu_ctx->dma, vfu_ctx->dma_unregister,
+                                          vfu_ctx);
+    }
+    if (vfu_ctx->irqs != NULL) {
+        irqs_reset(vfu_ctx);
+    }
+    close(fds[HANDOVER_FD_LISTEN]);
+    close(fds[HANDOVER_FD_CONN]);
+    vfu_ctx->handed_over = true;
+    ret = 0;
+
+out:
+    free(body);
+    free(fds);
+    return ret == 0 ? 0 : ERROR_INT(ret);
+}
+
+static int
+import_validate(vfu_ctx_t *vfu_ctx, const struct handover_hdr *hdr,
+                const char *body)
+{
+    const struct handover_dma *dma = (const struct handover_dma *)body;
+    const int32_t *irq_fds = (const int32_t *)(dma + hdr->nr_dma);
+    size_t i;
+
+    if (hdr->nr_dma > 0 &&
+        (vfu_ctx->dma == NULL || hdr->nr_dma > (size_t)vfu_ctx->dma->max_regions)) {
+        vfu_log(vfu_ctx, LOG_ERR, "can't take over %u DMA regions",
+                hdr->nr_dma);
+        return ERROR_INT(EINVAL);
+    }
+
+    if (hdr->nr_irq_fds != nr_irq_fds(vfu_ctx) ||
+        hdr->config_size != config_size(vfu_ctx) ||
+        hdr->msix_size != msix_state_size(vfu_ctx) ||
+        !(hdr->flags & HANDOVER_F_MIGR) != (vfu_ctx->migration == NULL)) {
+        vfu_log(vfu_ctx, LOG_ERR, "device set up differently from the "
+                "predecessor's");
+        return ERROR_INT(EINVAL);
+    }
+
+    for (i = 0; i < hdr->nr_dma; i++) {
+        if (dma[i].fd != -1 &&
+            (dma[i].fd < 2 || (uint32_t)dma[i].fd >= hdr->nr_fds)) {
+            return ERROR_INT(EINVAL);
+        }
+    }
+    for (i = 0; i < hdr->nr_irq_fds; i++) {
+        if (irq_fds[i] != -1 &&
+            (irq_fds[i] < 2 || (uint32_t)irq_fds[i] >= hdr->nr_fds)) {
+            return ERROR_INT(EINVAL);
+        }
+    }
+    return 0;
+}
+
+/* Takes ownership of @fds, which are set to -1 as they're used. */
+static int
+import_body(vfu_ctx_t *vfu_ctx, const struct handover_hdr *hdr,
+            const char *body, int *fds)
+{
+    const struct handover_dma *dma = (const struct handover_dma *)body;
+    const int32_t *irq_fds = (const int32_t *)(dma + hdr->nr_dma);
+    const char *p = (const char *)(irq_fds + hdr->nr_irq_fds);
+    size_t i;
+    int ret;
+
+    if (hdr->flags & HANDOVER_F_MIGR) {
+        if (migration_restore_device_state(vfu_ctx->migration,
+                                           hdr->flags & HANDOVER_F_MIGR_V2,
+                                           hdr->migr_state) < 0 ||
+            migration_set_pgsize(vfu_ctx->migration, hdr->migr_pgsize) < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "bad migration state %#x",
+                    hdr->migr_state);
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    if (msix_load_state(vfu_ctx, p + hdr->config_size, hdr->msix_size) < 0) {
+        return -1;
+    }
+    memcpy(vfu_ctx->pci.config_space, p, hdr->config_size);
+
+    for (i = 0; i < hdr->nr_irq_fds; i++) {
+        if (irq_fds[i] != -1) {
+            *irq_fd(vfu_ctx, i) = fds[irq_fds[i]];
+            fds[irq_fds[i]] = -1;
+        }
+    }
+
+    for (i = 0; i < hdr->nr_dma; i++) {
+        int fd = dma[i].fd == -1 ? -1 : fds[dma[i].fd];
+
+        ret = dma_controller_add_region(vfu_ctx->dma,
+                                        (vfu_dma_addr_t)(uintptr_t)dma[i].iova,
+                                        dma[i].size, fd, dma[i].offset,
+                                        dma[i].prot);
+        if (ret < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "failed to take over DMA region "
+                    "[%#lx, %#lx): %m", dma[i].iova, dma[i].iova + dma[i].size);
+            return -1;
+        }
+        if (fd != -1) {
+            fds[dma[i].fd] = -1;
+        }
+
+        if (vfu_ctx->dma_register != NULL) {
+            vfu_ctx->in_cb = CB_DMA_REGISTER;
+            vfu_ctx->dma_register(vfu_ctx, &vfu_ctx->dma->regions[ret].info);
+            vfu_ctx->in_cb = CB_NONE;
+        }
+    }
+
+    vfu_ctx->client_max_fds = hdr->client_max_fds;
+    vfu_ctx->client_max_data_xfer_size = hdr->client_max_data_xfer_size;
+    vfu_ctx->quiesced = hdr->flags & HANDOVER_F_QUIESCED;
+
+    ret = vfu_ctx->tran->import_fds(vfu_ctx, fds[HANDOVER_FD_LISTEN],
+                                    fds[HANDOVER_FD_CONN]);
+    if (ret < 0) {
+        return -1;
+    }
+    fds[HANDOVER_FD_LISTEN] = -1;
+    fds[HANDOVER_FD_CONN] = -1;
+    return 0;
+}
+
+EXPORT int
+vfu_ctx_import_state(vfu_ctx_t *vfu_ctx, int sock)
+{
+    struct handover_hdr hdr;
+    char *body = NULL;
+    int *fds = NULL;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (!vfu_ctx->realized) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->tran->import_fds == NULL) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    if (vfu_ctx->loop_entry != NULL ||
+        (vfu_ctx->dma != NULL && vfu_ctx->dma->nregions != 0)) {
+        return ERROR_INT(EBUSY);
+    }
+
+    if (recv_all(sock, &hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+
+    if (hdr.magic != HANDOVER_MAGIC || hdr.version != HANDOVER_VERSION ||
+        hdr.body_size > HANDOVER_MAX_BODY_SIZE ||
+        hdr.body_size != body_size(&hdr) || hdr.nr_fds < 2 ||
+        hdr.nr_fds > 2 + (size_t)hdr.nr_dma + hdr.nr_irq_fds) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad state header");
+        return ERROR_INT(EINVAL);
+    }
+
+    body = malloc(hdr.body_size == 0 ? 1 : hdr.body_size);
+    fds = malloc(hdr.nr_fds * sizeof(int));
+    if (body == NULL || fds == NULL) {
+        ret = ENOMEM;
+        goto out;
+    }
+
+    if (recv_all(sock, body, hdr.body_size) < 0 ||
+        recv_fds(sock, fds, hdr.nr_fds) < 0) {
+        ret = errno;
+        goto out;
+    }
+
+    if (import_validate(vfu_ctx, &hdr, body) < 0 ||
+        import_body(vfu_ctx, &hdr, body, fds) < 0) {
+        ret = errno;
+        /* don't keep part of the client */
+        if (vfu_ctx->dma != NULL) {
+            dma_controller_remove_all_regions(vfu_ctx->dma,
+                                              vfu_ctx->dma_unregister,
+                                              vfu_ctx);
+        }
+        if (vfu_ctx->irqs != NULL) {
+            irqs_reset(vfu_ctx);
+        }
+        close_fds(fds, hdr.nr_fds);
+        goto out;
+    }
+
+    vfu_log(vfu_ctx, LOG_INFO, "took over client with %u DMA regions",
+            hdr.nr_dma);
+    ret = 0;
+
+out:
+    free(body);
+    free(fds);
+    return ret == 0 ? 0 : ERROR_INT(ret);
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
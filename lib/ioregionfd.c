@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ioregionfd.h"
+#include "migration.h"
+#include "msix.h"
+#include "regs.h"
+#include "shadow.h"
+#include "thread.h"
+
+#define IOREGIONFD_MAX_EVENTS 16
+
+struct ioregionfd_loop {
+    int         epoll_fd;
+    int         stop_fd;
+    pthread_t   thread;
+};
+
+static void
+ioregionfd_access(vfu_ctx_t *vfu_ctx, ioeventfd_t *sub,
+                  struct vfio_user_ioregionfd_cmd *cmd)
+{
+    vfu_region_access_cb_t *cb = vfu_ctx->reg_info[sub->region].cb;
+    struct vfio_user_ioregionfd_resp resp = { 0 };
+    uint32_t op = cmd->info & VFIO_USER_IOREGIONFD_CMD_MASK;
+    size_t size = 1 << ((cmd->info & VFIO_USER_IOREGIONFD_SIZE_MASK) >>
+                        VFIO_USER_IOREGIONFD_SIZE_SHIFT);
+    bool is_write = op == VFIO_USER_IOREGIONFD_CMD_WRITE;
+    ssize_t ret;
+
+    /*
+     * There's no way to fail an access: as for unbacked MMIO, bad reads
+     * return all ones and bad writes are dropped.
+     */
+    if (op != VFIO_USER_IOREGIONFD_CMD_READ && !is_write) {
+        vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: bad command %#x", cmd->info);
+        resp.data = UINT64_MAX;
+    } else if (satadd_u64(cmd->offset, size) > sub->size) {
+        vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: out of bounds access %#lx-%#lx "
+                "(size %#lx)", cmd->offset, cmd->offset + size, sub->size);
+        resp.data = UINT64_MAX;
+    } else if (device_is_stopped_and_copying(vfu_ctx->migration)) {
+        vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: cannot access region %u while "
+                "device in stop-and-copy state", sub->region);
+        resp.data = UINT64_MAX;
+    } else if (msix_access(vfu_ctx, sub->region,
+                           is_write ? (char *)&cmd->data : (char *)&resp.data,
+                           size, sub->offset + cmd->offset, is_write, &ret)) {
+        if (ret != (ssize_t)size && !is_write) {
+            resp.data = UINT64_MAX;
+        }
+    } else if (regs_access(vfu_ctx, sub->region,
+                           is_write ? (char *)&cmd->data : (char *)&resp.data,
+                           size, sub->offset + cmd->offset, is_write, &ret)) {
+        /* registers can't fail */
+    } else if (shadow_access(vfu_ctx, sub->region,
+                             is_write ? (char *)&cmd->data : (char *)&resp.data,
+                             size, sub->offset + cmd->offset, is_write, &ret)) {
+        /* served from a shadow copy */
+    } else if (is_write) {
+        ret = cb(vfu_ctx, (char *)&cmd->data, size, sub->offset + cmd->offset,
+                 true);
+        if (ret != (ssize_t)size) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "region%u: write to (%#lx:%zu) "
+                    "failed: %m", sub->region, sub->offset + cmd->offset, size);
+        }
+    } else {
+        ret = cb(vfu_ctx, (char *)&resp.data, size, sub->offset + cmd->offset,
+                 false);
+        if (ret != (ssize_t)size) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "region%u: read from (%#lx:%zu) "
+                    "failed: %m", sub->region, sub->offset + cmd->offset, size);
+            resp.data = UINT64_MAX;
+        }
+    }
+
+    if (is_write) {
+        if (!(cmd->info & VFIO_USER_IOREGIONFD_RESP)) {
+            return;
+        }
+        resp.data = 0;
+    }
+
+    ret = send(sub->server_fd, &resp, sizeof(resp), MSG_NOSIGNAL);
+    if (ret != sizeof(resp)) {
+        vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: failed to send response: %m");
+    }
+}
+
+static void
+ioregionfd_service(vfu_ctx_t *vfu_ctx, ioeventfd_t *sub)
+{
+    struct vfio_user_ioregionfd_cmd cmds[IOREGIONFD_MAX_EVENTS];
+    ssize_t ret;
+    size_t i;
+
+    /* take as many frames as are queued in one go */
+    ret = recv(sub->server_fd, cmds, sizeof(cmds), MSG_DONTWAIT);
+    if (ret <= 0) {
+        if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+            vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: failed to receive: %m");
+        }
+        return;
+    }
+
+    /* frames are fixed-size, so wait for the rest of a partial one */
+    if (ret % sizeof(cmds[0]) != 0) {
+        size_t rest = sizeof(cmds[0]) - ret % sizeof(cmds[0]);
+        ssize_t ret2 = recv(sub->server_fd, (char *)cmds + ret, rest,
+                            MSG_WAITALL);
+
+        if (ret2 != (ssize_t)rest) {
+            vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: short frame");
+            return;
+        }
+        ret += rest;
+    }
+
+    for (i = 0; i < ret / sizeof(cmds[0]); i++) {
+        ioregionfd_access(vfu_ctx, sub, &cmds[i]);
+    }
+}
+
+static void *
+ioregionfd_thread_run(void *arg)
+{
+    vfu_ctx_t *vfu_ctx = arg;
+    struct ioregionfd_loop *loop = vfu_ctx->ioregionfd;
+    struct epoll_event events[IOREGIONFD_MAX_EVENTS];
+
+    for (;;) {
+        int nr = epoll_wait(loop->epoll_fd, events, IOREGIONFD_MAX_EVENTS, -1);
+        int i;
+
+        if (nr == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            vfu_log(vfu_ctx, LOG_ERR, "ioregionfd: epoll_wait failed: %m");
+            break;
+        }
+
+        for (i = 0; i < nr; i++) {
+            if (events[i].data.ptr == NULL) {
+                return NULL;
+            }
+            ioregionfd_service(vfu_ctx, events[i].data.ptr);
+        }
+    }
+
+    return NULL;
+}
+
+static struct ioregionfd_loop *
+ioregionfd_loop_create(vfu_ctx_t *vfu_ctx)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct ioregionfd_loop *loop;
+    int ret;
+
+    loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->stop_fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        goto fail;
+    }
+
+    loop->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->stop_fd == -1 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stop_fd, &ev) == -1) {
+        goto fail;
+    }
+
+    vfu_ctx->ioregionfd = loop;
+
+    ret = thread_create(vfu_ctx, &loop->thread, "ioregfd", ioregionfd_thread_run,
+                        vfu_ctx);
+    if (ret != 0) {
+        vfu_ctx->ioregionfd = NULL;
+        errno = ret;
+        goto fail;
+    }
+
+    return loop;
+
+fail:
+    ret = errno;
+    if (loop->stop_fd != -1) {
+        close(loop->stop_fd);
+    }
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+    }
+    free(loop);
+    return ERROR_PTR(ret);
+}
+
+int
+ioregionfd_add(vfu_ctx_t *vfu_ctx, ioeventfd_t *sub)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = sub };
+
+    assert(vfu_ctx != NULL);
+    assert(sub != NULL);
+
+    if (vfu_ctx->ioregionfd == NULL &&
+        ioregionfd_loop_create(vfu_ctx) == NULL) {
+        return -1;
+    }
+
+    return epoll_ctl(vfu_ctx->ioregionfd->epoll_fd, EPOLL_CTL_ADD,
+                     sub->server_fd, &ev);
+}
+
+void
+ioregionfd_destroy(vfu_ctx_t *vfu_ctx)
+{
+    struct ioregionfd_loop *loop = vfu_ctx->ioregionfd;
+
+    if (loop == NULL) {
+        return;
+    }
+
+    (void) eventfd_write(loop->stop_fd, 1);
+    pthread_join(loop->thread, NULL);
+
+    close(loop->stop_fd);
+    close(loop->epoll_fd);
+    free(loop);
+    vfu_ctx->ioregionfd = NULL;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
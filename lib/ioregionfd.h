@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_IOREGIONFD_H
+#define LIB_VFIO_USER_IOREGIONFD_H
+
+/*
+ * ioregionfd subregions, see vfu_create_ioregionfd().
+ *
+ * Each subregion is a socket pair: the client gets one end with
+ * VFIO_USER_DEVICE_GET_REGION_IO_FDS and sends a fixed-size frame for each
+ * access, the other end is polled by a thread of the context's own. That
+ * thread calls the region callback directly, so these accesses skip the
+ * vfio-user message path altogether.
+ */
+
+#include "libvfio-user.h"
+#include "private.h"
+
+/* Starts servicing @sub, starting the thread if needed. */
+int
+ioregionfd_add(vfu_ctx_t *vfu_ctx, ioeventfd_t *sub);
+
+/* Called by vfu_destroy_ctx() to stop the thread. */
+void
+ioregionfd_destroy(vfu_ctx_t *vfu_ctx);
+
+#endif /* LIB_VFIO_USER_IOREGIONFD_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -37,6 +37,8 @@
 #include <sys/eventfd.h>
 
 #include "irq.h"
+#include "msix.h"
+#include "trace.h"
 
 #define LM2VFIO_IRQT(type) (type - 1)
 
@@ -141,6 +143,7 @@ irqs_reset(vfu_ctx_t *vfu_ctx)
 
     irqs_disable(vfu_ctx, VFIO_PCI_REQ_IRQ_INDEX, 0, 0);
     irqs_disable(vfu_ctx, VFIO_PCI_ERR_IRQ_INDEX, 0, 0);
+    msix_reset(vfu_ctx);
 
     for (i = 0; i < vfu_ctx->irqs->max_ivs; i++) {
         if (efds[i] >= 0) {
@@ -426,6 +429,13 @@ vfu_irq_trigger(vfu_ctx_t *vfu_ctx, uint32_t subindex)
         return ERROR_INT(EINVAL);
     }
 
+    TRACE_INSTANT(TRACE_IRQ_TRIGGER, subindex);
+
+    if (msix_latch(vfu_ctx, subindex)) {
+        /* pending, fired when the vector is unmasked */
+        return 0;
+    }
+
     if (vfu_ctx->irqs->efds[subindex] == -1) {
         vfu_log(vfu_ctx, LOG_ERR, "no fd for interrupt %d", subindex);
         return ERROR_INT(ENOENT);
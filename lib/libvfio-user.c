@@ -48,40 +48,35 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <sys/eventfd.h>
 
 #include "dma.h"
+#include "dma_wp.h"
+#include "ioregionfd.h"
 #include "irq.h"
 #include "libvfio-user.h"
+#include "log.h"
+#include "loop.h"
 #include "migration.h"
+#include "msix.h"
 #include "pci.h"
 #include "private.h"
+#include "regs.h"
+#include "shadow.h"
+#include "thread.h"
+#include "trace.h"
 #include "tran_pipe.h"
+#include "tran_shm.h"
 #include "tran_sock.h"
 
 static int
 vfu_reset_ctx(vfu_ctx_t *vfu_ctx, int reason);
 
-EXPORT void
-vfu_log(vfu_ctx_t *vfu_ctx, int level, const char *fmt, ...)
-{
-    va_list ap;
-    char buf[BUFSIZ];
-    int _errno = errno;
-
-    assert(vfu_ctx != NULL);
-
-    if (vfu_ctx->log == NULL || level > vfu_ctx->log_level || fmt == NULL) {
-        return;
-    }
-
-    va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-    vfu_ctx->log(vfu_ctx, level, buf);
-    errno = _errno;
-}
+static int
+copyin_mmap_areas(vfu_reg_info_t *reg_info,
+                  struct iovec *mmap_areas, uint32_t nr_mmap_areas);
 
 static size_t
 get_vfio_caps_size(bool is_migr_reg, vfu_reg_info_t *reg)
@@ -222,6 +217,15 @@ region_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf,
         }
 
         ret = migration_region_access(vfu_ctx, buf, count, offset, is_write);
+    } else if (msix_access(vfu_ctx, region, buf, count, offset, is_write,
+                           &ret)) {
+        /* served from the emulated MSI-X table or PBA */
+    } else if (regs_access(vfu_ctx, region, buf, count, offset, is_write,
+                           &ret)) {
+        /* served from the region's register file */
+    } else if (shadow_access(vfu_ctx, region, buf, count, offset, is_write,
+                             &ret)) {
+        /* served from a shadow copy */
     } else {
         vfu_region_access_cb_t *cb = vfu_ctx->reg_info[region].cb;
 
@@ -336,8 +340,17 @@ handle_region_access(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         buf = (char *)(&in_ra->data);
     }
 
-    ret = region_access(vfu_ctx, in_ra->region, buf, in_ra->count,
-                        in_ra->offset, msg->hdr.cmd == VFIO_USER_REGION_WRITE);
+    if (in_ra->region == VFU_PCI_DEV_MIGR_REGION_IDX &&
+        msg->hdr.cmd == VFIO_USER_REGION_WRITE && msg->in.nr_fds > 0 &&
+        vfu_ctx->migration != NULL) {
+        ret = migration_stream(vfu_ctx,
+                               consume_fd(msg->in.fds, msg->in.nr_fds, 0),
+                               buf, in_ra->count, in_ra->offset);
+    } else {
+        ret = region_access(vfu_ctx, in_ra->region, buf, in_ra->count,
+                            in_ra->offset,
+                            msg->hdr.cmd == VFIO_USER_REGION_WRITE);
+    }
     if (ret != in_ra->count) {
         /* FIXME we should return whatever has been accessed, not an error */
         if (ret >= 0) {
@@ -494,7 +507,63 @@ vfu_create_ioeventfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, int fd,
     elem->offset = offset;
     elem->size = size;
     elem->flags = flags;
+    elem->type = VFIO_USER_IO_FD_TYPE_IOEVENTFD;
     elem->datamatch = datamatch;
+    elem->region = region_idx;
+    elem->server_fd = -1;
+    LIST_INSERT_HEAD(&vfu_reg->subregions, elem, entry);
+
+    return 0;
+}
+
+EXPORT int
+vfu_create_ioregionfd(vfu_ctx_t *vfu_ctx, uint32_t region_idx, size_t offset,
+                      uint32_t size, uint64_t user_data)
+{
+    vfu_reg_info_t *vfu_reg;
+    ioeventfd_t *elem;
+    int sv[2];
+
+    assert(vfu_ctx != NULL);
+
+    if (region_idx > VFU_PCI_DEV_BAR5_REGION_IDX) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+
+    if (vfu_reg->cb == NULL || size == 0 || offset + size > vfu_reg->size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    elem = malloc(sizeof(ioeventfd_t));
+    if (elem == NULL) {
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        free(elem);
+        return -1;
+    }
+
+    elem->fd = sv[1];
+    elem->offset = offset;
+    elem->size = size;
+    elem->flags = 0;
+    elem->type = VFIO_USER_IO_FD_TYPE_IOREGIONFD;
+    elem->user_data = user_data;
+    elem->region = region_idx;
+    elem->server_fd = sv[0];
+
+    if (ioregionfd_add(vfu_ctx, elem) == -1) {
+        int _errno = errno;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to set up ioregionfd: %m");
+        close(sv[0]);
+        close(sv[1]);
+        free(elem);
+        return ERROR_INT(_errno);
+    }
+
     LIST_INSERT_HEAD(&vfu_reg->subregions, elem, entry);
 
     return 0;
@@ -513,8 +582,14 @@ free_regions(vfu_ctx_t *vfu_ctx)
         while (!LIST_EMPTY(&vfu_reg->subregions)) {
             ioeventfd_t *n = LIST_FIRST(&vfu_reg->subregions);
             LIST_REMOVE(n, entry);
+            if (n->type == VFIO_USER_IO_FD_TYPE_IOREGIONFD) {
+                close(n->fd);
+                close(n->server_fd);
+            }
             free(n);
         }
+        regs_free(vfu_reg);
+        shadow_free(vfu_reg);
     }
     free(vfu_ctx->reg_info);
 }
@@ -623,14 +698,19 @@ handle_device_get_region_io_fds(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         sub_reg = LIST_FIRST(&vfu_reg->subregions);
         for (i = 0; i < max_sent_sub_regions; i++) {
 
+            /* the two layouts only differ in the meaning of the last field */
             ioefd = &reply->sub_regions[i].ioeventfd;
             ioefd->offset = sub_reg->offset;
             ioefd->size = sub_reg->size;
             ioefd->fd_index = add_fd_index(msg->out.fds, &msg->out.nr_fds,
                                         sub_reg->fd);
-            ioefd->type = VFIO_USER_IO_FD_TYPE_IOEVENTFD;
+            ioefd->type = sub_reg->type;
             ioefd->flags = sub_reg->flags;
-            ioefd->datamatch = sub_reg->datamatch;
+            if (sub_reg->type == VFIO_USER_IO_FD_TYPE_IOREGIONFD) {
+                reply->sub_regions[i].ioregionfd.user_data = sub_reg->user_data;
+            } else {
+                ioefd->datamatch = sub_reg->datamatch;
+            }
 
             sub_reg = LIST_NEXT(sub_reg, entry);
         }
@@ -653,11 +733,19 @@ consume_fd(int *fds, size_t nr_fds, size_t index)
    return fd;
 }
 
+/*
+ * Describes a DMA map request in log messages; @flags as sent by the client.
+ */
+#define DMA_MAP_FMT "[%#lx, %#lx) offset=%#lx flags=%#x"
+#define DMA_MAP_ARGS(dma_map, flags) \
+    (dma_map)->addr, (dma_map)->addr + (dma_map)->size, (dma_map)->offset, \
+    (flags)
+
 int
 handle_dma_map(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
                struct vfio_user_dma_map *dma_map)
 {
-    char rstr[1024];
+    uint32_t flags;
     int fd = -1;
     int ret;
     uint32_t prot = 0;
@@ -672,11 +760,10 @@ handle_dma_map(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
         return ERROR_INT(EINVAL);
     }
 
-    snprintf(rstr, sizeof(rstr), "[%#lx, %#lx) offset=%#lx flags=%#x",
-             dma_map->addr, dma_map->addr + dma_map->size, dma_map->offset,
-             dma_map->flags);
+    flags = dma_map->flags;
 
-    vfu_log(vfu_ctx, LOG_DEBUG, "adding DMA region %s", rstr);
+    vfu_log(vfu_ctx, LOG_DEBUG, "adding DMA region " DMA_MAP_FMT,
+            DMA_MAP_ARGS(dma_map, flags));
 
     if (dma_map->flags & VFIO_USER_F_DMA_REGION_READ) {
         prot |= PROT_READ;
@@ -696,17 +783,38 @@ handle_dma_map(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
     if (msg->in.nr_fds > 0) {
         fd = consume_fd(msg->in.fds, msg->in.nr_fds, 0);
         if (fd < 0) {
-            vfu_log(vfu_ctx, LOG_ERR, "failed to add DMA region %s: %m", rstr);
+            vfu_log(vfu_ctx, LOG_ERR, "failed to add DMA region "
+                    DMA_MAP_FMT ": %m", DMA_MAP_ARGS(dma_map, flags));
             return -1;
         }
     }
 
+    if (vfu_ctx->dma->nr_retained > 0) {
+        ret = dma_controller_readopt_region(vfu_ctx->dma,
+                                            (void *)dma_map->addr,
+                                            dma_map->size, fd,
+                                            dma_map->offset, prot,
+                                            vfu_ctx->dma_unregister, vfu_ctx);
+        if (ret >= 0) {
+            /* still mapped and registered from the previous client */
+            vfu_log(vfu_ctx, LOG_DEBUG, "took over retained DMA region "
+                    DMA_MAP_FMT, DMA_MAP_ARGS(dma_map, flags));
+            if (fd != -1) {
+                close(fd);
+            }
+            return 0;
+        }
+    }
+
+    TRACE_BEGIN(TRACE_DMA_MAP, dma_map->addr);
     ret = dma_controller_add_region(vfu_ctx->dma, (void *)dma_map->addr,
                                     dma_map->size, fd, dma_map->offset,
                                     prot);
+    TRACE_END(TRACE_DMA_MAP, dma_map->addr);
     if (ret < 0) {
         ret = errno;
-        vfu_log(vfu_ctx, LOG_ERR, "failed to add DMA region %s: %m", rstr);
+        vfu_log(vfu_ctx, LOG_ERR, "failed to add DMA region " DMA_MAP_FMT
+                ": %m", DMA_MAP_ARGS(dma_map, flags));
         if (fd != -1) {
             close(fd);
         }
@@ -782,7 +890,6 @@ handle_dma_unmap(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
 {
     size_t out_size;
     int ret = 0;
-    char rstr[1024];
 
     assert(vfu_ctx != NULL);
     assert(msg != NULL);
@@ -792,10 +899,9 @@ handle_dma_unmap(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
         return -1;
     }
 
-    snprintf(rstr, sizeof(rstr), "[%#lx, %#lx) flags=%#x",
-             dma_unmap->addr, dma_unmap->addr + dma_unmap->size, dma_unmap->flags);
-
-    vfu_log(vfu_ctx, LOG_DEBUG, "removing DMA region %s", rstr);
+    vfu_log(vfu_ctx, LOG_DEBUG, "removing DMA region [%#lx, %#lx) flags=%#x",
+            dma_unmap->addr, dma_unmap->addr + dma_unmap->size,
+            dma_unmap->flags);
 
     out_size = sizeof(*dma_unmap);
 
@@ -829,15 +935,19 @@ handle_dma_unmap(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
         }
     }
 
+    TRACE_BEGIN(TRACE_DMA_UNMAP, dma_unmap->addr);
     ret = dma_controller_remove_region(vfu_ctx->dma,
                                        (void *)dma_unmap->addr,
                                        dma_unmap->size,
                                        vfu_ctx->dma_unregister,
                                        vfu_ctx);
+    TRACE_END(TRACE_DMA_UNMAP, dma_unmap->addr);
     if (ret < 0) {
         ret = errno;
         vfu_log(vfu_ctx, LOG_WARNING,
-                "failed to remove DMA region %s: %m", rstr);
+                "failed to remove DMA region [%#lx, %#lx) flags=%#x: %m",
+                dma_unmap->addr, dma_unmap->addr + dma_unmap->size,
+                dma_unmap->flags);
         return ERROR_INT(ret);
     }
 
@@ -861,8 +971,7 @@ do_device_reset(vfu_ctx_t *vfu_ctx, vfu_reset_type_t reason)
         }
     }
     if (vfu_ctx->migration != NULL) {
-        return handle_device_state(vfu_ctx, vfu_ctx->migration,
-                                   VFIO_DEVICE_STATE_V1_RUNNING, false);
+        return migration_reset(vfu_ctx, vfu_ctx->migration);
     }
     return 0;
 }
@@ -1099,16 +1208,93 @@ do_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int reply_errno)
     return ret;
 }
 
+/*
+ * Starts handling a request that may call the migration transition callback:
+ * until migr_settle(), vfu_migr_done() only records its result.
+ */
+static void
+migr_window_open(vfu_ctx_t *vfu_ctx)
+{
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    vfu_ctx->in_migr_request = true;
+    vfu_ctx->migr_done = false;
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+}
+
+/*
+ * Finishes handling @msg, with result *@ret, after migr_window_open(). If the
+ * device deferred a transition and vfu_migr_done() was called meanwhile, the
+ * transition is completed here as if it had been synchronous, updating *@ret.
+ * If it is still deferred, @msg is handed over to vfu_migr_done(), which may
+ * run on another thread as soon as the lock is dropped, and true is returned:
+ * the caller must not touch @msg again.
+ */
+static bool
+migr_settle(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int *ret)
+{
+    int err = errno;
+
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    while (vfu_ctx->pending.state == VFU_CTX_PENDING_MIGR) {
+        uint32_t device_state = vfu_ctx->pending.migr_dev_state;
+        int reply_errno = vfu_ctx->migr_errno;
+
+        if (!vfu_ctx->migr_done) {
+            vfu_ctx->pending.msg = msg;
+            vfu_ctx->in_migr_request = false;
+            pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+            return true;
+        }
+        vfu_ctx->migr_done = false;
+        vfu_ctx->pending.state = VFU_CTX_PENDING_NONE;
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+        TRACE_ASYNC_END(TRACE_MIGR_WAIT, vfu_ctx);
+        vfu_log(vfu_ctx, LOG_DEBUG, "migration: device transitioned with "
+                "error=%d", reply_errno);
+        *ret = migration_transition_done(vfu_ctx, msg, device_state,
+                                         reply_errno);
+        err = errno;
+
+        pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    }
+    vfu_ctx->in_migr_request = false;
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+    errno = err;
+    return false;
+}
+
+/*
+ * Handles @msg and replies to it, unless the device deferred a migration
+ * transition, in which case *@deferred is set and @msg now belongs to
+ * vfu_migr_done().
+ */
 static int
-handle_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+handle_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, bool *deferred)
 {
+    bool migr = vfu_ctx->migration != NULL;
+    uint16_t cmd = msg->hdr.cmd;
     int ret = 0;
 
     assert(vfu_ctx != NULL);
     assert(msg != NULL);
 
+    *deferred = false;
+
+    TRACE_BEGIN(TRACE_HANDLE_REQUEST, cmd);
+
+    if (migr) {
+        migr_window_open(vfu_ctx);
+    }
+
     msg->processed_cmd = true;
 
+    if (unlikely(vfu_ctx->dma != NULL && vfu_ctx->dma->nr_retained > 0)) {
+        dma_controller_expire_regions(vfu_ctx->dma, vfu_ctx->dma_unregister,
+                                      vfu_ctx, false);
+    }
+
     switch (msg->hdr.cmd) {
     case VFIO_USER_DMA_MAP:
         if (vfu_ctx->dma != NULL) {
@@ -1161,19 +1347,53 @@ handle_request(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         }
         break;
 
+    case VFIO_USER_SHM_SETUP:
+        if (vfu_ctx->tran->setup_shm != NULL) {
+            ret = vfu_ctx->tran->setup_shm(vfu_ctx, msg);
+        } else {
+            ret = ERROR_INT(ENOTSUP);
+        }
+        break;
+
+    case VFIO_USER_DEVICE_FEATURE:
+        ret = handle_device_feature(vfu_ctx, msg);
+        break;
+
+    case VFIO_USER_MIG_DATA_READ:
+    case VFIO_USER_MIG_DATA_WRITE:
+        ret = handle_mig_data(vfu_ctx, msg, msg->in.nr_fds > 0 ?
+                              consume_fd(msg->in.fds, msg->in.nr_fds, 0) : -1);
+        break;
+
+    case VFIO_USER_MIG_STREAMS:
+        ret = handle_mig_streams(vfu_ctx, msg);
+        break;
+
     default:
         msg->processed_cmd = false;
-        vfu_log(vfu_ctx, LOG_ERR, "bad command %d", msg->hdr.cmd);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR, "bad command %d", msg->hdr.cmd);
         ret = ERROR_INT(EINVAL);
         break;
     }
 
+    if (migr && migr_settle(vfu_ctx, msg, &ret)) {
+        /*
+         * NB the message is replied to and freed in vfu_migr_done(); it may
+         * already be pending if the device quiesced asynchronously.
+         */
+        *deferred = true;
+        TRACE_END(TRACE_HANDLE_REQUEST, cmd);
+        return ERROR_INT(EBUSY);
+    }
+
     if (ret < 0) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: cmd %d failed: %m",
-                msg->hdr.msg_id, msg->hdr.cmd);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR, "msg%#hx: cmd %d failed: %m",
+                            msg->hdr.msg_id, msg->hdr.cmd);
     }
 
-    return do_reply(vfu_ctx, msg, ret == 0 ? 0 : errno);
+    ret = do_reply(vfu_ctx, msg, ret == 0 ? 0 : errno);
+    TRACE_END(TRACE_HANDLE_REQUEST, msg->hdr.cmd);
+    return ret;
 }
 
 /*
@@ -1231,19 +1451,19 @@ static bool
 is_valid_header(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
 {
     if (msg->hdr.flags.type != VFIO_USER_F_TYPE_COMMAND) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: not a command req",
-                msg->hdr.msg_id);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR, "msg%#hx: not a command req",
+                            msg->hdr.msg_id);
         return false;
     }
 
     if (msg->hdr.msg_size < sizeof(msg->hdr)) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: bad size %u in header",
-                msg->hdr.msg_id, msg->hdr.msg_size);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR, "msg%#hx: bad size %u in header",
+                            msg->hdr.msg_id, msg->hdr.msg_size);
         return false;
     } else if (msg->hdr.msg_size == sizeof(msg->hdr) &&
                msg->hdr.cmd != VFIO_USER_DEVICE_RESET) {
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: no payload for cmd%u",
-                msg->hdr.msg_id, msg->hdr.cmd);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR, "msg%#hx: no payload for cmd%u",
+                            msg->hdr.msg_id, msg->hdr.cmd);
         return false;
     } else if (msg->hdr.msg_size > SERVER_MAX_MSG_SIZE) {
         /*
@@ -1251,8 +1471,9 @@ is_valid_header(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
          * amount of space, including VFIO_USER_REGION_WRITE, which should be
          * bound by max_data_xfer_size.
          */
-        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: size of %u is too large",
-                msg->hdr.msg_id, msg->hdr.msg_size);
+        vfu_log_ratelimited(vfu_ctx, LOG_ERR,
+                            "msg%#hx: size of %u is too large",
+                            msg->hdr.msg_id, msg->hdr.msg_size);
         return false;
     }
 
@@ -1264,7 +1485,11 @@ MOCK_DEFINE(cmd_allowed_when_stopped_and_copying)(uint16_t cmd)
 {
     return cmd == VFIO_USER_REGION_READ ||
            cmd == VFIO_USER_REGION_WRITE ||
-           cmd == VFIO_USER_DIRTY_PAGES;
+           cmd == VFIO_USER_DIRTY_PAGES ||
+           cmd == VFIO_USER_DEVICE_FEATURE ||
+           cmd == VFIO_USER_MIG_DATA_READ ||
+           cmd == VFIO_USER_MIG_DATA_WRITE ||
+           cmd == VFIO_USER_MIG_STREAMS;
 }
 
 bool
@@ -1311,6 +1536,9 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
     case VFIO_USER_DEVICE_RESET:
         return true;
 
+    case VFIO_USER_DEVICE_FEATURE:
+        return feature_needs_quiesce(vfu_ctx, msg);
+
     case VFIO_USER_DIRTY_PAGES: {
         struct vfio_user_dirty_pages *dirty_pages = msg->in.iov.iov_base;
 
@@ -1340,6 +1568,53 @@ command_needs_quiesce(vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
     return false;
 }
 
+/*
+ * Calls the quiesce callback. If it returns EBUSY, the device quiesces
+ * asynchronously: @pending and @msg are recorded, and *@deferred set, before
+ * vfu_device_quiesced() can act on them. The device may already have called
+ * vfu_device_quiesced() from another thread while the callback was running, in
+ * which case nothing is deferred and its result is returned as if the callback
+ * had completed synchronously. Returns 0 or -1 with errno set.
+ */
+static int
+call_quiesce_cb(vfu_ctx_t *vfu_ctx, enum vfu_ctx_pending_state pending,
+                vfu_msg_t *msg, bool *deferred)
+{
+    int ret;
+    int err;
+
+    *deferred = false;
+
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    vfu_ctx->in_quiesce_cb = true;
+    vfu_ctx->quiesce_done = false;
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+    vfu_ctx->in_cb = CB_QUIESCE;
+    TRACE_BEGIN(TRACE_QUIESCE, 0);
+    ret = vfu_ctx->quiesce(vfu_ctx);
+    err = errno;
+    TRACE_END(TRACE_QUIESCE, 0);
+    vfu_ctx->in_cb = CB_NONE;
+
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    vfu_ctx->in_quiesce_cb = false;
+    if (ret < 0 && err == EBUSY) {
+        if (vfu_ctx->quiesce_done) {
+            err = vfu_ctx->quiesce_errno;
+            ret = err == 0 ? 0 : -1;
+        } else {
+            vfu_ctx->pending.state = pending;
+            vfu_ctx->pending.msg = msg;
+            *deferred = true;
+            TRACE_ASYNC_BEGIN(TRACE_QUIESCE_WAIT, vfu_ctx);
+        }
+    }
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+    return ret < 0 ? ERROR_INT(err) : 0;
+}
+
 /*
  * Acquire a request from the vfio-user socket. Returns 0 on success, or -1 with
  * errno set as follows:
@@ -1352,6 +1627,7 @@ static int
 get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
 {
     vfu_msg_t *msg = NULL;
+    uint16_t cmd;
     int ret;
 
     assert(vfu_ctx != NULL);
@@ -1364,6 +1640,9 @@ get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
         return ret;
     }
 
+    cmd = msg->hdr.cmd;
+    TRACE_BEGIN(TRACE_GET_REQUEST, cmd);
+
     if (!is_valid_header(vfu_ctx, msg)) {
         ret = ERROR_INT(EINVAL);
         goto err;
@@ -1385,21 +1664,19 @@ get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
     }
 
     if (command_needs_quiesce(vfu_ctx, msg)) {
-        vfu_log(vfu_ctx, LOG_DEBUG, "quiescing device");
-        vfu_ctx->in_cb = CB_QUIESCE;
-        ret = vfu_ctx->quiesce(vfu_ctx);
-        vfu_ctx->in_cb = CB_NONE;
-        if (ret < 0) {
-            if (errno != EBUSY) {
-                vfu_log(vfu_ctx, LOG_DEBUG, "device failed to quiesce: %m");
-                goto err;
-            }
+        bool deferred;
 
-            vfu_log(vfu_ctx, LOG_DEBUG, "device will quiesce asynchronously");
-            vfu_ctx->pending.state = VFU_CTX_PENDING_MSG;
-            vfu_ctx->pending.msg = msg;
+        vfu_log(vfu_ctx, LOG_DEBUG, "quiescing device");
+        ret = call_quiesce_cb(vfu_ctx, VFU_CTX_PENDING_MSG, msg, &deferred);
+        if (deferred) {
             /* NB the message is freed in vfu_device_quiesced */
-            return ret;
+            vfu_log(vfu_ctx, LOG_DEBUG, "device will quiesce asynchronously");
+            TRACE_END(TRACE_GET_REQUEST, cmd);
+            return ERROR_INT(EBUSY);
+        }
+        if (ret < 0) {
+            vfu_log(vfu_ctx, LOG_DEBUG, "device failed to quiesce: %m");
+            goto err;
         }
 
         vfu_log(vfu_ctx, LOG_DEBUG, "device quiesced immediately");
@@ -1407,11 +1684,13 @@ get_request(vfu_ctx_t *vfu_ctx, vfu_msg_t **msgp)
     }
 
     *msgp = msg;
+    TRACE_END(TRACE_GET_REQUEST, cmd);
     return 0;
 
 err:
     ret = do_reply(vfu_ctx, msg, ret == 0 ? 0 : errno);
     free_msg(vfu_ctx, msg);
+    TRACE_END(TRACE_GET_REQUEST, cmd);
     if (ret != 0) {
         return ret;
     }
@@ -1423,7 +1702,7 @@ err:
 EXPORT int
 vfu_run_vsock(vfu_ctx_t *vfu_ctx, disagg_pci_dev_info *disagg_pci_info)
 {
-    if (pthread_create(&(vfu_ctx->vsock_thread_id), NULL, run_vsock_app, (void *) disagg_pci_info)) {
+    if (thread_create(vfu_ctx, &(vfu_ctx->vsock_thread_id), "vsock", run_vsock_app, (void *) disagg_pci_info)) {
         fprintf(stderr, "Error creating vsock thread\n");
         return 1;
     }
@@ -1434,7 +1713,7 @@ vfu_run_vsock(vfu_ctx_t *vfu_ctx, disagg_pci_dev_info *disagg_pci_info)
 EXPORT int
 vfu_run_shmem(vfu_ctx_t *vfu_ctx, disagg_pci_dev_info *disagg_pci_info)
 {
-    if (pthread_create(&(vfu_ctx->vsock_thread_id), NULL, run_shmem_app, (void *) disagg_pci_info)) {
+    if (thread_create(vfu_ctx, &(vfu_ctx->vsock_thread_id), "shmem", run_shmem_app, (void *) disagg_pci_info)) {
         fprintf(stderr, "Error creating vsock thread\n");
         return 1;
     }
@@ -1448,6 +1727,61 @@ char *get_vfu_ctx_uuid(vfu_ctx_t * vfu_ctx)
     return vfu_ctx->uuid;
 }
 
+/* Upper bound on the pause iterations between two readiness checks. */
+#define BUSY_POLL_MAX_BACKOFF 1024
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * Spin until the transport reports a pending request or the busy-poll period
+ * expires, in which case the caller simply blocks in get_request().
+ */
+static void
+busy_poll_wait(vfu_ctx_t *vfu_ctx)
+{
+    uint64_t deadline = now_ns() + vfu_ctx->busy_poll_ns;
+    unsigned int backoff = 1;
+    unsigned int i;
+
+    while (vfu_ctx->tran->poll_ready(vfu_ctx) == 0) {
+        if (now_ns() >= deadline) {
+            return;
+        }
+
+        for (i = 0; i < backoff; i++) {
+            cpu_relax();
+        }
+        backoff = MIN(backoff * 2, BUSY_POLL_MAX_BACKOFF);
+    }
+}
+
+EXPORT int
+vfu_setup_busy_poll(vfu_ctx_t *vfu_ctx, uint32_t idle_us)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (idle_us != 0 && vfu_ctx->tran->poll_ready == NULL) {
+        return ERROR_INT(ENOTSUP);
+    }
+
+    vfu_ctx->busy_poll_ns = idle_us * 1000ULL;
+    return 0;
+}
+
 EXPORT int
 vfu_run_ctx(vfu_ctx_t *vfu_ctx)
 {
@@ -1466,17 +1800,26 @@ vfu_run_ctx(vfu_ctx_t *vfu_ctx)
 
     do {
         vfu_msg_t *msg;
+        bool deferred;
 
         if (vfu_ctx->pending.state != VFU_CTX_PENDING_NONE) {
             return ERROR_INT(EBUSY);
         }
 
+        if (blocking && vfu_ctx->busy_poll_ns != 0) {
+            busy_poll_wait(vfu_ctx);
+        }
+
         err = get_request(vfu_ctx, &msg);
 
         if (err == 0) {
-            err = handle_request(vfu_ctx, msg);
-            free_msg(vfu_ctx, msg);
+            err = handle_request(vfu_ctx, msg, &deferred);
             reqs_processed++;
+            if (deferred) {
+                /* the device is transitioning asynchronously */
+                break;
+            }
+            free_msg(vfu_ctx, msg);
             /*
              * get_request might call the quiesce callback which might
              * immediately quiesce the device, vfu_device_quiesced won't
@@ -1596,9 +1939,31 @@ free_sparse_mmap_areas(vfu_ctx_t *vfu_ctx)
 static void
 vfu_reset_ctx_quiesced(vfu_ctx_t *vfu_ctx)
 {
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    if (vfu_ctx->pending.state == VFU_CTX_PENDING_MIGR) {
+        vfu_msg_t *msg = vfu_ctx->pending.msg;
+
+        vfu_ctx->pending.msg = NULL;
+        vfu_ctx->pending.state = VFU_CTX_PENDING_NONE;
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+        /* the client is gone, there is no-one to reply to */
+        free_msg(vfu_ctx, msg);
+    } else {
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+    }
+
     if (vfu_ctx->dma != NULL) {
-        dma_controller_remove_all_regions(vfu_ctx->dma, vfu_ctx->dma_unregister,
-                                          vfu_ctx);
+        if (vfu_ctx->dma->retain_ns != 0) {
+            /* regions not taken over since the last disconnect are stale */
+            dma_controller_expire_regions(vfu_ctx->dma,
+                                          vfu_ctx->dma_unregister, vfu_ctx,
+                                          true);
+            dma_controller_retain_all_regions(vfu_ctx->dma);
+        } else {
+            dma_controller_remove_all_regions(vfu_ctx->dma,
+                                              vfu_ctx->dma_unregister,
+                                              vfu_ctx);
+        }
     }
 
     /* FIXME what happens if the device reset callback fails? */
@@ -1620,14 +1985,13 @@ vfu_reset_ctx(vfu_ctx_t *vfu_ctx, int reason)
 
     if (vfu_ctx->quiesce != NULL
         && vfu_ctx->pending.state == VFU_CTX_PENDING_NONE) {
-        vfu_ctx->in_cb = CB_QUIESCE;
-        int ret = vfu_ctx->quiesce(vfu_ctx);
-        vfu_ctx->in_cb = CB_NONE;
+        bool deferred;
+        int ret = call_quiesce_cb(vfu_ctx, VFU_CTX_PENDING_CTX_RESET, NULL,
+                                  &deferred);
+        if (deferred) {
+            return ERROR_INT(EBUSY);
+        }
         if (ret < 0) {
-            if (errno == EBUSY) {
-                vfu_ctx->pending.state = VFU_CTX_PENDING_CTX_RESET;
-                return ret;
-            }
             vfu_log(vfu_ctx, LOG_ERR, "failed to quiesce device: %m");
             return ret;
         }
@@ -1643,13 +2007,24 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
         return;
     }
 
+    loop_ctx_destroy(vfu_ctx);
+    ioregionfd_destroy(vfu_ctx);
+
     vfu_ctx->quiesce = NULL;
-    if (vfu_reset_ctx(vfu_ctx, ESHUTDOWN) < 0) {
+    if (vfu_ctx->dma != NULL) {
+        /* there's no next client to keep the DMA regions for */
+        vfu_ctx->dma->retain_ns = 0;
+    }
+    /* after a handover the device carries on in the successor */
+    if (!vfu_ctx->handed_over && vfu_reset_ctx(vfu_ctx, ESHUTDOWN) < 0) {
         vfu_log(vfu_ctx, LOG_WARNING, "failed to reset context: %m");
     }
 
     free(vfu_ctx->uuid);
     free(vfu_ctx->pci.config_space);
+    free(vfu_ctx->pci.caps);
+    free(vfu_ctx->pci.ext_caps);
+    free(vfu_ctx->thread_attr);
 
     if (vfu_ctx->tran->fini != NULL) {
         vfu_ctx->tran->fini(vfu_ctx);
@@ -1660,8 +2035,11 @@ vfu_destroy_ctx(vfu_ctx_t *vfu_ctx)
     }
     free_sparse_mmap_areas(vfu_ctx);
     free_regions(vfu_ctx);
-    free(vfu_ctx->migration);
+    free_migration(vfu_ctx->migration);
+    msix_free(vfu_ctx);
     free(vfu_ctx->irqs);
+    log_async_stop(vfu_ctx);
+    pthread_mutex_destroy(&vfu_ctx->quiesce_lock);
     free(vfu_ctx);
 }
 
@@ -1673,6 +2051,57 @@ vfu_get_private(vfu_ctx_t *vfu_ctx)
     return vfu_ctx->pvt;
 }
 
+EXPORT size_t
+vfu_ctx_memory_usage(vfu_ctx_t *vfu_ctx)
+{
+    size_t size = sizeof(*vfu_ctx);
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->uuid != NULL) {
+        size += strlen(vfu_ctx->uuid) + 1;
+    }
+    if (vfu_ctx->pci.config_space != NULL) {
+        size += pci_config_space_size(vfu_ctx);
+    }
+    size += (vfu_ctx->pci.nr_caps + vfu_ctx->pci.nr_ext_caps) *
+            sizeof(struct pci_cap);
+
+    size += vfu_ctx->nr_regions * sizeof(*vfu_ctx->reg_info);
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_reg_info_t *reg = &vfu_ctx->reg_info[i];
+        ioeventfd_t *sub_reg;
+
+        size += reg->nr_mmap_areas * sizeof(*reg->mmap_areas);
+        LIST_FOREACH(sub_reg, &reg->subregions, entry) {
+            size += sizeof(*sub_reg);
+        }
+        size += regs_memory_usage(reg->regs);
+        size += shadow_memory_usage(reg->shadow);
+    }
+
+    if (vfu_ctx->thread_attr != NULL) {
+        size += sizeof(*vfu_ctx->thread_attr);
+    }
+    size += log_memory_usage(vfu_ctx);
+
+    if (vfu_ctx->irqs != NULL) {
+        size += sizeof(*vfu_ctx->irqs) +
+                vfu_ctx->irqs->max_ivs * sizeof(vfu_ctx->irqs->efds[0]);
+    }
+    size += msix_memory_usage(vfu_ctx);
+
+    if (vfu_ctx->dma != NULL) {
+        size += dma_controller_memory_usage(vfu_ctx->dma);
+    }
+    if (vfu_ctx->migration != NULL) {
+        size += migration_memory_usage(vfu_ctx->migration);
+    }
+
+    return size;
+}
+
 EXPORT vfu_ctx_t *
 vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
                vfu_dev_type_t dev_type)
@@ -1686,11 +2115,12 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
     }
 
 #ifdef WITH_TRAN_PIPE
-    if (trans != VFU_TRANS_SOCK && trans != VFU_TRANS_PIPE) {
+    if (trans != VFU_TRANS_SOCK && trans != VFU_TRANS_PIPE &&
+        trans != VFU_TRANS_SHM) {
         return ERROR_PTR(ENOTSUP);
     }
 #else
-    if (trans != VFU_TRANS_SOCK) {
+    if (trans != VFU_TRANS_SOCK && trans != VFU_TRANS_SHM) {
         return ERROR_PTR(ENOTSUP);
     }
 #endif
@@ -1703,10 +2133,13 @@ vfu_create_ctx(vfu_trans_t trans, const char *path, int flags, void *pvt,
     if (vfu_ctx == NULL) {
         return NULL;
     }
+    pthread_mutex_init(&vfu_ctx->quiesce_lock, NULL);
 
     vfu_ctx->dev_type = dev_type;
     if (trans == VFU_TRANS_SOCK) {
         vfu_ctx->tran = &tran_sock_ops;
+    } else if (trans == VFU_TRANS_SHM) {
+        vfu_ctx->tran = &tran_shm_ops;
     } else {
 #ifdef WITH_TRAN_PIPE
         vfu_ctx->tran = &tran_pipe_ops;
@@ -1763,55 +2196,268 @@ err_out:
     return ERROR_PTR(err);
 }
 
-EXPORT int
-vfu_attach_ctx(vfu_ctx_t *vfu_ctx)
+static int
+clone_caps(struct pci_cap **caps, const struct pci_cap *template, size_t nr)
 {
+    if (nr == 0) {
+        return 0;
+    }
 
-    assert(vfu_ctx != NULL);
+    *caps = malloc(nr * sizeof(**caps));
+    if (*caps == NULL) {
+        return -1;
+    }
 
-    return vfu_ctx->tran->attach(vfu_ctx);
+    memcpy(*caps, template, nr * sizeof(**caps));
+    return 0;
 }
 
-EXPORT int
-vfu_get_poll_fd(vfu_ctx_t *vfu_ctx)
+static int
+clone_regions(vfu_ctx_t *vfu_ctx, const vfu_ctx_t *template)
 {
+    size_t i;
 
-    assert(vfu_ctx != NULL);
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_reg_info_t *reg = &vfu_ctx->reg_info[i];
+        const vfu_reg_info_t *src = &template->reg_info[i];
 
-    return vfu_ctx->tran->get_poll_fd(vfu_ctx);
+        reg->flags = src->flags;
+        reg->size = src->size;
+        reg->cb = src->cb;
+        reg->fd = src->fd;
+        reg->offset = src->offset;
+
+        if (copyin_mmap_areas(reg, src->mmap_areas, src->nr_mmap_areas) < 0 ||
+            regs_clone(reg, src) < 0 || shadow_clone(reg, src) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
-EXPORT int
-vfu_setup_log(vfu_ctx_t *vfu_ctx, vfu_log_fn_t *log, int log_level)
+static int
+clone_dma(vfu_ctx_t *vfu_ctx, const vfu_ctx_t *template)
 {
-    if (log_level < LOG_EMERG || log_level > LOG_DEBUG) {
-        return ERROR_INT(EINVAL);
+    if (template->dma == NULL) {
+        return 0;
     }
 
-    vfu_ctx->log = log;
-    vfu_ctx->log_level = log_level;
+    vfu_ctx->dma = dma_controller_create(vfu_ctx, template->dma->max_regions,
+                                         template->dma->max_size);
+    if (vfu_ctx->dma == NULL) {
+        return -1;
+    }
+    vfu_ctx->dma->retain_ns = template->dma->retain_ns;
 
+    if (template->dma->wp != NULL) {
+        return vfu_setup_dirty_tracking(vfu_ctx, VFU_DIRTY_TRACKING_WP);
+    }
     return 0;
 }
 
 static int
-copyin_mmap_areas(vfu_reg_info_t *reg_info,
-                  struct iovec *mmap_areas, uint32_t nr_mmap_areas)
+clone_irqs(vfu_ctx_t *vfu_ctx, const vfu_ctx_t *template)
 {
-    size_t size = nr_mmap_areas * sizeof(*mmap_areas);
+    uint32_t i;
 
-    if (mmap_areas == NULL || nr_mmap_areas ==  0) {
+    memcpy(vfu_ctx->irq_count, template->irq_count,
+           sizeof(vfu_ctx->irq_count));
+    memcpy(vfu_ctx->irq_state_cbs, template->irq_state_cbs,
+           sizeof(vfu_ctx->irq_state_cbs));
+
+    if (template->irqs == NULL) {
         return 0;
     }
 
-    reg_info->mmap_areas = malloc(size);
-
-    if (reg_info->mmap_areas == NULL) {
+    vfu_ctx->irqs = malloc(sizeof(vfu_irqs_t) +
+                           sizeof(int) * template->irqs->max_ivs);
+    if (vfu_ctx->irqs == NULL) {
         return -1;
     }
 
-    memcpy(reg_info->mmap_areas, mmap_areas, size);
-    reg_info->nr_mmap_areas = nr_mmap_areas;
+    for (i = 0; i < template->irqs->max_ivs; i++) {
+        vfu_ctx->irqs->efds[i] = -1;
+    }
+    vfu_ctx->irqs->err_efd = -1;
+    vfu_ctx->irqs->req_efd = -1;
+    vfu_ctx->irqs->max_ivs = template->irqs->max_ivs;
+
+    return 0;
+}
+
+EXPORT vfu_ctx_t *
+vfu_clone_ctx(vfu_ctx_t *template, const char *path, void *pvt)
+{
+    vfu_ctx_t *vfu_ctx = NULL;
+    int err = 0;
+    size_t i;
+
+    assert(template != NULL);
+
+    if (path == NULL) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    if (template->in_cb != CB_NONE ||
+        template->pending.state != VFU_CTX_PENDING_NONE ||
+        (template->dma != NULL && template->dma->nregions != 0)) {
+        return ERROR_PTR(EBUSY);
+    }
+
+    vfu_ctx = calloc(1, sizeof(vfu_ctx_t));
+    if (vfu_ctx == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&vfu_ctx->quiesce_lock, NULL);
+
+    vfu_ctx->dev_type = template->dev_type;
+    vfu_ctx->tran = template->tran;
+    vfu_ctx->pvt = pvt;
+    vfu_ctx->flags = template->flags;
+    vfu_ctx->log = template->log;
+    vfu_ctx->log_level = template->log_level;
+    vfu_ctx->pci_cap_exp_off = template->pci_cap_exp_off;
+    vfu_ctx->busy_poll_ns = template->busy_poll_ns;
+
+    /* the config space and capability tables are copied below */
+    vfu_ctx->pci.type = template->pci.type;
+
+    vfu_ctx->uuid = strdup(path);
+    if (vfu_ctx->uuid == NULL) {
+        goto err_out;
+    }
+
+    vfu_ctx->nr_regions = template->nr_regions;
+    vfu_ctx->reg_info = calloc(vfu_ctx->nr_regions, sizeof(*vfu_ctx->reg_info));
+    if (vfu_ctx->reg_info == NULL) {
+        goto err_out;
+    }
+
+    for (i = 0; i < vfu_ctx->nr_regions; i++) {
+        vfu_ctx->reg_info[i].fd = -1;
+        LIST_INIT(&vfu_ctx->reg_info[i].subregions);
+    }
+
+    if (clone_regions(vfu_ctx, template) < 0) {
+        goto err_out;
+    }
+
+    if (template->pci.config_space != NULL) {
+        vfu_ctx->pci.config_space = malloc(pci_config_space_size(template));
+        if (vfu_ctx->pci.config_space == NULL) {
+            goto err_out;
+        }
+        memcpy(vfu_ctx->pci.config_space, template->pci.config_space,
+               pci_config_space_size(template));
+    }
+
+    if (clone_caps(&vfu_ctx->pci.caps, template->pci.caps,
+                   template->pci.nr_caps) < 0 ||
+        clone_caps(&vfu_ctx->pci.ext_caps, template->pci.ext_caps,
+                   template->pci.nr_ext_caps) < 0) {
+        goto err_out;
+    }
+    vfu_ctx->pci.nr_caps = template->pci.nr_caps;
+    vfu_ctx->pci.nr_ext_caps = template->pci.nr_ext_caps;
+
+    if (template->thread_attr != NULL) {
+        vfu_ctx->thread_attr = malloc(sizeof(*vfu_ctx->thread_attr));
+        if (vfu_ctx->thread_attr == NULL) {
+            goto err_out;
+        }
+        memcpy(vfu_ctx->thread_attr, template->thread_attr,
+               sizeof(*vfu_ctx->thread_attr));
+    }
+
+    if (clone_dma(vfu_ctx, template) < 0 || clone_irqs(vfu_ctx, template) < 0 ||
+        msix_clone(vfu_ctx, template) < 0) {
+        goto err_out;
+    }
+
+    if (template->migration != NULL) {
+        vfu_ctx->migration = migration_clone(template->migration,
+                           &vfu_ctx->reg_info[VFU_PCI_DEV_MIGR_REGION_IDX],
+                           &err);
+        if (vfu_ctx->migration == NULL) {
+            errno = err;
+            goto err_out;
+        }
+    }
+
+    if (vfu_ctx->tran->init != NULL) {
+        err = vfu_ctx->tran->init(vfu_ctx);
+        if (err < 0) {
+            goto err_out;
+        }
+    }
+
+    /* only now, so that a failed clone is destroyed without callbacks */
+    vfu_ctx->quiesce = template->quiesce;
+    vfu_ctx->reset = template->reset;
+    vfu_ctx->dma_register = template->dma_register;
+    vfu_ctx->dma_unregister = template->dma_unregister;
+    vfu_ctx->realized = template->realized;
+
+    return vfu_ctx;
+
+err_out:
+    err = errno;
+
+    vfu_destroy_ctx(vfu_ctx);
+
+    return ERROR_PTR(err);
+}
+
+EXPORT int
+vfu_attach_ctx(vfu_ctx_t *vfu_ctx)
+{
+
+    assert(vfu_ctx != NULL);
+
+    return vfu_ctx->tran->attach(vfu_ctx);
+}
+
+EXPORT int
+vfu_get_poll_fd(vfu_ctx_t *vfu_ctx)
+{
+
+    assert(vfu_ctx != NULL);
+
+    return vfu_ctx->tran->get_poll_fd(vfu_ctx);
+}
+
+EXPORT int
+vfu_setup_log(vfu_ctx_t *vfu_ctx, vfu_log_fn_t *log, int log_level)
+{
+    if (log_level < LOG_EMERG || log_level > LOG_DEBUG) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->log = log;
+    vfu_ctx->log_level = log_level;
+
+    return 0;
+}
+
+static int
+copyin_mmap_areas(vfu_reg_info_t *reg_info,
+                  struct iovec *mmap_areas, uint32_t nr_mmap_areas)
+{
+    size_t size = nr_mmap_areas * sizeof(*mmap_areas);
+
+    if (mmap_areas == NULL || nr_mmap_areas ==  0) {
+        return 0;
+    }
+
+    reg_info->mmap_areas = malloc(size);
+
+    if (reg_info->mmap_areas == NULL) {
+        return -1;
+    }
+
+    memcpy(reg_info->mmap_areas, mmap_areas, size);
+    reg_info->nr_mmap_areas = nr_mmap_areas;
 
     return 0;
 }
@@ -1979,6 +2625,56 @@ vfu_setup_device_dma(vfu_ctx_t *vfu_ctx, vfu_dma_register_cb_t *dma_register,
     return 0;
 }
 
+EXPORT int
+vfu_setup_dma_reconnect(vfu_ctx_t *vfu_ctx, uint32_t grace_ms)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->dma == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "DMA not set up");
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->dma->retain_ns = grace_ms * 1000000ULL;
+    return 0;
+}
+
+EXPORT int
+vfu_setup_dirty_tracking(vfu_ctx_t *vfu_ctx, vfu_dirty_tracking_t mode)
+{
+    dma_controller_t *dma;
+
+    assert(vfu_ctx != NULL);
+
+    dma = vfu_ctx->dma;
+
+    if (dma == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "DMA not set up");
+        return ERROR_INT(EINVAL);
+    }
+
+    if (dma->dirty_pgsize != 0) {
+        return ERROR_INT(EBUSY);
+    }
+
+    switch (mode) {
+    case VFU_DIRTY_TRACKING_MANUAL:
+        dma_wp_destroy(dma->wp);
+        dma->wp = NULL;
+        return 0;
+    case VFU_DIRTY_TRACKING_WP:
+        if (dma->wp == NULL) {
+            dma->wp = dma_wp_create(dma);
+            if (dma->wp == NULL) {
+                return -1;
+            }
+        }
+        return 0;
+    default:
+        return ERROR_INT(EINVAL);
+    }
+}
+
 EXPORT int
 vfu_setup_device_nr_irqs(vfu_ctx_t *vfu_ctx, enum vfu_dev_irq_type type,
                          uint32_t count)
@@ -2017,6 +2713,7 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
                                      const vfu_migration_callbacks_t *callbacks,
                                      uint64_t data_offset)
 {
+    vfu_reg_info_t *reg;
     int ret = 0;
 
     assert(vfu_ctx != NULL);
@@ -2027,13 +2724,48 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
         return ERROR_INT(EINVAL);
     }
 
+    if (vfu_ctx->migration != NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "device migration already set up");
+        return ERROR_INT(EEXIST);
+    }
+
     if (callbacks->version != VFU_MIGR_CALLBACKS_VERS) {
         vfu_log(vfu_ctx, LOG_ERR, "unsupported migration callbacks version %d",
                 callbacks->version);
         return ERROR_INT(EINVAL);
     }
 
-    vfu_ctx->migration = init_migration(callbacks, data_offset, &ret);
+    reg = &vfu_ctx->reg_info[VFU_PCI_DEV_MIGR_REGION_IDX];
+    vfu_ctx->migration = init_migration(callbacks, data_offset, reg, &ret);
+    if (vfu_ctx->migration == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to initialize device migration");
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_setup_device_migration_v2(vfu_ctx_t *vfu_ctx, uint64_t flags,
+                              const vfu_migration_v2_callbacks_t *callbacks)
+{
+    int ret = 0;
+
+    assert(vfu_ctx != NULL);
+    assert(callbacks != NULL);
+
+    if (vfu_ctx->migration != NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "device migration already set up");
+        return ERROR_INT(EEXIST);
+    }
+
+    if (callbacks->version != VFU_MIGR_V2_CALLBACKS_VERS) {
+        vfu_log(vfu_ctx, LOG_ERR, "unsupported migration callbacks version %d",
+                callbacks->version);
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_ctx->migration = init_migration_v2(flags, callbacks, &ret);
     if (vfu_ctx->migration == NULL) {
         vfu_log(vfu_ctx, LOG_ERR, "failed to initialize device migration");
         return ERROR_INT(ret);
@@ -2042,12 +2774,89 @@ vfu_setup_device_migration_callbacks(vfu_ctx_t *vfu_ctx,
     return 0;
 }
 
+EXPORT int
+vfu_setup_migration_encoding(vfu_ctx_t *vfu_ctx, uint32_t flags)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->migration == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "device migration not set up");
+        return ERROR_INT(EINVAL);
+    }
+
+    if (migration_set_encoding(vfu_ctx->migration, flags) < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to set up migration encoding: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_setup_migration_streams(vfu_ctx_t *vfu_ctx, uint32_t nr_streams,
+                            vfu_migr_stream_read_cb_t *read_cb,
+                            vfu_migr_stream_write_cb_t *write_cb)
+{
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->migration == NULL) {
+        vfu_log(vfu_ctx, LOG_ERR, "device migration not set up");
+        return ERROR_INT(EINVAL);
+    }
+
+    return migration_set_streams(vfu_ctx->migration, nr_streams, read_cb,
+                                 write_cb);
+}
+
+EXPORT int
+vfu_migr_get_stats(vfu_ctx_t *vfu_ctx, vfu_migr_stats_t *stats)
+{
+    assert(vfu_ctx != NULL);
+
+    if (stats == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    if (vfu_ctx->dma != NULL && vfu_ctx->dma->dirty_pgsize != 0) {
+        stats->dirty_pages = vfu_ctx->dma->dirty_stats.dirty_pages;
+        stats->dirty_rate = dma_controller_dirty_rate(vfu_ctx->dma);
+    }
+
+    if (vfu_ctx->migration != NULL) {
+        migration_get_stats(vfu_ctx->migration, stats);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_dma_get_dirty_pages(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr,
+                        uint64_t *dirty_pages)
+{
+    dma_sg_t sg;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->dma == NULL || dirty_pages == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (dma_addr_to_sgl(vfu_ctx->dma, dma_addr, 1, &sg, 1, PROT_NONE) != 1) {
+        return -1;
+    }
+
+    *dirty_pages = vfu_ctx->dma->regions[sg.region].dirty_pages;
+    return 0;
+}
+
 static void
 quiesce_check_allowed(vfu_ctx_t *vfu_ctx, const char *func)
 {
     if (!(vfu_ctx->in_cb != CB_NONE ||
           vfu_ctx->quiesce == NULL ||
-          !vfu_ctx->quiesced)) {
+          !vfu_ctx->quiesced ||
+          vfu_ctx->pending.state == VFU_CTX_PENDING_MIGR)) {
         vfu_log(vfu_ctx, LOG_ERR,
                 "illegal function %s() in quiesced state", func);
 #ifdef DEBUG
@@ -2071,6 +2880,39 @@ vfu_addr_to_sgl(vfu_ctx_t *vfu_ctx, vfu_dma_addr_t dma_addr,
     return dma_addr_to_sgl(vfu_ctx->dma, dma_addr, len, sgl, max_nr_sgs, prot);
 }
 
+EXPORT int
+vfu_addrs_to_sgl(vfu_ctx_t *vfu_ctx, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, size_t max_nr_sgs)
+{
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    quiesce_check_allowed(vfu_ctx, __func__);
+
+    return dma_addrs_to_sgl(vfu_ctx->dma, descs, nr_descs, sgl, NULL,
+                            max_nr_sgs);
+}
+
+EXPORT int
+vfu_addrs_to_iov(vfu_ctx_t *vfu_ctx, const vfu_dma_desc_t *descs,
+                 size_t nr_descs, dma_sg_t *sgl, struct iovec *iov,
+                 size_t max_nr_sgs)
+{
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL || vfu_ctx->dma_unregister == NULL)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    quiesce_check_allowed(vfu_ctx, __func__);
+
+    return dma_addrs_to_sgl(vfu_ctx->dma, descs, nr_descs, sgl, iov,
+                            max_nr_sgs);
+}
+
 EXPORT int
 vfu_sgl_get(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, struct iovec *iov, size_t cnt,
             int flags)
@@ -2110,8 +2952,8 @@ vfu_sgl_put(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl,
 }
 
 static int
-vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
-                 dma_sg_t *sg, void *data)
+dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
+             dma_sg_t *sg, void *data)
 {
     struct vfio_user_dma_region_access *dma_reply;
     struct vfio_user_dma_region_access *dma_req;
@@ -2202,6 +3044,19 @@ vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
     return 0;
 }
 
+static int
+vfu_dma_transfer(vfu_ctx_t *vfu_ctx, enum vfio_user_command cmd,
+                 dma_sg_t *sg, void *data)
+{
+    int ret;
+
+    TRACE_BEGIN(TRACE_DMA_TRANSFER, sg->length);
+    ret = dma_transfer(vfu_ctx, cmd, sg, data);
+    TRACE_END(TRACE_DMA_TRANSFER, sg->length);
+
+    return ret;
+}
+
 EXPORT int
 vfu_sgl_read(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data)
 {
@@ -2228,6 +3083,66 @@ vfu_sgl_write(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data)
     return vfu_dma_transfer(vfu_ctx, VFIO_USER_DMA_WRITE, sgl, data);
 }
 
+static int
+sgl_copy(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, char *data,
+         bool to_guest)
+{
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (unlikely(vfu_ctx->dma == NULL)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    quiesce_check_allowed(vfu_ctx, to_guest ? "vfu_sgl_copy_to" :
+                                              "vfu_sgl_copy_from");
+
+    for (i = 0; i < cnt; i++) {
+        dma_sg_t *sg = &sgl[i];
+
+        if (sg->region >= vfu_ctx->dma->nregions) {
+            return ERROR_INT(EINVAL);
+        }
+        if (to_guest && !sg->writeable) {
+            return ERROR_INT(EPERM);
+        }
+
+        if (dma_sg_is_mappable(vfu_ctx->dma, sg)) {
+            if (to_guest) {
+                dma_sg_copy_to(vfu_ctx->dma, sg, data);
+            } else {
+                dma_sg_copy_from(vfu_ctx->dma, sg, data);
+            }
+        } else {
+            assert(vfu_ctx->pending.state == VFU_CTX_PENDING_NONE);
+
+            if (vfu_dma_transfer(vfu_ctx, to_guest ? VFIO_USER_DMA_WRITE :
+                                                     VFIO_USER_DMA_READ,
+                                 sg, data) < 0) {
+                return -1;
+            }
+        }
+
+        data += sg->length;
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_sgl_copy_to(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt,
+                const void *data)
+{
+    return sgl_copy(vfu_ctx, sgl, cnt, (char *)data, true);
+}
+
+EXPORT int
+vfu_sgl_copy_from(vfu_ctx_t *vfu_ctx, dma_sg_t *sgl, size_t cnt, void *data)
+{
+    return sgl_copy(vfu_ctx, sgl, cnt, data, false);
+}
+
 EXPORT bool
 vfu_sg_is_mappable(vfu_ctx_t *vfu_ctx, dma_sg_t *sg)
 {
@@ -2241,23 +3156,46 @@ vfu_device_quiesced(vfu_ctx_t *vfu_ctx, int quiesce_errno)
 
     assert(vfu_ctx != NULL);
 
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+
+    if (vfu_ctx->in_quiesce_cb) {
+        /* completed by call_quiesce_cb() once the callback returns */
+        vfu_ctx->quiesce_done = true;
+        vfu_ctx->quiesce_errno = quiesce_errno;
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+        return 0;
+    }
+
     if (vfu_ctx->quiesce == NULL
-        || vfu_ctx->pending.state == VFU_CTX_PENDING_NONE) {
+        || vfu_ctx->pending.state == VFU_CTX_PENDING_NONE
+        || vfu_ctx->pending.state == VFU_CTX_PENDING_MIGR) {
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
         vfu_log(vfu_ctx, LOG_DEBUG,
                 "invalid call to quiesce callback, state=%d",
                 vfu_ctx->pending.state);
         return ERROR_INT(EINVAL);
     }
 
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+    TRACE_ASYNC_END(TRACE_QUIESCE_WAIT, vfu_ctx);
+
     vfu_log(vfu_ctx, LOG_DEBUG, "device quiesced with error=%d", quiesce_errno);
     vfu_ctx->quiesced = true;
 
     if (quiesce_errno == 0) {
         switch (vfu_ctx->pending.state) {
-        case VFU_CTX_PENDING_MSG:
-            ret = handle_request(vfu_ctx, vfu_ctx->pending.msg);
+        case VFU_CTX_PENDING_MSG: {
+            bool deferred;
+
+            ret = handle_request(vfu_ctx, vfu_ctx->pending.msg, &deferred);
+            if (deferred) {
+                /* now waiting for vfu_migr_done() */
+                return 0;
+            }
             free_msg(vfu_ctx, vfu_ctx->pending.msg);
             break;
+        }
         case VFU_CTX_PENDING_CTX_RESET:
             vfu_reset_ctx_quiesced(vfu_ctx);
             ret = 0;
@@ -2276,6 +3214,69 @@ vfu_device_quiesced(vfu_ctx_t *vfu_ctx, int quiesce_errno)
     vfu_log(vfu_ctx, LOG_DEBUG, "device unquiesced");
     vfu_ctx->quiesced = false;
 
+    loop_ctx_resume(vfu_ctx);
+
+    return ret;
+}
+
+EXPORT int
+vfu_migr_done(vfu_ctx_t *vfu_ctx, int reply_errno)
+{
+    uint32_t device_state;
+    vfu_msg_t *msg;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+
+    if (vfu_ctx->in_migr_request) {
+        /* completed by migr_settle() once the request has been handled */
+        vfu_ctx->migr_done = true;
+        vfu_ctx->migr_errno = reply_errno;
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+        return 0;
+    }
+
+    if (vfu_ctx->pending.state != VFU_CTX_PENDING_MIGR) {
+        pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+        vfu_log(vfu_ctx, LOG_DEBUG,
+                "invalid call to migration done, state=%d",
+                vfu_ctx->pending.state);
+        return ERROR_INT(EINVAL);
+    }
+
+    device_state = vfu_ctx->pending.migr_dev_state;
+    msg = vfu_ctx->pending.msg;
+    vfu_ctx->pending.msg = NULL;
+    vfu_ctx->pending.state = VFU_CTX_PENDING_NONE;
+    /* the remaining v2 steps may call the transition callback again */
+    vfu_ctx->in_migr_request = true;
+    vfu_ctx->migr_done = false;
+
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+
+    TRACE_ASYNC_END(TRACE_MIGR_WAIT, vfu_ctx);
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "migration: device transitioned with error=%d",
+            reply_errno);
+
+    ret = migration_transition_done(vfu_ctx, msg, device_state, reply_errno);
+    if (migr_settle(vfu_ctx, msg, &ret)) {
+        /* the device deferred the next step too */
+        return 0;
+    }
+
+    ret = do_reply(vfu_ctx, msg, ret == 0 ? 0 : errno);
+    free_msg(vfu_ctx, msg);
+
+    if (vfu_ctx->quiesced) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "device unquiesced");
+        vfu_ctx->quiesced = false;
+    }
+
+    loop_ctx_resume(vfu_ctx);
+
     return ret;
 }
 
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "libvfio-user.h"
+#include "log.h"
+#include "private.h"
+#include "thread.h"
+
+#define LOG_QUEUE_MAX_MSGS (1 << 16)
+
+/*
+ * A bounded multi-producer queue: a producer claims a slot by advancing
+ * ->head, and hands it to the logger thread by setting its ->seq to one past
+ * its position. See Dmitry Vyukov's bounded MPMC queue.
+ */
+struct log_slot {
+    uint64_t    seq;
+    int         level;
+    /* set instead of ->msg for messages of LOG_MSG_SIZE or more */
+    char        *long_msg;
+    char        msg[LOG_MSG_SIZE];
+};
+
+struct log_queue {
+    vfu_ctx_t       *vfu_ctx;
+    pthread_t       thread;
+    int             efd;
+    size_t          mask;
+    /* set while the logger thread is about to wait on ->efd */
+    bool            waiting;
+    bool            stop;
+    uint64_t        dropped;
+    /* written by producers */
+    uint64_t        head __attribute__((aligned(64)));
+    /* written by the logger thread */
+    uint64_t        tail __attribute__((aligned(64)));
+    struct log_slot slots[];
+};
+
+/*
+ * Hands a message to the logger thread, taking ownership of @long_msg if it's
+ * set. Never blocks: if the queue is full the message is dropped.
+ */
+static void
+log_queue_push(struct log_queue *q, int level, const char *msg,
+               char *long_msg)
+{
+    uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+
+    for (;;) {
+        int64_t diff;
+
+        slot = &q->slots[pos & q->mask];
+        diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+               (int64_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+            free(long_msg);
+            return;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->long_msg = long_msg;
+    if (long_msg == NULL) {
+        strcpy(slot->msg, msg);
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in log_thread() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&q->waiting, false, __ATOMIC_RELAXED)) {
+        (void) eventfd_write(q->efd, 1);
+    }
+}
+
+static bool
+log_queue_empty(struct log_queue *q)
+{
+    struct log_slot *slot = &q->slots[q->tail & q->mask];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1;
+}
+
+static void
+log_queue_drain(struct log_queue *q)
+{
+    vfu_ctx_t *vfu_ctx = q->vfu_ctx;
+    vfu_log_fn_t *log;
+    uint64_t dropped;
+
+    while (!log_queue_empty(q)) {
+        struct log_slot *slot = &q->slots[q->tail & q->mask];
+
+        log = vfu_ctx->log;
+        if (log != NULL) {
+            log(vfu_ctx, slot->level,
+                slot->long_msg != NULL ? slot->long_msg : slot->msg);
+        }
+        free(slot->long_msg);
+
+        __atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+        q->tail++;
+    }
+
+    dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED);
+    log = vfu_ctx->log;
+    if (dropped > 0 && log != NULL) {
+        char buf[64];
+
+        snprintf(buf, sizeof(buf), "%lu log messages dropped", dropped);
+        log(vfu_ctx, LOG_WARNING, buf);
+    }
+}
+
+static void *
+log_thread(void *arg)
+{
+    struct log_queue *q = arg;
+    eventfd_t val;
+
+    while (!__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+        log_queue_drain(q);
+
+        __atomic_store_n(&q->waiting, true, __ATOMIC_RELAXED);
+        /* pairs with the fence in log_queue_push() */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (log_queue_empty(q) &&
+            !__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+            (void) eventfd_read(q->efd, &val);
+        }
+        __atomic_store_n(&q->waiting, false, __ATOMIC_RELAXED);
+    }
+
+    log_queue_drain(q);
+    return NULL;
+}
+
+EXPORT void
+(vfu_log)(vfu_ctx_t *vfu_ctx, int level, const char *fmt, ...)
+{
+    struct log_queue *q;
+    char buf[LOG_MSG_SIZE];
+    char *long_msg = NULL;
+    int _errno = errno;
+    va_list ap;
+    int len;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->log == NULL || level > vfu_ctx->log_level || fmt == NULL) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    /* long messages are rare, so don't keep a big buffer on the stack */
+    if (len >= (int)sizeof(buf) && (long_msg = malloc(len + 1)) != NULL) {
+        errno = _errno;
+        va_start(ap, fmt);
+        vsnprintf(long_msg, len + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    q = __atomic_load_n(&vfu_ctx->log_queue, __ATOMIC_ACQUIRE);
+    if (q != NULL) {
+        log_queue_push(q, level, buf, long_msg);
+    } else {
+        vfu_ctx->log(vfu_ctx, level, long_msg != NULL ? long_msg : buf);
+        free(long_msg);
+    }
+    errno = _errno;
+}
+
+static void
+log_queue_free(struct log_queue *q)
+{
+    if (q->efd != -1) {
+        close(q->efd);
+    }
+    free(q);
+}
+
+EXPORT int
+vfu_setup_log_async(vfu_ctx_t *vfu_ctx, size_t nr_msgs)
+{
+    struct log_queue *q;
+    size_t size = 1;
+    size_t i;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+
+    if (nr_msgs == 0) {
+        log_async_stop(vfu_ctx);
+        return 0;
+    }
+    if (nr_msgs > LOG_QUEUE_MAX_MSGS) {
+        return ERROR_INT(EINVAL);
+    }
+    if (vfu_ctx->log_queue != NULL) {
+        return ERROR_INT(EBUSY);
+    }
+
+    while (size < nr_msgs) {
+        size <<= 1;
+    }
+
+    q = calloc(1, sizeof(*q) + size * sizeof(q->slots[0]));
+    if (q == NULL) {
+        return -1;
+    }
+    q->vfu_ctx = vfu_ctx;
+    q->mask = size - 1;
+    for (i = 0; i < size; i++) {
+        q->slots[i].seq = i;
+    }
+
+    q->efd = eventfd(0, EFD_CLOEXEC);
+    if (q->efd == -1) {
+        ret = errno;
+        log_queue_free(q);
+        return ERROR_INT(ret);
+    }
+
+    ret = thread_create(vfu_ctx, &q->thread, "log", log_thread, q);
+    if (ret != 0) {
+        log_queue_free(q);
+        return ERROR_INT(ret);
+    }
+
+    __atomic_store_n(&vfu_ctx->log_queue, q, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+log_async_stop(vfu_ctx_t *vfu_ctx)
+{
+    struct log_queue *q = vfu_ctx->log_queue;
+
+    if (q == NULL) {
+        return;
+    }
+
+    /*
+     * Messages logged from here on are passed to the log function directly;
+     * the caller must make sure no other thread is still logging.
+     */
+    __atomic_store_n(&vfu_ctx->log_queue, NULL, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&q->stop, true, __ATOMIC_RELEASE);
+    (void) eventfd_write(q->efd, 1);
+    (void) pthread_join(q->thread, NULL);
+
+    log_queue_free(q);
+}
+
+size_t
+log_memory_usage(vfu_ctx_t *vfu_ctx)
+{
+    struct log_queue *q = vfu_ctx->log_queue;
+
+    if (q == NULL) {
+        return 0;
+    }
+    return sizeof(*q) + (q->mask + 1) * sizeof(q->slots[0]);
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
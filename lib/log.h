@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_LOG_H
+#define LIB_VFIO_USER_LOG_H
+
+/*
+ * Logging within the library.
+ *
+ * vfu_log() is wrapped in a macro that checks the level first, so filtered
+ * messages cost a compare and their arguments aren't evaluated. Levels above
+ * VFU_LOG_MAX_LEVEL are compiled out altogether.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+
+/* Set by the max-log-level build option. */
+#ifndef VFU_LOG_MAX_LEVEL
+#define VFU_LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/*
+ * vfu_log_ratelimited() logs at most LOG_RATELIMIT_BURST messages from a call
+ * site per LOG_RATELIMIT_INTERVAL_NS.
+ */
+#define LOG_RATELIMIT_INTERVAL_NS (5ULL * 1000 * 1000 * 1000)
+#define LOG_RATELIMIT_BURST 10
+
+/* Size of messages formatted without allocating. */
+#define LOG_MSG_SIZE 256
+
+#define vfu_log_enabled(vfu_ctx, level)                                 \
+    ((level) <= VFU_LOG_MAX_LEVEL && (level) <= (vfu_ctx)->log_level &&  \
+     (vfu_ctx)->log != NULL)
+
+#define vfu_log(vfu_ctx, level, ...)                                    \
+    do {                                                                \
+        if (vfu_log_enabled(vfu_ctx, level)) {                          \
+            (vfu_log)(vfu_ctx, level, __VA_ARGS__);                     \
+        }                                                               \
+    } while (0)
+
+struct log_ratelimit {
+    uint64_t    begin_ns;
+    uint64_t    count;
+    uint64_t    suppressed;
+};
+
+/*
+ * Returns whether a call site may log, and in @suppressed how many of its
+ * messages were dropped since it last could. The state is shared between
+ * threads without a lock, so the limit is approximate under contention.
+ */
+static inline bool
+log_ratelimit(struct log_ratelimit *rl, uint64_t *suppressed)
+{
+    uint64_t begin = __atomic_load_n(&rl->begin_ns, __ATOMIC_RELAXED);
+    uint64_t now = now_ns();
+
+    *suppressed = 0;
+
+    if (now - begin >= LOG_RATELIMIT_INTERVAL_NS &&
+        __atomic_compare_exchange_n(&rl->begin_ns, &begin, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&rl->suppressed, 0,
+                                          __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) <
+        LOG_RATELIMIT_BURST) {
+        return true;
+    }
+
+    __atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/* For messages a client can trigger at will, such as bad requests. */
+#define vfu_log_ratelimited(vfu_ctx, level, ...)                        \
+    do {                                                                \
+        static struct log_ratelimit _rl;                                \
+        uint64_t _suppressed;                                           \
+                                                                        \
+        if (vfu_log_enabled(vfu_ctx, level) &&                          \
+            log_ratelimit(&_rl, &_suppressed)) {                        \
+            if (_suppressed > 0) {                                      \
+                (vfu_log)(vfu_ctx, level, "%lu messages suppressed",    \
+                          _suppressed);                                 \
+            }                                                           \
+            (vfu_log)(vfu_ctx, level, __VA_ARGS__);                     \
+        }                                                               \
+    } while (0)
+
+struct log_queue;
+
+/* Stops the logger thread of vfu_setup_log_async(), if there is one. */
+void
+log_async_stop(vfu_ctx_t *vfu_ctx);
+
+size_t
+log_memory_usage(vfu_ctx_t *vfu_ctx);
+
+#endif /* LIB_VFIO_USER_LOG_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2021 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Multi-context event loop.
+ *
+ * All threads of a loop share a single epoll instance. Each context's poll fd
+ * is registered with EPOLLONESHOT, so once a thread picks up a context no
+ * other thread sees it until it is re-armed at the end of the turn. A turn
+ * handles at most max_reqs requests; a context that still has work after that
+ * is put on the thread's retry list and serviced again after the other ready
+ * contexts, rather than relying on the fd becoming readable again (which it
+ * may not for transports that buffer requests outside the socket).
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+#define LOOP_MAX_EVENTS 64
+
+struct vfu_loop_entry {
+    vfu_ctx_t                   *vfu_ctx;
+    struct vfu_loop             *loop;
+    /* fd currently registered with epoll, or -1. */
+    int                         fd;
+    bool                        attached;
+    /* Being serviced by a thread (including sitting on a retry list). */
+    bool                        busy;
+    /* Waiting for vfu_device_quiesced(). */
+    bool                        parked;
+    /* vfu_device_quiesced() was called while busy. */
+    bool                        resumed;
+    bool                        removed;
+    LIST_ENTRY(vfu_loop_entry)  entry;
+    LIST_ENTRY(vfu_loop_entry)  retry;
+};
+
+struct loop_thread {
+    struct vfu_loop *loop;
+    pthread_t       tid;
+    unsigned int    idx;
+};
+
+struct vfu_loop {
+    int                         epoll_fd;
+    int                         wake_fd;
+    unsigned int                nr_threads;
+    unsigned int                max_reqs;
+    int                         *cpus;
+    size_t                      nr_cpus;
+    struct loop_thread          *threads;
+    bool                        running;
+    pthread_mutex_t             lock;
+    pthread_cond_t              cond;
+    LIST_HEAD(, vfu_loop_entry) entries;
+    /*
+     * Removed entries may still be referenced by events another thread has
+     * already dequeued, so they are only freed with the loop.
+     */
+    LIST_HEAD(, vfu_loop_entry) zombies;
+};
+
+/* Called with the loop lock held. */
+static int
+entry_arm(struct vfu_loop_entry *e)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.ptr = e,
+    };
+    int fd = vfu_get_poll_fd(e->vfu_ctx);
+
+    if (fd == e->fd) {
+        if (epoll_ctl(e->loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+            return 0;
+        }
+        /* The old fd was closed and the number reused. */
+        if (errno != ENOENT) {
+            return -1;
+        }
+    } else if (e->fd != -1) {
+        /* Fails harmlessly if the fd was closed, e.g. on disconnect. */
+        (void) epoll_ctl(e->loop->epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+    }
+
+    e->fd = fd;
+    return epoll_ctl(e->loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Called with the loop lock held, at the end of a turn. */
+static void
+entry_release(struct vfu_loop_entry *e)
+{
+    e->busy = false;
+
+    if (!e->removed && !e->parked && entry_arm(e) < 0) {
+        vfu_log(e->vfu_ctx, LOG_ERR, "failed to re-arm poll fd: %m");
+    }
+
+    pthread_cond_broadcast(&e->loop->cond);
+}
+
+/*
+ * Service one context for a single turn. Returns true if the turn was used
+ * up and the context may have more requests waiting.
+ */
+static bool
+entry_service(struct vfu_loop_entry *e)
+{
+    struct vfu_loop *loop = e->loop;
+    unsigned int i;
+    int ret;
+
+    if (!e->attached) {
+        if (vfu_attach_ctx(e->vfu_ctx) == 0) {
+            e->attached = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            vfu_log(e->vfu_ctx, LOG_ERR, "failed to attach: %m");
+        }
+        return false;
+    }
+
+    for (i = 0; i < loop->max_reqs; i++) {
+        ret = vfu_run_ctx(e->vfu_ctx);
+
+        if (ret == 0) {
+            return false;
+        } else if (ret > 0) {
+            continue;
+        }
+
+        switch (errno) {
+        case ENOTCONN:
+            e->attached = false;
+            break;
+        case EBUSY:
+            pthread_mutex_lock(&loop->lock);
+            if (!e->resumed) {
+                e->parked = true;
+            }
+            e->resumed = false;
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        default:
+            vfu_log(e->vfu_ctx, LOG_ERR, "failed to run context: %m");
+            break;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static void *
+loop_thread_run(void *arg)
+{
+    struct loop_thread *lt = arg;
+    struct vfu_loop *loop = lt->loop;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    LIST_HEAD(, vfu_loop_entry) retry = LIST_HEAD_INITIALIZER(retry);
+    struct vfu_loop_entry *e;
+    bool stop = false;
+    int i, n;
+
+    if (loop->nr_cpus > 0) {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(loop->cpus[lt->idx % loop->nr_cpus], &cpuset);
+        (void) pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+
+    while (!stop) {
+        LIST_HEAD(, vfu_loop_entry) todo = LIST_HEAD_INITIALIZER(todo);
+
+        n = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS,
+                       LIST_EMPTY(&retry) ? -1 : 0);
+        if (n < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+            n = 0;
+        }
+
+        /* Contexts that used up their last turn go after the newly ready. */
+        while ((e = LIST_FIRST(&retry)) != NULL) {
+            LIST_REMOVE(e, retry);
+            LIST_INSERT_HEAD(&todo, e, retry);
+        }
+
+        for (i = 0; i < n; i++) {
+            e = events[i].data.ptr;
+
+            if (e == NULL) {
+                stop = true;
+                continue;
+            }
+
+            pthread_mutex_lock(&loop->lock);
+            if (e->removed || e->busy) {
+                pthread_mutex_unlock(&loop->lock);
+                continue;
+            }
+            e->busy = true;
+            pthread_mutex_unlock(&loop->lock);
+
+            if (entry_service(e)) {
+                LIST_INSERT_HEAD(&retry, e, retry);
+                continue;
+            }
+
+            pthread_mutex_lock(&loop->lock);
+            entry_release(e);
+            pthread_mutex_unlock(&loop->lock);
+        }
+
+        while ((e = LIST_FIRST(&todo)) != NULL) {
+            LIST_REMOVE(e, retry);
+
+            if (!stop && entry_service(e)) {
+                LIST_INSERT_HEAD(&retry, e, retry);
+                continue;
+            }
+
+            pthread_mutex_lock(&loop->lock);
+            entry_release(e);
+            pthread_mutex_unlock(&loop->lock);
+        }
+    }
+
+    /* Hand anything still pending back to epoll for the next start. */
+    pthread_mutex_lock(&loop->lock);
+    while ((e = LIST_FIRST(&retry)) != NULL) {
+        LIST_REMOVE(e, retry);
+        entry_release(e);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    return NULL;
+}
+
+EXPORT vfu_loop_t *
+vfu_loop_create(const vfu_loop_attr_t *attr)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct vfu_loop *loop;
+    int ret;
+
+    loop = calloc(1, sizeof(*loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->epoll_fd = -1;
+    loop->wake_fd = -1;
+    loop->nr_threads = 1;
+    loop->max_reqs = VFU_LOOP_DEFAULT_MAX_REQS;
+    LIST_INIT(&loop->entries);
+    LIST_INIT(&loop->zombies);
+
+    if (attr != NULL) {
+        if (attr->nr_threads != 0) {
+            loop->nr_threads = attr->nr_threads;
+        }
+        if (attr->max_reqs_per_turn != 0) {
+            loop->max_reqs = attr->max_reqs_per_turn;
+        }
+        if (attr->nr_cpus != 0) {
+            if (attr->cpus == NULL) {
+                ret = EINVAL;
+                goto err;
+            }
+            loop->cpus = malloc(attr->nr_cpus * sizeof(*loop->cpus));
+            if (loop->cpus == NULL) {
+                ret = errno;
+                goto err;
+            }
+            memcpy(loop->cpus, attr->cpus, attr->nr_cpus * sizeof(*loop->cpus));
+            loop->nr_cpus = attr->nr_cpus;
+        }
+    }
+
+    loop->threads = calloc(loop->nr_threads, sizeof(*loop->threads));
+    if (loop->threads == NULL) {
+        ret = errno;
+        goto err;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        ret = errno;
+        goto err;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->wake_fd == -1) {
+        ret = errno;
+        goto err;
+    }
+
+    /* Level-triggered: once written, every thread sees it. */
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        ret = errno;
+        goto err;
+    }
+
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_cond_init(&loop->cond, NULL);
+
+    return loop;
+
+err:
+    if (loop->wake_fd != -1) {
+        close(loop->wake_fd);
+    }
+    if (loop->epoll_fd != -1) {
+        close(loop->epoll_fd);
+    }
+    free(loop->threads);
+    free(loop->cpus);
+    free(loop);
+    return ERROR_PTR(ret);
+}
+
+EXPORT int
+vfu_loop_add_ctx(vfu_loop_t *loop, vfu_ctx_t *vfu_ctx)
+{
+    struct vfu_loop_entry *e;
+    int ret;
+
+    assert(loop != NULL);
+    assert(vfu_ctx != NULL);
+
+    if (!(vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB) ||
+        !vfu_ctx->realized) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (vfu_ctx->loop_entry != NULL) {
+        return ERROR_INT(EBUSY);
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        return -1;
+    }
+
+    e->vfu_ctx = vfu_ctx;
+    e->loop = loop;
+    e->fd = -1;
+
+    pthread_mutex_lock(&loop->lock);
+    ret = entry_arm(e);
+    if (ret == 0) {
+        LIST_INSERT_HEAD(&loop->entries, e, entry);
+        vfu_ctx->loop_entry = e;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    if (ret < 0) {
+        ret = errno;
+        free(e);
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+EXPORT int
+vfu_loop_remove_ctx(vfu_loop_t *loop, vfu_ctx_t *vfu_ctx)
+{
+    struct vfu_loop_entry *e;
+
+    assert(loop != NULL);
+    assert(vfu_ctx != NULL);
+
+    e = vfu_ctx->loop_entry;
+
+    if (e == NULL || e->loop != loop) {
+        return ERROR_INT(ENOENT);
+    }
+
+    pthread_mutex_lock(&loop->lock);
+
+    e->removed = true;
+    while (e->busy) {
+        pthread_cond_wait(&loop->cond, &loop->lock);
+    }
+
+    if (e->fd != -1) {
+        (void) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, e->fd, NULL);
+        e->fd = -1;
+    }
+
+    LIST_REMOVE(e, entry);
+    LIST_INSERT_HEAD(&loop->zombies, e, entry);
+    vfu_ctx->loop_entry = NULL;
+
+    pthread_mutex_unlock(&loop->lock);
+
+    return 0;
+}
+
+EXPORT int
+vfu_loop_start(vfu_loop_t *loop)
+{
+    unsigned int i;
+    int ret;
+
+    assert(loop != NULL);
+
+    if (loop->running) {
+        return ERROR_INT(EALREADY);
+    }
+
+    for (i = 0; i < loop->nr_threads; i++) {
+        loop->threads[i].loop = loop;
+        loop->threads[i].idx = i;
+
+        ret = pthread_create(&loop->threads[i].tid, NULL, loop_thread_run,
+                             &loop->threads[i]);
+        if (ret != 0) {
+            unsigned int nr_threads = loop->nr_threads;
+
+            loop->running = true;
+            loop->nr_threads = i;
+            vfu_loop_stop(loop);
+            loop->nr_threads = nr_threads;
+            return ERROR_INT(ret);
+        }
+    }
+
+    loop->running = true;
+    return 0;
+}
+
+EXPORT void
+vfu_loop_stop(vfu_loop_t *loop)
+{
+    eventfd_t val;
+    unsigned int i;
+
+    assert(loop != NULL);
+
+    if (!loop->running) {
+        return;
+    }
+
+    (void) eventfd_write(loop->wake_fd, 1);
+
+    for (i = 0; i < loop->nr_threads; i++) {
+        pthread_join(loop->threads[i].tid, NULL);
+    }
+
+    (void) eventfd_read(loop->wake_fd, &val);
+    loop->running = false;
+}
+
+EXPORT void
+vfu_loop_destroy(vfu_loop_t *loop)
+{
+    struct vfu_loop_entry *e;
+
+    if (loop == NULL) {
+        return;
+    }
+
+    vfu_loop_stop(loop);
+
+    while ((e = LIST_FIRST(&loop->entries)) != NULL) {
+        vfu_loop_remove_ctx(loop, e->vfu_ctx);
+    }
+
+    while ((e = LIST_FIRST(&loop->zombies)) != NULL) {
+        LIST_REMOVE(e, entry);
+        free(e);
+    }
+
+    pthread_cond_destroy(&loop->cond);
+    pthread_mutex_destroy(&loop->lock);
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    free(loop->threads);
+    free(loop->cpus);
+    free(loop);
+}
+
+void
+loop_ctx_resume(vfu_ctx_t *vfu_ctx)
+{
+    struct vfu_loop_entry *e = vfu_ctx->loop_entry;
+
+    if (e == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&e->loop->lock);
+    if (e->busy) {
+        e->resumed = true;
+    } else if (e->parked) {
+        e->parked = false;
+        if (entry_arm(e) < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "failed to re-arm poll fd: %m");
+        }
+    }
+    pthread_mutex_unlock(&e->loop->lock);
+}
+
+void
+loop_ctx_destroy(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->loop_entry != NULL) {
+        (void) vfu_loop_remove_ctx(vfu_ctx->loop_entry->loop, vfu_ctx);
+    }
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
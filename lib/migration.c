@@ -31,13 +31,19 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "migration.h"
+#include "migration_enc.h"
 #include "private.h"
 #include "migration_priv.h"
+#include "trace.h"
 
 bool
 MOCK_DEFINE(vfio_migr_state_transition_is_valid)(uint32_t from, uint32_t to)
@@ -52,13 +58,118 @@ vfu_get_migr_register_area_size(void)
                     sysconf(_SC_PAGE_SIZE));
 }
 
+/*
+ * Maps the data section of the migration region if the client can map all of
+ * it too, so that both sides see the same data.
+ *
+ * Returns 0 on success (including if there's nothing to map), -1 on error
+ * setting errno.
+ */
+static int
+map_data_window(struct migration *migr, const vfu_reg_info_t *reg)
+{
+    uint64_t offset, delta;
+    int i;
+
+    if (reg == NULL || reg->fd == -1 || migr->data_area_size == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < reg->nr_mmap_areas; i++) {
+        uint64_t start = (uint64_t)reg->mmap_areas[i].iov_base;
+        uint64_t end = start + reg->mmap_areas[i].iov_len;
+
+        if (start <= migr->data_offset && end >= reg->size) {
+            break;
+        }
+    }
+    if (i == reg->nr_mmap_areas) {
+        return 0;
+    }
+
+    offset = reg->offset + migr->data_offset;
+    delta = offset % PAGE_SIZE;
+    migr->data_window_map_size = migr->data_area_size + delta;
+    migr->data_window_map = mmap(NULL, migr->data_window_map_size,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, reg->fd,
+                                 offset - delta);
+    if (migr->data_window_map == MAP_FAILED) {
+        migr->data_window_map = NULL;
+        return -1;
+    }
+    migr->data_window = (char *)migr->data_window_map + delta;
+    return 0;
+}
+
+/*
+ * Accounts the time spent in the state being left and enters @state, a
+ * vfu_migr_state_t or -1 for the error state. See vfu_migr_get_stats().
+ */
+static void
+migr_stats_set_state(struct migration *migr, int state)
+{
+    uint64_t now = now_ns();
+
+    if (migr->stats.state >= 0) {
+        migr->stats.state_ns[migr->stats.state] +=
+            now - migr->stats.state_since_ns;
+    }
+
+    /* a new migration starts */
+    if ((state == VFU_MIGR_STATE_PRE_COPY ||
+         state == VFU_MIGR_STATE_STOP_AND_COPY) &&
+        (migr->stats.state == VFU_MIGR_STATE_RUNNING ||
+         migr->stats.state == VFU_MIGR_STATE_STOP)) {
+        migr->stats.nr_iterations = 0;
+    }
+
+    migr->stats.state = state;
+    migr->stats.state_since_ns = now;
+}
+
+/*
+ * Records the pending bytes the device reported at the start of an iteration.
+ */
+static void
+migr_stats_add_pending(struct migration *migr, uint64_t pending_bytes)
+{
+    migr->stats.pending_bytes[migr->stats.nr_iterations %
+                              VFU_MIGR_PENDING_HISTORY] = pending_bytes;
+    migr->stats.nr_iterations++;
+}
+
+void
+migration_get_stats(struct migration *migr, vfu_migr_stats_t *stats)
+{
+    uint64_t first;
+    size_t i;
+
+    assert(migr != NULL);
+    assert(stats != NULL);
+
+    stats->nr_iterations = migr->stats.nr_iterations;
+    stats->nr_pending = MIN(migr->stats.nr_iterations,
+                            VFU_MIGR_PENDING_HISTORY);
+    first = migr->stats.nr_iterations - stats->nr_pending;
+    for (i = 0; i < stats->nr_pending; i++) {
+        stats->pending_bytes[i] =
+            migr->stats.pending_bytes[(first + i) % VFU_MIGR_PENDING_HISTORY];
+    }
+
+    memcpy(stats->state_ns, migr->stats.state_ns, sizeof(stats->state_ns));
+    if (migr->stats.state >= 0) {
+        stats->state_ns[migr->stats.state] +=
+            now_ns() - migr->stats.state_since_ns;
+    }
+}
+
 /*
  * TODO no need to dynamically allocate memory, we can keep struct migration
  * in vfu_ctx_t.
  */
 struct migration *
 init_migration(const vfu_migration_callbacks_t * callbacks,
-               uint64_t data_offset, int *err)
+               uint64_t data_offset, const vfu_reg_info_t *reg, int *err)
 {
     struct migration *migr;
 
@@ -82,14 +193,32 @@ init_migration(const vfu_migration_callbacks_t * callbacks,
 
     /* FIXME this should be done in vfu_ctx_realize */
     migr->info.device_state = VFIO_DEVICE_STATE_V1_RUNNING;
+    /* calloc() left stats.state as VFU_MIGR_STATE_STOP; nothing to account */
+    migr->stats.state = -1;
+    migr_stats_set_state(migr, VFU_MIGR_STATE_RUNNING);
     migr->data_offset = data_offset;
+    if (reg != NULL && reg->size > data_offset) {
+        migr->data_area_size = reg->size - data_offset;
+    }
 
     migr->callbacks = *callbacks;
     if (migr->callbacks.transition == NULL ||
         migr->callbacks.get_pending_bytes == NULL ||
-        migr->callbacks.prepare_data == NULL ||
-        migr->callbacks.read_data == NULL ||
-        migr->callbacks.write_data == NULL) {
+        migr->callbacks.prepare_data == NULL) {
+        free(migr);
+        *err = EINVAL;
+        return NULL;
+    }
+
+    if (map_data_window(migr, reg) < 0) {
+        *err = errno;
+        free(migr);
+        return NULL;
+    }
+
+    if (migr->data_window == NULL &&
+        (migr->callbacks.read_data == NULL ||
+         migr->callbacks.write_data == NULL)) {
         free(migr);
         *err = EINVAL;
         return NULL;
@@ -98,6 +227,143 @@ init_migration(const vfu_migration_callbacks_t * callbacks,
     return migr;
 }
 
+struct migration *
+migration_clone(const struct migration *template, const vfu_reg_info_t *reg,
+                int *err)
+{
+    struct migration *migr;
+
+    if (template->is_v2) {
+        migr = init_migration_v2(template->v2.flags, &template->v2.callbacks,
+                                 err);
+    } else {
+        migr = init_migration(&template->callbacks, template->data_offset, reg,
+                              err);
+    }
+    if (migr == NULL) {
+        return NULL;
+    }
+
+    if (template->enc != NULL &&
+        migration_set_encoding(migr, migr_enc_flags(template->enc)) < 0) {
+        *err = errno;
+        free_migration(migr);
+        return NULL;
+    }
+    migr->streams.nr = template->streams.nr;
+    migr->streams.read_cb = template->streams.read_cb;
+    migr->streams.write_cb = template->streams.write_cb;
+
+    return migr;
+}
+
+/*
+ * Waits for the transfer in flight, if any, and records its outcome for
+ * handle_mig_streams() to report. Called before the migration state changes,
+ * as the callbacks must not run past the state they were started in.
+ */
+void
+migration_streams_join(struct migration *migr)
+{
+    struct stream_worker *workers = migr->streams.workers;
+    size_t i;
+
+    if (workers == NULL) {
+        return;
+    }
+
+    migr->streams.bytes = 0;
+    migr->streams.err = 0;
+    for (i = 0; i < migr->streams.nr_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].err != 0) {
+            vfu_log(workers[i].vfu_ctx, LOG_ERR, "migration: stream fd %zu: %s",
+                    i, strerror(workers[i].err));
+            if (migr->streams.err == 0) {
+                migr->streams.err = workers[i].err;
+            }
+        }
+        migr->streams.bytes += workers[i].bytes;
+    }
+
+    vfu_log(workers[0].vfu_ctx, LOG_DEBUG,
+            "migration: %s %lu bytes over %zu streams",
+            workers[0].saving ? "sent" : "received", migr->streams.bytes,
+            migr->streams.nr_workers);
+
+    free(workers);
+    migr->streams.workers = NULL;
+    migr->streams.nr_workers = 0;
+}
+
+void
+free_migration(struct migration *migr)
+{
+    if (migr == NULL) {
+        return;
+    }
+    migration_streams_join(migr);
+    migr_enc_destroy(migr->enc);
+    if (migr->enc_buf != migr->data_window) {
+        free(migr->enc_buf);
+    }
+    free(migr->enc_raw);
+    if (migr->data_window_map != NULL) {
+        munmap(migr->data_window_map, migr->data_window_map_size);
+    }
+    free(migr);
+}
+
+size_t
+migration_memory_usage(const struct migration *migr)
+{
+    size_t size = sizeof(*migr);
+
+    if (migr->enc != NULL) {
+        size += migr_enc_memory_usage(migr->enc) + migr->data_area_size;
+        if (migr->enc_buf != migr->data_window) {
+            size += migr->data_area_size;
+        }
+    }
+    return size;
+}
+
+int
+migration_set_encoding(struct migration *migr, uint32_t flags)
+{
+    assert(migr != NULL);
+
+    if (migr->is_v2 || migr->enc != NULL ||
+        (flags & ~(VFU_MIGR_ENC_ZERO_PAGES | VFU_MIGR_ENC_UNCHANGED_PAGES)) ||
+        migr->callbacks.read_data == NULL ||
+        migr->callbacks.write_data == NULL || migr->data_area_size == 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    migr->enc = migr_enc_create(flags, migr->pgsize, migr->data_area_size);
+    if (migr->enc == NULL) {
+        return -1;
+    }
+    migr->enc_buf = migr->data_window;
+    if (migr->enc_buf == NULL) {
+        migr->enc_buf = malloc(migr->data_area_size);
+    }
+    migr->enc_raw = malloc(migr->data_area_size);
+    if (migr->enc_buf == NULL || migr->enc_raw == NULL) {
+        int err = errno;
+
+        migr_enc_destroy(migr->enc);
+        if (migr->enc_buf != migr->data_window) {
+            free(migr->enc_buf);
+        }
+        free(migr->enc_raw);
+        migr->enc = NULL;
+        migr->enc_buf = migr->enc_raw = NULL;
+        return ERROR_INT(err);
+    }
+    return 0;
+}
+
 void
 MOCK_DEFINE(migr_state_transition)(struct migration *migr,
                                    enum migr_iter_state state)
@@ -146,6 +412,26 @@ MOCK_DEFINE(state_trans_notify)(vfu_ctx_t *vfu_ctx,
     return fn(vfu_ctx, migr_state_vfio_to_vfu(vfio_device_state));
 }
 
+/*
+ * The device returned EBUSY from its transition callback: park the request
+ * being handled until it calls vfu_migr_done().
+ */
+static void
+migr_trans_defer(vfu_ctx_t *vfu_ctx, uint32_t device_state)
+{
+    assert(vfu_ctx->pending.state == VFU_CTX_PENDING_NONE ||
+           vfu_ctx->pending.state == VFU_CTX_PENDING_MSG);
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "migration: device will transition "
+            "asynchronously");
+    /* the message is handed over to vfu_migr_done() by migr_settle() */
+    pthread_mutex_lock(&vfu_ctx->quiesce_lock);
+    vfu_ctx->pending.state = VFU_CTX_PENDING_MIGR;
+    vfu_ctx->pending.migr_dev_state = device_state;
+    pthread_mutex_unlock(&vfu_ctx->quiesce_lock);
+    TRACE_ASYNC_BEGIN(TRACE_MIGR_WAIT, vfu_ctx);
+}
+
 /**
  * Returns 0 on success, -1 on failure setting errno.
  */
@@ -153,19 +439,36 @@ ssize_t
 MOCK_DEFINE(migr_trans_to_valid_state)(vfu_ctx_t *vfu_ctx, struct migration *migr,
                                        uint32_t device_state, bool notify)
 {
+    /* streams are transferred in the state they were requested in */
+    migration_streams_join(migr);
+
     if (notify) {
         int ret;
         assert(!vfu_ctx->in_cb);
         vfu_ctx->in_cb = CB_MIGR_STATE;
+        TRACE_BEGIN(TRACE_MIGR_TRANSITION, device_state);
         ret = state_trans_notify(vfu_ctx, migr->callbacks.transition,
                                  device_state);
+        TRACE_END(TRACE_MIGR_TRANSITION, device_state);
         vfu_ctx->in_cb = CB_NONE;
 
         if (ret != 0) {
+            if (errno == EBUSY) {
+                migr_trans_defer(vfu_ctx, device_state);
+            }
             return ret;
         }
     }
+    /* a new migration starts, in either direction */
+    if (migr->enc != NULL &&
+        !(migr->info.device_state & (VFIO_DEVICE_STATE_V1_SAVING |
+                                     VFIO_DEVICE_STATE_V1_RESUMING)) &&
+        (device_state & (VFIO_DEVICE_STATE_V1_SAVING |
+                         VFIO_DEVICE_STATE_V1_RESUMING))) {
+        migr_enc_reset(migr->enc);
+    }
     migr->info.device_state = device_state;
+    migr_stats_set_state(migr, migr_state_vfio_to_vfu(device_state));
     migr_state_transition(migr, VFIO_USER_MIGR_ITER_STATE_INITIAL);
     return 0;
 }
@@ -214,6 +517,7 @@ handle_pending_bytes(vfu_ctx_t *vfu_ctx, struct migration *migr,
              * iteration? Check https://www.spinics.net/lists/kvm/msg228608.html.
              */
             *pending_bytes = migr->iter.pending_bytes = migr->callbacks.get_pending_bytes(vfu_ctx);
+            migr_stats_add_pending(migr, *pending_bytes);
 
             if (*pending_bytes == 0) {
                 migr_state_transition(migr, VFIO_USER_MIGR_ITER_STATE_FINISHED);
@@ -242,6 +546,79 @@ handle_pending_bytes(vfu_ctx_t *vfu_ctx, struct migration *migr,
  * Make this behavior conditional.
  */
 
+/*
+ * Reads the chunk the device has just prepared and replaces it with its
+ * encoding, at the start of the data section.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+migr_encode_chunk(vfu_ctx_t *vfu_ctx, struct migration *migr)
+{
+    ssize_t ret;
+
+    if (migr->iter.size > migr->data_area_size) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: chunk of %lu bytes too large",
+                migr->iter.size);
+        return ERROR_INT(EINVAL);
+    }
+
+    ret = migr->callbacks.read_data(vfu_ctx, migr->enc_raw, migr->iter.size,
+                                    migr->iter.offset);
+    if (ret != (ssize_t)migr->iter.size) {
+        return ret < 0 ? -1 : ERROR_INT(EINVAL);
+    }
+
+    ret = migr_encode(migr->enc, migr->iter.offset, migr->enc_raw,
+                      migr->iter.size, migr->enc_buf, migr->data_area_size);
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: failed to encode chunk of %lu "
+                "bytes: %m", migr->iter.size);
+        return -1;
+    }
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "migration: encoded %#lx-%#lx into %zd bytes",
+            migr->iter.offset, migr->iter.offset + migr->iter.size - 1, ret);
+
+    migr->iter.offset = 0;
+    migr->iter.size = ret;
+    return 0;
+}
+
+/*
+ * Decodes the @size bytes of the chunk written to the start of the data
+ * section and hands it to the device.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+migr_decode_chunk(vfu_ctx_t *vfu_ctx, struct migration *migr, uint64_t size)
+{
+    uint64_t pos;
+    ssize_t ret;
+
+    if (size > migr->data_area_size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    ret = migr_decode(migr->enc, migr->enc_buf, size, migr->enc_raw,
+                      migr->data_area_size, &pos);
+    if (ret < 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: failed to decode chunk of %lu "
+                "bytes: %m", size);
+        return -1;
+    }
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "migration: decoded %lu bytes into %#lx-%#lx",
+            size, pos, pos + ret - 1);
+
+    if (migr->callbacks.write_data(vfu_ctx, migr->enc_raw, ret,
+                                   migr->enc_offset) < 0) {
+        return -1;
+    }
+    return migr->callbacks.data_written(vfu_ctx, ret);
+}
+
 /**
  * Returns 0 on success, -1 on error setting errno.
  */
@@ -265,6 +642,9 @@ handle_data_offset_when_saving(vfu_ctx_t *vfu_ctx, struct migration *migr,
         if (ret != 0) {
             return ret;
         }
+        if (migr->enc != NULL && migr_encode_chunk(vfu_ctx, migr) != 0) {
+            return -1;
+        }
         /*
          * FIXME must first read data_offset and then data_size. They way we've
          * implemented it now, if data_size is read before data_offset we
@@ -318,6 +698,11 @@ handle_data_offset(vfu_ctx_t *vfu_ctx, struct migration *migr,
         if (ret != 0) {
             return ret;
         }
+        if (migr->enc != NULL) {
+            /* the encoded chunk goes to the start of the data section */
+            migr->enc_offset = *offset;
+            *offset = 0;
+        }
         *offset += migr->data_offset;
         return 0;
     }
@@ -362,6 +747,9 @@ handle_data_size_when_resuming(vfu_ctx_t *vfu_ctx, struct migration *migr,
     assert(migr != NULL);
 
     if (is_write) {
+        if (migr->enc != NULL) {
+            return migr_decode_chunk(vfu_ctx, migr, size);
+        }
         return migr->callbacks.data_written(vfu_ctx, size);
     }
     return 0;
@@ -395,6 +783,47 @@ handle_data_size(vfu_ctx_t *vfu_ctx, struct migration *migr,
     return ERROR_INT(EINVAL);
 }
 
+static bool
+is_saving(struct migration *migr)
+{
+    return migr->info.device_state == VFIO_DEVICE_STATE_V1_SAVING ||
+           migr->info.device_state == (VFIO_DEVICE_STATE_V1_RUNNING |
+                                       VFIO_DEVICE_STATE_V1_SAVING);
+}
+
+/*
+ * Handles a read of pending_bytes, data_offset and data_size in one go, as if
+ * they had been read one after the other. If there are no more data,
+ * data_offset and data_size are zero.
+ *
+ * Returns 0 on success, -1 on failure setting errno.
+ */
+static ssize_t
+handle_iteration_registers(vfu_ctx_t *vfu_ctx, struct migration *migr,
+                           uint64_t *regs)
+{
+    ssize_t ret;
+
+    if (!is_saving(migr)) {
+        vfu_log(vfu_ctx, LOG_ERR,
+                "bad access to migration iteration registers in state %s",
+                migr_states[migr->info.device_state].name);
+        return ERROR_INT(EINVAL);
+    }
+
+    regs[1] = regs[2] = 0;
+
+    ret = handle_pending_bytes(vfu_ctx, migr, &regs[0], false);
+    if (ret != 0 || regs[0] == 0) {
+        return ret;
+    }
+    ret = handle_data_offset(vfu_ctx, migr, &regs[1], false);
+    if (ret != 0) {
+        return ret;
+    }
+    return handle_data_size(vfu_ctx, migr, &regs[2], false);
+}
+
 /**
  * Returns 0 on success, -1 on failure setting errno.
  */
@@ -409,6 +838,11 @@ MOCK_DEFINE(migration_region_access_registers)(vfu_ctx_t *vfu_ctx, char *buf,
 
     assert(migr != NULL);
 
+    if (pos == offsetof(struct vfio_user_migration_info, pending_bytes) &&
+        count == 3 * sizeof(uint64_t) && !is_write) {
+        return handle_iteration_registers(vfu_ctx, migr, (uint64_t *)buf);
+    }
+
     switch (pos) {
     case offsetof(struct vfio_user_migration_info, device_state):
         if (count != sizeof(migr->info.device_state)) {
@@ -433,7 +867,7 @@ MOCK_DEFINE(migration_region_access_registers)(vfu_ctx_t *vfu_ctx, char *buf,
                 "migration: transitioned from state %s to state %s",
                  migr_states[old_device_state].name,
                  migr_states[*device_state].name);
-        } else {
+        } else if (vfu_ctx->pending.state != VFU_CTX_PENDING_MIGR) {
             vfu_log(vfu_ctx, LOG_ERR,
                 "migration: failed to transition from state %s to state %s",
                  migr_states[old_device_state].name,
@@ -472,6 +906,45 @@ MOCK_DEFINE(migration_region_access_registers)(vfu_ctx_t *vfu_ctx, char *buf,
     return ret;
 }
 
+/*
+ * Accesses migration data at @pos, relative to data_offset, via the device
+ * callbacks or else the data window.
+ */
+static ssize_t
+migr_data_access(vfu_ctx_t *vfu_ctx, struct migration *migr, char *buf,
+                 size_t count, uint64_t pos, bool is_write)
+{
+    if (migr->enc != NULL) {
+        if (pos + count > migr->data_area_size) {
+            return ERROR_INT(EINVAL);
+        }
+        if (is_write) {
+            memcpy(migr->enc_buf + pos, buf, count);
+        } else {
+            memcpy(buf, migr->enc_buf + pos, count);
+        }
+        return count;
+    }
+
+    if (is_write && migr->callbacks.write_data != NULL) {
+        return migr->callbacks.write_data(vfu_ctx, buf, count, pos);
+    } else if (!is_write && migr->callbacks.read_data != NULL) {
+        return migr->callbacks.read_data(vfu_ctx, buf, count, pos);
+    }
+
+    assert(migr->data_window != NULL);
+
+    if (pos + count > migr->data_area_size) {
+        return ERROR_INT(EINVAL);
+    }
+    if (is_write) {
+        memcpy((char *)migr->data_window + pos, buf, count);
+    } else {
+        memcpy(buf, (char *)migr->data_window + pos, count);
+    }
+    return count;
+}
+
 ssize_t
 migration_region_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
                         loff_t pos, bool is_write)
@@ -482,6 +955,11 @@ migration_region_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
     assert(migr != NULL);
     assert(buf != NULL);
 
+    if (migr->is_v2) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: v2 has no migration region");
+        return ERROR_INT(EINVAL);
+    }
+
     /*
      * FIXME don't call the device callback if the migration state is in not in
      * pre-copy/stop-and-copy/resuming state, since the behavior is undefined
@@ -508,54 +986,1005 @@ migration_region_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
         }
 
         pos -= migr->data_offset;
-        if (is_write) {
-            ret = migr->callbacks.write_data(vfu_ctx, buf, count, pos);
-            if (ret < 0) {
-                return -1;
-            }
-        } else {
-            /*
-             * FIXME <linux/vfio.h> says:
-             *
-             *  d. Read data_size bytes of data from (region + data_offset) from the
-             *     migration region.
-             *
-             * Does this mean that partial reads are not allowed?
-             */
-            ret = migr->callbacks.read_data(vfu_ctx, buf, count, pos);
-            if (ret < 0) {
-                return -1;
-            }
+        /*
+         * FIXME <linux/vfio.h> says:
+         *
+         *  d. Read data_size bytes of data from (region + data_offset) from the
+         *     migration region.
+         *
+         * Does this mean that partial reads are not allowed?
+         */
+        ret = migr_data_access(vfu_ctx, migr, buf, count, pos, is_write);
+        if (ret < 0) {
+            return -1;
         }
     }
 
     return count;
 }
 
-bool
-MOCK_DEFINE(device_is_stopped_and_copying)(struct migration *migr)
+static int
+fd_wait(int fd, short events)
 {
-    return migr != NULL && migr->info.device_state == VFIO_DEVICE_STATE_V1_SAVING;
-}
+    struct pollfd pfd = { .fd = fd, .events = events };
 
-bool
-MOCK_DEFINE(device_is_stopped)(struct migration *migr)
-{
-    return migr != NULL && migr->info.device_state == VFIO_DEVICE_STATE_V1_STOP;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+        return -1;
+    }
+    return 0;
 }
 
-size_t
-migration_get_pgsize(struct migration *migr)
+/*
+ * Writes all of @buf to @fd, which may be non-blocking.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+int
+fd_write_all(int fd, const void *buf, size_t len)
 {
-    assert(migr != NULL);
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
 
-    return migr->pgsize;
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                ret = fd_wait(fd, POLLOUT);
+            } else if (errno == EINTR) {
+                ret = 0;
+            }
+            if (ret < 0) {
+                return -1;
+            }
+            continue;
+        }
+        buf = (const char *)buf + ret;
+        len -= ret;
+    }
+    return 0;
 }
 
-int
-migration_set_pgsize(struct migration *migr, size_t pgsize)
-{
-    assert(migr != NULL);
+/*
+ * Reads exactly @len bytes from @fd, which may be non-blocking.
+ *
+ * Returns the number of bytes read, which is less than @len only at end of
+ * file, or -1 on error setting errno.
+ */
+ssize_t
+fd_read_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = read(fd, (char *)buf + done, len - done);
+
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                ret = fd_wait(fd, POLLIN);
+            } else if (errno == EINTR) {
+                ret = 0;
+            }
+            if (ret < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/*
+ * Sends the data of save iterations to @fd until there are no more or at
+ * least @limit bytes (if non-zero) have been sent.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+migration_stream_save(vfu_ctx_t *vfu_ctx, struct migration *migr, int fd,
+                      uint64_t limit)
+{
+    uint64_t sent = 0;
+    char *bounce = NULL;
+    int ret = 0;
+
+    while (limit == 0 || sent < limit) {
+        struct vfio_user_migr_stream_chunk chunk;
+        uint64_t regs[3];
+        uint64_t done;
+
+        if (handle_iteration_registers(vfu_ctx, migr, regs) != 0) {
+            ret = -1;
+            break;
+        }
+        if (regs[0] == 0 || regs[2] == 0) {
+            break;
+        }
+
+        chunk.size = regs[2];
+        if (fd_write_all(fd, &chunk, sizeof(chunk)) < 0) {
+            ret = -1;
+            break;
+        }
+
+        for (done = 0; done < chunk.size; ) {
+            uint64_t pos = regs[1] - migr->data_offset + done;
+            size_t len = MIN(chunk.size - done, SERVER_MAX_DATA_XFER_SIZE);
+            const char *data;
+
+            if (migr->enc != NULL || migr->callbacks.read_data == NULL) {
+                if (pos + len > migr->data_area_size) {
+                    ret = ERROR_INT(EINVAL);
+                    break;
+                }
+                data = migr->enc != NULL ? migr->enc_buf + pos :
+                                           (char *)migr->data_window + pos;
+            } else {
+                if (bounce == NULL &&
+                    (bounce = malloc(SERVER_MAX_DATA_XFER_SIZE)) == NULL) {
+                    ret = -1;
+                    break;
+                }
+                if (migr->callbacks.read_data(vfu_ctx, bounce, len,
+                                              pos) != (ssize_t)len) {
+                    ret = -1;
+                    break;
+                }
+                data = bounce;
+            }
+            if (fd_write_all(fd, data, len) < 0) {
+                ret = -1;
+                break;
+            }
+            done += len;
+        }
+        if (ret != 0) {
+            break;
+        }
+        sent += chunk.size;
+    }
+
+    ret = ret != 0 ? errno : 0;
+    free(bounce);
+    vfu_log(vfu_ctx, LOG_DEBUG, "migration: streamed %lu bytes: %s", sent,
+            strerror(ret));
+    return ret != 0 ? ERROR_INT(ret) : 0;
+}
+
+/*
+ * Writes the chunks of data read from @fd to the device until end of file.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+migration_stream_load(vfu_ctx_t *vfu_ctx, struct migration *migr, int fd)
+{
+    char *bounce = NULL;
+    int ret = 0;
+
+    for (;;) {
+        struct vfio_user_migr_stream_chunk chunk;
+        uint64_t offset, done;
+        ssize_t len;
+
+        len = fd_read_all(fd, &chunk, sizeof(chunk));
+        if (len <= 0) {
+            ret = len;
+            break;
+        }
+        if (len != sizeof(chunk) || chunk.size > migr->data_area_size) {
+            vfu_log(vfu_ctx, LOG_ERR, "migration: bad stream chunk");
+            ret = ERROR_INT(EINVAL);
+            break;
+        }
+
+        if (handle_data_offset(vfu_ctx, migr, &offset, false) != 0) {
+            ret = -1;
+            break;
+        }
+        offset -= migr->data_offset;
+
+        for (done = 0; done < chunk.size; done += len) {
+            uint64_t pos = offset + done;
+            size_t want = MIN(chunk.size - done, SERVER_MAX_DATA_XFER_SIZE);
+            char *data;
+
+            if (migr->enc != NULL || migr->callbacks.write_data == NULL) {
+                if (pos + want > migr->data_area_size) {
+                    len = ERROR_INT(EINVAL);
+                    break;
+                }
+                data = migr->enc != NULL ? migr->enc_buf + pos :
+                                           (char *)migr->data_window + pos;
+            } else {
+                if (bounce == NULL &&
+                    (bounce = malloc(SERVER_MAX_DATA_XFER_SIZE)) == NULL) {
+                    len = -1;
+                    break;
+                }
+                data = bounce;
+            }
+
+            len = fd_read_all(fd, data, want);
+            if (len >= 0 && (size_t)len != want) {
+                vfu_log(vfu_ctx, LOG_ERR, "migration: truncated stream");
+                len = ERROR_INT(EINVAL);
+            }
+            if (len < 0) {
+                break;
+            }
+            if (migr->enc == NULL && migr->callbacks.write_data != NULL &&
+                migr->callbacks.write_data(vfu_ctx, data, want,
+                                           pos) != (ssize_t)want) {
+                len = -1;
+                break;
+            }
+        }
+        if (len < 0 ||
+            handle_data_size_when_resuming(vfu_ctx, migr, chunk.size,
+                                           true) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(bounce);
+    return ret;
+}
+
+/*
+ * Handles a write of the data_size register with a file descriptor attached:
+ * see vfu_setup_device_migration_callbacks(). Takes ownership of @fd.
+ *
+ * Returns @count on success, -1 on failure setting errno.
+ */
+ssize_t
+migration_stream(vfu_ctx_t *vfu_ctx, int fd, char *buf, size_t count,
+                 loff_t pos)
+{
+    struct migration *migr = vfu_ctx->migration;
+    int ret;
+
+    assert(migr != NULL);
+    assert(buf != NULL);
+
+    if (migr->is_v2 ||
+        pos != offsetof(struct vfio_user_migration_info, data_size) ||
+        count != sizeof(migr->info.data_size)) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: bad stream request %#lx-%#lx",
+                pos, pos + count - 1);
+        close(fd);
+        return ERROR_INT(EINVAL);
+    }
+
+    if (is_saving(migr)) {
+        ret = migration_stream_save(vfu_ctx, migr, fd, *(uint64_t *)buf);
+    } else if (migr->info.device_state == VFIO_DEVICE_STATE_V1_RESUMING) {
+        ret = migration_stream_load(vfu_ctx, migr, fd);
+    } else {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: cannot stream in state %s",
+                migr_states[migr->info.device_state].name);
+        ret = ERROR_INT(EINVAL);
+    }
+
+    close(fd);
+    return ret == 0 ? (ssize_t)count : -1;
+}
+
+/*
+ * VFIO migration v2.
+ *
+ * The client moves the device between the states of enum
+ * vfio_user_device_mig_state with VFIO_USER_DEVICE_FEATURE, and reads or
+ * writes the device state as an opaque stream with VFIO_USER_MIG_DATA_READ
+ * and VFIO_USER_MIG_DATA_WRITE.
+ */
+
+struct migration *
+init_migration_v2(uint64_t flags, const vfu_migration_v2_callbacks_t *callbacks,
+                  int *err)
+{
+    struct migration *migr;
+
+    if ((flags & ~VFU_MIGR_V2_FLAG_PRE_COPY) != 0 ||
+        callbacks->transition == NULL || callbacks->read_data == NULL ||
+        callbacks->write_data == NULL) {
+        *err = EINVAL;
+        return NULL;
+    }
+
+    migr = calloc(1, sizeof(*migr));
+    if (migr == NULL) {
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    migr->pgsize = sysconf(_SC_PAGESIZE);
+    migr->is_v2 = true;
+    migr->v2.state = VFIO_USER_DEVICE_STATE_RUNNING;
+    migr->stats.state = -1;
+    migr_stats_set_state(migr, VFU_MIGR_STATE_RUNNING);
+    migr->v2.flags = flags;
+    migr->v2.callbacks = *callbacks;
+
+    return migr;
+}
+
+static const char *const mig_v2_state_names[VFIO_USER_DEVICE_NUM_STATES] = {
+    [VFIO_USER_DEVICE_STATE_ERROR] = "error",
+    [VFIO_USER_DEVICE_STATE_STOP] = "stopped",
+    [VFIO_USER_DEVICE_STATE_RUNNING] = "running",
+    [VFIO_USER_DEVICE_STATE_STOP_COPY] = "stop-and-copy",
+    [VFIO_USER_DEVICE_STATE_RESUMING] = "resuming",
+    [VFIO_USER_DEVICE_STATE_RUNNING_P2P] = "running-p2p",
+    [VFIO_USER_DEVICE_STATE_PRE_COPY] = "pre-copy",
+    [VFIO_USER_DEVICE_STATE_PRE_COPY_P2P] = "pre-copy-p2p",
+};
+
+/*
+ * Next state on the way from one state to another, as in the kernel's
+ * vfio_mig_get_next_state() without the P2P states, which we don't support:
+ * only the arcs RUNNING <-> STOP, RUNNING <-> PRE_COPY, PRE_COPY -> STOP_COPY,
+ * STOP <-> STOP_COPY and STOP <-> RESUMING are taken directly. ERROR means
+ * there's no way, as from STOP_COPY to PRE_COPY.
+ */
+static const uint8_t
+mig_v2_next_state[VFIO_USER_DEVICE_NUM_STATES][VFIO_USER_DEVICE_NUM_STATES] = {
+    [VFIO_USER_DEVICE_STATE_STOP] = {
+        [VFIO_USER_DEVICE_STATE_STOP] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RUNNING] = VFIO_USER_DEVICE_STATE_RUNNING,
+        [VFIO_USER_DEVICE_STATE_STOP_COPY] = VFIO_USER_DEVICE_STATE_STOP_COPY,
+        [VFIO_USER_DEVICE_STATE_RESUMING] = VFIO_USER_DEVICE_STATE_RESUMING,
+        [VFIO_USER_DEVICE_STATE_PRE_COPY] = VFIO_USER_DEVICE_STATE_RUNNING,
+    },
+    [VFIO_USER_DEVICE_STATE_RUNNING] = {
+        [VFIO_USER_DEVICE_STATE_STOP] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RUNNING] = VFIO_USER_DEVICE_STATE_RUNNING,
+        [VFIO_USER_DEVICE_STATE_STOP_COPY] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RESUMING] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_PRE_COPY] = VFIO_USER_DEVICE_STATE_PRE_COPY,
+    },
+    [VFIO_USER_DEVICE_STATE_STOP_COPY] = {
+        [VFIO_USER_DEVICE_STATE_STOP] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RUNNING] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_STOP_COPY] = VFIO_USER_DEVICE_STATE_STOP_COPY,
+        [VFIO_USER_DEVICE_STATE_RESUMING] = VFIO_USER_DEVICE_STATE_STOP,
+        /* pre-copy data can't be taken back once stop-and-copy has begun */
+        [VFIO_USER_DEVICE_STATE_PRE_COPY] = VFIO_USER_DEVICE_STATE_ERROR,
+    },
+    [VFIO_USER_DEVICE_STATE_RESUMING] = {
+        [VFIO_USER_DEVICE_STATE_STOP] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RUNNING] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_STOP_COPY] = VFIO_USER_DEVICE_STATE_STOP,
+        [VFIO_USER_DEVICE_STATE_RESUMING] = VFIO_USER_DEVICE_STATE_RESUMING,
+        [VFIO_USER_DEVICE_STATE_PRE_COPY] = VFIO_USER_DEVICE_STATE_STOP,
+    },
+    [VFIO_USER_DEVICE_STATE_PRE_COPY] = {
+        [VFIO_USER_DEVICE_STATE_STOP] = VFIO_USER_DEVICE_STATE_RUNNING,
+        [VFIO_USER_DEVICE_STATE_RUNNING] = VFIO_USER_DEVICE_STATE_RUNNING,
+        [VFIO_USER_DEVICE_STATE_STOP_COPY] = VFIO_USER_DEVICE_STATE_STOP_COPY,
+        [VFIO_USER_DEVICE_STATE_RESUMING] = VFIO_USER_DEVICE_STATE_RUNNING,
+        [VFIO_USER_DEVICE_STATE_PRE_COPY] = VFIO_USER_DEVICE_STATE_PRE_COPY,
+    },
+};
+
+static vfu_migr_state_t
+mig_v2_state_to_vfu(uint32_t state)
+{
+    switch (state) {
+    case VFIO_USER_DEVICE_STATE_STOP:
+        return VFU_MIGR_STATE_STOP;
+    case VFIO_USER_DEVICE_STATE_RUNNING:
+        return VFU_MIGR_STATE_RUNNING;
+    case VFIO_USER_DEVICE_STATE_STOP_COPY:
+        return VFU_MIGR_STATE_STOP_AND_COPY;
+    case VFIO_USER_DEVICE_STATE_PRE_COPY:
+        return VFU_MIGR_STATE_PRE_COPY;
+    case VFIO_USER_DEVICE_STATE_RESUMING:
+        return VFU_MIGR_STATE_RESUME;
+    }
+    abort();
+}
+
+static bool
+mig_v2_state_is_supported(struct migration *migr, uint32_t state)
+{
+    switch (state) {
+    case VFIO_USER_DEVICE_STATE_STOP:
+    case VFIO_USER_DEVICE_STATE_RUNNING:
+    case VFIO_USER_DEVICE_STATE_STOP_COPY:
+    case VFIO_USER_DEVICE_STATE_RESUMING:
+        return true;
+    case VFIO_USER_DEVICE_STATE_PRE_COPY:
+        return (migr->v2.flags & VFU_MIGR_V2_FLAG_PRE_COPY) != 0;
+    }
+    return false;
+}
+
+/*
+ * Moves the device to @target, one arc at a time, calling the transition
+ * callback for each intermediate state. If it fails the device is left in the
+ * error state, which only a reset leaves.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+mig_v2_set_state(vfu_ctx_t *vfu_ctx, struct migration *migr, uint32_t target)
+{
+    migration_streams_join(migr);
+
+    if (!mig_v2_state_is_supported(migr, target) ||
+        migr->v2.state == VFIO_USER_DEVICE_STATE_ERROR ||
+        mig_v2_next_state[migr->v2.state][target] ==
+        VFIO_USER_DEVICE_STATE_ERROR) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: bad transition %s -> %s",
+                mig_v2_state_names[migr->v2.state],
+                target < VFIO_USER_DEVICE_NUM_STATES ?
+                mig_v2_state_names[target] : "invalid");
+        return ERROR_INT(EINVAL);
+    }
+
+    while (migr->v2.state != target) {
+        uint32_t next = mig_v2_next_state[migr->v2.state][target];
+        int ret;
+
+        assert(next != VFIO_USER_DEVICE_STATE_ERROR);
+
+        vfu_log(vfu_ctx, LOG_DEBUG, "migration: %s -> %s",
+                mig_v2_state_names[migr->v2.state], mig_v2_state_names[next]);
+
+        assert(!vfu_ctx->in_cb);
+        vfu_ctx->in_cb = CB_MIGR_STATE;
+        TRACE_BEGIN(TRACE_MIGR_TRANSITION, next);
+        ret = migr->v2.callbacks.transition(vfu_ctx, mig_v2_state_to_vfu(next));
+        TRACE_END(TRACE_MIGR_TRANSITION, next);
+        vfu_ctx->in_cb = CB_NONE;
+
+        if (ret != 0) {
+            ret = errno;
+            if (ret == EBUSY) {
+                migr_trans_defer(vfu_ctx, next);
+                return ERROR_INT(ret);
+            }
+            vfu_log(vfu_ctx, LOG_ERR, "migration: transition to %s failed: %m",
+                    mig_v2_state_names[next]);
+            migr->v2.state = VFIO_USER_DEVICE_STATE_ERROR;
+            migr_stats_set_state(migr, -1);
+            return ERROR_INT(ret);
+        }
+        migr->v2.state = next;
+        migr_stats_set_state(migr, mig_v2_state_to_vfu(next));
+    }
+
+    return 0;
+}
+
+/*
+ * Puts the device back in the running state on reset, without telling the
+ * device.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+int
+migration_reset(vfu_ctx_t *vfu_ctx, struct migration *migr)
+{
+    assert(migr != NULL);
+
+    if (!migr->is_v2) {
+        return handle_device_state(vfu_ctx, migr, VFIO_DEVICE_STATE_V1_RUNNING,
+                                   false);
+    }
+    migration_streams_join(migr);
+    migr->v2.state = VFIO_USER_DEVICE_STATE_RUNNING;
+    migr_stats_set_state(migr, VFU_MIGR_STATE_RUNNING);
+    return 0;
+}
+
+/*
+ * Returns the GET/SET operations supported for @feature, 0 if none.
+ */
+static uint32_t
+device_feature_ops(struct migration *migr, uint32_t feature)
+{
+    if (migr == NULL || !migr->is_v2) {
+        return 0;
+    }
+
+    switch (feature) {
+    case VFIO_DEVICE_FEATURE_MIGRATION:
+        return VFIO_DEVICE_FEATURE_GET;
+    case VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE:
+        return VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_SET;
+    case VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO:
+        if (migr->v2.flags & VFU_MIGR_V2_FLAG_PRE_COPY) {
+            return VFIO_DEVICE_FEATURE_GET;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+static size_t
+device_feature_data_size(uint32_t feature)
+{
+    switch (feature) {
+    case VFIO_DEVICE_FEATURE_MIGRATION:
+        return sizeof(struct vfio_user_device_feature_migration);
+    case VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE:
+        return sizeof(struct vfio_user_device_feature_mig_state);
+    case VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO:
+        return sizeof(struct vfio_user_precopy_info);
+    }
+    return 0;
+}
+
+static int
+device_feature_get(vfu_ctx_t *vfu_ctx, struct migration *migr,
+                   uint32_t feature, void *data)
+{
+    struct vfio_user_device_feature_migration *mig = data;
+    struct vfio_user_device_feature_mig_state *mig_state = data;
+    struct vfio_user_precopy_info *info = data;
+    uint64_t initial_bytes, dirty_bytes;
+    int ret;
+
+    switch (feature) {
+    case VFIO_DEVICE_FEATURE_MIGRATION:
+        mig->flags = VFIO_MIGRATION_STOP_COPY;
+        if (migr->v2.flags & VFU_MIGR_V2_FLAG_PRE_COPY) {
+            mig->flags |= VFIO_MIGRATION_PRE_COPY;
+        }
+        return 0;
+
+    case VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE:
+        mig_state->device_state = migr->v2.state;
+        mig_state->data_fd = -1;
+        return 0;
+
+    case VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO:
+        if (migr->v2.state != VFIO_USER_DEVICE_STATE_PRE_COPY) {
+            vfu_log(vfu_ctx, LOG_ERR, "migration: no pre-copy info in state "
+                    "%s", mig_v2_state_names[migr->v2.state]);
+            return ERROR_INT(EINVAL);
+        }
+        if (migr->v2.callbacks.precopy_info == NULL) {
+            info->initial_bytes = 0;
+            info->dirty_bytes = 0;
+            return 0;
+        }
+        ret = migr->v2.callbacks.precopy_info(vfu_ctx, &initial_bytes,
+                                              &dirty_bytes);
+        if (ret != 0) {
+            return -1;
+        }
+        info->initial_bytes = initial_bytes;
+        info->dirty_bytes = dirty_bytes;
+        migr_stats_add_pending(migr, initial_bytes + dirty_bytes);
+        return 0;
+    }
+
+    return ERROR_INT(ENOTSUP);
+}
+
+int
+handle_device_feature(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    struct vfio_user_device_feature *req = msg->in.iov.iov_base;
+    struct migration *migr = vfu_ctx->migration;
+    struct vfio_user_device_feature *res;
+    uint32_t feature, op, ops;
+    size_t size;
+    int ret;
+
+    assert(vfu_ctx != NULL);
+    assert(msg != NULL);
+
+    if (msg->in.iov.iov_len < sizeof(*req) || req->argsz < sizeof(*req)) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid message size %zu",
+                msg->in.iov.iov_len);
+        return ERROR_INT(EINVAL);
+    }
+
+    feature = req->flags & VFIO_DEVICE_FEATURE_MASK;
+    op = req->flags & (VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_SET);
+
+    if ((req->flags & ~(VFIO_DEVICE_FEATURE_MASK | VFIO_DEVICE_FEATURE_GET |
+                        VFIO_DEVICE_FEATURE_SET |
+                        VFIO_DEVICE_FEATURE_PROBE)) != 0 ||
+        (op == (VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_SET) &&
+         !(req->flags & VFIO_DEVICE_FEATURE_PROBE)) ||
+        (op == 0 && !(req->flags & VFIO_DEVICE_FEATURE_PROBE))) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad device feature flags %#x", req->flags);
+        return ERROR_INT(EINVAL);
+    }
+
+    ops = device_feature_ops(migr, feature);
+    if (ops == 0 || (op & ~ops) != 0) {
+        vfu_log(vfu_ctx, LOG_DEBUG, "unsupported device feature %#x",
+                req->flags);
+        return ERROR_INT(ENOTSUP);
+    }
+
+    if (req->flags & VFIO_DEVICE_FEATURE_PROBE) {
+        size = sizeof(*req);
+    } else {
+        size = sizeof(*req) + device_feature_data_size(feature);
+        if (op == VFIO_DEVICE_FEATURE_SET && msg->in.iov.iov_len < size) {
+            vfu_log(vfu_ctx, LOG_ERR, "invalid message size %zu",
+                    msg->in.iov.iov_len);
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    msg->out.iov.iov_base = calloc(1, size);
+    if (msg->out.iov.iov_base == NULL) {
+        return -1;
+    }
+    msg->out.iov.iov_len = size;
+    res = msg->out.iov.iov_base;
+    res->argsz = size;
+    res->flags = req->flags;
+
+    if (req->flags & VFIO_DEVICE_FEATURE_PROBE) {
+        return 0;
+    }
+
+    if (op == VFIO_DEVICE_FEATURE_SET) {
+        /* only VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE can be set */
+        struct vfio_user_device_feature_mig_state *mig_state =
+            (void *)req->data;
+
+        ret = mig_v2_set_state(vfu_ctx, migr, mig_state->device_state);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    /* the reply to a set carries the new state, like a get */
+    return device_feature_get(vfu_ctx, migr, feature, res->data);
+}
+
+/*
+ * Completes the transition to @device_state that the device deferred while
+ * handling @msg, see vfu_migr_done(). For v2 the remaining steps towards the
+ * requested state are taken, and the reply filled in.
+ *
+ * Returns 0 on success, -1 on error setting errno: EBUSY if the device deferred
+ * another step.
+ */
+int
+migration_transition_done(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
+                          uint32_t device_state, int reply_errno)
+{
+    struct migration *migr = vfu_ctx->migration;
+    struct vfio_user_device_feature *req, *res;
+    struct vfio_user_device_feature_mig_state *mig_state;
+    int ret;
+
+    assert(migr != NULL);
+    assert(msg != NULL);
+
+    if (reply_errno != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: asynchronous transition failed: "
+                "%s", strerror(reply_errno));
+    }
+
+    if (!migr->is_v2) {
+        if (reply_errno != 0) {
+            return ERROR_INT(reply_errno);
+        }
+        return migr_trans_to_valid_state(vfu_ctx, migr, device_state, false);
+    }
+
+    if (reply_errno != 0) {
+        migr->v2.state = VFIO_USER_DEVICE_STATE_ERROR;
+        migr_stats_set_state(migr, -1);
+        return ERROR_INT(reply_errno);
+    }
+
+    migr->v2.state = device_state;
+    migr_stats_set_state(migr, mig_v2_state_to_vfu(device_state));
+
+    /* handle_device_feature() has validated the request */
+    req = msg->in.iov.iov_base;
+    res = msg->out.iov.iov_base;
+    mig_state = (void *)req->data;
+
+    ret = mig_v2_set_state(vfu_ctx, migr, mig_state->device_state);
+    if (ret < 0) {
+        return ret;
+    }
+    return device_feature_get(vfu_ctx, migr,
+                              VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE, res->data);
+}
+
+bool
+feature_needs_quiesce(const vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg)
+{
+    struct vfio_user_device_feature *req = msg->in.iov.iov_base;
+
+    return vfu_ctx->migration != NULL && vfu_ctx->migration->is_v2 &&
+           msg->in.iov.iov_len >= sizeof(*req) &&
+           (req->flags & VFIO_DEVICE_FEATURE_MASK) ==
+               VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE &&
+           (req->flags & VFIO_DEVICE_FEATURE_SET) &&
+           !(req->flags & VFIO_DEVICE_FEATURE_PROBE);
+}
+
+/*
+ * Reads up to @count bytes of device state into @buf, calling the device
+ * until it has no more.
+ *
+ * Returns the number of bytes read, or -1 on error setting errno.
+ */
+static ssize_t
+mig_v2_read(vfu_ctx_t *vfu_ctx, struct migration *migr, char *buf,
+            size_t count)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t ret = migr->v2.callbacks.read_data(vfu_ctx, buf + done,
+                                                   count - done);
+
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        if ((size_t)ret > count - done) {
+            return ERROR_INT(EINVAL);
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static ssize_t
+mig_v2_write(vfu_ctx_t *vfu_ctx, struct migration *migr, char *buf,
+             size_t count)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        ssize_t ret = migr->v2.callbacks.write_data(vfu_ctx, buf + done,
+                                                    count - done);
+
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0 || (size_t)ret > count - done) {
+            return ERROR_INT(EINVAL);
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/*
+ * Streams device state to @fd until the device has no more or @limit bytes
+ * (if non-zero) have been sent.
+ *
+ * Returns the number of bytes sent, or -1 on error setting errno.
+ */
+static ssize_t
+mig_v2_stream_save(vfu_ctx_t *vfu_ctx, struct migration *migr, int fd,
+                   uint64_t limit)
+{
+    uint64_t sent = 0;
+    ssize_t ret = 0;
+    char *bounce;
+
+    if ((bounce = malloc(SERVER_MAX_DATA_XFER_SIZE)) == NULL) {
+        return -1;
+    }
+
+    while (limit == 0 || sent < limit) {
+        size_t len = SERVER_MAX_DATA_XFER_SIZE;
+
+        if (limit != 0) {
+            len = MIN(len, limit - sent);
+        }
+        ret = mig_v2_read(vfu_ctx, migr, bounce, len);
+        if (ret <= 0) {
+            break;
+        }
+        if (fd_write_all(fd, bounce, ret) < 0) {
+            ret = -1;
+            break;
+        }
+        sent += ret;
+    }
+
+    free(bounce);
+    return ret < 0 ? -1 : (ssize_t)sent;
+}
+
+/*
+ * Feeds @count bytes read from @fd to the device.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+static int
+mig_v2_stream_load(vfu_ctx_t *vfu_ctx, struct migration *migr, int fd,
+                   uint64_t count)
+{
+    uint64_t done = 0;
+    ssize_t ret = 0;
+    char *bounce;
+
+    if ((bounce = malloc(SERVER_MAX_DATA_XFER_SIZE)) == NULL) {
+        return -1;
+    }
+
+    while (done < count) {
+        size_t len = MIN(count - done, SERVER_MAX_DATA_XFER_SIZE);
+
+        ret = fd_read_all(fd, bounce, len);
+        if (ret >= 0 && (size_t)ret != len) {
+            vfu_log(vfu_ctx, LOG_ERR, "migration: truncated stream");
+            ret = ERROR_INT(EINVAL);
+        }
+        if (ret < 0 || mig_v2_write(vfu_ctx, migr, bounce, len) < 0) {
+            ret = -1;
+            break;
+        }
+        done += len;
+    }
+
+    free(bounce);
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Handles VFIO_USER_MIG_DATA_READ/WRITE, streaming through @fd if it isn't -1,
+ * which we take ownership of.
+ *
+ * Returns 0 on success, -1 on error setting errno.
+ */
+int
+handle_mig_data(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int fd)
+{
+    struct vfio_user_mig_data *req = msg->in.iov.iov_base;
+    struct migration *migr = vfu_ctx->migration;
+    bool is_read = msg->hdr.cmd == VFIO_USER_MIG_DATA_READ;
+    struct vfio_user_mig_data *res;
+    ssize_t ret = -1;
+
+    assert(vfu_ctx != NULL);
+    assert(msg != NULL);
+
+    if (msg->in.iov.iov_len < sizeof(*req) || req->argsz < sizeof(*req)) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid message size %zu",
+                msg->in.iov.iov_len);
+        errno = EINVAL;
+        goto out;
+    }
+
+    if (migr == NULL || !migr->is_v2) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration v2 not configured");
+        errno = ENOTSUP;
+        goto out;
+    }
+
+    if (is_read ? (migr->v2.state != VFIO_USER_DEVICE_STATE_PRE_COPY &&
+                   migr->v2.state != VFIO_USER_DEVICE_STATE_STOP_COPY)
+                : migr->v2.state != VFIO_USER_DEVICE_STATE_RESUMING) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: cannot %s data in state %s",
+                is_read ? "read" : "write", mig_v2_state_names[migr->v2.state]);
+        errno = EINVAL;
+        goto out;
+    }
+
+    if (fd == -1 &&
+        (req->size > SERVER_MAX_DATA_XFER_SIZE ||
+         (!is_read && msg->in.iov.iov_len - sizeof(*req) != req->size))) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration: bad data size %u", req->size);
+        errno = EINVAL;
+        goto out;
+    }
+
+    msg->out.iov.iov_len = sizeof(*res);
+    if (is_read && fd == -1) {
+        msg->out.iov.iov_len += req->size;
+    }
+    msg->out.iov.iov_base = calloc(1, msg->out.iov.iov_len);
+    if (msg->out.iov.iov_base == NULL) {
+        ret = -1;
+        goto out;
+    }
+    res = msg->out.iov.iov_base;
+
+    if (fd != -1) {
+        if (is_read) {
+            ret = mig_v2_stream_save(vfu_ctx, migr, fd, req->size);
+        } else {
+            ret = mig_v2_stream_load(vfu_ctx, migr, fd, req->size);
+            if (ret == 0) {
+                ret = req->size;
+            }
+        }
+        vfu_log(vfu_ctx, LOG_DEBUG, "migration: streamed %zd bytes", ret);
+    } else if (is_read) {
+        ret = mig_v2_read(vfu_ctx, migr, (char *)res->data, req->size);
+        /* only send what we got */
+        if (ret >= 0) {
+            msg->out.iov.iov_len = sizeof(*res) + ret;
+        }
+    } else {
+        ret = mig_v2_write(vfu_ctx, migr, (char *)req->data, req->size);
+    }
+
+    if (ret >= 0) {
+        res->argsz = msg->out.iov.iov_len;
+        res->size = ret;
+    }
+
+out:
+    if (fd != -1) {
+        int err = errno;
+
+        close(fd);
+        errno = err;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+bool
+migration_is_saving(struct migration *migr)
+{
+    assert(migr != NULL);
+
+    if (migr->is_v2) {
+        return migr->v2.state == VFIO_USER_DEVICE_STATE_PRE_COPY ||
+               migr->v2.state == VFIO_USER_DEVICE_STATE_STOP_COPY;
+    }
+    return is_saving(migr);
+}
+
+bool
+migration_is_resuming(struct migration *migr)
+{
+    assert(migr != NULL);
+
+    if (migr->is_v2) {
+        return migr->v2.state == VFIO_USER_DEVICE_STATE_RESUMING;
+    }
+    return migr->info.device_state == VFIO_DEVICE_STATE_V1_RESUMING;
+}
+
+bool
+MOCK_DEFINE(device_is_stopped_and_copying)(struct migration *migr)
+{
+    if (migr != NULL && migr->is_v2) {
+        return migr->v2.state == VFIO_USER_DEVICE_STATE_STOP_COPY;
+    }
+    return migr != NULL && migr->info.device_state == VFIO_DEVICE_STATE_V1_SAVING;
+}
+
+bool
+MOCK_DEFINE(device_is_stopped)(struct migration *migr)
+{
+    if (migr != NULL && migr->is_v2) {
+        return migr->v2.state == VFIO_USER_DEVICE_STATE_STOP;
+    }
+    return migr != NULL && migr->info.device_state == VFIO_DEVICE_STATE_V1_STOP;
+}
+
+size_t
+migration_get_pgsize(struct migration *migr)
+{
+    assert(migr != NULL);
+
+    return migr->pgsize;
+}
+
+int
+migration_set_pgsize(struct migration *migr, size_t pgsize)
+{
+    assert(migr != NULL);
 
     // FIXME?
     if (pgsize != PAGE_SIZE) {
@@ -566,6 +1995,44 @@ migration_set_pgsize(struct migration *migr, size_t pgsize)
     return 0;
 }
 
+uint32_t
+migration_get_device_state(struct migration *migr, bool *is_v2)
+{
+    assert(migr != NULL);
+
+    *is_v2 = migr->is_v2;
+    return migr->is_v2 ? migr->v2.state : migr->info.device_state;
+}
+
+int
+migration_restore_device_state(struct migration *migr, bool is_v2,
+                               uint32_t state)
+{
+    assert(migr != NULL);
+
+    if (is_v2 != migr->is_v2) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (migr->is_v2) {
+        if (state != VFIO_USER_DEVICE_STATE_STOP &&
+            state != VFIO_USER_DEVICE_STATE_RUNNING) {
+            return ERROR_INT(EINVAL);
+        }
+        migr->v2.state = state;
+        migr_stats_set_state(migr, mig_v2_state_to_vfu(state));
+        return 0;
+    }
+
+    if (state != VFIO_DEVICE_STATE_V1_STOP &&
+        state != VFIO_DEVICE_STATE_V1_RUNNING) {
+        return ERROR_INT(EINVAL);
+    }
+    migr->info.device_state = state;
+    migr_stats_set_state(migr, migr_state_vfio_to_vfu(state));
+    return 0;
+}
+
 bool
 access_migration_needs_quiesce(const vfu_ctx_t *vfu_ctx, size_t region_index,
                               uint64_t offset)
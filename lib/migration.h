@@ -46,15 +46,77 @@
 
 struct migration *
 init_migration(const vfu_migration_callbacks_t *callbacks,
-               uint64_t data_offset, int *err);
+               uint64_t data_offset, const vfu_reg_info_t *reg, int *err);
+
+/*
+ * A migration set up like @template's, for a context whose migration region
+ * is @reg, see vfu_clone_ctx(). The device state is running.
+ */
+struct migration *
+migration_clone(const struct migration *template, const vfu_reg_info_t *reg,
+                int *err);
+
+void
+free_migration(struct migration *migr);
+
+/* Bytes allocated for @migr, including any encoding buffers. */
+size_t
+migration_memory_usage(const struct migration *migr);
+
+void
+migration_get_stats(struct migration *migr, vfu_migr_stats_t *stats);
+
+int
+migration_set_encoding(struct migration *migr, uint32_t flags);
+
+struct migration *
+init_migration_v2(uint64_t flags, const vfu_migration_v2_callbacks_t *callbacks,
+                  int *err);
+
+int
+migration_reset(vfu_ctx_t *vfu_ctx, struct migration *migr);
+
+int
+migration_transition_done(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg,
+                          uint32_t device_state, int reply_errno);
+
+int
+handle_device_feature(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
+
+int
+handle_mig_data(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int fd);
+
+bool
+feature_needs_quiesce(const vfu_ctx_t *vfu_ctx, const vfu_msg_t *msg);
 
 ssize_t
 migration_region_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count,
                         loff_t pos, bool is_write);
 
+ssize_t
+migration_stream(vfu_ctx_t *vfu_ctx, int fd, char *buf, size_t count,
+                 loff_t pos);
+
 bool
 migration_available(vfu_ctx_t *vfu_ctx);
 
+bool
+migration_is_saving(struct migration *migr);
+
+bool
+migration_is_resuming(struct migration *migr);
+
+int
+migration_set_streams(struct migration *migr, uint32_t nr_streams,
+                      vfu_migr_stream_read_cb_t *read_cb,
+                      vfu_migr_stream_write_cb_t *write_cb);
+
+int
+handle_mig_streams(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
+
+void
+migration_streams_join(struct migration *migr);
+
 MOCK_DECLARE(bool, device_is_stopped, struct migration *migr);
 
 MOCK_DECLARE(bool, device_is_stopped_and_copying, struct migration *migration);
@@ -65,6 +127,21 @@ migration_get_pgsize(struct migration *migr);
 int
 migration_set_pgsize(struct migration *migr, size_t pgsize);
 
+/*
+ * The v1 device_state or v2 state, depending on *@is_v2, see
+ * vfu_ctx_export_state().
+ */
+uint32_t
+migration_get_device_state(struct migration *migr, bool *is_v2);
+
+/*
+ * Sets the state without any callbacks. Only the stopped and running states
+ * can be restored, not those of a migration in progress.
+ */
+int
+migration_restore_device_state(struct migration *migr, bool is_v2,
+                               uint32_t state);
+
 MOCK_DECLARE(bool, vfio_migr_state_transition_is_valid, uint32_t from,
              uint32_t to);
 
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "common.h"
+#include "libvfio-user.h"
+#include "migration_enc.h"
+#include "private.h"
+#include "rte_hash_crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+struct migr_enc {
+    uint32_t flags;
+    size_t pgsize;
+    size_t nr_pages;
+    /* last contents sent or received of each page, allocated on first use */
+    char *shadow;
+    uint32_t *crc;
+    bool *valid;
+    uint32_t zero_crc;
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(const void *data, size_t len, uint32_t crc)
+{
+    const char *p = data;
+    uint64_t crc64 = crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * The SSE4.2 instruction and the table driven fallback compute the same
+ * checksum, so either side of a migration may use either.
+ */
+uint32_t
+migr_enc_crc32c(const void *data, size_t len)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42(data, len, ~0U);
+    }
+#endif
+    return rte_hash_crc(data, len, ~0U);
+}
+
+/*
+ * Written so that the compiler vectorizes the inner loop, and bails out at the
+ * first cache line that isn't zero.
+ */
+static bool
+is_zero(const char *buf, size_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    size_t i;
+
+    assert(((uintptr_t)buf & (sizeof(uint64_t) - 1)) == 0);
+
+    for (; len >= 64; p += 8, len -= 64) {
+        uint64_t acc = 0;
+
+        for (i = 0; i < 8; i++) {
+            acc |= p[i];
+        }
+        if (acc != 0) {
+            return false;
+        }
+    }
+    for (buf = (const char *)p; len > 0; buf++, len--) {
+        if (*buf != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct migr_enc *
+migr_enc_create(uint32_t flags, size_t pgsize, size_t max_size)
+{
+    struct migr_enc *enc;
+    char *zero;
+
+    assert(pgsize != 0 && (pgsize & (sizeof(uint64_t) - 1)) == 0);
+
+    if ((zero = calloc(1, pgsize)) == NULL) {
+        return NULL;
+    }
+    if ((enc = calloc(1, sizeof(*enc))) == NULL) {
+        free(zero);
+        return NULL;
+    }
+    enc->flags = flags;
+    enc->pgsize = pgsize;
+    enc->nr_pages = max_size / pgsize;
+    enc->zero_crc = migr_enc_crc32c(zero, pgsize);
+    free(zero);
+    return enc;
+}
+
+uint32_t
+migr_enc_flags(const struct migr_enc *enc)
+{
+    return enc->flags;
+}
+
+size_t
+migr_enc_memory_usage(const struct migr_enc *enc)
+{
+    size_t size = sizeof(*enc);
+
+    if (enc->shadow != NULL) {
+        size += enc->nr_pages * (enc->pgsize + sizeof(*enc->crc) +
+                                 sizeof(*enc->valid));
+    }
+    return size;
+}
+
+void
+migr_enc_destroy(struct migr_enc *enc)
+{
+    if (enc == NULL) {
+        return;
+    }
+    free(enc->shadow);
+    free(enc->crc);
+    free(enc->valid);
+    free(enc);
+}
+
+void
+migr_enc_reset(struct migr_enc *enc)
+{
+    assert(enc != NULL);
+
+    if (enc->valid != NULL) {
+        memset(enc->valid, 0, enc->nr_pages * sizeof(*enc->valid));
+    }
+}
+
+static int
+shadow_alloc(struct migr_enc *enc)
+{
+    if (enc->shadow != NULL) {
+        return 0;
+    }
+    enc->shadow = malloc(enc->nr_pages * enc->pgsize);
+    enc->crc = malloc(enc->nr_pages * sizeof(*enc->crc));
+    enc->valid = calloc(enc->nr_pages, sizeof(*enc->valid));
+    if (enc->shadow == NULL || enc->crc == NULL || enc->valid == NULL) {
+        free(enc->shadow);
+        free(enc->crc);
+        free(enc->valid);
+        enc->shadow = NULL;
+        enc->crc = NULL;
+        enc->valid = NULL;
+        return ERROR_INT(ENOMEM);
+    }
+    return 0;
+}
+
+/*
+ * Returns the index in the shadow of the page at @pos, or -1 if it isn't
+ * tracked: only whole, aligned pages are.
+ */
+static ssize_t
+shadow_index(const struct migr_enc *enc, uint64_t pos, size_t len)
+{
+    if (enc->shadow == NULL || len != enc->pgsize || pos % enc->pgsize != 0 ||
+        pos / enc->pgsize >= enc->nr_pages) {
+        return -1;
+    }
+    return pos / enc->pgsize;
+}
+
+static void
+shadow_update(struct migr_enc *enc, ssize_t idx, const char *page, bool zero)
+{
+    if (idx < 0) {
+        return;
+    }
+    if (zero) {
+        memset(enc->shadow + idx * enc->pgsize, 0, enc->pgsize);
+        enc->crc[idx] = enc->zero_crc;
+    } else {
+        memcpy(enc->shadow + idx * enc->pgsize, page, enc->pgsize);
+        enc->crc[idx] = migr_enc_crc32c(page, enc->pgsize);
+    }
+    enc->valid[idx] = true;
+}
+
+size_t
+migr_enc_bound(const struct migr_enc *enc, size_t size)
+{
+    size_t nr_pages = (size + enc->pgsize - 1) / enc->pgsize;
+
+    return sizeof(struct migr_enc_hdr) +
+           nr_pages * sizeof(struct migr_enc_rec) + size;
+}
+
+ssize_t
+migr_encode(struct migr_enc *enc, uint64_t pos, const char *in, size_t size,
+            char *out, size_t out_size)
+{
+    struct migr_enc_hdr *hdr = (struct migr_enc_hdr *)out;
+    struct migr_enc_rec *rec = NULL;
+    size_t off, len = sizeof(*hdr);
+
+    assert(enc != NULL);
+
+    if ((enc->flags & VFU_MIGR_ENC_UNCHANGED_PAGES) && shadow_alloc(enc) < 0) {
+        return -1;
+    }
+
+    if (out_size < sizeof(*hdr)) {
+        return ERROR_INT(EOVERFLOW);
+    }
+    hdr->magic = MIGR_ENC_MAGIC;
+    hdr->pgsize = enc->pgsize;
+    hdr->pos = pos;
+    hdr->size = size;
+
+    for (off = 0; off < size; off += enc->pgsize) {
+        size_t pglen = MIN(enc->pgsize, size - off);
+        ssize_t idx = shadow_index(enc, pos + off, pglen);
+        enum migr_enc_rec_type type = MIGR_ENC_REC_DATA;
+
+        if ((enc->flags & VFU_MIGR_ENC_ZERO_PAGES) && is_zero(in + off, pglen)) {
+            type = MIGR_ENC_REC_ZERO;
+        } else if (idx >= 0 && enc->valid[idx] &&
+                   memcmp(enc->shadow + idx * enc->pgsize, in + off,
+                          pglen) == 0) {
+            type = MIGR_ENC_REC_SAME;
+        }
+
+        if (rec == NULL || rec->type != type) {
+            if (len + sizeof(*rec) > out_size) {
+                return ERROR_INT(EOVERFLOW);
+            }
+            rec = (struct migr_enc_rec *)(out + len);
+            memset(rec, 0, sizeof(*rec));
+            rec->type = type;
+            rec->crc = ~0U;
+            len += sizeof(*rec);
+        }
+        rec->nr_pages++;
+
+        switch (type) {
+        case MIGR_ENC_REC_DATA:
+            if (len + pglen > out_size) {
+                return ERROR_INT(EOVERFLOW);
+            }
+            memcpy(out + len, in + off, pglen);
+            len += pglen;
+            shadow_update(enc, idx, in + off, false);
+            break;
+        case MIGR_ENC_REC_ZERO:
+            shadow_update(enc, idx, NULL, true);
+            break;
+        case MIGR_ENC_REC_SAME:
+            rec->crc = rte_hash_crc_4byte(enc->crc[idx], rec->crc);
+            break;
+        }
+    }
+
+    return len;
+}
+
+ssize_t
+migr_decode(struct migr_enc *enc, const char *in, size_t size, char *out,
+            size_t out_size, uint64_t *pos)
+{
+    const struct migr_enc_hdr *hdr = (const struct migr_enc_hdr *)in;
+    size_t len = sizeof(*hdr);
+    uint64_t off = 0;
+
+    assert(enc != NULL);
+    assert(pos != NULL);
+
+    if (size < sizeof(*hdr) || hdr->magic != MIGR_ENC_MAGIC ||
+        hdr->pgsize != enc->pgsize || hdr->size > out_size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if ((enc->flags & VFU_MIGR_ENC_UNCHANGED_PAGES) && shadow_alloc(enc) < 0) {
+        return -1;
+    }
+
+    while (off < hdr->size) {
+        const struct migr_enc_rec *rec = (const struct migr_enc_rec *)(in + len);
+        uint32_t crc = ~0U;
+        uint32_t i;
+
+        if (size - len < sizeof(*rec) || rec->nr_pages == 0 ||
+            rec->nr_pages > (hdr->size - off + enc->pgsize - 1) / enc->pgsize) {
+            return ERROR_INT(EINVAL);
+        }
+        len += sizeof(*rec);
+
+        for (i = 0; i < rec->nr_pages; i++, off += enc->pgsize) {
+            size_t pglen = MIN(enc->pgsize, hdr->size - off);
+            ssize_t idx = shadow_index(enc, hdr->pos + off, pglen);
+
+            switch (rec->type) {
+            case MIGR_ENC_REC_DATA:
+                if (size - len < pglen) {
+                    return ERROR_INT(EINVAL);
+                }
+                memcpy(out + off, in + len, pglen);
+                len += pglen;
+                shadow_update(enc, idx, out + off, false);
+                break;
+            case MIGR_ENC_REC_ZERO:
+                memset(out + off, 0, pglen);
+                shadow_update(enc, idx, NULL, true);
+                break;
+            case MIGR_ENC_REC_SAME:
+                if (idx < 0 || !enc->valid[idx]) {
+                    return ERROR_INT(EINVAL);
+                }
+                memcpy(out + off, enc->shadow + idx * enc->pgsize, pglen);
+                crc = rte_hash_crc_4byte(enc->crc[idx], crc);
+                break;
+            default:
+                return ERROR_INT(EINVAL);
+            }
+        }
+
+        /* we and the sender disagree on what was last sent */
+        if (rec->type == MIGR_ENC_REC_SAME && crc != rec->crc) {
+            return ERROR_INT(EBADMSG);
+        }
+    }
+
+    if (len != size) {
+        return ERROR_INT(EINVAL);
+    }
+
+    *pos = hdr->pos;
+    return hdr->size;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
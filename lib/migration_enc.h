@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_MIGRATION_ENC_H
+#define LIB_VFIO_USER_MIGRATION_ENC_H
+
+/*
+ * Migration data encoder, see vfu_setup_migration_encoding().
+ *
+ * Each chunk of device state the device hands out is split into pages and
+ * sent as a header followed by records, each describing a run of pages that
+ * are either literal data, all zeroes, or unchanged since the page at the
+ * same position was last sent. To detect the latter, the sending side keeps a
+ * copy of what it last sent for each page; the receiving side keeps a copy of
+ * what it last received, which it expands these records from. The two copies
+ * are checked against each other with a CRC32C of the pages of each run.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MIGR_ENC_MAGIC 0x636e6576 /* "venc" */
+
+struct migr_enc_hdr {
+    uint32_t magic;
+    uint32_t pgsize;
+    /* position of the chunk in the device state */
+    uint64_t pos;
+    /* decoded size */
+    uint64_t size;
+} __attribute__((packed));
+
+enum migr_enc_rec_type {
+    MIGR_ENC_REC_DATA,
+    MIGR_ENC_REC_ZERO,
+    MIGR_ENC_REC_SAME,
+};
+
+struct migr_enc_rec {
+    uint32_t type;
+    uint32_t nr_pages;
+    /* MIGR_ENC_REC_SAME: CRC32C over the CRC32C of each page */
+    uint32_t crc;
+    uint32_t reserved;
+    /* MIGR_ENC_REC_DATA: the pages follow, the last one possibly partial */
+} __attribute__((packed));
+
+struct migr_enc;
+
+/*
+ * Creates an encoder for chunks of at most @max_size bytes at positions below
+ * @max_size. @flags are VFU_MIGR_ENC_*.
+ *
+ * Returns the encoder, or NULL on error setting errno.
+ */
+struct migr_enc *
+migr_enc_create(uint32_t flags, size_t pgsize, size_t max_size);
+
+void
+migr_enc_destroy(struct migr_enc *enc);
+
+/* The VFU_MIGR_ENC_* flags the encoder was created with. */
+uint32_t
+migr_enc_flags(const struct migr_enc *enc);
+
+/* Bytes allocated for @enc, including the page shadow once in use. */
+size_t
+migr_enc_memory_usage(const struct migr_enc *enc);
+
+/*
+ * Forgets what has been sent or received, at the start of a migration.
+ */
+void
+migr_enc_reset(struct migr_enc *enc);
+
+/*
+ * Returns the largest size @size bytes can be encoded into.
+ */
+size_t
+migr_enc_bound(const struct migr_enc *enc, size_t size);
+
+/*
+ * Encodes the @size bytes of device state at @pos in @in into @out.
+ *
+ * Returns the encoded size, or -1 on error setting errno.
+ */
+ssize_t
+migr_encode(struct migr_enc *enc, uint64_t pos, const char *in, size_t size,
+            char *out, size_t out_size);
+
+/*
+ * Decodes the @size bytes of @in into @out, setting @pos to the position of
+ * the chunk.
+ *
+ * Returns the decoded size, or -1 on error setting errno.
+ */
+ssize_t
+migr_decode(struct migr_enc *enc, const char *in, size_t size, char *out,
+            size_t out_size, uint64_t *pos);
+
+uint32_t
+migr_enc_crc32c(const void *data, size_t len);
+
+#endif /* LIB_VFIO_USER_MIGRATION_ENC_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -32,6 +32,7 @@
 #define LIB_VFIO_USER_MIGRATION_PRIV_H
 
 #include <linux/vfio.h>
+#include <pthread.h>
 
 /*
  * FSM to simplify saving device state.
@@ -43,6 +44,20 @@ enum migr_iter_state {
     VFIO_USER_MIGR_ITER_STATE_FINISHED
 };
 
+/* a thread transferring migration streams, see handle_mig_streams() */
+struct stream_worker {
+    vfu_ctx_t *vfu_ctx;
+    struct migration *migr;
+    bool saving;
+    /* while saving, the stream sent over fd */
+    uint32_t stream;
+    int fd;
+    pthread_t thread;
+    /* updated atomically, handle_mig_streams() reads it while running */
+    uint64_t bytes;
+    int err;
+};
+
 struct migration {
     /*
      * TODO if the user provides an FD then should mmap it and use the migration
@@ -52,6 +67,27 @@ struct migration {
     size_t pgsize;
     vfu_migration_callbacks_t callbacks;
     uint64_t data_offset;
+    /* size of the data section, from data_offset to the end of the region */
+    size_t data_area_size;
+
+    /*
+     * Library mapping of the data section, if the client can map it too; used
+     * instead of read_data/write_data if these aren't provided.
+     */
+    void *data_window;
+    void *data_window_map;
+    size_t data_window_map_size;
+
+    /*
+     * Migration data encoding, see vfu_setup_migration_encoding(): the encoded
+     * chunk being saved or restored lives in enc_buf (the data window if
+     * there's one), the device's in enc_raw.
+     */
+    struct migr_enc *enc;
+    char *enc_buf;
+    char *enc_raw;
+    /* device offset of the chunk being restored */
+    uint64_t enc_offset;
 
     /*
      * This is only for the saving state. The resuming state is simpler so we
@@ -63,6 +99,43 @@ struct migration {
         uint64_t offset;
         uint64_t size;
     } iter;
+
+    /*
+     * VFIO migration v2, see vfu_setup_device_migration_v2(): the fields above
+     * that are specific to the migration region are unused.
+     */
+    bool is_v2;
+    struct {
+        uint32_t state; /* VFIO_USER_DEVICE_STATE_* */
+        uint64_t flags;
+        vfu_migration_v2_callbacks_t callbacks;
+    } v2;
+
+    /* see vfu_setup_migration_streams() */
+    struct {
+        uint32_t nr;
+        vfu_migr_stream_read_cb_t *read_cb;
+        vfu_migr_stream_write_cb_t *write_cb;
+        /* the transfer in flight, NULL if none, see handle_mig_streams() */
+        struct stream_worker *workers;
+        size_t nr_workers;
+        /* workers still running, updated atomically */
+        size_t nr_running;
+        /* outcome of the last transfer joined */
+        uint64_t bytes;
+        int err;
+    } streams;
+
+    /* see vfu_migr_get_stats() */
+    struct {
+        /* ring of the last VFU_MIGR_PENDING_HISTORY values */
+        uint64_t pending_bytes[VFU_MIGR_PENDING_HISTORY];
+        uint64_t nr_iterations;
+        /* vfu_migr_state_t, -1 in the error state */
+        int state;
+        uint64_t state_since_ns;
+        uint64_t state_ns[VFU_MIGR_STATE_RESUME + 1];
+    } stats;
 };
 
 struct migr_state_data {
@@ -115,6 +188,12 @@ static const struct migr_state_data migr_states[(VFIO_DEVICE_STATE_MASK + 1)] =
     }
 };
 
+int
+fd_write_all(int fd, const void *buf, size_t len);
+
+ssize_t
+fd_read_all(int fd, void *buf, size_t len);
+
 MOCK_DECLARE(ssize_t, migration_region_access_registers, vfu_ctx_t *vfu_ctx,
              char *buf, size_t count, loff_t pos,  bool is_write);
 
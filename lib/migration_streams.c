@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Parallel migration streams, see vfu_setup_migration_streams().
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "migration.h"
+#include "migration_priv.h"
+#include "private.h"
+#include "thread.h"
+
+static void
+stream_save(struct stream_worker *w)
+{
+    struct vfio_user_mig_stream_hdr *hdr;
+    uint64_t seq;
+
+    hdr = malloc(sizeof(*hdr) + SERVER_MAX_DATA_XFER_SIZE);
+    if (hdr == NULL) {
+        w->err = ENOMEM;
+        return;
+    }
+
+    for (seq = 0; ; seq++) {
+        ssize_t ret = w->migr->streams.read_cb(w->vfu_ctx, w->stream, hdr->data,
+                                               SERVER_MAX_DATA_XFER_SIZE);
+
+        if (ret < 0 || ret > SERVER_MAX_DATA_XFER_SIZE) {
+            w->err = ret < 0 ? errno : EINVAL;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+
+        hdr->stream = w->stream;
+        hdr->reserved = 0;
+        hdr->seq = seq;
+        hdr->size = ret;
+        if (fd_write_all(w->fd, hdr, sizeof(*hdr) + ret) < 0) {
+            w->err = errno;
+            break;
+        }
+        __atomic_fetch_add(&w->bytes, ret, __ATOMIC_RELAXED);
+    }
+
+    free(hdr);
+}
+
+static void
+stream_load(struct stream_worker *w)
+{
+    struct vfio_user_mig_stream_hdr hdr;
+    char *buf;
+
+    buf = malloc(SERVER_MAX_DATA_XFER_SIZE);
+    if (buf == NULL) {
+        w->err = ENOMEM;
+        return;
+    }
+
+    for (;;) {
+        ssize_t ret = fd_read_all(w->fd, &hdr, sizeof(hdr));
+
+        if (ret == 0) {
+            break;
+        }
+        if (ret != sizeof(hdr) || hdr.stream >= w->migr->streams.nr ||
+            hdr.size > SERVER_MAX_DATA_XFER_SIZE) {
+            w->err = ret < 0 ? errno : EINVAL;
+            break;
+        }
+        ret = fd_read_all(w->fd, buf, hdr.size);
+        if (ret != (ssize_t)hdr.size) {
+            w->err = ret < 0 ? errno : EINVAL;
+            break;
+        }
+        ret = w->migr->streams.write_cb(w->vfu_ctx, hdr.stream, hdr.seq, buf,
+                                        hdr.size);
+        if (ret < 0) {
+            w->err = errno;
+            break;
+        }
+        __atomic_fetch_add(&w->bytes, hdr.size, __ATOMIC_RELAXED);
+    }
+
+    free(buf);
+}
+
+static void *
+stream_worker(void *arg)
+{
+    struct stream_worker *w = arg;
+
+    if (w->saving) {
+        stream_save(w);
+    } else {
+        stream_load(w);
+    }
+    /* closing it tells the client this stream is done */
+    close(w->fd);
+    w->fd = -1;
+    __atomic_sub_fetch(&w->migr->streams.nr_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Starts a worker per file descriptor in @msg. On failure the workers already
+ * started are joined.
+ */
+static int
+streams_start(vfu_ctx_t *vfu_ctx, struct migration *migr, vfu_msg_t *msg)
+{
+    struct stream_worker *workers;
+    bool saving = migration_is_saving(migr);
+    size_t i, nr_fds = msg->in.nr_fds;
+    int err = 0;
+
+    workers = calloc(nr_fds, sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < nr_fds; i++) {
+        workers[i].vfu_ctx = vfu_ctx;
+        workers[i].migr = migr;
+        workers[i].saving = saving;
+        workers[i].stream = i;
+        workers[i].fd = consume_fd(msg->in.fds, msg->in.nr_fds, i);
+    }
+
+    migr->streams.workers = workers;
+    migr->streams.nr_workers = 0;
+    migr->streams.bytes = 0;
+    migr->streams.err = 0;
+
+    for (i = 0; i < nr_fds; i++) {
+        __atomic_add_fetch(&migr->streams.nr_running, 1, __ATOMIC_RELAXED);
+        err = thread_create(vfu_ctx, &workers[i].thread, "migr", stream_worker,
+                            &workers[i]);
+        if (err != 0) {
+            __atomic_sub_fetch(&migr->streams.nr_running, 1, __ATOMIC_RELAXED);
+            vfu_log(vfu_ctx, LOG_ERR, "failed to start stream thread: %s",
+                    strerror(err));
+            break;
+        }
+        migr->streams.nr_workers++;
+    }
+
+    if (err != 0) {
+        for (; i < nr_fds; i++) {
+            close(workers[i].fd);
+        }
+        if (migr->streams.nr_workers > 0) {
+            migration_streams_join(migr);
+        } else {
+            free(workers);
+            migr->streams.workers = NULL;
+        }
+        return ERROR_INT(err);
+    }
+    return 0;
+}
+
+int
+migration_set_streams(struct migration *migr, uint32_t nr_streams,
+                      vfu_migr_stream_read_cb_t *read_cb,
+                      vfu_migr_stream_write_cb_t *write_cb)
+{
+    assert(migr != NULL);
+
+    if (nr_streams == 0 || read_cb == NULL || write_cb == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    migr->streams.nr = nr_streams;
+    migr->streams.read_cb = read_cb;
+    migr->streams.write_cb = write_cb;
+    return 0;
+}
+
+int
+handle_mig_streams(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    struct vfio_user_mig_streams *req = msg->in.iov.iov_base;
+    struct migration *migr = vfu_ctx->migration;
+    struct vfio_user_mig_streams *res;
+    uint32_t flags = 0;
+    uint64_t size = 0;
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+    assert(msg != NULL);
+
+    if (msg->in.iov.iov_len < sizeof(*req) || req->argsz < sizeof(*req) ||
+        req->flags != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "invalid migration streams request");
+        return ERROR_INT(EINVAL);
+    }
+
+    if (migr == NULL || migr->streams.nr == 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "migration streams not configured");
+        return ERROR_INT(ENOTSUP);
+    }
+
+    /* reap a transfer that has finished */
+    if (migr->streams.workers != NULL &&
+        __atomic_load_n(&migr->streams.nr_running, __ATOMIC_ACQUIRE) == 0) {
+        migration_streams_join(migr);
+    }
+
+    if (msg->in.nr_fds > 0) {
+        if (migr->streams.workers != NULL) {
+            vfu_log(vfu_ctx, LOG_ERR, "migration: streams already in flight");
+            return ERROR_INT(EALREADY);
+        }
+        if (migration_is_saving(migr)) {
+            if (msg->in.nr_fds != migr->streams.nr) {
+                vfu_log(vfu_ctx, LOG_ERR, "migration: need %u stream fds, "
+                        "got %zu", migr->streams.nr, msg->in.nr_fds);
+                return ERROR_INT(EINVAL);
+            }
+        } else if (!migration_is_resuming(migr)) {
+            vfu_log(vfu_ctx, LOG_ERR, "migration: cannot stream now");
+            return ERROR_INT(EINVAL);
+        }
+        if (streams_start(vfu_ctx, migr, msg) < 0) {
+            return -1;
+        }
+    }
+
+    if (migr->streams.workers != NULL) {
+        flags = VFIO_USER_MIG_STREAMS_F_BUSY;
+        for (i = 0; i < migr->streams.nr_workers; i++) {
+            size += __atomic_load_n(&migr->streams.workers[i].bytes,
+                                    __ATOMIC_RELAXED);
+        }
+    } else if (migr->streams.err != 0) {
+        return ERROR_INT(migr->streams.err);
+    } else {
+        size = migr->streams.bytes;
+    }
+
+    msg->out.iov.iov_base = calloc(1, sizeof(*res));
+    if (msg->out.iov.iov_base == NULL) {
+        return -1;
+    }
+    msg->out.iov.iov_len = sizeof(*res);
+    res = msg->out.iov.iov_base;
+    res->argsz = sizeof(*res);
+    res->flags = flags;
+    res->nr_streams = migr->streams.nr;
+    res->size = size;
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include "msix.h"
+#include "pci_caps/msix.h"
+
+struct msix {
+    uint32_t    nr_vectors;
+    uint32_t    table_bar;
+    uint64_t    table_off;
+    uint64_t    table_size;
+    uint32_t    pba_bar;
+    uint64_t    pba_off;
+    uint64_t    pba_size;
+    /* mirror Message Control */
+    bool        enabled;
+    bool        mask_all;
+    /* PCI_MSIX_ENTRY_SIZE bytes per vector, as the guest sees it */
+    uint32_t    *table;
+    uint64_t    *pba;
+};
+
+#define ENTRY_DWORDS (PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t))
+#define CTRL_DWORD (PCI_MSIX_ENTRY_VECTOR_CTRL / sizeof(uint32_t))
+
+static bool
+ranges_overlap(uint64_t start1, uint64_t size1, uint64_t start2,
+               uint64_t size2)
+{
+    return start1 < start2 + size2 && start2 < start1 + size1;
+}
+
+static bool
+overlaps_mmap_area(vfu_reg_info_t *reg, uint64_t start, uint64_t size)
+{
+    int i;
+
+    for (i = 0; i < reg->nr_mmap_areas; i++) {
+        if (ranges_overlap(start, size,
+                           (uintptr_t)reg->mmap_areas[i].iov_base,
+                           reg->mmap_areas[i].iov_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+EXPORT int
+vfu_setup_msix_table(vfu_ctx_t *vfu_ctx)
+{
+    struct msixcap *cap;
+    struct msix *msix;
+    vfu_reg_info_t *reg;
+    size_t pos;
+    uint32_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (vfu_ctx->msix != NULL) {
+        return ERROR_INT(EEXIST);
+    }
+
+    pos = vfu_pci_find_capability(vfu_ctx, false, PCI_CAP_ID_MSIX);
+    if (pos == 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "no MSI-X capability");
+        return ERROR_INT(EINVAL);
+    }
+    cap = (struct msixcap *)((char *)vfu_ctx->pci.config_space + pos);
+
+    msix = calloc(1, sizeof(*msix));
+    if (msix == NULL) {
+        return -1;
+    }
+
+    msix->nr_vectors = cap->mxc.ts + 1;
+    msix->table_bar = cap->mtab.tbir;
+    msix->table_off = (uint64_t)cap->mtab.to << 3;
+    msix->table_size = (uint64_t)msix->nr_vectors * PCI_MSIX_ENTRY_SIZE;
+    msix->pba_bar = cap->mpba.pbir;
+    msix->pba_off = (uint64_t)cap->mpba.pbao << 3;
+    msix->pba_size = ROUND_UP(msix->nr_vectors, 64) / CHAR_BIT;
+
+    if (msix->table_bar > VFU_PCI_DEV_BAR5_REGION_IDX ||
+        msix->pba_bar > VFU_PCI_DEV_BAR5_REGION_IDX) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad MSI-X table or PBA BIR");
+        goto fail_inval;
+    }
+
+    reg = &vfu_ctx->reg_info[msix->table_bar];
+    if (msix->table_off + msix->table_size > reg->size ||
+        overlaps_mmap_area(reg, msix->table_off, msix->table_size)) {
+        vfu_log(vfu_ctx, LOG_ERR, "MSI-X table [%#lx, %#lx) doesn't fit in "
+                "the non-mappable part of region %u", msix->table_off,
+                msix->table_off + msix->table_size, msix->table_bar);
+        goto fail_inval;
+    }
+
+    reg = &vfu_ctx->reg_info[msix->pba_bar];
+    if (msix->pba_off + msix->pba_size > reg->size ||
+        overlaps_mmap_area(reg, msix->pba_off, msix->pba_size) ||
+        (msix->pba_bar == msix->table_bar &&
+         ranges_overlap(msix->table_off, msix->table_size,
+                        msix->pba_off, msix->pba_size))) {
+        vfu_log(vfu_ctx, LOG_ERR, "MSI-X PBA [%#lx, %#lx) doesn't fit in the "
+                "non-mappable part of region %u, or overlaps the table",
+                msix->pba_off, msix->pba_off + msix->pba_size, msix->pba_bar);
+        goto fail_inval;
+    }
+
+    msix->table = calloc(1, msix->table_size);
+    msix->pba = calloc(1, msix->pba_size);
+    if (msix->table == NULL || msix->pba == NULL) {
+        free(msix->table);
+        free(msix->pba);
+        free(msix);
+        return ERROR_INT(ENOMEM);
+    }
+
+    for (i = 0; i < msix->nr_vectors; i++) {
+        msix->table[i * ENTRY_DWORDS + CTRL_DWORD] = PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    }
+
+    msix->enabled = cap->mxc.mxe;
+    msix->mask_all = cap->mxc.fm;
+
+    vfu_ctx->msix = msix;
+    return 0;
+
+fail_inval:
+    free(msix);
+    return ERROR_INT(EINVAL);
+}
+
+int
+msix_clone(vfu_ctx_t *vfu_ctx, const vfu_ctx_t *template)
+{
+    const struct msix *src = template->msix;
+    struct msix *msix;
+
+    if (src == NULL) {
+        return 0;
+    }
+
+    msix = malloc(sizeof(*msix));
+    if (msix == NULL) {
+        return -1;
+    }
+    *msix = *src;
+
+    msix->table = malloc(msix->table_size);
+    msix->pba = malloc(msix->pba_size);
+    if (msix->table == NULL || msix->pba == NULL) {
+        free(msix->table);
+        free(msix->pba);
+        free(msix);
+        return ERROR_INT(ENOMEM);
+    }
+
+    vfu_ctx->msix = msix;
+    msix_reset(vfu_ctx);
+    return 0;
+}
+
+size_t
+msix_memory_usage(const vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->msix == NULL) {
+        return 0;
+    }
+    return sizeof(*vfu_ctx->msix) + vfu_ctx->msix->table_size +
+           vfu_ctx->msix->pba_size;
+}
+
+void
+msix_free(vfu_ctx_t *vfu_ctx)
+{
+    if (vfu_ctx->msix == NULL) {
+        return;
+    }
+
+    free(vfu_ctx->msix->table);
+    free(vfu_ctx->msix->pba);
+    free(vfu_ctx->msix);
+    vfu_ctx->msix = NULL;
+}
+
+/*
+ * Saved state: enabled and mask_all as a byte each, padded to eight bytes,
+ * then the table and the PBA.
+ */
+#define STATE_HDR_SIZE 8
+
+size_t
+msix_state_size(vfu_ctx_t *vfu_ctx)
+{
+    struct msix *msix = vfu_ctx->msix;
+
+    if (msix == NULL) {
+        return 0;
+    }
+
+    return STATE_HDR_SIZE + msix->table_size + msix->pba_size;
+}
+
+void
+msix_save_state(vfu_ctx_t *vfu_ctx, void *buf)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint8_t *p = buf;
+    uint32_t i;
+
+    assert(msix != NULL);
+
+    memset(p, 0, STATE_HDR_SIZE);
+    p[0] = msix->enabled;
+    p[1] = msix->mask_all;
+    p += STATE_HDR_SIZE;
+
+    for (i = 0; i < msix->table_size / sizeof(uint32_t); i++) {
+        uint32_t v = __atomic_load_n(&msix->table[i], __ATOMIC_SEQ_CST);
+        memcpy(p + i * sizeof(v), &v, sizeof(v));
+    }
+    p += msix->table_size;
+    for (i = 0; i < msix->pba_size / sizeof(uint64_t); i++) {
+        uint64_t v = __atomic_load_n(&msix->pba[i], __ATOMIC_SEQ_CST);
+        memcpy(p + i * sizeof(v), &v, sizeof(v));
+    }
+}
+
+int
+msix_load_state(vfu_ctx_t *vfu_ctx, const void *buf, size_t size)
+{
+    struct msix *msix = vfu_ctx->msix;
+    const uint8_t *p = buf;
+
+    if (size != msix_state_size(vfu_ctx)) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (msix == NULL) {
+        return 0;
+    }
+
+    msix->enabled = p[0];
+    msix->mask_all = p[1];
+    p += STATE_HDR_SIZE;
+    memcpy(msix->table, p, msix->table_size);
+    p += msix->table_size;
+    memcpy(msix->pba, p, msix->pba_size);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void
+msix_reset(vfu_ctx_t *vfu_ctx)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint32_t i;
+
+    if (msix == NULL) {
+        return;
+    }
+
+    for (i = 0; i < msix->table_size / sizeof(uint32_t); i++) {
+        __atomic_store_n(&msix->table[i],
+                         i % ENTRY_DWORDS == CTRL_DWORD ?
+                         PCI_MSIX_ENTRY_CTRL_MASKBIT : 0, __ATOMIC_SEQ_CST);
+    }
+    for (i = 0; i < msix->pba_size / sizeof(uint64_t); i++) {
+        __atomic_store_n(&msix->pba[i], 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+static bool
+vector_masked(struct msix *msix, uint32_t vector)
+{
+    return __atomic_load_n(&msix->mask_all, __ATOMIC_SEQ_CST) ||
+           (__atomic_load_n(&msix->table[vector * ENTRY_DWORDS + CTRL_DWORD],
+                            __ATOMIC_SEQ_CST) & PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+/* Clears the pending bit of @vector, returning whether it was set. */
+static bool
+vector_claim(struct msix *msix, uint32_t vector)
+{
+    uint64_t bit = 1ULL << (vector % 64);
+
+    return __atomic_fetch_and(&msix->pba[vector / 64], ~bit,
+                              __ATOMIC_SEQ_CST) & bit;
+}
+
+static void
+vector_fire(vfu_ctx_t *vfu_ctx, uint32_t vector)
+{
+    int efd;
+
+    if (vfu_ctx->irqs == NULL || vector >= vfu_ctx->irqs->max_ivs) {
+        return;
+    }
+
+    efd = vfu_ctx->irqs->efds[vector];
+    if (efd >= 0 && eventfd_write(efd, 1) == -1) {
+        vfu_log(vfu_ctx, LOG_ERR, "failed to fire pending MSI-X vector %u: %m",
+                vector);
+    }
+}
+
+/* Fires @vector if it's pending and no longer masked. */
+static void
+vector_deliver(vfu_ctx_t *vfu_ctx, uint32_t vector)
+{
+    struct msix *msix = vfu_ctx->msix;
+
+    if (!vector_masked(msix, vector) && vector_claim(msix, vector)) {
+        vector_fire(vfu_ctx, vector);
+    }
+}
+
+bool
+msix_latch(vfu_ctx_t *vfu_ctx, uint32_t vector)
+{
+    struct msix *msix = vfu_ctx->msix;
+
+    if (msix == NULL || vector >= msix->nr_vectors ||
+        !__atomic_load_n(&msix->enabled, __ATOMIC_SEQ_CST) ||
+        !vector_masked(msix, vector)) {
+        return false;
+    }
+
+    __atomic_fetch_or(&msix->pba[vector / 64], 1ULL << (vector % 64),
+                      __ATOMIC_SEQ_CST);
+
+    /*
+     * If the vector was unmasked meanwhile, whoever did it may have looked at
+     * the pending bit before we set it: fire it ourselves unless they got it.
+     */
+    if (!vector_masked(msix, vector) && vector_claim(msix, vector)) {
+        return false;
+    }
+
+    return true;
+}
+
+void
+msix_ctrl_write(vfu_ctx_t *vfu_ctx, bool enable, bool mask_all)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint32_t i;
+
+    if (msix == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&msix->enabled, enable, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&msix->mask_all, mask_all, __ATOMIC_SEQ_CST);
+
+    if (enable && !mask_all) {
+        for (i = 0; i < msix->nr_vectors; i++) {
+            vector_deliver(vfu_ctx, i);
+        }
+    }
+}
+
+static void
+table_write_ctrl(vfu_ctx_t *vfu_ctx, uint32_t vector, uint32_t val)
+{
+    struct msix *msix = vfu_ctx->msix;
+    vfu_dev_irq_state_cb_t *cb = vfu_ctx->irq_state_cbs[VFU_DEV_MSIX_IRQ];
+    uint32_t old;
+
+    /* everything but the mask bit is reserved */
+    val &= PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    old = __atomic_exchange_n(&msix->table[vector * ENTRY_DWORDS + CTRL_DWORD],
+                              val, __ATOMIC_SEQ_CST);
+    if (old == val) {
+        return;
+    }
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "MSI-X vector %u %s", vector,
+            val ? "masked" : "unmasked");
+
+    if (cb != NULL) {
+        cb(vfu_ctx, vector, 1, val != 0);
+    }
+
+    if (val == 0) {
+        vector_deliver(vfu_ctx, vector);
+    }
+}
+
+static ssize_t
+table_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, uint64_t offset,
+             bool is_write)
+{
+    struct msix *msix = vfu_ctx->msix;
+    size_t i;
+
+    for (i = 0; i < count / sizeof(uint32_t); i++) {
+        size_t idx = offset / sizeof(uint32_t) + i;
+        uint32_t val;
+
+        if (!is_write) {
+            val = __atomic_load_n(&msix->table[idx], __ATOMIC_SEQ_CST);
+            memcpy(buf + i * sizeof(val), &val, sizeof(val));
+            continue;
+        }
+
+        memcpy(&val, buf + i * sizeof(val), sizeof(val));
+        if (idx % ENTRY_DWORDS == CTRL_DWORD) {
+            table_write_ctrl(vfu_ctx, idx / ENTRY_DWORDS, val);
+        } else {
+            __atomic_store_n(&msix->table[idx], val, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    return count;
+}
+
+static ssize_t
+pba_access(vfu_ctx_t *vfu_ctx, char *buf, size_t count, uint64_t offset,
+           bool is_write)
+{
+    struct msix *msix = vfu_ctx->msix;
+    uint64_t val;
+
+    /* the PBA is read-only, writes are ignored */
+    if (is_write) {
+        return count;
+    }
+
+    val = __atomic_load_n(&msix->pba[offset / sizeof(uint64_t)],
+                          __ATOMIC_SEQ_CST);
+    memcpy(buf, (char *)&val + offset % sizeof(uint64_t), count);
+    return count;
+}
+
+bool
+msix_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+            uint64_t offset, bool is_write, ssize_t *ret)
+{
+    struct msix *msix = vfu_ctx->msix;
+    bool table;
+
+    if (msix == NULL) {
+        return false;
+    }
+
+    if (region == msix->table_bar && offset >= msix->table_off &&
+        offset < msix->table_off + msix->table_size) {
+        table = true;
+        offset -= msix->table_off;
+    } else if (region == msix->pba_bar && offset >= msix->pba_off &&
+               offset < msix->pba_off + msix->pba_size) {
+        table = false;
+        offset -= msix->pba_off;
+    } else {
+        return false;
+    }
+
+    /* the spec only allows aligned dword and qword accesses */
+    if ((count != 4 && count != 8) || offset % count != 0 ||
+        offset + count > (table ? msix->table_size : msix->pba_size)) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad MSI-X %s access %#lx-%#lx",
+                table ? "table" : "PBA", offset, offset + count);
+        *ret = ERROR_INT(EINVAL);
+        return true;
+    }
+
+    if (table) {
+        *ret = table_access(vfu_ctx, buf, count, offset, is_write);
+    } else {
+        *ret = pba_access(vfu_ctx, buf, count, offset, is_write);
+    }
+    return true;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_MSIX_H
+#define LIB_VFIO_USER_MSIX_H
+
+/*
+ * MSI-X table and PBA emulation, see vfu_setup_msix_table().
+ *
+ * The table lives in library memory and is served straight from the region
+ * access path. The mask bits and pending bits are only ever accessed
+ * atomically, so vfu_irq_trigger() can be called from any device thread: for
+ * a masked vector it latches the pending bit, and whoever unmasks the vector
+ * afterwards fires it. Both sides re-check after publishing their own change,
+ * and claim the pending bit with an atomic exchange, so an interrupt is never
+ * lost nor delivered twice.
+ */
+
+#include "libvfio-user.h"
+#include "private.h"
+
+/*
+ * If [@offset, @offset + @count) of @region is the emulated table or PBA,
+ * handles the access, sets *@ret and returns true.
+ */
+bool
+msix_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+            uint64_t offset, bool is_write, ssize_t *ret);
+
+/*
+ * Returns true if @vector is masked, in which case it's now pending and
+ * mustn't be fired.
+ */
+bool
+msix_latch(vfu_ctx_t *vfu_ctx, uint32_t vector);
+
+/* Called when the MSI-X capability's Message Control is written. */
+void
+msix_ctrl_write(vfu_ctx_t *vfu_ctx, bool enable, bool mask_all);
+
+/* Back to the state after reset: all vectors masked, none pending. */
+void
+msix_reset(vfu_ctx_t *vfu_ctx);
+
+/* Gives @vfu_ctx the same table and PBA as @template, after reset. */
+int
+msix_clone(vfu_ctx_t *vfu_ctx, const vfu_ctx_t *template);
+
+/* Bytes allocated for the emulated table and PBA. */
+size_t
+msix_memory_usage(const vfu_ctx_t *vfu_ctx);
+
+void
+msix_free(vfu_ctx_t *vfu_ctx);
+
+/*
+ * Table, PBA and Message Control state, for vfu_ctx_export_state(): the size
+ * is 0 if there's no emulated MSI-X.
+ */
+size_t
+msix_state_size(vfu_ctx_t *vfu_ctx);
+
+void
+msix_save_state(vfu_ctx_t *vfu_ctx, void *buf);
+
+int
+msix_load_state(vfu_ctx_t *vfu_ctx, const void *buf, size_t size);
+
+#endif /* LIB_VFIO_USER_MSIX_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
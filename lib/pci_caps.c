@@ -63,6 +63,7 @@
 
 #include "common.h"
 #include "libvfio-user.h"
+#include "msix.h"
 #include "pci_caps.h"
 #include "pci.h"
 #include "private.h"
@@ -196,6 +197,8 @@ cap_write_msix(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, char *buf,
         msix->mxc.mxe = new_msix.mxc.mxe;
     }
 
+    msix_ctrl_write(vfu_ctx, msix->mxc.mxe, msix->mxc.fm);
+
     return count;
 }
 
@@ -599,6 +602,28 @@ ext_cap_place(vfu_ctx_t *vfu_ctx, struct pci_cap *cap, void *data)
     return 0;
 }
 
+/*
+ * Make room for one more entry in a capability table; the tables are only
+ * allocated once a device actually adds capabilities.
+ */
+static int
+caps_grow(struct pci_cap **caps, size_t nr_caps)
+{
+    struct pci_cap *new;
+
+    if (nr_caps == VFU_MAX_CAPS) {
+        return ERROR_INT(ENOSPC);
+    }
+
+    new = realloc(*caps, (nr_caps + 1) * sizeof(*new));
+    if (new == NULL) {
+        return -1;
+    }
+
+    *caps = new;
+    return 0;
+}
+
 EXPORT ssize_t
 vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
 {
@@ -634,8 +659,8 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
             return ERROR_INT(EINVAL);
         }
 
-        if (vfu_ctx->pci.nr_ext_caps == VFU_MAX_CAPS) {
-            return ERROR_INT(ENOSPC);
+        if (caps_grow(&vfu_ctx->pci.ext_caps, vfu_ctx->pci.nr_ext_caps) < 0) {
+            return -1;
         }
 
         cap.id = ((struct pcie_ext_cap_hdr *)data)->id;
@@ -666,8 +691,8 @@ vfu_pci_add_capability(vfu_ctx_t *vfu_ctx, size_t pos, int flags, void *data)
         ret = ext_cap_place(vfu_ctx, &cap, data);
 
     } else {
-        if (vfu_ctx->pci.nr_caps == VFU_MAX_CAPS) {
-            return ERROR_INT(ENOSPC);
+        if (caps_grow(&vfu_ctx->pci.caps, vfu_ctx->pci.nr_caps) < 0) {
+            return -1;
         }
 
         cap.id = ((struct cap_hdr *)data)->id;
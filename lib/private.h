@@ -38,6 +38,7 @@
 #include <pthread.h>
 
 #include "common.h"
+#include "log.h"
 #include "pci_caps.h"
 #include "vfio-user.h"
 
@@ -90,6 +91,8 @@ typedef struct {
 } vfu_irqs_t;
 
 struct migration;
+struct reg_file;
+struct shadow;
 
 typedef struct  {
     /* Region flags, see VFU_REGION_FLAG_READ and friends. */
@@ -107,31 +110,42 @@ typedef struct  {
     uint64_t offset;
     /* The subregions for ioregionfds and ioeventfds */
     LIST_HEAD(, ioeventfd) subregions;
+    /* Typed registers, see vfu_setup_region_regs(). */
+    struct reg_file *regs;
+    /* Cacheable ranges, see vfu_region_shadow_range(). */
+    struct shadow *shadow;
 } vfu_reg_info_t;
 
 struct pci_dev {
     vfu_pci_type_t          type;
     vfu_pci_config_space_t  *config_space;
-    struct pci_cap          caps[VFU_MAX_CAPS];
+    /* Grown on demand, up to VFU_MAX_CAPS entries each. */
+    struct pci_cap          *caps;
     size_t                  nr_caps;
-    struct pci_cap          ext_caps[VFU_MAX_CAPS];
+    struct pci_cap          *ext_caps;
     size_t                  nr_ext_caps;
 };
 
 struct dma_controller;
+struct thread_attr;
+struct vfu_loop_entry;
 
 enum vfu_ctx_pending_state {
     VFU_CTX_PENDING_NONE,
     VFU_CTX_PENDING_MSG,
     VFU_CTX_PENDING_DEVICE_RESET,
-    VFU_CTX_PENDING_CTX_RESET
+    VFU_CTX_PENDING_CTX_RESET,
+    VFU_CTX_PENDING_MIGR
 };
 
 struct vfu_ctx_pending_info {
     enum vfu_ctx_pending_state  state;
     vfu_msg_t                   *msg;
 
-    /* when pending == VFU_CTX_PENDING_XXX_RESET */
+    /*
+     * When pending == VFU_CTX_PENDING_XXX_RESET, or the state the device is
+     * moving to when pending == VFU_CTX_PENDING_MIGR.
+     */
     uint32_t                migr_dev_state;
 };
 
@@ -145,20 +159,53 @@ enum cb_type {
 };
 
 struct vfu_ctx {
-    void                    *pvt;
-    struct dma_controller   *dma;
+    /*
+     * Fields used for every request come first, so that they share the
+     * leading cache lines; setup-time state follows. Larger, optional state
+     * (capability tables, DMA regions, MSI-X, migration) is allocated only
+     * once the device uses it.
+     */
+    struct transport_ops    *tran;
+    void                    *tran_data;
+    struct vfu_ctx_pending_info pending;
+    bool                    quiesced;
+    bool                    realized;
+    enum cb_type            in_cb;
     int                     log_level;
     vfu_log_fn_t            *log;
+    /* See vfu_setup_log_async(), NULL if messages are logged directly. */
+    struct log_queue        *log_queue;
+    void                    *pvt;
+    uint64_t                flags;
     size_t                  nr_regions;
     vfu_reg_info_t          *reg_info;
-    struct pci_dev          pci;
-    struct transport_ops    *tran;
-    void                    *tran_data;
-    uint64_t                flags;
-    char                    *uuid;
+    struct dma_controller   *dma;
+    struct migration        *migration;
+    int                     client_max_fds;
+    size_t                  client_max_data_xfer_size;
 
-    /* vsock stuff */
-    pthread_t vsock_thread_id;
+    /* Busy-poll spin period before blocking, 0 if disabled. */
+    uint64_t                busy_poll_ns;
+
+    /* Set while the context is hosted by a vfu_loop_t. */
+    struct vfu_loop_entry   *loop_entry;
+
+    /*
+     * Hands off between a quiesce callback returning EBUSY and the device
+     * calling vfu_device_quiesced(), possibly on another thread before the
+     * callback has returned; see call_quiesce_cb(). Likewise between a
+     * migration transition callback and vfu_migr_done(), see migr_settle().
+     */
+    pthread_mutex_t         quiesce_lock;
+    bool                    in_quiesce_cb;
+    /* vfu_device_quiesced() was called while in_quiesce_cb was set */
+    bool                    quiesce_done;
+    int                     quiesce_errno;
+    /* a request that may call the transition callback is being handled */
+    bool                    in_migr_request;
+    /* vfu_migr_done() was called while in_migr_request was set */
+    bool                    migr_done;
+    int                     migr_errno;
 
     /* device callbacks */
     vfu_device_quiesce_cb_t *quiesce;
@@ -166,22 +213,29 @@ struct vfu_ctx {
     vfu_dma_register_cb_t   *dma_register;
     vfu_dma_unregister_cb_t *dma_unregister;
 
-    int                     client_max_fds;
-    size_t                  client_max_data_xfer_size;
-
-    struct vfu_ctx_pending_info pending;
-    bool                    quiesced;
-    enum cb_type            in_cb;
-
-    struct migration        *migration;
+    struct pci_dev          pci;
+    ssize_t                 pci_cap_exp_off;
+    vfu_dev_type_t          dev_type;
+    char                    *uuid;
 
     uint32_t                irq_count[VFU_DEV_NUM_IRQS];
     vfu_dev_irq_state_cb_t  *irq_state_cbs[VFU_DEV_NUM_IRQS];
     vfu_irqs_t              *irqs;
-    bool                    realized;
-    vfu_dev_type_t          dev_type;
 
-    ssize_t                 pci_cap_exp_off;
+    /* vsock stuff */
+    pthread_t vsock_thread_id;
+
+    /* See vfu_setup_thread_attr(), NULL for the defaults. */
+    struct thread_attr      *thread_attr;
+
+    /* Services ioregionfds, see ioregionfd.h. */
+    struct ioregionfd_loop  *ioregionfd;
+
+    /* Emulated MSI-X table and PBA, see msix.h. */
+    struct msix             *msix;
+
+    /* Set once vfu_ctx_export_state() has passed the client on. */
+    bool                    handed_over;
 };
 
 typedef struct ioeventfd {
@@ -189,7 +243,16 @@ typedef struct ioeventfd {
     uint64_t size;
     int32_t fd;
     uint32_t flags;
-    uint64_t datamatch;
+    /* VFIO_USER_IO_FD_TYPE_* */
+    uint32_t type;
+    union {
+        uint64_t datamatch;
+        /* ioregionfd: passed back by the client in each frame */
+        uint64_t user_data;
+    };
+    /* ioregionfd: region index, and our end of the socket pair */
+    uint32_t region;
+    int server_fd;
     LIST_ENTRY(ioeventfd) entry;
 } ioeventfd_t;
 
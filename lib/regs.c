@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "regs.h"
+
+struct reg {
+    vfu_reg_t   desc;
+    uint64_t    value;
+};
+
+struct reg_file {
+    size_t      nr_regs;
+    /* sorted by offset */
+    struct reg  regs[];
+};
+
+static uint64_t
+width_mask(uint32_t width)
+{
+    return width == sizeof(uint64_t) ? UINT64_MAX : (1ULL << (width * 8)) - 1;
+}
+
+/* Returns the register starting at @offset, if any. */
+static struct reg *
+reg_lookup(struct reg_file *rf, uint64_t offset)
+{
+    size_t lo = 0, hi;
+
+    if (rf == NULL) {
+        return NULL;
+    }
+
+    hi = rf->nr_regs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t start = rf->regs[mid].desc.offset;
+
+        if (start == offset) {
+            return &rf->regs[mid];
+        }
+        if (start < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static int
+reg_cmp(const void *a, const void *b)
+{
+    const struct reg *ra = a, *rb = b;
+
+    if (ra->desc.offset < rb->desc.offset) {
+        return -1;
+    }
+    return ra->desc.offset > rb->desc.offset;
+}
+
+EXPORT int
+vfu_setup_region_regs(vfu_ctx_t *vfu_ctx, int region_idx, const vfu_reg_t *regs,
+                      size_t nr_regs)
+{
+    vfu_reg_info_t *vfu_reg;
+    struct reg_file *rf;
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (region_idx < 0 || region_idx >= (int)vfu_ctx->nr_regions ||
+        region_idx == VFU_PCI_DEV_CFG_REGION_IDX ||
+        region_idx == VFU_PCI_DEV_MIGR_REGION_IDX ||
+        regs == NULL || nr_regs == 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+
+    if (vfu_reg->regs != NULL) {
+        return ERROR_INT(EEXIST);
+    }
+
+    for (i = 0; i < nr_regs; i++) {
+        const vfu_reg_t *r = &regs[i];
+
+        if ((r->width != 1 && r->width != 2 && r->width != 4 &&
+             r->width != 8) || r->offset < 0 || r->offset % r->width != 0 ||
+            (uint64_t)r->offset + r->width > vfu_reg->size ||
+            r->type > VFU_REG_W1C) {
+            vfu_log(vfu_ctx, LOG_ERR, "bad register %zu (offset %#lx width %u "
+                    "type %d) for region %d", i, r->offset, r->width, r->type,
+                    region_idx);
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    rf = calloc(1, sizeof(*rf) + nr_regs * sizeof(rf->regs[0]));
+    if (rf == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+    rf->nr_regs = nr_regs;
+
+    for (i = 0; i < nr_regs; i++) {
+        rf->regs[i].desc = regs[i];
+        rf->regs[i].value = regs[i].value & width_mask(regs[i].width);
+    }
+
+    qsort(rf->regs, nr_regs, sizeof(rf->regs[0]), reg_cmp);
+
+    /* once sorted, a register can only overlap the next one */
+    for (i = 0; i + 1 < nr_regs; i++) {
+        const vfu_reg_t *r = &rf->regs[i].desc;
+
+        if (r->offset + r->width > rf->regs[i + 1].desc.offset) {
+            vfu_log(vfu_ctx, LOG_ERR, "register at %#lx of region %d "
+                    "overlaps another", rf->regs[i + 1].desc.offset,
+                    region_idx);
+            free(rf);
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    vfu_reg->regs = rf;
+    return 0;
+}
+
+int
+regs_clone(vfu_reg_info_t *reg, const vfu_reg_info_t *template)
+{
+    const struct reg_file *src = template->regs;
+    struct reg_file *rf;
+    size_t i;
+
+    if (src == NULL) {
+        return 0;
+    }
+
+    rf = malloc(sizeof(*rf) + src->nr_regs * sizeof(rf->regs[0]));
+    if (rf == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+    rf->nr_regs = src->nr_regs;
+
+    for (i = 0; i < src->nr_regs; i++) {
+        rf->regs[i].desc = src->regs[i].desc;
+        rf->regs[i].value = rf->regs[i].desc.value &
+                            width_mask(rf->regs[i].desc.width);
+    }
+
+    reg->regs = rf;
+    return 0;
+}
+
+size_t
+regs_memory_usage(const struct reg_file *rf)
+{
+    if (rf == NULL) {
+        return 0;
+    }
+    return sizeof(*rf) + rf->nr_regs * sizeof(rf->regs[0]);
+}
+
+void
+regs_free(vfu_reg_info_t *reg)
+{
+    if (reg->regs == NULL) {
+        return;
+    }
+    free(reg->regs);
+    reg->regs = NULL;
+}
+
+static struct reg *
+reg_find(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset)
+{
+    struct reg *reg;
+
+    assert(vfu_ctx != NULL);
+
+    if (region_idx < 0 || region_idx >= (int)vfu_ctx->nr_regions ||
+        offset < 0) {
+        return ERROR_PTR(EINVAL);
+    }
+
+    reg = reg_lookup(vfu_ctx->reg_info[region_idx].regs, offset);
+    if (reg == NULL) {
+        return ERROR_PTR(ENOENT);
+    }
+    return reg;
+}
+
+EXPORT int
+vfu_reg_get(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset, uint64_t *val)
+{
+    struct reg *reg = reg_find(vfu_ctx, region_idx, offset);
+
+    if (reg == NULL) {
+        return -1;
+    }
+    *val = __atomic_load_n(&reg->value, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+EXPORT int
+vfu_reg_set(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset, uint64_t val)
+{
+    struct reg *reg = reg_find(vfu_ctx, region_idx, offset);
+
+    if (reg == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&reg->value, val & width_mask(reg->desc.width),
+                     __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+EXPORT int
+vfu_reg_set_bits(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                 uint64_t bits)
+{
+    struct reg *reg = reg_find(vfu_ctx, region_idx, offset);
+
+    if (reg == NULL) {
+        return -1;
+    }
+    __atomic_fetch_or(&reg->value, bits & width_mask(reg->desc.width),
+                      __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static uint64_t
+buf_load(const char *buf, uint32_t width)
+{
+    switch (width) {
+    case 1:
+        return *(const uint8_t *)buf;
+    case 2:
+        return *(const uint16_t *)buf;
+    case 4:
+        return *(const uint32_t *)buf;
+    default:
+        return *(const uint64_t *)buf;
+    }
+}
+
+static void
+buf_store(char *buf, uint32_t width, uint64_t val)
+{
+    switch (width) {
+    case 1:
+        *(uint8_t *)buf = val;
+        break;
+    case 2:
+        *(uint16_t *)buf = val;
+        break;
+    case 4:
+        *(uint32_t *)buf = val;
+        break;
+    default:
+        *(uint64_t *)buf = val;
+        break;
+    }
+}
+
+bool
+regs_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+            uint64_t offset, bool is_write, ssize_t *ret)
+{
+    struct reg *reg = reg_lookup(vfu_ctx->reg_info[region].regs, offset);
+    uint64_t val;
+
+    if (reg == NULL || reg->desc.width != count) {
+        return false;
+    }
+
+    if (!is_write) {
+        if (reg->desc.read != NULL) {
+            val = reg->desc.read(vfu_ctx, offset);
+        } else {
+            val = __atomic_load_n(&reg->value, __ATOMIC_SEQ_CST);
+        }
+        buf_store(buf, count, val);
+        *ret = count;
+        return true;
+    }
+
+    val = buf_load(buf, count);
+
+    switch (reg->desc.type) {
+    case VFU_REG_RO:
+        *ret = count;
+        return true;
+    case VFU_REG_RW:
+        __atomic_store_n(&reg->value, val, __ATOMIC_SEQ_CST);
+        break;
+    case VFU_REG_W1C:
+        __atomic_fetch_and(&reg->value, ~val, __ATOMIC_SEQ_CST);
+        break;
+    }
+
+    if (reg->desc.write != NULL) {
+        reg->desc.write(vfu_ctx, offset, val);
+    }
+
+    *ret = count;
+    return true;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
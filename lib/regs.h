@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_REGS_H
+#define LIB_VFIO_USER_REGS_H
+
+/*
+ * Register files, see vfu_setup_region_regs().
+ *
+ * Each region with registers has an array of them sorted by offset, so memory
+ * is bounded by the number of registers however sparse they are. Dispatching
+ * an access is then a binary search and a width comparison; the value is
+ * converted to and from the access buffer with a single load or store of the
+ * register's width.
+ */
+
+#include "libvfio-user.h"
+#include "private.h"
+
+/*
+ * If [@offset, @offset + @count) of @region is exactly one register, handles
+ * the access, sets *@ret and returns true.
+ */
+bool
+regs_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+            uint64_t offset, bool is_write, ssize_t *ret);
+
+/*
+ * Gives @reg a copy of @template's register file, with the registers at their
+ * initial values, see vfu_clone_ctx().
+ */
+int
+regs_clone(vfu_reg_info_t *reg, const vfu_reg_info_t *template);
+
+/* Bytes allocated for @rf, see vfu_ctx_memory_usage(). */
+size_t
+regs_memory_usage(const struct reg_file *rf);
+
+void
+regs_free(vfu_reg_info_t *reg);
+
+#endif /* LIB_VFIO_USER_REGS_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
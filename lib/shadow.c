@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shadow.h"
+
+struct shadow_range {
+    uint64_t    offset;
+    uint64_t    size;
+    /* odd while being updated */
+    uint64_t    version;
+    bool        valid;
+    char        *data;
+};
+
+struct shadow {
+    /* serializes updates */
+    pthread_mutex_t     lock;
+    size_t              nr_ranges;
+    struct shadow_range *ranges;
+};
+
+static bool
+overlaps(uint64_t off1, uint64_t size1, uint64_t off2, uint64_t size2)
+{
+    return off1 < off2 + size2 && off2 < off1 + size1;
+}
+
+static struct shadow_range *
+shadow_range_find(struct shadow *shadow, uint64_t offset, uint64_t count)
+{
+    size_t i;
+
+    if (shadow == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < shadow->nr_ranges; i++) {
+        struct shadow_range *r = &shadow->ranges[i];
+
+        if (offset >= r->offset && offset - r->offset < r->size &&
+            count <= r->size - (offset - r->offset)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+static void
+shadow_range_begin(struct shadow_range *r)
+{
+    __atomic_store_n(&r->version, r->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+shadow_range_end(struct shadow_range *r)
+{
+    __atomic_store_n(&r->version, r->version + 1, __ATOMIC_RELEASE);
+}
+
+static int
+shadow_region_check(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                    size_t size)
+{
+    assert(vfu_ctx != NULL);
+
+    if (region_idx < 0 || region_idx >= (int)vfu_ctx->nr_regions ||
+        region_idx == VFU_PCI_DEV_CFG_REGION_IDX ||
+        region_idx == VFU_PCI_DEV_MIGR_REGION_IDX ||
+        offset < 0 || size == 0 ||
+        satadd_u64(offset, size) > vfu_ctx->reg_info[region_idx].size) {
+        return ERROR_INT(EINVAL);
+    }
+    return 0;
+}
+
+EXPORT int
+vfu_region_shadow_range(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                        size_t size)
+{
+    vfu_reg_info_t *vfu_reg;
+    struct shadow *shadow;
+    struct shadow_range *ranges;
+    char *data;
+    size_t i;
+
+    if (shadow_region_check(vfu_ctx, region_idx, offset, size) == -1) {
+        return -1;
+    }
+
+    if (vfu_ctx->realized) {
+        vfu_log(vfu_ctx, LOG_ERR, "shadow ranges must be set up before the "
+                "device is realized");
+        return ERROR_INT(EBUSY);
+    }
+
+    vfu_reg = &vfu_ctx->reg_info[region_idx];
+    shadow = vfu_reg->shadow;
+
+    if (shadow == NULL) {
+        shadow = calloc(1, sizeof(*shadow));
+        if (shadow == NULL) {
+            return ERROR_INT(ENOMEM);
+        }
+        pthread_mutex_init(&shadow->lock, NULL);
+        vfu_reg->shadow = shadow;
+    }
+
+    for (i = 0; i < shadow->nr_ranges; i++) {
+        if (overlaps(offset, size, shadow->ranges[i].offset,
+                     shadow->ranges[i].size)) {
+            vfu_log(vfu_ctx, LOG_ERR, "shadow range %#lx-%#lx of region %d "
+                    "overlaps another", offset, offset + size, region_idx);
+            return ERROR_INT(EINVAL);
+        }
+    }
+
+    data = calloc(1, size);
+    if (data == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+
+    ranges = realloc(shadow->ranges,
+                     (shadow->nr_ranges + 1) * sizeof(*shadow->ranges));
+    if (ranges == NULL) {
+        free(data);
+        return ERROR_INT(ENOMEM);
+    }
+
+    ranges[shadow->nr_ranges] = (struct shadow_range) {
+        .offset = offset,
+        .size = size,
+        .data = data,
+    };
+    shadow->ranges = ranges;
+    shadow->nr_ranges++;
+    return 0;
+}
+
+EXPORT int
+vfu_region_shadow_write(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                        const void *data, size_t count)
+{
+    struct shadow *shadow;
+    struct shadow_range *r;
+
+    if (shadow_region_check(vfu_ctx, region_idx, offset, count) == -1) {
+        return -1;
+    }
+
+    shadow = vfu_ctx->reg_info[region_idx].shadow;
+    r = shadow_range_find(shadow, offset, count);
+    if (r == NULL) {
+        return ERROR_INT(ENOENT);
+    }
+
+    pthread_mutex_lock(&shadow->lock);
+    shadow_range_begin(r);
+    memcpy(r->data + (offset - r->offset), data, count);
+    if (count == r->size) {
+        __atomic_store_n(&r->valid, true, __ATOMIC_RELAXED);
+    }
+    shadow_range_end(r);
+    pthread_mutex_unlock(&shadow->lock);
+    return 0;
+}
+
+static void
+shadow_invalidate(struct shadow *shadow, uint64_t offset, uint64_t size)
+{
+    size_t i;
+
+    if (shadow == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&shadow->lock);
+    for (i = 0; i < shadow->nr_ranges; i++) {
+        struct shadow_range *r = &shadow->ranges[i];
+
+        if (r->valid && overlaps(offset, size, r->offset, r->size)) {
+            shadow_range_begin(r);
+            __atomic_store_n(&r->valid, false, __ATOMIC_RELAXED);
+            shadow_range_end(r);
+        }
+    }
+    pthread_mutex_unlock(&shadow->lock);
+}
+
+EXPORT int
+vfu_region_shadow_invalidate(vfu_ctx_t *vfu_ctx, int region_idx, loff_t offset,
+                             size_t size)
+{
+    if (shadow_region_check(vfu_ctx, region_idx, offset, size) == -1) {
+        return -1;
+    }
+
+    shadow_invalidate(vfu_ctx->reg_info[region_idx].shadow, offset, size);
+    return 0;
+}
+
+bool
+shadow_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+              uint64_t offset, bool is_write, ssize_t *ret)
+{
+    struct shadow *shadow = vfu_ctx->reg_info[region].shadow;
+    struct shadow_range *r;
+    uint64_t version;
+
+    if (shadow == NULL) {
+        return false;
+    }
+
+    if (is_write) {
+        shadow_invalidate(shadow, offset, count);
+        return false;
+    }
+
+    r = shadow_range_find(shadow, offset, count);
+    if (r == NULL) {
+        return false;
+    }
+
+    for (;;) {
+        version = __atomic_load_n(&r->version, __ATOMIC_ACQUIRE);
+        if (version & 1) {
+            continue;
+        }
+        if (!__atomic_load_n(&r->valid, __ATOMIC_RELAXED)) {
+            return false;
+        }
+        memcpy(buf, r->data + (offset - r->offset), count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->version, __ATOMIC_RELAXED) == version) {
+            break;
+        }
+    }
+
+    *ret = count;
+    return true;
+}
+
+int
+shadow_clone(vfu_reg_info_t *reg, const vfu_reg_info_t *template)
+{
+    const struct shadow *src = template->shadow;
+    struct shadow *shadow;
+    size_t i;
+
+    if (src == NULL) {
+        return 0;
+    }
+
+    shadow = calloc(1, sizeof(*shadow));
+    if (shadow == NULL) {
+        return ERROR_INT(ENOMEM);
+    }
+    pthread_mutex_init(&shadow->lock, NULL);
+    reg->shadow = shadow;
+
+    shadow->ranges = calloc(src->nr_ranges, sizeof(*shadow->ranges));
+    if (shadow->ranges == NULL) {
+        shadow_free(reg);
+        return ERROR_INT(ENOMEM);
+    }
+
+    for (i = 0; i < src->nr_ranges; i++) {
+        struct shadow_range *r = &shadow->ranges[i];
+
+        r->offset = src->ranges[i].offset;
+        r->size = src->ranges[i].size;
+        r->data = calloc(1, r->size);
+        if (r->data == NULL) {
+            shadow_free(reg);
+            return ERROR_INT(ENOMEM);
+        }
+        shadow->nr_ranges++;
+    }
+    return 0;
+}
+
+size_t
+shadow_memory_usage(const struct shadow *shadow)
+{
+    size_t size;
+    size_t i;
+
+    if (shadow == NULL) {
+        return 0;
+    }
+
+    size = sizeof(*shadow) + shadow->nr_ranges * sizeof(shadow->ranges[0]);
+    for (i = 0; i < shadow->nr_ranges; i++) {
+        if (shadow->ranges[i].data != NULL) {
+            size += shadow->ranges[i].size;
+        }
+    }
+    return size;
+}
+
+void
+shadow_free(vfu_reg_info_t *reg)
+{
+    struct shadow *shadow = reg->shadow;
+    size_t i;
+
+    if (shadow == NULL) {
+        return;
+    }
+
+    for (i = 0; i < shadow->nr_ranges; i++) {
+        free(shadow->ranges[i].data);
+    }
+    free(shadow->ranges);
+    pthread_mutex_destroy(&shadow->lock);
+    free(shadow);
+    reg->shadow = NULL;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_SHADOW_H
+#define LIB_VFIO_USER_SHADOW_H
+
+/*
+ * Shadow copies of cacheable region ranges, see vfu_region_shadow_range().
+ *
+ * Each range is a seqlock: writers, serialized by a per-region mutex, make the
+ * version odd while they update the data and its validity, and readers retry
+ * until they see the same even version before and after copying the data out.
+ */
+
+#include "libvfio-user.h"
+#include "private.h"
+
+/*
+ * Reads of @region that lie within a valid shadow range are copied out, with
+ * *@ret set to @count, and true returned. Writes invalidate any overlapping
+ * ranges and return false, as do other reads, for the caller to pass the
+ * access on to the region's callback.
+ */
+bool
+shadow_access(vfu_ctx_t *vfu_ctx, size_t region, char *buf, size_t count,
+              uint64_t offset, bool is_write, ssize_t *ret);
+
+/*
+ * Gives @reg the same shadow ranges as @template, all invalid, see
+ * vfu_clone_ctx().
+ */
+int
+shadow_clone(vfu_reg_info_t *reg, const vfu_reg_info_t *template);
+
+/* Bytes allocated for @shadow, see vfu_ctx_memory_usage(). */
+size_t
+shadow_memory_usage(const struct shadow *shadow);
+
+void
+shadow_free(vfu_reg_info_t *reg);
+
+#endif /* LIB_VFIO_USER_SHADOW_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread.h"
+
+struct thread_start {
+    void *(*fn)(void *);
+    void *arg;
+    vfu_ctx_t *vfu_ctx;
+    int numa_node;
+};
+
+/*
+ * Reads the CPUs of NUMA node @node from sysfs, a list of ranges such as
+ * "0-3,8-11".
+ */
+static int
+node_cpus(int node, cpu_set_t *cpus)
+{
+    char path[64];
+    char buf[4096];
+    char *p = buf;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return ERROR_INT(errno == ENOENT ? EINVAL : errno);
+    }
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return ERROR_INT(EINVAL);
+    }
+    fclose(fp);
+
+    CPU_ZERO(cpus);
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p, &end, 10);
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == p || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return ERROR_INT(EINVAL);
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, cpus);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : ERROR_INT(EINVAL);
+}
+
+static int
+check_sched(int policy, int priority)
+{
+    switch (policy) {
+    case SCHED_OTHER:
+    case SCHED_BATCH:
+    case SCHED_IDLE:
+        return priority == 0 ? 0 : ERROR_INT(EINVAL);
+    case SCHED_FIFO:
+    case SCHED_RR:
+        if (priority < sched_get_priority_min(policy) ||
+            priority > sched_get_priority_max(policy)) {
+            return ERROR_INT(EINVAL);
+        }
+        return 0;
+    default:
+        return ERROR_INT(EINVAL);
+    }
+}
+
+EXPORT int
+vfu_setup_thread_attr(vfu_ctx_t *vfu_ctx, const vfu_thread_attr_t *attr)
+{
+    struct thread_attr *ta;
+    size_t i;
+
+    assert(vfu_ctx != NULL);
+
+    if (attr == NULL) {
+        free(vfu_ctx->thread_attr);
+        vfu_ctx->thread_attr = NULL;
+        return 0;
+    }
+
+    if ((attr->nr_cpus != 0 && attr->cpus == NULL) ||
+        attr->numa_node < -1 || attr->numa_node >= THREAD_MAX_NUMA_NODES ||
+        check_sched(attr->sched_policy, attr->sched_priority) < 0) {
+        return ERROR_INT(EINVAL);
+    }
+
+    ta = calloc(1, sizeof(*ta));
+    if (ta == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < attr->nr_cpus; i++) {
+        if (attr->cpus[i] < 0 || attr->cpus[i] >= CPU_SETSIZE) {
+            free(ta);
+            return ERROR_INT(EINVAL);
+        }
+        CPU_SET(attr->cpus[i], &ta->cpus);
+        ta->has_cpus = true;
+    }
+
+    if (attr->numa_node >= 0 && !ta->has_cpus) {
+        if (node_cpus(attr->numa_node, &ta->cpus) < 0) {
+            int _errno = errno;
+
+            vfu_log(vfu_ctx, LOG_ERR, "bad NUMA node %d", attr->numa_node);
+            free(ta);
+            return ERROR_INT(_errno);
+        }
+        ta->has_cpus = true;
+    }
+
+    ta->numa_node = attr->numa_node;
+    ta->sched_policy = attr->sched_policy;
+    ta->sched_priority = attr->sched_priority;
+    if (attr->name != NULL) {
+        snprintf(ta->name, sizeof(ta->name), "%s", attr->name);
+    }
+
+    free(vfu_ctx->thread_attr);
+    vfu_ctx->thread_attr = ta;
+    return 0;
+}
+
+static void *
+thread_run(void *arg)
+{
+    struct thread_start start = *(struct thread_start *)arg;
+
+    free(arg);
+
+    /* so that everything the thread allocates comes from its node */
+    if (start.numa_node >= 0) {
+        unsigned long mask[THREAD_MAX_NUMA_NODES / NODE_MASK_BITS] = { 0 };
+
+        mask[start.numa_node / NODE_MASK_BITS] |=
+            1UL << (start.numa_node % NODE_MASK_BITS);
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                    THREAD_MAX_NUMA_NODES + 1) != 0) {
+            vfu_log(start.vfu_ctx, LOG_WARNING, "failed to prefer NUMA node "
+                    "%d: %m", start.numa_node);
+        }
+    }
+
+    return start.fn(start.arg);
+}
+
+int
+thread_create(vfu_ctx_t *vfu_ctx, pthread_t *thread, const char *role,
+              void *(*fn)(void *), void *arg)
+{
+    struct thread_attr *ta = vfu_ctx->thread_attr;
+    struct thread_start *start;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if (ta == NULL) {
+        return pthread_create(thread, NULL, fn, arg);
+    }
+
+    start = malloc(sizeof(*start));
+    if (start == NULL) {
+        return errno;
+    }
+    start->fn = fn;
+    start->arg = arg;
+    start->vfu_ctx = vfu_ctx;
+    start->numa_node = ta->numa_node;
+
+    pthread_attr_init(&attr);
+    if (ta->has_cpus) {
+        ret = pthread_attr_setaffinity_np(&attr, sizeof(ta->cpus), &ta->cpus);
+    }
+    if (ret == 0 && ta->sched_policy != SCHED_OTHER) {
+        struct sched_param param = { .sched_priority = ta->sched_priority };
+
+        ret = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (ret == 0) {
+            ret = pthread_attr_setschedpolicy(&attr, ta->sched_policy);
+        }
+        if (ret == 0) {
+            ret = pthread_attr_setschedparam(&attr, &param);
+        }
+    }
+    if (ret == 0) {
+        ret = pthread_create(thread, &attr, thread_run, start);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        free(start);
+        return ret;
+    }
+
+    if (ta->name[0] != '\0') {
+        char name[sizeof(ta->name) + 16];
+
+        /* the kernel takes 15 characters at most */
+        snprintf(name, sizeof(name), "%s-%s", ta->name, role);
+        name[15] = '\0';
+        (void) pthread_setname_np(*thread, name);
+    }
+
+    return 0;
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
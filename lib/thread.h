@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_THREAD_H
+#define LIB_VFIO_USER_THREAD_H
+
+/*
+ * Threads the library creates on behalf of a context, see
+ * vfu_setup_thread_attr().
+ */
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "private.h"
+
+/* Highest NUMA node number supported, plus one. */
+#define THREAD_MAX_NUMA_NODES 1024
+
+#define NODE_MASK_BITS (8 * sizeof(unsigned long))
+
+struct thread_attr {
+    /* set from vfu_thread_attr_t.cpus, or the NUMA node's CPUs */
+    cpu_set_t   cpus;
+    bool        has_cpus;
+    int         numa_node;
+    char        name[16];
+    int         sched_policy;
+    int         sched_priority;
+};
+
+/*
+ * Like pthread_create(), with the context's thread attributes applied; @role
+ * is appended to the thread name. Returns 0 or an error number.
+ */
+int
+thread_create(vfu_ctx_t *vfu_ctx, pthread_t *thread, const char *role,
+              void *(*fn)(void *), void *arg);
+
+/*
+ * Prefers the context's NUMA node, if it has one, for the pages of @addr not
+ * faulted in yet; @addr must be page aligned. This is inline for the sake of
+ * the transport, which the client sample builds without the rest of the
+ * library.
+ */
+static inline int
+thread_bind_memory(vfu_ctx_t *vfu_ctx, void *addr, size_t len)
+{
+    unsigned long mask[THREAD_MAX_NUMA_NODES / NODE_MASK_BITS] = { 0 };
+    struct thread_attr *ta = vfu_ctx->thread_attr;
+
+    if (ta == NULL || ta->numa_node < 0) {
+        return 0;
+    }
+
+    mask[ta->numa_node / NODE_MASK_BITS] |=
+        1UL << (ta->numa_node % NODE_MASK_BITS);
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+                   THREAD_MAX_NUMA_NODES + 1, 0);
+}
+
+#endif /* LIB_VFIO_USER_THREAD_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
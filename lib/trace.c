@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libvfio-user.h"
+#include "private.h"
+#include "trace.h"
+
+#define TRACE_DEFAULT_EVENTS (1 << 16)
+#define TRACE_MAX_EVENTS (1 << 24)
+
+struct trace_entry {
+    uint64_t    ts_ns;
+    uint64_t    arg;
+    uint16_t    event;
+    uint8_t     phase;
+};
+
+struct trace_ring {
+    struct trace_ring   *next;
+    /* the tracing session the ring was last used in */
+    uint64_t            gen;
+    /* set once the thread has exited */
+    bool                orphaned;
+    pid_t               tid;
+    char                name[16];
+    size_t              mask;
+    /* number of events recorded, only ever written by the thread */
+    uint64_t            head;
+    struct trace_entry  entries[];
+};
+
+static const struct {
+    const char *name;
+    /* what the argument is, NULL if there is none */
+    const char *arg;
+} trace_events[TRACE_NR_EVENTS] = {
+    [TRACE_GET_REQUEST] = { "get_request", "cmd" },
+    [TRACE_HANDLE_REQUEST] = { "handle_request", "cmd" },
+    [TRACE_QUIESCE] = { "quiesce_cb", NULL },
+    [TRACE_QUIESCE_WAIT] = { "quiesce_wait", NULL },
+    [TRACE_DMA_MAP] = { "dma_map", "iova" },
+    [TRACE_DMA_UNMAP] = { "dma_unmap", "iova" },
+    [TRACE_DMA_TRANSFER] = { "dma_transfer", "bytes" },
+    [TRACE_MIGR_TRANSITION] = { "migr_transition", "state" },
+    [TRACE_MIGR_WAIT] = { "migr_wait", NULL },
+    [TRACE_IRQ_TRIGGER] = { "irq_trigger", "vector" },
+};
+
+bool trace_enabled;
+
+/*
+ * Protects the ring list and session changes. Recording an event doesn't take
+ * it, except for a thread's first event of a session.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static struct trace_ring *trace_rings;
+static size_t trace_nr_events;
+static uint64_t trace_gen;
+
+static __thread struct trace_ring *thread_ring;
+
+/* Keeps the events of exited threads until the next session. */
+static void
+ring_orphan(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    pthread_mutex_lock(&trace_lock);
+    ring->orphaned = true;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void
+trace_key_create(void)
+{
+    (void) pthread_key_create(&trace_key, ring_orphan);
+}
+
+/*
+ * Sets up the calling thread's ring for the current session, reusing the one
+ * from an earlier session if it's the right size.
+ */
+static struct trace_ring *
+ring_get(void)
+{
+    struct trace_ring *ring = thread_ring;
+    struct trace_ring **p;
+    int _errno = errno;
+
+    pthread_once(&trace_once, trace_key_create);
+    pthread_mutex_lock(&trace_lock);
+
+    if (ring != NULL && ring->mask + 1 == trace_nr_events) {
+        ring->head = 0;
+        ring->gen = trace_gen;
+        goto out;
+    }
+
+    if (ring != NULL) {
+        for (p = &trace_rings; *p != ring; p = &(*p)->next) {
+            ;
+        }
+        *p = ring->next;
+        free(ring);
+    }
+
+    ring = calloc(1, sizeof(*ring) +
+                     trace_nr_events * sizeof(ring->entries[0]));
+    if (ring != NULL) {
+        ring->gen = trace_gen;
+        ring->tid = syscall(SYS_gettid);
+        ring->mask = trace_nr_events - 1;
+        (void) pthread_getname_np(pthread_self(), ring->name,
+                                  sizeof(ring->name));
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    thread_ring = ring;
+    (void) pthread_setspecific(trace_key, ring);
+
+out:
+    pthread_mutex_unlock(&trace_lock);
+    errno = _errno;
+    return ring;
+}
+
+void
+trace_record(enum trace_event event, enum trace_phase phase, uint64_t arg)
+{
+    struct trace_ring *ring = thread_ring;
+    struct trace_entry *e;
+
+    if (unlikely(ring == NULL ||
+                 ring->gen != __atomic_load_n(&trace_gen, __ATOMIC_ACQUIRE))) {
+        if ((ring = ring_get()) == NULL) {
+            return;
+        }
+    }
+
+    e = &ring->entries[ring->head & ring->mask];
+    e->ts_ns = now_ns();
+    e->arg = arg;
+    e->event = event;
+    e->phase = phase;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+EXPORT int
+vfu_trace_start(size_t nr_events)
+{
+    struct trace_ring **p;
+    size_t size = 1;
+
+    if (nr_events == 0) {
+        nr_events = TRACE_DEFAULT_EVENTS;
+    }
+    if (nr_events > TRACE_MAX_EVENTS) {
+        return ERROR_INT(EINVAL);
+    }
+    while (size < nr_events) {
+        size <<= 1;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_enabled) {
+        pthread_mutex_unlock(&trace_lock);
+        return ERROR_INT(EBUSY);
+    }
+
+    for (p = &trace_rings; *p != NULL; ) {
+        struct trace_ring *ring = *p;
+
+        if (ring->orphaned) {
+            *p = ring->next;
+            free(ring);
+        } else {
+            p = &ring->next;
+        }
+    }
+
+    trace_nr_events = size;
+    __atomic_store_n(&trace_gen, trace_gen + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+EXPORT void
+vfu_trace_stop(void)
+{
+    __atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+}
+
+static void
+export_entry(FILE *fp, pid_t tid, const struct trace_entry *e, bool *first)
+{
+    static const char phases[] = {
+        [TRACE_PH_BEGIN] = 'B',
+        [TRACE_PH_END] = 'E',
+        [TRACE_PH_INSTANT] = 'i',
+        [TRACE_PH_ASYNC_BEGIN] = 'b',
+        [TRACE_PH_ASYNC_END] = 'e',
+    };
+    const char *arg = trace_events[e->event].arg;
+
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"vfu\",\"ph\":\"%c\","
+            "\"ts\":%" PRIu64 ".%03" PRIu64 ",\"pid\":%d,\"tid\":%d",
+            *first ? "" : ",", trace_events[e->event].name,
+            phases[e->phase], e->ts_ns / 1000, e->ts_ns % 1000, getpid(),
+            tid);
+    *first = false;
+
+    switch (e->phase) {
+    case TRACE_PH_ASYNC_BEGIN:
+    case TRACE_PH_ASYNC_END:
+        fprintf(fp, ",\"id\":\"%#" PRIx64 "\"}", e->arg);
+        return;
+    case TRACE_PH_INSTANT:
+        fprintf(fp, ",\"s\":\"t\"");
+        break;
+    default:
+        break;
+    }
+
+    if (arg != NULL) {
+        fprintf(fp, ",\"args\":{\"%s\":\"%#" PRIx64 "\"}", arg, e->arg);
+    }
+    fprintf(fp, "}");
+}
+
+static void
+export_thread_name(FILE *fp, const struct trace_ring *ring, bool *first)
+{
+    char name[sizeof(ring->name)];
+    size_t i;
+
+    for (i = 0; i < sizeof(name) - 1 && ring->name[i] != '\0'; i++) {
+        name[i] = ring->name[i] == '"' || ring->name[i] == '\\' ? '_' :
+                  ring->name[i];
+    }
+    name[i] = '\0';
+
+    fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",",
+            getpid(), ring->tid, name);
+    *first = false;
+}
+
+EXPORT int
+vfu_trace_export(const char *path)
+{
+    struct trace_ring *ring;
+    bool first = true;
+    int ret = 0;
+    FILE *fp;
+
+    if (path == NULL) {
+        return ERROR_INT(EINVAL);
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_enabled) {
+        pthread_mutex_unlock(&trace_lock);
+        return ERROR_INT(EBUSY);
+    }
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        ret = errno;
+        pthread_mutex_unlock(&trace_lock);
+        return ERROR_INT(ret);
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (ring = trace_rings; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t i;
+
+        if (ring->gen != trace_gen) {
+            continue;
+        }
+
+        if (ring->name[0] != '\0') {
+            export_thread_name(fp, ring, &first);
+        }
+
+        /* only the last mask + 1 events are still there */
+        i = head > ring->mask + 1 ? head - (ring->mask + 1) : 0;
+        for (; i < head; i++) {
+            export_entry(fp, ring->tid, &ring->entries[i & ring->mask],
+                         &first);
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if (ferror(fp)) {
+        ret = EIO;
+    }
+    if (fclose(fp) != 0 && ret == 0) {
+        ret = errno;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+    return ret == 0 ? 0 : ERROR_INT(ret);
+}
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Nutanix Inc. All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+#ifndef LIB_VFIO_USER_TRACE_H
+#define LIB_VFIO_USER_TRACE_H
+
+/*
+ * Binary event recorder, see vfu_trace_start().
+ *
+ * Each thread records into a ring of its own, so recording takes no locks:
+ * the ring is only written by its thread, and only read by
+ * vfu_trace_export() once tracing has stopped. While tracing is off, a trace
+ * point costs a load and a branch predicted not taken.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+enum trace_event {
+    TRACE_GET_REQUEST,
+    TRACE_HANDLE_REQUEST,
+    TRACE_QUIESCE,
+    TRACE_QUIESCE_WAIT,
+    TRACE_DMA_MAP,
+    TRACE_DMA_UNMAP,
+    TRACE_DMA_TRANSFER,
+    TRACE_MIGR_TRANSITION,
+    TRACE_MIGR_WAIT,
+    TRACE_IRQ_TRIGGER,
+    TRACE_NR_EVENTS
+};
+
+enum trace_phase {
+    TRACE_PH_BEGIN,
+    TRACE_PH_END,
+    TRACE_PH_INSTANT,
+    /* spans that may end on another thread, @arg identifies them */
+    TRACE_PH_ASYNC_BEGIN,
+    TRACE_PH_ASYNC_END,
+};
+
+extern bool trace_enabled;
+
+void
+trace_record(enum trace_event event, enum trace_phase phase, uint64_t arg);
+
+#define TRACE(event, phase, arg)                                    \
+    do {                                                            \
+        if (unlikely(__atomic_load_n(&trace_enabled,                \
+                                     __ATOMIC_RELAXED))) {          \
+            trace_record(event, phase, (uint64_t)(arg));            \
+        }                                                           \
+    } while (0)
+
+#define TRACE_BEGIN(event, arg) TRACE(event, TRACE_PH_BEGIN, arg)
+#define TRACE_END(event, arg) TRACE(event, TRACE_PH_END, arg)
+#define TRACE_INSTANT(event, arg) TRACE(event, TRACE_PH_INSTANT, arg)
+#define TRACE_ASYNC_BEGIN(event, id) TRACE(event, TRACE_PH_ASYNC_BEGIN, id)
+#define TRACE_ASYNC_END(event, id) TRACE(event, TRACE_PH_ASYNC_END, id)
+
+#endif /* LIB_VFIO_USER_TRACE_H */
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
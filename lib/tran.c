@@ -277,28 +277,31 @@ send_version(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
     vfu_msg_t msg = { { 0 } };
     int slen;
 
-    if (vfu_ctx->migration == NULL) {
-        slen = snprintf(server_caps, sizeof(server_caps),
-            "{"
-                "\"capabilities\":{"
-                    "\"max_msg_fds\":%u,"
-                    "\"max_data_xfer_size\":%u"
-                "}"
-             "}", SERVER_MAX_FDS, SERVER_MAX_DATA_XFER_SIZE);
-    } else {
-        slen = snprintf(server_caps, sizeof(server_caps),
-            "{"
-                "\"capabilities\":{"
-                    "\"max_msg_fds\":%u,"
-                    "\"max_data_xfer_size\":%u,"
-                    "\"migration\":{"
-                        "\"pgsize\":%zu"
-                    "}"
-                "}"
-             "}", SERVER_MAX_FDS, SERVER_MAX_DATA_XFER_SIZE,
-                  migration_get_pgsize(vfu_ctx->migration));
+    slen = snprintf(server_caps, sizeof(server_caps),
+        "{"
+            "\"capabilities\":{"
+                "\"max_msg_fds\":%u,"
+                "\"max_data_xfer_size\":%u",
+        SERVER_MAX_FDS, SERVER_MAX_DATA_XFER_SIZE);
+
+    if (vfu_ctx->migration != NULL) {
+        slen += snprintf(server_caps + slen, sizeof(server_caps) - slen,
+                ","
+                "\"migration\":{"
+                    "\"pgsize\":%zu"
+                "}", migration_get_pgsize(vfu_ctx->migration));
     }
 
+    if (vfu_ctx->tran->setup_shm != NULL) {
+        slen += snprintf(server_caps + slen, sizeof(server_caps) - slen,
+                ","
+                "\"shm\":{"
+                    "\"max_ring_size\":%u"
+                "}", TRAN_SHM_MAX_RING_SIZE);
+    }
+
+    slen += snprintf(server_caps + slen, sizeof(server_caps) - slen, "}}");
+
     // FIXME: we should save the client minor here, and check that before trying
     // to send unsupported things.
     sversion.major =  LIB_VFIO_USER_MAJOR;
@@ -60,12 +60,39 @@ struct transport_ops {
 
     void (*detach)(vfu_ctx_t *vfu_ctx);
     void (*fini)(vfu_ctx_t *vfu_ctx);
+
+    /*
+     * Optional: handle VFIO_USER_SHM_SETUP. Transports without shared-memory
+     * rings leave this NULL and the command fails with ENOTSUP.
+     */
+    int (*setup_shm)(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg);
+
+    /*
+     * Optional: cheap, non-blocking check for a pending request, used for busy
+     * polling. Returns 1 if get_request_header() would not block (including on
+     * disconnection), 0 otherwise.
+     */
+    int (*poll_ready)(vfu_ctx_t *vfu_ctx);
+
+    /*
+     * Optional: live upgrade, see vfu_ctx_export_state(). export_fds() hands
+     * the listening and connected sockets over to the caller, leaving the
+     * transport with neither; import_fds() adopts such a pair in place of the
+     * transport's own listening socket.
+     */
+    int (*export_fds)(vfu_ctx_t *vfu_ctx, int *listen_fd, int *conn_fd);
+
+    int (*import_fds)(vfu_ctx_t *vfu_ctx, int listen_fd, int conn_fd);
 };
 
 /* The largest number of fd's we are prepared to receive. */
 // FIXME: value?
 #define VFIO_USER_CLIENT_MAX_MSG_FDS_LIMIT (1024)
 
+/* Bounds on the ring size a client may ask for in VFIO_USER_SHM_SETUP. */
+#define TRAN_SHM_MIN_RING_SIZE (4096)
+#define TRAN_SHM_MAX_RING_SIZE (64 * 1024 * 1024)
+
 /*
  * Parse JSON supplied from the other side into the known parameters. Note: they
  * will not be set if not found in the JSON.
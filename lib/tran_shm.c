@@ -0,0 +1,742 @@
+/*
+ * Copyright (c) 2021 Nutanix Inc. All rights reserved.
+ *
+ * Authors: Thanos Makatos <thanos@nutanix.com>
+ *          Swapnil Ingle <swapnil.ingle@nutanix.com>
+ *          Felipe Franciosi <felipe@nutanix.com>
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *      * Neither the name of Nutanix nor the names of its contributors may be
+ *        used to endorse or promote products derived from this software without
+ *        specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ *  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ *  DAMAGE.
+ *
+ */
+
+/*
+ * Shared-memory transport.
+ *
+ * This is the UNIX socket transport with an optional fast path: once the
+ * client has sent VFIO_USER_SHM_SETUP, messages that carry no file descriptors
+ * are exchanged through a pair of rings in a client-supplied memfd, with an
+ * eventfd per direction for wakeups. The socket stays connected for the
+ * fd-carrying commands and for detecting disconnection.
+ *
+ * The poll fd handed out to the application is an epoll fd covering both the
+ * socket and the client-to-server eventfd.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tran_shm.h"
+#include "tran_sock.h"
+
+/*
+ * When busy polling, how many ring checks to make between checks of the
+ * socket, which costs a system call.
+ */
+#define SHM_POLL_SOCK_INTERVAL 64
+
+typedef struct {
+    struct vfio_user_shm_ring *ring;
+    uint32_t size;
+    /* Our private copy of head (consumer) or tail (producer). */
+    uint32_t pos;
+} shm_ring_t;
+
+typedef struct {
+    /* Must be first: the tran_sock_ops callbacks operate on it directly. */
+    tran_sock_t sock;
+    int epoll_fd;
+    void *map;
+    size_t map_size;
+    shm_ring_t rx;
+    shm_ring_t tx;
+    int rx_efd;
+    int tx_efd;
+    /* Whether the last request header was taken from the rx ring. */
+    bool rx_from_ring;
+    /* Body bytes of that request not yet consumed by recv_body(). */
+    uint32_t rx_body_len;
+    /* Counts down to the next socket check in poll_ready(). */
+    unsigned int poll_sock_countdown;
+} tran_shm_t;
+
+static bool
+shm_active(tran_shm_t *ts)
+{
+    return ts->map != NULL;
+}
+
+static void
+ring_copy_out(shm_ring_t *r, uint32_t pos, void *buf, size_t len)
+{
+    uint32_t off = pos & (r->size - 1);
+    size_t first = MIN(len, r->size - off);
+
+    memcpy(buf, r->ring->data + off, first);
+    memcpy((char *)buf + first, r->ring->data, len - first);
+}
+
+static void
+ring_copy_in(shm_ring_t *r, uint32_t pos, const void *buf, size_t len)
+{
+    uint32_t off = pos & (r->size - 1);
+    size_t first = MIN(len, r->size - off);
+
+    memcpy(r->ring->data + off, buf, first);
+    memcpy(r->ring->data, (const char *)buf + first, len - first);
+}
+
+/*
+ * Returns the number of bytes the peer has produced into @r, or -1 if the
+ * peer's tail is nonsensical.
+ */
+static int64_t
+ring_used(shm_ring_t *r)
+{
+    uint32_t used = __atomic_load_n(&r->ring->tail, __ATOMIC_ACQUIRE) - r->pos;
+
+    return used > r->size ? -1 : (int64_t)used;
+}
+
+/*
+ * Returns the number of bytes we can produce into @r, or -1 if the peer's
+ * head is nonsensical.
+ */
+static int64_t
+ring_free(shm_ring_t *r)
+{
+    uint32_t used = r->pos - __atomic_load_n(&r->ring->head, __ATOMIC_ACQUIRE);
+
+    return used > r->size ? -1 : (int64_t)(r->size - used);
+}
+
+static void
+rx_consume(tran_shm_t *ts, uint32_t len)
+{
+    ts->rx.pos += len;
+    __atomic_store_n(&ts->rx.ring->head, ts->rx.pos, __ATOMIC_RELEASE);
+}
+
+static int
+rx_ring_get_header(vfu_ctx_t *vfu_ctx, tran_shm_t *ts,
+                   struct vfio_user_header *hdr)
+{
+    int64_t used;
+
+    /* Skip any body that was never asked for, e.g. on a bad header. */
+    if (ts->rx_body_len != 0) {
+        rx_consume(ts, ts->rx_body_len);
+        ts->rx_body_len = 0;
+    }
+
+    used = ring_used(&ts->rx);
+
+    if (used == 0) {
+        return ERROR_INT(EAGAIN);
+    }
+
+    if (used < (int64_t)sizeof(*hdr)) {
+        vfu_log(vfu_ctx, LOG_ERR, "corrupt request ring (%ld bytes used)",
+                (long)used);
+        return ERROR_INT(ECONNRESET);
+    }
+
+    ring_copy_out(&ts->rx, ts->rx.pos, hdr, sizeof(*hdr));
+
+    if (hdr->msg_size < sizeof(*hdr) || hdr->msg_size > used) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: bad size %u in ring header",
+                hdr->msg_id, hdr->msg_size);
+        return ERROR_INT(ECONNRESET);
+    }
+
+    ts->rx.pos += sizeof(*hdr);
+    ts->rx_body_len = hdr->msg_size - sizeof(*hdr);
+    if (ts->rx_body_len == 0) {
+        rx_consume(ts, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Write a complete message into the tx ring and kick the client. Waits for the
+ * client to make room if necessary; a message that can never fit fails with
+ * EMSGSIZE.
+ */
+static int
+tx_ring_send_iovec(vfu_ctx_t *vfu_ctx, tran_shm_t *ts,
+                   struct vfio_user_header *hdr,
+                   struct iovec *iovecs, size_t nr_iovecs)
+{
+    uint32_t pos;
+    int64_t avail;
+    size_t i;
+
+    hdr->msg_size = sizeof(*hdr);
+    for (i = 0; i < nr_iovecs; i++) {
+        hdr->msg_size += iovecs[i].iov_len;
+    }
+
+    if (hdr->msg_size > ts->tx.size) {
+        vfu_log(vfu_ctx, LOG_ERR, "msg%#hx: %u bytes exceed ring size %u",
+                hdr->msg_id, hdr->msg_size, ts->tx.size);
+        return ERROR_INT(EMSGSIZE);
+    }
+
+    while ((avail = ring_free(&ts->tx)) < (int64_t)hdr->msg_size) {
+        struct pollfd pfd = { .fd = ts->sock.conn_fd, .events = POLLRDHUP };
+
+        if (avail < 0) {
+            vfu_log(vfu_ctx, LOG_ERR, "corrupt reply ring");
+            return ERROR_INT(ECONNRESET);
+        }
+
+        /* Don't spin forever on a client that has gone away. */
+        if (poll(&pfd, 1, 1) == 1 &&
+            (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+            return ERROR_INT(ECONNRESET);
+        }
+    }
+
+    pos = ts->tx.pos;
+    ring_copy_in(&ts->tx, pos, hdr, sizeof(*hdr));
+    pos += sizeof(*hdr);
+
+    for (i = 0; i < nr_iovecs; i++) {
+        ring_copy_in(&ts->tx, pos, iovecs[i].iov_base, iovecs[i].iov_len);
+        pos += iovecs[i].iov_len;
+    }
+
+    ts->tx.pos = pos;
+    __atomic_store_n(&ts->tx.ring->tail, pos, __ATOMIC_RELEASE);
+
+    if (eventfd_write(ts->tx_efd, 1) < 0) {
+        return ERROR_INT(ECONNRESET);
+    }
+
+    return 0;
+}
+
+static void
+shm_teardown(tran_shm_t *ts)
+{
+    if (ts->map != NULL) {
+        munmap(ts->map, ts->map_size);
+        ts->map = NULL;
+    }
+    if (ts->rx_efd != -1) {
+        (void) epoll_ctl(ts->epoll_fd, EPOLL_CTL_DEL, ts->rx_efd, NULL);
+        close(ts->rx_efd);
+        ts->rx_efd = -1;
+    }
+    if (ts->tx_efd != -1) {
+        close(ts->tx_efd);
+        ts->tx_efd = -1;
+    }
+    ts->rx_from_ring = false;
+    ts->rx_body_len = 0;
+}
+
+static int
+tran_shm_init(vfu_ctx_t *vfu_ctx)
+{
+    tran_shm_t *ts;
+    int ret;
+
+    ret = tran_sock_ops.init(vfu_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ts = realloc(vfu_ctx->tran_data, sizeof(*ts));
+    if (ts == NULL) {
+        ret = errno;
+        tran_sock_ops.fini(vfu_ctx);
+        return ERROR_INT(ret);
+    }
+
+    memset((char *)ts + sizeof(ts->sock), 0, sizeof(*ts) - sizeof(ts->sock));
+    ts->rx_efd = -1;
+    ts->tx_efd = -1;
+    vfu_ctx->tran_data = ts;
+
+    ts->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ts->epoll_fd == -1) {
+        ret = errno;
+        tran_sock_ops.fini(vfu_ctx);
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+static int
+tran_shm_get_poll_fd(vfu_ctx_t *vfu_ctx)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (ts->sock.conn_fd != -1) {
+        return ts->epoll_fd;
+    }
+
+    return ts->sock.listen_fd;
+}
+
+static int
+tran_shm_attach(vfu_ctx_t *vfu_ctx)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    int ret;
+
+    ret = tran_sock_ops.attach(vfu_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ev.data.fd = ts->sock.conn_fd;
+    if (epoll_ctl(ts->epoll_fd, EPOLL_CTL_ADD, ts->sock.conn_fd, &ev) < 0) {
+        ret = errno;
+        tran_sock_ops.detach(vfu_ctx);
+        return ERROR_INT(ret);
+    }
+
+    return 0;
+}
+
+static int
+tran_shm_get_request_header(vfu_ctx_t *vfu_ctx, struct vfio_user_header *hdr,
+                            int *fds, size_t *nr_fds)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    struct epoll_event events[2];
+    bool nb = vfu_ctx->flags & LIBVFIO_USER_FLAG_ATTACH_NB;
+    int i, n;
+
+    if (!shm_active(ts)) {
+        ts->rx_from_ring = false;
+        return tran_sock_ops.get_request_header(vfu_ctx, hdr, fds, nr_fds);
+    }
+
+    for (;;) {
+        bool sock_ready = false;
+
+        if (rx_ring_get_header(vfu_ctx, ts, hdr) == 0) {
+            ts->rx_from_ring = true;
+            *nr_fds = 0;
+            return 0;
+        } else if (errno != EAGAIN) {
+            return -1;
+        }
+
+        n = epoll_wait(ts->epoll_fd, events, ARRAY_SIZE(events), nb ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR && !nb) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == ts->rx_efd) {
+                eventfd_t val;
+                (void) eventfd_read(ts->rx_efd, &val);
+            } else {
+                sock_ready = true;
+            }
+        }
+
+        if (sock_ready) {
+            ts->rx_from_ring = false;
+            return tran_sock_ops.get_request_header(vfu_ctx, hdr, fds, nr_fds);
+        }
+
+        if (n == 0 && nb) {
+            return ERROR_INT(EAGAIN);
+        }
+    }
+}
+
+static int
+tran_shm_recv_body(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (!ts->rx_from_ring) {
+        return tran_sock_ops.recv_body(vfu_ctx, msg);
+    }
+
+    assert(msg->in.iov.iov_len == ts->rx_body_len);
+
+    msg->in.iov.iov_base = malloc(msg->in.iov.iov_len);
+    if (msg->in.iov.iov_base == NULL) {
+        return -1;
+    }
+
+    ring_copy_out(&ts->rx, ts->rx.pos, msg->in.iov.iov_base,
+                  msg->in.iov.iov_len);
+    rx_consume(ts, ts->rx_body_len);
+    ts->rx_body_len = 0;
+
+    return 0;
+}
+
+static int
+tran_shm_reply(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg, int err)
+{
+    struct vfio_user_header hdr = { .msg_id = msg->hdr.msg_id };
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    struct iovec iov;
+
+    /* Anything involving file descriptors is answered over the socket. */
+    if (!shm_active(ts) || msg->in.nr_fds != 0 || msg->out.nr_fds != 0) {
+        return tran_sock_ops.reply(vfu_ctx, msg, err);
+    }
+
+    hdr.cmd = msg->hdr.cmd;
+    hdr.flags.type = VFIO_USER_F_TYPE_REPLY;
+    if (err != 0) {
+        hdr.flags.error = 1U;
+        hdr.error_no = err;
+    }
+
+    if (msg->out_iovecs != NULL) {
+        return tx_ring_send_iovec(vfu_ctx, ts, &hdr, msg->out_iovecs,
+                                  msg->nr_out_iovecs);
+    }
+
+    iov = msg->out.iov;
+    return tx_ring_send_iovec(vfu_ctx, ts, &hdr, &iov, 1);
+}
+
+static int
+tran_shm_recv_msg(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    return tran_sock_ops.recv_msg(vfu_ctx, msg);
+}
+
+/*
+ * Wait for the client's reply to a server-initiated command in the rx ring.
+ */
+static int
+rx_ring_wait_reply(vfu_ctx_t *vfu_ctx, tran_shm_t *ts, uint16_t msg_id,
+                   struct vfio_user_header *hdr, void *recv_data,
+                   size_t recv_len)
+{
+    struct pollfd pfds[2] = {
+        { .fd = ts->rx_efd, .events = POLLIN },
+        { .fd = ts->sock.conn_fd, .events = POLLRDHUP },
+    };
+    size_t len;
+
+    while (rx_ring_get_header(vfu_ctx, ts, hdr) < 0) {
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (pfds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+            return ERROR_INT(ECONNRESET);
+        }
+        if (pfds[0].revents & POLLIN) {
+            eventfd_t val;
+            (void) eventfd_read(ts->rx_efd, &val);
+        }
+    }
+
+    if (hdr->msg_id != msg_id) {
+        return ERROR_INT(EPROTO);
+    }
+
+    if (hdr->flags.type != VFIO_USER_F_TYPE_REPLY) {
+        return ERROR_INT(EINVAL);
+    }
+
+    if (hdr->flags.error == 1U) {
+        if (hdr->error_no <= 0) {
+            hdr->error_no = EINVAL;
+        }
+        return ERROR_INT(hdr->error_no);
+    }
+
+    len = MIN(recv_len, ts->rx_body_len);
+    if (recv_len > 0 && len != recv_len) {
+        return ERROR_INT(ECONNRESET);
+    }
+
+    ring_copy_out(&ts->rx, ts->rx.pos, recv_data, len);
+    rx_consume(ts, ts->rx_body_len);
+    ts->rx_body_len = 0;
+
+    return 0;
+}
+
+static int
+tran_shm_send_msg(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
+                  enum vfio_user_command cmd,
+                  void *send_data, size_t send_len,
+                  struct vfio_user_header *hdr,
+                  void *recv_data, size_t recv_len)
+{
+    struct vfio_user_header send_hdr = { .msg_id = msg_id, .cmd = cmd };
+    struct vfio_user_header rhdr;
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    struct iovec iov = { .iov_base = send_data, .iov_len = send_len };
+    int ret;
+
+    if (!shm_active(ts)) {
+        return tran_sock_ops.send_msg(vfu_ctx, msg_id, cmd, send_data,
+                                      send_len, hdr, recv_data, recv_len);
+    }
+
+    send_hdr.flags.type = VFIO_USER_F_TYPE_COMMAND;
+
+    ret = tx_ring_send_iovec(vfu_ctx, ts, &send_hdr, &iov, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (hdr == NULL) {
+        hdr = &rhdr;
+    }
+
+    return rx_ring_wait_reply(vfu_ctx, ts, msg_id, hdr, recv_data, recv_len);
+}
+
+static void
+tran_shm_detach(vfu_ctx_t *vfu_ctx)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (ts == NULL) {
+        return;
+    }
+
+    shm_teardown(ts);
+
+    if (ts->sock.conn_fd != -1) {
+        (void) epoll_ctl(ts->epoll_fd, EPOLL_CTL_DEL, ts->sock.conn_fd, NULL);
+    }
+
+    tran_sock_ops.detach(vfu_ctx);
+}
+
+static void
+tran_shm_fini(vfu_ctx_t *vfu_ctx)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (ts != NULL && ts->epoll_fd != -1) {
+        close(ts->epoll_fd);
+        ts->epoll_fd = -1;
+    }
+
+    tran_sock_ops.fini(vfu_ctx);
+}
+
+/*
+ * The rings would have to be handed over too, along with our private ring
+ * positions: only a connection that hasn't set them up can be exported.
+ */
+static int
+tran_shm_export_fds(vfu_ctx_t *vfu_ctx, int *listen_fd, int *conn_fd)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (shm_active(ts)) {
+        return ERROR_INT(EBUSY);
+    }
+
+    if (ts->sock.conn_fd != -1) {
+        (void) epoll_ctl(ts->epoll_fd, EPOLL_CTL_DEL, ts->sock.conn_fd, NULL);
+    }
+
+    return tran_sock_ops.export_fds(vfu_ctx, listen_fd, conn_fd);
+}
+
+static int
+tran_shm_import_fds(vfu_ctx_t *vfu_ctx, int listen_fd, int conn_fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = conn_fd };
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    int ret;
+
+    if (ts->sock.conn_fd != -1) {
+        return ERROR_INT(EISCONN);
+    }
+
+    if (epoll_ctl(ts->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0) {
+        return -1;
+    }
+
+    ret = tran_sock_ops.import_fds(vfu_ctx, listen_fd, conn_fd);
+    assert(ret == 0);
+    return ret;
+}
+
+static int
+tran_shm_poll_ready(vfu_ctx_t *vfu_ctx)
+{
+    tran_shm_t *ts = vfu_ctx->tran_data;
+
+    if (!shm_active(ts)) {
+        return tran_sock_ops.poll_ready(vfu_ctx);
+    }
+
+    /* Leftover body bytes are skipped by the next header read. */
+    if (ring_used(&ts->rx) != (int64_t)ts->rx_body_len) {
+        return 1;
+    }
+
+    if (ts->poll_sock_countdown-- == 0) {
+        ts->poll_sock_countdown = SHM_POLL_SOCK_INTERVAL;
+        return tran_sock_ops.poll_ready(vfu_ctx);
+    }
+
+    return 0;
+}
+
+static int
+tran_shm_setup_shm(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
+{
+    struct vfio_user_shm_setup *setup = msg->in.iov.iov_base;
+    struct epoll_event ev = { .events = EPOLLIN };
+    tran_shm_t *ts = vfu_ctx->tran_data;
+    uint64_t ring_size;
+    size_t map_size;
+    struct stat st;
+    int memfd = -1;
+    int ret;
+
+    if (msg->in.iov.iov_len < sizeof(*setup) ||
+        setup->argsz < sizeof(*setup) || setup->flags != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad VFIO_USER_SHM_SETUP request");
+        return ERROR_INT(EINVAL);
+    }
+
+    ring_size = setup->ring_size;
+
+    /*
+     * Bounding the size before computing any offsets keeps them from
+     * overflowing; a power of two keeps the second ring's header cache-line
+     * aligned.
+     */
+    if (ring_size < TRAN_SHM_MIN_RING_SIZE ||
+        ring_size > TRAN_SHM_MAX_RING_SIZE ||
+        (ring_size & (ring_size - 1)) != 0) {
+        vfu_log(vfu_ctx, LOG_ERR, "bad shared-memory ring size %#lx",
+                ring_size);
+        return ERROR_INT(EINVAL);
+    }
+    map_size = VFIO_USER_SHM_RING_OFFSET(ring_size, 2);
+
+    if (msg->in.nr_fds != 3) {
+        vfu_log(vfu_ctx, LOG_ERR, "VFIO_USER_SHM_SETUP needs 3 fds, got %zu",
+                msg->in.nr_fds);
+        return ERROR_INT(EINVAL);
+    }
+
+    if (shm_active(ts)) {
+        vfu_log(vfu_ctx, LOG_ERR, "shared-memory rings already set up");
+        return ERROR_INT(EEXIST);
+    }
+
+    /* Accessing the rings beyond the end of the file would raise SIGBUS. */
+    if (fstat(msg->in.fds[0], &st) < 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size < map_size) {
+        vfu_log(vfu_ctx, LOG_ERR, "shared-memory file too small for rings "
+                "of %#lx bytes", ring_size);
+        return ERROR_INT(EINVAL);
+    }
+
+    ts->map_size = map_size;
+    ts->map = mmap(NULL, ts->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   msg->in.fds[0], 0);
+    if (ts->map == MAP_FAILED) {
+        ret = errno;
+        ts->map = NULL;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to map shared-memory rings: %m");
+        return ERROR_INT(ret);
+    }
+
+    memfd = consume_fd(msg->in.fds, msg->in.nr_fds, 0);
+    close(memfd);
+    ts->rx_efd = consume_fd(msg->in.fds, msg->in.nr_fds, 1);
+    ts->tx_efd = consume_fd(msg->in.fds, msg->in.nr_fds, 2);
+
+    ts->rx.ring = (void *)((char *)ts->map +
+        VFIO_USER_SHM_RING_OFFSET(ring_size, VFIO_USER_SHM_RING_C2S));
+    ts->rx.size = ring_size;
+    ts->rx.pos = __atomic_load_n(&ts->rx.ring->head, __ATOMIC_ACQUIRE);
+
+    ts->tx.ring = (void *)((char *)ts->map +
+        VFIO_USER_SHM_RING_OFFSET(ring_size, VFIO_USER_SHM_RING_S2C));
+    ts->tx.size = ring_size;
+    ts->tx.pos = __atomic_load_n(&ts->tx.ring->tail, __ATOMIC_ACQUIRE);
+
+    ev.data.fd = ts->rx_efd;
+    if (epoll_ctl(ts->epoll_fd, EPOLL_CTL_ADD, ts->rx_efd, &ev) < 0) {
+        ret = errno;
+        vfu_log(vfu_ctx, LOG_ERR, "failed to poll request eventfd: %m");
+        /* Avoid EPOLL_CTL_DEL on an fd that was never added. */
+        close(ts->rx_efd);
+        ts->rx_efd = -1;
+        shm_teardown(ts);
+        return ERROR_INT(ret);
+    }
+
+    vfu_log(vfu_ctx, LOG_DEBUG, "shared-memory rings of %lu bytes set up",
+            ring_size);
+
+    return 0;
+}
+
+struct transport_ops tran_shm_ops = {
+    .init = tran_shm_init,
+    .get_poll_fd = tran_shm_get_poll_fd,
+    .attach = tran_shm_attach,
+    .get_request_header = tran_shm_get_request_header,
+    .recv_body = tran_shm_recv_body,
+    .reply = tran_shm_reply,
+    .recv_msg = tran_shm_recv_msg,
+    .send_msg = tran_shm_send_msg,
+    .detach = tran_shm_detach,
+    .fini = tran_shm_fini,
+    .setup_shm = tran_shm_setup_shm,
+    .poll_ready = tran_shm_poll_ready,
+    .export_fds = tran_shm_export_fds,
+    .import_fds = tran_shm_import_fds,
+};
+
+/* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
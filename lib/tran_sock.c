@@ -48,13 +48,10 @@
 #include <sys/mman.h>
 #include <string.h>
 
+#include "shadow.h"
+#include "thread.h"
 #include "tran_sock.h"
 
-typedef struct {
-    int listen_fd;
-    int conn_fd;
-} tran_sock_t;
-
 int
 tran_sock_send_iovec(int sock, uint16_t msg_id, bool is_reply,
                      enum vfio_user_command cmd,
@@ -534,7 +531,9 @@ tran_sock_recv_body(vfu_ctx_t *vfu_ctx, vfu_msg_t *msg)
         return -1;
     }
 
-    ret = recv(ts->conn_fd, msg->in.iov.iov_base, msg->in.iov.iov_len, 0);
+    /* the body may arrive in pieces, e.g. if larger than the socket buffer */
+    ret = recv(ts->conn_fd, msg->in.iov.iov_base, msg->in.iov.iov_len,
+               MSG_WAITALL);
 
     if (ret < 0) {
         ret = errno;
@@ -633,6 +632,20 @@ tran_sock_send_msg(vfu_ctx_t *vfu_ctx, uint16_t msg_id,
                          hdr, recv_data, recv_len);
 }
 
+static int
+tran_sock_poll_ready(vfu_ctx_t *vfu_ctx)
+{
+    tran_sock_t *ts = vfu_ctx->tran_data;
+    char c;
+
+    if (recv(ts->conn_fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT) < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+    }
+
+    /* Data, or EOF which get_request_header() will report. */
+    return 1;
+}
+
 static void
 tran_sock_detach(vfu_ctx_t *vfu_ctx)
 {
@@ -649,6 +662,50 @@ tran_sock_detach(vfu_ctx_t *vfu_ctx)
     }
 }
 
+static int
+tran_sock_export_fds(vfu_ctx_t *vfu_ctx, int *listen_fd, int *conn_fd)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->conn_fd == -1) {
+        return ERROR_INT(ENOTCONN);
+    }
+
+    *listen_fd = ts->listen_fd;
+    *conn_fd = ts->conn_fd;
+    ts->listen_fd = -1;
+    ts->conn_fd = -1;
+    return 0;
+}
+
+static int
+tran_sock_import_fds(vfu_ctx_t *vfu_ctx, int listen_fd, int conn_fd)
+{
+    tran_sock_t *ts;
+
+    assert(vfu_ctx != NULL);
+    assert(vfu_ctx->tran_data != NULL);
+
+    ts = vfu_ctx->tran_data;
+
+    if (ts->conn_fd != -1) {
+        return ERROR_INT(EISCONN);
+    }
+
+    if (ts->listen_fd != -1) {
+        // FIXME: handle EINTR
+        (void) close(ts->listen_fd);
+    }
+    ts->listen_fd = listen_fd;
+    ts->conn_fd = conn_fd;
+    return 0;
+}
+
 static void
 tran_sock_fini(vfu_ctx_t *vfu_ctx)
 {
@@ -678,7 +735,10 @@ struct transport_ops tran_sock_ops = {
     .recv_msg = tran_sock_recv_msg,
     .send_msg = tran_sock_send_msg,
     .detach = tran_sock_detach,
-    .fini = tran_sock_fini
+    .fini = tran_sock_fini,
+    .poll_ready = tran_sock_poll_ready,
+    .export_fds = tran_sock_export_fds,
+    .import_fds = tran_sock_import_fds,
 };
 
 /* ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: */
@@ -820,7 +880,12 @@ void vsock_handle_client(int client_fd, disagg_pci_dev_info *vsock_pci_info)
 
             loff_t offset = header.address -  *(vsock_pci_info->regions[pci_region].addr);
             bool is_write = false;
-            uint32_t ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
+            ssize_t shadow_ret;
+            uint32_t ret;
+            if (shadow_access(vsock_pci_info->vctx, pci_region, data, header.length, offset, is_write, &shadow_ret))
+                ret = shadow_ret;
+            else
+                ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
 
             if (ret != header.length)
             {
@@ -850,6 +915,8 @@ void vsock_handle_client(int client_fd, disagg_pci_dev_info *vsock_pci_info)
 
             offset = header.address -  *(vsock_pci_info->regions[pci_region].addr);
             is_write = true;
+            /* invalidates any shadow copies of what's written */
+            shadow_access(vsock_pci_info->vctx, pci_region, data, header.length, offset, is_write, &shadow_ret);
             ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
 
             if (ret != header.length)
@@ -1003,7 +1070,7 @@ static int create_or_open_shmem_file() {
     return fd;
 }
 
-static int init_shared_memory() {
+static int init_shared_memory(vfu_ctx_t *vfu_ctx) {
     int fd = create_or_open_shmem_file();
     if (fd < 0) {
         return -1;
@@ -1016,6 +1083,12 @@ static int init_shared_memory() {
         return -1;
     }
 
+    /* only pages not touched yet by the other side move, but it's a start */
+    if (thread_bind_memory(vfu_ctx, shmem, SHMEM_SIZE) != 0) {
+        vfu_log(vfu_ctx, LOG_WARNING, "failed to bind shared memory to NUMA "
+                "node: %m");
+    }
+
     read_doorbell = (volatile uint8_t *)shmem + READ_DOORBELL_OFFSET;
     write_doorbell = (volatile uint8_t *)shmem + WRITE_DOORBELL_OFFSET;
     close(fd);
@@ -1084,13 +1157,13 @@ static int wait_and_read_data(void *buf, size_t count) {
 }
 
 void *run_shmem_app(void* arg) {
-    if (init_shared_memory() < 0) {
+    disagg_pci_dev_info *vsock_pci_info = (disagg_pci_dev_info*) arg;
+
+    if (init_shared_memory(vsock_pci_info->vctx) < 0) {
         printf("SHMEM: init_shared_memory failed\n");
         // return;
     }
 
-    disagg_pci_dev_info *vsock_pci_info = (disagg_pci_dev_info*) arg;
-
     printf("tran_sock.c: In shmem app: vfu_ctx: uuid: %s\n", vsock_pci_info->vctx->uuid);
 
     printf("SHMEM application started. Waiting for messages...\n");
@@ -1126,7 +1199,12 @@ void *run_shmem_app(void* arg) {
 
             loff_t offset = header.address -  *(vsock_pci_info->regions[pci_region].addr);
             is_write = false;
-            uint32_t ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
+            ssize_t shadow_ret;
+            uint32_t ret;
+            if (shadow_access(vsock_pci_info->vctx, pci_region, data, header.length, offset, is_write, &shadow_ret))
+                ret = shadow_ret;
+            else
+                ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
 
             if (ret != header.length)
             {
@@ -1174,6 +1252,8 @@ void *run_shmem_app(void* arg) {
 
             offset = header.address -  *(vsock_pci_info->regions[pci_region].addr);
             is_write = true;
+            /* invalidates any shadow copies of what's written */
+            shadow_access(vsock_pci_info->vctx, pci_region, data, header.length, offset, is_write, &shadow_ret);
             ret = cb(vsock_pci_info->vctx, data, header.length, offset, is_write);
 
             if (ret != header.length)
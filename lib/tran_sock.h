@@ -38,6 +38,15 @@
 
 extern struct transport_ops tran_sock_ops;
 
+/*
+ * Transport data for tran_sock_ops. Exposed so that transports layered on top
+ * of the socket (see tran_shm.c) can embed it as their first member.
+ */
+typedef struct {
+    int listen_fd;
+    int conn_fd;
+} tran_sock_t;
+
 /*
  * These are not public routines, but for convenience, they are used by the
  * sample/test code as well as privately within libvfio-user.
@@ -62,9 +62,10 @@ static char const *irq_to_str[] = {
     [VFU_DEV_REQ_IRQ] = "REQ"
 };
 
+/* parenthesized, as the library's headers wrap vfu_log() in a macro */
 void
-vfu_log(UNUSED vfu_ctx_t *vfu_ctx, UNUSED int level,
-        const char *fmt, ...)
+(vfu_log)(UNUSED vfu_ctx_t *vfu_ctx, UNUSED int level,
+          const char *fmt, ...)
 {
     va_list ap;
 
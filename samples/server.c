@@ -553,6 +553,13 @@ int main(int argc, char *argv[])
         err(EXIT_FAILURE, "failed to setup device migration");
     }
 
+    /* most of BAR1 is zero or unchanged between iterations */
+    ret = vfu_setup_migration_encoding(vfu_ctx, VFU_MIGR_ENC_ZERO_PAGES |
+                                                VFU_MIGR_ENC_UNCHANGED_PAGES);
+    if (ret < 0) {
+        err(EXIT_FAILURE, "failed to setup migration encoding");
+    }
+
     ret = vfu_setup_device_reset_cb(vfu_ctx, &device_reset);
     if (ret < 0) {
         err(EXIT_FAILURE, "failed to setup device reset callbacks");
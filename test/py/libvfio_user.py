@@ -50,6 +50,8 @@ UINT64_MAX = 18446744073709551615
 
 PCI_HEADER_TYPE_NORMAL = 0
 
+PCI_COMMAND = 4
+
 PCI_STD_HEADER_SIZEOF = 64
 
 PCI_BARS_NR = 6
@@ -122,7 +124,8 @@ VFIO_DEVICE_STATE_MASK = ((1 << 3) - 1)
 
 VFU_TRANS_SOCK = 0
 VFU_TRANS_PIPE = 1
-VFU_TRANS_MAX = 2
+VFU_TRANS_SHM = 2
+VFU_TRANS_MAX = 3
 
 LIBVFIO_USER_FLAG_ATTACH_NB = (1 << 0)
 VFU_DEV_TYPE_PCI = 0
@@ -159,6 +162,13 @@ VFIO_USER_DMA_WRITE = 12
 VFIO_USER_DEVICE_RESET = 13
 VFIO_USER_DIRTY_PAGES = 14
 VFIO_USER_MAX = 15
+VFIO_USER_EXT_BASE = 0x8000
+VFIO_USER_SHM_SETUP = VFIO_USER_EXT_BASE
+VFIO_USER_DEVICE_FEATURE = 0x8001
+VFIO_USER_MIG_DATA_READ = 0x8002
+VFIO_USER_MIG_DATA_WRITE = 0x8003
+VFIO_USER_MIG_STREAMS = 0x8004
+VFIO_USER_EXT_MAX = 0x8005
 
 VFIO_USER_F_TYPE_COMMAND = 0
 VFIO_USER_F_TYPE_REPLY = 1
@@ -195,6 +205,11 @@ VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP = (1 << 2)
 VFIO_USER_IO_FD_TYPE_IOEVENTFD = 0
 VFIO_USER_IO_FD_TYPE_IOREGIONFD = 1
 
+VFIO_USER_IOREGIONFD_CMD_READ = 0
+VFIO_USER_IOREGIONFD_CMD_WRITE = 1
+VFIO_USER_IOREGIONFD_SIZE_SHIFT = 4
+VFIO_USER_IOREGIONFD_RESP = (1 << 6)
+
 
 # enum vfu_dev_irq_type
 VFU_DEV_INTX_IRQ = 0
@@ -221,6 +236,17 @@ VFU_CAP_FLAG_READONLY = (1 << 2)
 
 VFU_MIGR_CALLBACKS_VERS = 1
 
+VFU_MIGR_STATE_STOP = 0
+VFU_MIGR_STATE_RUNNING = 1
+VFU_MIGR_STATE_STOP_AND_COPY = 2
+VFU_MIGR_STATE_PRE_COPY = 3
+VFU_MIGR_STATE_RESUME = 4
+
+VFU_MIGR_PENDING_HISTORY = 16
+
+VFU_DIRTY_TRACKING_MANUAL = 0
+VFU_DIRTY_TRACKING_WP = 1
+
 SOCK_PATH = b"/tmp/vfio-user.sock.%d" % os.getpid()
 
 topdir = os.path.realpath(os.path.dirname(__file__) + "/../..")
@@ -459,6 +485,25 @@ class vfio_user_dma_unmap(Structure):
     ]
 
 
+VFU_REG_RO = 0
+VFU_REG_RW = 1
+VFU_REG_W1C = 2
+
+vfu_reg_read_cb_t = c.CFUNCTYPE(c.c_uint64, c.c_void_p, c.c_long)
+vfu_reg_write_cb_t = c.CFUNCTYPE(None, c.c_void_p, c.c_long, c.c_uint64)
+
+
+class vfu_reg_t(Structure):
+    _fields_ = [
+        ("offset", c.c_long),
+        ("width", c.c_uint32),
+        ("type", c.c_int),
+        ("value", c.c_uint64),
+        ("read", vfu_reg_read_cb_t),
+        ("write", vfu_reg_write_cb_t),
+    ]
+
+
 class vfu_dma_info_t(Structure):
     _fields_ = [
         ("iova", iovec_t),
@@ -566,6 +611,37 @@ class vfio_user_migration_info(Structure):
     ]
 
 
+class vfu_migr_stats_t(Structure):
+    _fields_ = [
+        ("dirty_pages", c.c_uint64),
+        ("dirty_rate", c.c_uint64),
+        ("pending_bytes", c.c_uint64 * VFU_MIGR_PENDING_HISTORY),
+        ("nr_pending", c.c_uint32),
+        ("nr_iterations", c.c_uint64),
+        ("state_ns", c.c_uint64 * (VFU_MIGR_STATE_RESUME + 1)),
+    ]
+
+
+class vfu_loop_attr_t(Structure):
+    _fields_ = [
+        ("nr_threads", c.c_uint),
+        ("max_reqs_per_turn", c.c_uint),
+        ("cpus", c.POINTER(c.c_int)),
+        ("nr_cpus", c.c_size_t),
+    ]
+
+
+class vfu_thread_attr_t(Structure):
+    _fields_ = [
+        ("cpus", c.POINTER(c.c_int)),
+        ("nr_cpus", c.c_size_t),
+        ("numa_node", c.c_int),
+        ("name", c.c_char_p),
+        ("sched_policy", c.c_int),
+        ("sched_priority", c.c_int),
+    ]
+
+
 #
 # Util functions
 #
@@ -574,6 +650,13 @@ class vfio_user_migration_info(Structure):
 lib.vfu_create_ctx.argtypes = (c.c_int, c.c_char_p, c.c_int,
                                c.c_void_p, c.c_int)
 lib.vfu_create_ctx.restype = (c.c_void_p)
+lib.vfu_clone_ctx.argtypes = (c.c_void_p, c.c_char_p, c.c_void_p)
+lib.vfu_clone_ctx.restype = (c.c_void_p)
+lib.vfu_get_private.argtypes = (c.c_void_p,)
+lib.vfu_get_private.restype = (c.c_void_p)
+lib.vfu_ctx_memory_usage.argtypes = (c.c_void_p,)
+lib.vfu_ctx_memory_usage.restype = (c.c_size_t)
+vfu_log_fn_t = c.CFUNCTYPE(None, c.c_void_p, c.c_int, c.c_char_p)
 lib.vfu_setup_log.argtypes = (c.c_void_p, c.c_void_p, c.c_int)
 lib.vfu_realize_ctx.argtypes = (c.c_void_p,)
 lib.vfu_attach_ctx.argtypes = (c.c_void_p,)
@@ -608,6 +691,23 @@ vfu_dma_unregister_cb_t = c.CFUNCTYPE(None, c.c_void_p,
                                       use_errno=True)
 lib.vfu_setup_device_dma.argtypes = (c.c_void_p, vfu_dma_register_cb_t,
                                      vfu_dma_unregister_cb_t)
+lib.vfu_setup_dirty_tracking.argtypes = (c.c_void_p, c.c_int)
+lib.vfu_setup_dma_reconnect.argtypes = (c.c_void_p, c.c_uint32)
+lib.vfu_ctx_export_state.argtypes = (c.c_void_p, c.c_int)
+lib.vfu_ctx_import_state.argtypes = (c.c_void_p, c.c_int)
+lib.vfu_setup_msix_table.argtypes = (c.c_void_p,)
+lib.vfu_setup_region_regs.argtypes = (c.c_void_p, c.c_int,
+                                      c.POINTER(vfu_reg_t), c.c_size_t)
+lib.vfu_reg_get.argtypes = (c.c_void_p, c.c_int, c.c_long,
+                            c.POINTER(c.c_uint64))
+lib.vfu_reg_set.argtypes = (c.c_void_p, c.c_int, c.c_long, c.c_uint64)
+lib.vfu_reg_set_bits.argtypes = (c.c_void_p, c.c_int, c.c_long, c.c_uint64)
+lib.vfu_region_shadow_range.argtypes = (c.c_void_p, c.c_int, c.c_long,
+                                       c.c_size_t)
+lib.vfu_region_shadow_write.argtypes = (c.c_void_p, c.c_int, c.c_long,
+                                       c.c_char_p, c.c_size_t)
+lib.vfu_region_shadow_invalidate.argtypes = (c.c_void_p, c.c_int, c.c_long,
+                                            c.c_size_t)
 lib.vfu_setup_device_migration_callbacks.argtypes = (c.c_void_p,
     c.POINTER(vfu_migration_callbacks_t), c.c_uint64)
 lib.dma_sg_size.restype = (c.c_size_t)
@@ -621,8 +721,31 @@ lib.vfu_sgl_put.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
 lib.vfu_create_ioeventfd.argtypes = (c.c_void_p, c.c_uint32, c.c_int,
                                      c.c_size_t, c.c_uint32, c.c_uint32,
                                      c.c_uint64)
+lib.vfu_create_ioregionfd.argtypes = (c.c_void_p, c.c_uint32, c.c_size_t,
+                                      c.c_uint32, c.c_uint64)
 
 lib.vfu_device_quiesced.argtypes = (c.c_void_p, c.c_int)
+lib.vfu_migr_done.argtypes = (c.c_void_p, c.c_int)
+
+lib.vfu_setup_busy_poll.argtypes = (c.c_void_p, c.c_uint32)
+lib.vfu_setup_thread_attr.argtypes = (c.c_void_p,
+                                      c.POINTER(vfu_thread_attr_t))
+
+lib.vfu_setup_log_async.argtypes = (c.c_void_p, c.c_size_t)
+lib.vfu_trace_start.argtypes = (c.c_size_t,)
+lib.vfu_trace_export.argtypes = (c.c_char_p,)
+
+lib.vfu_migr_get_stats.argtypes = (c.c_void_p, c.POINTER(vfu_migr_stats_t))
+lib.vfu_dma_get_dirty_pages.argtypes = (c.c_void_p, c.c_void_p,
+                                        c.POINTER(c.c_uint64))
+
+lib.vfu_loop_create.argtypes = (c.POINTER(vfu_loop_attr_t),)
+lib.vfu_loop_create.restype = (c.c_void_p)
+lib.vfu_loop_add_ctx.argtypes = (c.c_void_p, c.c_void_p)
+lib.vfu_loop_remove_ctx.argtypes = (c.c_void_p, c.c_void_p)
+lib.vfu_loop_start.argtypes = (c.c_void_p,)
+lib.vfu_loop_stop.argtypes = (c.c_void_p,)
+lib.vfu_loop_destroy.argtypes = (c.c_void_p,)
 
 vfu_dev_irq_state_cb_t = c.CFUNCTYPE(None, c.c_void_p, c.c_uint32,
                                      c.c_uint32, c.c_bool, use_errno=True)
@@ -923,7 +1046,7 @@ def prepare_ctx_for_dma(dma_register=__dma_register,
 msg_id = 1
 
 
-@c.CFUNCTYPE(None, c.c_void_p, c.c_int, c.c_char_p)
+@vfu_log_fn_t
 def log(ctx, level, msg):
     lvl2str = {syslog.LOG_EMERG: "EMERGENCY",
                 syslog.LOG_ALERT: "ALERT",
@@ -960,6 +1083,27 @@ def vfu_create_ctx(trans=VFU_TRANS_SOCK, sock_path=SOCK_PATH, flags=0,
     return ctx
 
 
+def vfu_clone_ctx(ctx, sock_path, private=None):
+    assert ctx is not None
+
+    if os.path.exists(sock_path):
+        os.remove(sock_path)
+
+    return lib.vfu_clone_ctx(ctx, sock_path, private)
+
+
+def vfu_get_private(ctx):
+    assert ctx is not None
+
+    return lib.vfu_get_private(ctx)
+
+
+def vfu_ctx_memory_usage(ctx):
+    assert ctx is not None
+
+    return lib.vfu_ctx_memory_usage(ctx)
+
+
 def vfu_realize_ctx(ctx):
     return lib.vfu_realize_ctx(ctx)
 
@@ -1030,6 +1174,53 @@ def vfu_setup_region(ctx, index, size, cb=__pci_region_cb, flags=0,
     return ret
 
 
+def vfu_setup_region_regs(ctx, index, regs):
+    assert ctx is not None
+
+    c_regs = (vfu_reg_t * len(regs))(*regs)
+    return lib.vfu_setup_region_regs(ctx, index, c_regs, len(regs))
+
+
+def vfu_reg_get(ctx, index, offset):
+    """Returns the register value, or None on error."""
+    assert ctx is not None
+
+    val = c.c_uint64()
+    if lib.vfu_reg_get(ctx, index, offset, c.byref(val)) != 0:
+        return None
+    return val.value
+
+
+def vfu_reg_set(ctx, index, offset, val):
+    assert ctx is not None
+
+    return lib.vfu_reg_set(ctx, index, offset, val)
+
+
+def vfu_reg_set_bits(ctx, index, offset, bits):
+    assert ctx is not None
+
+    return lib.vfu_reg_set_bits(ctx, index, offset, bits)
+
+
+def vfu_region_shadow_range(ctx, index, offset, size):
+    assert ctx is not None
+
+    return lib.vfu_region_shadow_range(ctx, index, offset, size)
+
+
+def vfu_region_shadow_write(ctx, index, offset, data):
+    assert ctx is not None
+
+    return lib.vfu_region_shadow_write(ctx, index, offset, data, len(data))
+
+
+def vfu_region_shadow_invalidate(ctx, index, offset, size):
+    assert ctx is not None
+
+    return lib.vfu_region_shadow_invalidate(ctx, index, offset, size)
+
+
 def vfu_setup_device_nr_irqs(ctx, irqtype, count):
     assert ctx is not None
     return lib.vfu_setup_device_nr_irqs(ctx, irqtype, count)
@@ -1080,6 +1271,12 @@ def vfu_irq_trigger(ctx, subindex):
     return lib.vfu_irq_trigger(ctx, subindex)
 
 
+def vfu_setup_msix_table(ctx):
+    assert ctx is not None
+
+    return lib.vfu_setup_msix_table(ctx)
+
+
 def vfu_setup_device_dma(ctx, register_cb=None, unregister_cb=None):
     assert ctx is not None
 
@@ -1191,10 +1388,126 @@ def vfu_create_ioeventfd(ctx, region_idx, fd, offset, size, flags, datamatch):
                                     flags, datamatch)
 
 
+def vfu_create_ioregionfd(ctx, region_idx, offset, size, user_data=0):
+    assert ctx is not None
+
+    return lib.vfu_create_ioregionfd(ctx, region_idx, offset, size, user_data)
+
+
 def vfu_device_quiesced(ctx, err):
     return lib.vfu_device_quiesced(ctx, err)
 
 
+def vfu_migr_done(ctx, err):
+    return lib.vfu_migr_done(ctx, err)
+
+
+def vfu_setup_busy_poll(ctx, idle_us):
+    return lib.vfu_setup_busy_poll(ctx, idle_us)
+
+
+def vfu_setup_thread_attr(ctx, cpus=None, numa_node=-1, name=None,
+                          sched_policy=0, sched_priority=0):
+    assert ctx is not None
+
+    attr = vfu_thread_attr_t(numa_node=numa_node, name=name,
+                             sched_policy=sched_policy,
+                             sched_priority=sched_priority)
+    if cpus:
+        attr.cpus = (c.c_int * len(cpus))(*cpus)
+        attr.nr_cpus = len(cpus)
+    return lib.vfu_setup_thread_attr(ctx, attr)
+
+
+def vfu_setup_log(ctx, log_cb, level=syslog.LOG_DEBUG):
+    assert ctx is not None
+
+    return lib.vfu_setup_log(ctx, log_cb, level)
+
+
+def vfu_setup_log_async(ctx, nr_msgs):
+    assert ctx is not None
+
+    return lib.vfu_setup_log_async(ctx, nr_msgs)
+
+
+def vfu_trace_start(nr_events=0):
+    return lib.vfu_trace_start(nr_events)
+
+
+def vfu_trace_stop():
+    lib.vfu_trace_stop()
+
+
+def vfu_trace_export(path):
+    return lib.vfu_trace_export(path)
+
+
+def vfu_setup_dirty_tracking(ctx, mode):
+    assert ctx is not None
+
+    return lib.vfu_setup_dirty_tracking(ctx, mode)
+
+
+def vfu_setup_dma_reconnect(ctx, grace_ms):
+    assert ctx is not None
+
+    return lib.vfu_setup_dma_reconnect(ctx, grace_ms)
+
+
+def vfu_ctx_export_state(ctx, sock):
+    assert ctx is not None
+
+    return lib.vfu_ctx_export_state(ctx, sock)
+
+
+def vfu_ctx_import_state(ctx, sock):
+    assert ctx is not None
+
+    return lib.vfu_ctx_import_state(ctx, sock)
+
+
+def vfu_migr_get_stats(ctx):
+    stats = vfu_migr_stats_t()
+    ret = lib.vfu_migr_get_stats(ctx, stats)
+    return ret, stats
+
+
+def vfu_dma_get_dirty_pages(ctx, dma_addr):
+    dirty_pages = c.c_uint64()
+    ret = lib.vfu_dma_get_dirty_pages(ctx, dma_addr, dirty_pages)
+    return ret, dirty_pages.value
+
+
+def vfu_loop_create(nr_threads=0, max_reqs_per_turn=0, cpus=None):
+    attr = vfu_loop_attr_t(nr_threads=nr_threads,
+                           max_reqs_per_turn=max_reqs_per_turn)
+    if cpus:
+        attr.cpus = (c.c_int * len(cpus))(*cpus)
+        attr.nr_cpus = len(cpus)
+    return lib.vfu_loop_create(attr)
+
+
+def vfu_loop_add_ctx(loop, ctx):
+    return lib.vfu_loop_add_ctx(loop, ctx)
+
+
+def vfu_loop_remove_ctx(loop, ctx):
+    return lib.vfu_loop_remove_ctx(loop, ctx)
+
+
+def vfu_loop_start(loop):
+    return lib.vfu_loop_start(loop)
+
+
+def vfu_loop_stop(loop):
+    lib.vfu_loop_stop(loop)
+
+
+def vfu_loop_destroy(loop):
+    lib.vfu_loop_destroy(loop)
+
+
 def fail_with_errno(err):
     def side_effect(args, *kwargs):
         c.set_errno(err)
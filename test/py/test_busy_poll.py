@@ -0,0 +1,85 @@
+#
+# Copyright (c) 2022 Nutanix Inc. All rights reserved.
+#
+# Authors: John Levon <john.levon@nutanix.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+import time
+
+
+def test_busy_poll_nb():
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_setup_busy_poll(ctx, 100) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    vfu_destroy_ctx(ctx)
+
+
+def test_busy_poll():
+    ctx = vfu_create_ctx()
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    assert vfu_setup_busy_poll(ctx, 1000) == 0
+
+    sock = connect_sock()
+    result = []
+
+    def server():
+        # blocking: returns once the client goes away
+        result.append(lib.vfu_attach_ctx(ctx))
+        result.append(lib.vfu_run_ctx(ctx))
+        result.append(c.get_errno())
+
+    t = threading.Thread(target=server)
+    t.start()
+
+    payload = struct.pack("HH", LIBVFIO_USER_MAJOR, LIBVFIO_USER_MINOR)
+    sock.send(vfio_user_header(VFIO_USER_VERSION, size=len(payload)) +
+              payload)
+    get_reply(sock)
+
+    # Some requests back to back while spinning, then one after the spin
+    # period has expired and the server has gone back to blocking.
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+    for delay in [0, 0, 0, 0.01]:
+        time.sleep(delay)
+        sock.send(vfio_user_header(VFIO_USER_DEVICE_GET_INFO,
+                                   size=len(payload)) + payload)
+        get_reply(sock)
+
+    sock.close()
+    t.join()
+    assert result == [0, -1, errno.ENOTCONN]
+
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,304 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+
+#
+# The client library is exercised against a server context running in a
+# separate thread of this process.
+#
+
+clib = c.CDLL(os.path.join(os.getenv("LIBVFIO_SO_DIR"),
+                           "libvfio-user-client.so"), use_errno=True)
+
+vfu_client_cb_t = c.CFUNCTYPE(None, c.c_void_p, c.c_void_p, c.c_int,
+                              c.c_void_p, c.c_size_t, c.POINTER(c.c_int),
+                              c.c_size_t)
+
+clib.vfu_client_connect.argtypes = (c.c_char_p, c.c_void_p)
+clib.vfu_client_connect.restype = c.c_void_p
+clib.vfu_client_close.argtypes = (c.c_void_p,)
+clib.vfu_client_run.argtypes = (c.c_void_p, c.c_int)
+clib.vfu_client_inflight.argtypes = (c.c_void_p,)
+clib.vfu_client_inflight.restype = c.c_uint32
+clib.vfu_client_get_device_info.argtypes = (c.c_void_p, c.c_void_p)
+clib.vfu_client_region_access_async.argtypes = (c.c_void_p, c.c_uint32,
+                                                c.c_uint64, c.c_void_p,
+                                                c.c_size_t, c.c_bool,
+                                                vfu_client_cb_t, c.c_void_p)
+clib.vfu_client_region_read.argtypes = (c.c_void_p, c.c_uint32, c.c_uint64,
+                                        c.c_void_p, c.c_size_t)
+clib.vfu_client_region_write.argtypes = (c.c_void_p, c.c_uint32, c.c_uint64,
+                                         c.c_void_p, c.c_size_t)
+clib.vfu_client_region_mmap.argtypes = (c.c_void_p, c.c_uint32, c.c_int,
+                                        c.POINTER(c.POINTER(iovec_t)),
+                                        c.POINTER(c.c_size_t))
+clib.vfu_client_region_munmap.argtypes = (c.POINTER(iovec_t), c.c_size_t)
+clib.vfu_client_dma_map.argtypes = (c.c_void_p, c.c_int, c.c_uint64,
+                                    c.c_uint64, c.c_uint64, c.c_uint32,
+                                    c.c_void_p)
+clib.vfu_client_dma_unmap.argtypes = (c.c_void_p, c.c_uint64, c.c_uint64)
+
+lib.vfu_sgl_read.argtypes = (c.c_void_p, c.POINTER(dma_sg_t), c.c_size_t,
+                             c.c_void_p)
+lib.vfu_sgl_copy_to.argtypes = (c.c_void_p, c.POINTER(dma_sg_t), c.c_size_t,
+                                c.c_void_p)
+lib.vfu_sgl_copy_from.argtypes = (c.c_void_p, c.POINTER(dma_sg_t),
+                                  c.c_size_t, c.c_void_p)
+
+BAR0_SIZE = 0x4000
+
+ctx = None
+bar0 = bytearray(BAR0_SIZE)
+server_thread = None
+dma_seen = []
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    if is_write:
+        bar0[offset:offset + count] = c.string_at(buf, count)
+        # A write to the last dword makes the device read 8 bytes of guest
+        # memory at the IOVA just written.
+        if offset == BAR0_SIZE - 8 and count == 8:
+            iova = struct.unpack("Q", bar0[offset:offset + 8])[0]
+            ret, sg = vfu_addr_to_sgl(ctx, iova, 8)
+            assert ret == 1
+            data = c.create_string_buffer(8)
+            assert lib.vfu_sgl_read(ctx, sg, 1, data) == 0
+            dma_seen.append(data.raw)
+        # A write of (IOVA, length) to the two dwords before makes the device
+        # copy a pattern to guest memory there, then read it back.
+        elif offset == BAR0_SIZE - 24 and count == 16:
+            iova, length = struct.unpack("QQ", bar0[offset:offset + 16])
+            ret, sg = vfu_addr_to_sgl(ctx, iova, length, max_nr_sgs=4)
+            assert ret > 0
+            pattern = bytes(range(251)) * (length // 251 + 1)
+            assert lib.vfu_sgl_copy_to(ctx, sg, ret, pattern[:length]) == 0
+            data = c.create_string_buffer(length)
+            assert lib.vfu_sgl_copy_from(ctx, sg, ret, data) == 0
+            dma_seen.append(data.raw)
+    else:
+        c.memmove(buf, bytes(bar0[offset:offset + count]), count)
+    return count
+
+
+def run_server():
+    ret = lib.vfu_attach_ctx(ctx)
+    assert ret == 0
+    while lib.vfu_run_ctx(ctx) >= 0:
+        pass
+
+
+def setup_function(function):
+    global ctx, server_thread, mmap_file
+
+    ctx = vfu_create_ctx()
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                            size=BAR0_SIZE, cb=bar0_access,
+                            flags=VFU_REGION_FLAG_RW) == 0
+
+    mmap_file = tempfile.TemporaryFile()
+    mmap_file.truncate(0x2000)
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR1_REGION_IDX,
+                            size=0x2000, flags=VFU_REGION_FLAG_RW,
+                            mmap_areas=[(0x1000, 0x1000)],
+                            fd=mmap_file.fileno()) == 0
+    assert vfu_setup_device_dma(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    server_thread = threading.Thread(target=run_server)
+    server_thread.start()
+
+
+def teardown_function(function):
+    server_thread.join()
+    vfu_destroy_ctx(ctx)
+    mmap_file.close()
+
+
+def client_connect():
+    client = clib.vfu_client_connect(SOCK_PATH, None)
+    assert client is not None
+    return client
+
+
+def test_client_device_info():
+    client = client_connect()
+
+    info = vfio_user_device_info()
+    assert clib.vfu_client_get_device_info(client, c.byref(info)) == 0
+    assert info.num_regions == VFU_PCI_DEV_NUM_REGIONS
+
+    clib.vfu_client_close(client)
+
+
+def test_client_region_rw():
+    client = client_connect()
+
+    data = bytes(range(256)) * (BAR0_SIZE // 256)
+    assert clib.vfu_client_region_write(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                        0, data, len(data)) == 0
+    assert bytes(bar0) == data
+
+    buf = c.create_string_buffer(BAR0_SIZE)
+    assert clib.vfu_client_region_read(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                       0, buf, BAR0_SIZE) == 0
+    assert buf.raw == data
+
+    # out of range access is reported by the server
+    assert clib.vfu_client_region_read(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                       BAR0_SIZE, buf, 4) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    clib.vfu_client_close(client)
+
+
+def test_client_pipelined():
+    client = client_connect()
+
+    bar0[:] = bytes(range(256)) * (BAR0_SIZE // 256)
+    nr = 64
+    bufs = [c.create_string_buffer(4) for _ in range(nr)]
+    done = []
+
+    @vfu_client_cb_t
+    def completion(client, arg, err, data, length, fds, nr_fds):
+        assert err == 0
+        done.append(arg)
+
+    # all submitted before any reply is reaped
+    for i in range(nr):
+        assert clib.vfu_client_region_access_async(
+            client, VFU_PCI_DEV_BAR0_REGION_IDX, i * 4, bufs[i], 4, False,
+            completion, i + 1) >= 0
+
+    while clib.vfu_client_inflight(client) > 0:
+        assert clib.vfu_client_run(client, -1) >= 0
+
+    # (arguments are offset by one as ctypes turns a NULL arg into None)
+    assert sorted(done) == list(range(1, nr + 1))
+    for i in range(nr):
+        assert bufs[i].raw == bytes(bar0[i * 4:i * 4 + 4])
+
+    clib.vfu_client_close(client)
+
+
+def test_client_dma_read():
+    client = client_connect()
+
+    # No fd: the server has to use DMA_READ messages, which the client
+    # services while waiting for the reply to its region write.
+    guest = c.create_string_buffer(b"vfiouser" + b"\0" * 0xff8, 0x1000)
+    iova = 0x100000
+    assert clib.vfu_client_dma_map(client, -1, 0, iova, 0x1000,
+                                   VFIO_USER_F_DMA_REGION_READ |
+                                   VFIO_USER_F_DMA_REGION_WRITE,
+                                   c.addressof(guest)) == 0
+
+    del dma_seen[:]
+    addr = struct.pack("Q", iova)
+    assert clib.vfu_client_region_write(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                        BAR0_SIZE - 8, addr, 8) == 0
+    assert dma_seen == [b"vfiouser"]
+
+    assert clib.vfu_client_dma_unmap(client, iova, 0x1000) == 0
+
+    clib.vfu_client_close(client)
+
+
+def test_client_sgl_copy():
+    client = client_connect()
+
+    # A mapped region, large enough for non-temporal stores, followed by one
+    # that the server can only reach with DMA messages.
+    mapped_size = 0x80000
+    fd = os.memfd_create("guest")
+    os.ftruncate(fd, mapped_size)
+    mapped = mmap.mmap(fd, mapped_size)
+    unmapped = c.create_string_buffer(0x1000)
+    iova = 0x200000
+    assert clib.vfu_client_dma_map(client, fd, 0, iova, mapped_size,
+                                   VFIO_USER_F_DMA_REGION_READ |
+                                   VFIO_USER_F_DMA_REGION_WRITE, None) == 0
+    assert clib.vfu_client_dma_map(client, -1, 0, iova + mapped_size, 0x1000,
+                                   VFIO_USER_F_DMA_REGION_READ |
+                                   VFIO_USER_F_DMA_REGION_WRITE,
+                                   c.addressof(unmapped)) == 0
+
+    # unaligned start, spanning both regions
+    start = 0x13
+    length = mapped_size - start + 0x800
+    pattern = (bytes(range(251)) * (length // 251 + 1))[:length]
+
+    del dma_seen[:]
+    req = struct.pack("QQ", iova + start, length)
+    assert clib.vfu_client_region_write(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                        BAR0_SIZE - 24, req, 16) == 0
+    assert dma_seen == [pattern]
+    assert mapped[start:] == pattern[:mapped_size - start]
+    assert unmapped.raw[:0x800] == pattern[mapped_size - start:]
+    assert unmapped.raw[0x800:] == b"\0" * 0x800
+
+    assert clib.vfu_client_dma_unmap(client, iova, mapped_size) == 0
+    assert clib.vfu_client_dma_unmap(client, iova + mapped_size, 0x1000) == 0
+    mapped.close()
+    os.close(fd)
+
+    clib.vfu_client_close(client)
+
+
+def test_client_region_mmap():
+    client = client_connect()
+
+    areas = c.POINTER(iovec_t)()
+    nr_areas = c.c_size_t()
+    assert clib.vfu_client_region_mmap(client, VFU_PCI_DEV_BAR1_REGION_IDX,
+                                       mmap.PROT_READ | mmap.PROT_WRITE,
+                                       c.byref(areas), c.byref(nr_areas)) == 0
+    assert nr_areas.value == 1
+    assert areas[0].iov_len == 0x1000
+
+    c.memmove(areas[0].iov_base, b"sparse", 6)
+    mmap_file.seek(0x1000)
+    assert mmap_file.read(6) == b"sparse"
+
+    clib.vfu_client_region_munmap(areas, nr_areas)
+
+    # BAR0 has no fd
+    assert clib.vfu_client_region_mmap(client, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                       mmap.PROT_READ, c.byref(areas),
+                                       c.byref(nr_areas)) == -1
+    assert c.get_errno() == errno.ENOTSUP
+
+    clib.vfu_client_close(client)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
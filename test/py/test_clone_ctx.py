@@ -0,0 +1,159 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+from libvfio_user import *
+import errno
+import os
+
+TEMPLATE_SOCK_PATH = SOCK_PATH + b".template"
+NR_CLONES = 3
+
+BAR = VFU_PCI_DEV_BAR0_REGION_IDX
+REG_ID = 0x0
+REG_ID_VALUE = 0x1234abcd
+
+template = None
+clones = []
+sock = None
+accesses = []
+registered = []
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    accesses.append((ctx, offset))
+    return count
+
+
+@vfu_dma_register_cb_t
+def dma_register(ctx, info):
+    registered.append(ctx)
+
+
+@vfu_dma_unregister_cb_t
+def dma_unregister(ctx, info):
+    pass
+
+
+def clone_sock_path(i):
+    # the first clone is the one connect_client() talks to
+    return SOCK_PATH if i == 0 else SOCK_PATH + b".%d" % i
+
+
+def test_clone_ctx_template():
+    global template
+
+    template = vfu_create_ctx(sock_path=TEMPLATE_SOCK_PATH,
+                              flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert template is not None
+    assert vfu_pci_init(template) == 0
+
+    data = b"clone"
+    cap = struct.pack("ccc%ds" % len(data), to_byte(PCI_CAP_ID_VNDR), b'\0',
+                      to_byte(3 + len(data)), data)
+    assert vfu_pci_add_capability(template, pos=0, flags=0, data=cap) > 0
+
+    assert vfu_setup_region(template, index=BAR, size=0x1000, cb=bar0_access,
+                            flags=VFU_REGION_FLAG_RW) == 0
+    regs = [vfu_reg_t(offset=REG_ID, width=4, type=VFU_REG_RW,
+                      value=REG_ID_VALUE)]
+    assert vfu_setup_region_regs(template, BAR, regs) == 0
+
+    assert vfu_setup_device_dma(template, dma_register, dma_unregister) == 0
+    assert vfu_setup_device_nr_irqs(template, VFU_DEV_MSIX_IRQ, 4) == 0
+    assert vfu_realize_ctx(template) == 0
+
+    # clones start from the initial register values
+    assert vfu_reg_set(template, BAR, REG_ID, 0x5678) == 0
+
+
+def test_clone_ctx():
+    cfg = get_pci_ext_cfg_space(template)
+    cap_off = vfu_pci_find_capability(template, False, PCI_CAP_ID_VNDR)
+
+    for i in range(NR_CLONES):
+        clone = vfu_clone_ctx(template, clone_sock_path(i), private=i + 1)
+        assert clone is not None
+        clones.append(clone)
+
+        assert vfu_get_private(clone) == i + 1
+        assert get_pci_ext_cfg_space(clone) == cfg
+        assert vfu_pci_find_capability(clone, False, PCI_CAP_ID_VNDR) == cap_off
+        assert vfu_reg_get(clone, BAR, REG_ID) == REG_ID_VALUE
+
+        # realized like the template, with its own IRQ table
+        assert vfu_realize_ctx(clone) == 0
+        assert vfu_irq_trigger(clone, 3) == -1
+        assert c.get_errno() == errno.ENOENT
+
+    # the clone's config space is its own
+    assert lib.vfu_pci_get_config_space(clones[1]) != \
+        lib.vfu_pci_get_config_space(template)
+
+
+def test_clone_ctx_independent():
+    global sock
+
+    # not vfu_destroy_ctx(), which removes the first clone's socket
+    lib.vfu_destroy_ctx(template)
+    os.remove(TEMPLATE_SOCK_PATH)
+
+    sock = connect_client(clones[0])
+
+    read_region(clones[0], sock, BAR, offset=0x100, count=4)
+    assert accesses == [(clones[0], 0x100)]
+
+    payload = read_region(clones[0], sock, BAR, offset=REG_ID, count=4)
+    assert struct.unpack("I", payload)[0] == REG_ID_VALUE
+
+    fd = os.memfd_create("dma")
+    os.ftruncate(fd, 0x1000)
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=0x10000, size=0x1000)
+    msg(clones[0], sock, VFIO_USER_DMA_MAP, payload, fds=[fd])
+    os.close(fd)
+    assert registered == [clones[0]]
+
+
+def test_clone_ctx_busy():
+    # a context with a client's DMA mapped isn't a template
+    assert vfu_clone_ctx(clones[0], SOCK_PATH + b".busy") is None
+    assert c.get_errno() == errno.EBUSY
+
+
+def test_clone_ctx_cleanup():
+    disconnect_client(clones[0], sock)
+
+    for i, clone in enumerate(clones):
+        vfu_destroy_ctx(clone)
+        if os.path.exists(clone_sock_path(i)):
+            os.remove(clone_sock_path(i))
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
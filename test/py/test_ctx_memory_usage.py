@@ -0,0 +1,84 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+
+ctx = None
+sock = None
+
+
+def test_ctx_memory_usage_idle():
+    global ctx
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    created = vfu_ctx_memory_usage(ctx)
+    assert created > 0
+
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_ctx_memory_usage(ctx) >= created + PCI_CFG_SPACE_SIZE
+
+    # capability tables are only allocated once used
+    before = vfu_ctx_memory_usage(ctx)
+    cap = struct.pack("ccHH", to_byte(PCI_CAP_ID_PM), b'\0', 0, 0)
+    assert vfu_pci_add_capability(ctx, pos=0, flags=0, data=cap) > 0
+    assert vfu_ctx_memory_usage(ctx) > before
+
+    assert vfu_setup_device_dma(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    # an idle device must stay small, see benchmarks/ctx-memory.c
+    assert vfu_ctx_memory_usage(ctx) < 8192
+
+
+def test_ctx_memory_usage_dma():
+    global sock
+
+    sock = connect_client(ctx)
+    idle = vfu_ctx_memory_usage(ctx)
+
+    for i in range(8):
+        payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+            flags=(VFIO_USER_F_DMA_REGION_READ |
+                   VFIO_USER_F_DMA_REGION_WRITE),
+            offset=0, addr=0x10000 * (i + 1), size=0x1000)
+        msg(ctx, sock, VFIO_USER_DMA_MAP, payload)
+
+    assert vfu_ctx_memory_usage(ctx) > idle
+
+    # the region array goes with the client
+    disconnect_client(ctx, sock)
+    assert vfu_ctx_memory_usage(ctx) == idle
+
+
+def test_ctx_memory_usage_cleanup():
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -32,6 +32,7 @@ import ctypes as c
 import errno
 import mmap
 import tempfile
+import time
 
 ctx = None
 quiesce_errno = 0
@@ -283,13 +284,13 @@ def test_dirty_pages_get_unmodified():
     assert br.bitmap.size == 8
 
 
-def get_dirty_page_bitmap():
+def get_dirty_page_bitmap(iova=0x10000):
     argsz = len(vfio_user_dirty_pages()) + len(vfio_user_bitmap_range()) + 8
 
     dirty_pages = vfio_user_dirty_pages(argsz=argsz,
         flags=VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP)
     bitmap = vfio_user_bitmap(pgsize=0x1000, size=8)
-    br = vfio_user_bitmap_range(iova=0x10000, size=0x10000, bitmap=bitmap)
+    br = vfio_user_bitmap_range(iova=iova, size=0x10000, bitmap=bitmap)
 
     payload = bytes(dirty_pages) + bytes(br)
 
@@ -412,6 +413,33 @@ def test_dirty_pages_get_modified():
     assert bitmap == 0b010000000000000000001100
 
 
+def test_dirty_pages_stats():
+    ret, before = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    ret, region_before = vfu_dma_get_dirty_pages(ctx, 0x10000)
+    assert ret == 0
+
+    bitmap = write_to_addr(ctx, 0x10000, 0x3000)
+    assert bitmap == 0b111
+
+    ret, after = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    assert after.dirty_pages == before.dirty_pages + 3
+    assert after.dirty_rate > 0
+
+    ret, region_after = vfu_dma_get_dirty_pages(ctx, 0x11000)
+    assert ret == 0
+    assert region_after == region_before + 3
+
+    # the other region hasn't been fetched
+    ret, dirty_pages = vfu_dma_get_dirty_pages(ctx, 0x40000)
+    assert ret == 0
+    assert dirty_pages == 0
+
+    ret, dirty_pages = vfu_dma_get_dirty_pages(ctx, 0x80000)
+    assert ret == -1 and c.get_errno() == errno.ENOENT
+
+
 def test_dirty_pages_stop():
     # FIXME we have a memory leak as we don't free dirty bitmaps when
     # destroying the context.
@@ -421,6 +449,39 @@ def test_dirty_pages_stop():
     msg(ctx, sock, VFIO_USER_DIRTY_PAGES, payload)
 
 
+def test_dirty_pages_rate_multiple_regions():
+    # with another region per client fd, each round fetches several bitmaps
+    regions = [0x10000]
+    for i in range(7):
+        f = tempfile.TemporaryFile()
+        f.truncate(0x10000)
+        addr = 0x100000 + i * 0x10000
+        payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+            flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+            offset=0, addr=addr, size=0x10000)
+        msg(ctx, sock, VFIO_USER_DMA_MAP, payload, fds=[f.fileno()])
+        regions.append(addr)
+
+    start_logging()
+
+    # one page per region per round, for more rounds than the rate spans
+    ends = []
+    for _ in range(12):
+        time.sleep(0.02)
+        for addr in regions:
+            write_to_addr(ctx, addr, 0x1000, get_bitmap=False)
+            assert get_dirty_page_bitmap(iova=addr) == 0b1
+        ends.append(time.monotonic())
+
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    period = (ends[-1] - ends[-5]) / 4
+    expected = len(regions) * 0x1000 / period
+    assert expected * 0.9 <= stats.dirty_rate <= expected * 1.05
+
+    test_dirty_pages_stop()
+
+
 def test_dirty_pages_start_with_quiesce():
     global quiesce_errno
 
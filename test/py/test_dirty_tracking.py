@@ -0,0 +1,223 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+import ctypes as c
+import errno
+import os
+import pytest
+import tempfile
+
+ctx = None
+sock = None
+vaddr = None
+
+libc = c.CDLL("libc.so.6", use_errno=True)
+libc.read.argtypes = (c.c_int, c.c_void_p, c.c_size_t)
+libc.read.restype = c.c_ssize_t
+
+
+@vfu_dma_register_cb_t
+def dma_register(ctx, info):
+    return 0
+
+
+@vfu_dma_unregister_cb_t
+def dma_unregister(ctx, info):
+    return 0
+
+
+def dirty_pages(flags):
+    payload = vfio_user_dirty_pages(argsz=len(vfio_user_dirty_pages()),
+                                    flags=flags)
+    msg(ctx, sock, VFIO_USER_DIRTY_PAGES, payload)
+
+
+def get_dirty_page_bitmap():
+    argsz = len(vfio_user_dirty_pages()) + len(vfio_user_bitmap_range()) + 8
+
+    dirty_pages = vfio_user_dirty_pages(argsz=argsz,
+        flags=VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP)
+    bitmap = vfio_user_bitmap(pgsize=0x1000, size=8)
+    br = vfio_user_bitmap_range(iova=0x10000, size=0x10000, bitmap=bitmap)
+
+    result = msg(ctx, sock, VFIO_USER_DIRTY_PAGES, bytes(dirty_pages) + bytes(br))
+
+    _, result = vfio_user_dirty_pages.pop_from_buffer(result)
+    _, result = vfio_user_bitmap_range.pop_from_buffer(result)
+
+    return struct.unpack("Q", result)[0]
+
+
+def test_dirty_tracking_no_dma():
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_setup_dirty_tracking(ctx, VFU_DIRTY_TRACKING_WP)
+    assert ret == -1 and c.get_errno() == errno.EINVAL
+
+    vfu_destroy_ctx(ctx)
+
+
+def test_dirty_tracking_setup():
+    global ctx, sock, vaddr
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    ret = vfu_setup_device_dma(ctx, dma_register, dma_unregister)
+    assert ret == 0
+
+    ret = vfu_setup_dirty_tracking(ctx, 2)
+    assert ret == -1 and c.get_errno() == errno.EINVAL
+
+    ret = vfu_setup_dirty_tracking(ctx, VFU_DIRTY_TRACKING_WP)
+    if ret == -1 and c.get_errno() == errno.ENOTSUP:
+        pytest.skip("userfaultfd write-protection not supported")
+    assert ret == 0
+
+    f = tempfile.TemporaryFile()
+    f.truncate(0x2000)
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_MIGR_REGION_IDX, size=0x2000,
+                           flags=VFU_REGION_FLAG_RW,
+                           mmap_areas=[(0x1000, 0x1000)], fd=f.fileno())
+    assert ret == 0
+
+    ret = vfu_setup_device_migration_callbacks(ctx, offset=0x1000)
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+    # only shared memory can be write-protected
+    fd = os.memfd_create("dma")
+    os.ftruncate(fd, 0x10000)
+
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=0x10000, size=0x10000)
+
+    msg(ctx, sock, VFIO_USER_DMA_MAP, payload, fds=[fd])
+    os.close(fd)
+
+    # No vfu_sgl_put(): the device just writes to the memory directly.
+    ret, sg = vfu_addr_to_sgl(ctx, dma_addr=0x10000, length=0x10000)
+    assert ret == 1
+    iovec = iovec_t()
+    ret = vfu_sgl_get(ctx, sg, iovec)
+    assert ret == 0
+    vaddr = iovec.iov_base
+
+    dirty_pages(VFIO_IOMMU_DIRTY_PAGES_FLAG_START)
+
+    # can't change modes while logging
+    ret = vfu_setup_dirty_tracking(ctx, VFU_DIRTY_TRACKING_MANUAL)
+    assert ret == -1 and c.get_errno() == errno.EBUSY
+
+
+def test_dirty_tracking_write():
+    assert get_dirty_page_bitmap() == 0
+
+    c.memmove(vaddr + 0x1000, b"\xff" * 8, 8)
+    c.memmove(vaddr + 0x3ff8, b"\xff" * 16, 16)
+
+    assert get_dirty_page_bitmap() == 0b11010
+
+    # reported pages are protected again
+    assert get_dirty_page_bitmap() == 0
+
+    c.memmove(vaddr + 0x3000, b"\xff" * 8, 8)
+    c.memmove(vaddr + 0x3008, b"\xff" * 8, 8)
+
+    assert get_dirty_page_bitmap() == 0b1000
+
+
+def test_dirty_tracking_kernel_write():
+    rfd, wfd = os.pipe()
+    os.write(wfd, b"x" * 0x10)
+
+    assert libc.read(rfd, vaddr + 0xf000, 0x10) == 0x10
+    os.close(rfd)
+    os.close(wfd)
+
+    assert get_dirty_page_bitmap() == 0b1000000000000000
+
+
+def test_dirty_tracking_remap():
+    fd = os.memfd_create("dma")
+    os.ftruncate(fd, 0x10000)
+
+    # a region mapped while logging is protected too
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=0x40000, size=0x10000)
+    msg(ctx, sock, VFIO_USER_DMA_MAP, payload, fds=[fd])
+    os.close(fd)
+
+    ret, sg = vfu_addr_to_sgl(ctx, dma_addr=0x40000, length=0x10000)
+    assert ret == 1
+    iovec = iovec_t()
+    ret = vfu_sgl_get(ctx, sg, iovec)
+    assert ret == 0
+    c.memmove(iovec.iov_base + 0x2000, b"\xff" * 8, 8)
+
+    argsz = len(vfio_user_dirty_pages()) + len(vfio_user_bitmap_range()) + 8
+    dirty_pages = vfio_user_dirty_pages(argsz=argsz,
+        flags=VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP)
+    bitmap = vfio_user_bitmap(pgsize=0x1000, size=8)
+    br = vfio_user_bitmap_range(iova=0x40000, size=0x10000, bitmap=bitmap)
+    result = msg(ctx, sock, VFIO_USER_DIRTY_PAGES, bytes(dirty_pages) + bytes(br))
+    assert struct.unpack("Q", result[-8:])[0] == 0b100
+
+    payload = vfio_user_dma_unmap(argsz=len(vfio_user_dma_unmap()),
+                                  addr=0x40000, size=0x10000)
+    msg(ctx, sock, VFIO_USER_DMA_UNMAP, payload)
+
+
+def test_dirty_tracking_stop():
+    dirty_pages(VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP)
+
+    # no longer protected
+    c.memmove(vaddr, b"\xff" * 8, 8)
+
+    dirty_pages(VFIO_IOMMU_DIRTY_PAGES_FLAG_START)
+    c.memmove(vaddr + 0x2000, b"\xff" * 8, 8)
+    assert get_dirty_page_bitmap() == 0b100
+
+
+def test_dirty_tracking_cleanup():
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,172 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+import os
+import time
+
+ctx = None
+sock = None
+registered = []
+unregistered = []
+fds = []
+
+GRACE_MS = 500
+
+
+@vfu_dma_register_cb_t
+def dma_register(ctx, info):
+    registered.append(info.contents.iova.iov_base)
+
+
+@vfu_dma_unregister_cb_t
+def dma_unregister(ctx, info):
+    unregistered.append(info.contents.iova.iov_base)
+
+
+def dma_map(addr, fd, offset=0, size=0x10000, expect=0):
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=offset, addr=addr, size=size)
+    msg(ctx, sock, VFIO_USER_DMA_MAP, payload, fds=[fd], expect=expect)
+
+
+def reconnect():
+    global sock
+
+    disconnect_client(ctx, sock)
+    sock = connect_client(ctx)
+
+
+def vaddr_of(addr):
+    ret, sg = vfu_addr_to_sgl(ctx, dma_addr=addr, length=8)
+    assert ret == 1
+    iovec = iovec_t()
+    assert vfu_sgl_get(ctx, sg, iovec) == 0
+    vfu_sgl_put(ctx, sg, iovec)
+    return iovec.iov_base
+
+
+def test_dma_reconnect_no_dma():
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_setup_dma_reconnect(ctx, GRACE_MS) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    vfu_destroy_ctx(ctx)
+
+
+def test_dma_reconnect_setup():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx, dma_register, dma_unregister) == 0
+    assert vfu_setup_dma_reconnect(ctx, GRACE_MS) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    sock = connect_client(ctx)
+
+    for i in range(3):
+        fd = os.memfd_create("dma%d" % i)
+        os.ftruncate(fd, 0x10000)
+        fds.append(fd)
+        dma_map(0x10000 * (i + 1), fd)
+
+    assert registered == [0x10000, 0x20000, 0x30000]
+
+
+def test_dma_reconnect_takeover():
+    vaddr = vaddr_of(0x10000)
+    c.memmove(vaddr, b"retained", 8)
+
+    reconnect()
+    assert unregistered == []
+
+    # still usable in the meantime
+    assert vaddr_of(0x20000) is not None
+
+    # same region: taken over as is
+    del registered[:]
+    dma_map(0x10000, fds[0])
+    assert registered == []
+    assert vaddr_of(0x10000) == vaddr
+    assert c.string_at(vaddr, 8) == b"retained"
+
+    # different offset: the retained region is replaced
+    dma_map(0x20000, fds[1], offset=0x1000, size=0x8000)
+    assert unregistered == [0x20000]
+    assert registered == [0x20000]
+
+
+def test_dma_reconnect_expiry():
+    del registered[:]
+    del unregistered[:]
+
+    time.sleep(GRACE_MS / 1000 + 0.1)
+
+    # the next request drops the region that wasn't mapped again
+    dma_map(0x40000, fds[2])
+    assert unregistered == [0x30000]
+    assert registered == [0x40000]
+
+    ret, sg = vfu_addr_to_sgl(ctx, dma_addr=0x30000, length=8)
+    assert ret == -1
+    assert c.get_errno() == errno.ENOENT
+
+
+def test_dma_reconnect_disabled():
+    del registered[:]
+    del unregistered[:]
+
+    assert vfu_setup_dma_reconnect(ctx, 0) == 0
+    reconnect()
+    assert sorted(unregistered) == [0x10000, 0x20000, 0x40000]
+
+
+def test_dma_reconnect_cleanup():
+    assert vfu_setup_dma_reconnect(ctx, GRACE_MS) == 0
+    dma_map(0x10000, fds[0])
+    reconnect()
+
+    # destroying the context doesn't keep them
+    del unregistered[:]
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+    assert unregistered == [0x10000]
+
+    for fd in fds:
+        os.close(fd)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,177 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+from libvfio_user import *
+import errno
+import os
+
+NEW_SOCK_PATH = SOCK_PATH + b".new"
+
+old = None
+new = None
+sock = None
+dma_fd = -1
+irq_fd = -1
+registered = []
+unregistered = []
+resets = []
+
+
+@vfu_dma_register_cb_t
+def dma_register(ctx, info):
+    registered.append((ctx, info.contents.iova.iov_base))
+
+
+@vfu_dma_unregister_cb_t
+def dma_unregister(ctx, info):
+    unregistered.append((ctx, info.contents.iova.iov_base))
+
+
+@vfu_reset_cb_t
+def reset_cb(ctx, reset_type):
+    resets.append(ctx)
+    return 0
+
+
+def setup_ctx(sock_path, nr_irqs=4):
+    ctx = vfu_create_ctx(sock_path=sock_path, flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx, dma_register, dma_unregister) == 0
+    assert vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, nr_irqs) == 0
+    assert vfu_setup_device_reset_cb(ctx, reset_cb) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    return ctx
+
+
+def handover(src, dst):
+    a, b = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    ret = vfu_ctx_export_state(src, a.fileno())
+    err = c.get_errno()
+    if ret == 0:
+        ret = vfu_ctx_import_state(dst, b.fileno())
+        err = c.get_errno()
+    a.close()
+    b.close()
+    return ret, err
+
+
+def test_handover_setup():
+    global old, new, sock, dma_fd, irq_fd
+
+    old = setup_ctx(SOCK_PATH)
+    new = setup_ctx(NEW_SOCK_PATH)
+
+    # nothing to hand over yet
+    assert vfu_ctx_export_state(old, -1) == -1
+    assert c.get_errno() == errno.ENOTCONN
+
+    sock = connect_client(old)
+
+    dma_fd = os.memfd_create("dma")
+    os.ftruncate(dma_fd, 0x10000)
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=0x10000, size=0x10000)
+    msg(old, sock, VFIO_USER_DMA_MAP, payload, fds=[dma_fd])
+
+    irq_fd = eventfd()
+    payload = vfio_irq_set(argsz=len(vfio_irq_set()),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_EVENTFD, index=VFU_DEV_MSIX_IRQ,
+                           start=1, count=1)
+    msg(old, sock, VFIO_USER_DEVICE_SET_IRQS, payload, fds=[irq_fd])
+
+    write_region(old, sock, VFU_PCI_DEV_CFG_REGION_IDX, offset=PCI_COMMAND,
+                 count=2, data=struct.pack("H", 0x6))
+
+    os.pwrite(dma_fd, b"handover", 0x100)
+
+
+def test_handover():
+    del registered[:]
+
+    assert handover(old, new) == (0, 0)
+
+    assert unregistered == [(old, 0x10000)]
+    assert registered == [(new, 0x10000)]
+    # handed over, not reset
+    assert resets == []
+
+    # the same connection is served by the new context
+    payload = read_region(new, sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                          offset=PCI_COMMAND, count=2)
+    assert struct.unpack("H", payload)[0] == 0x6
+
+    ret, sg = vfu_addr_to_sgl(new, dma_addr=0x10100, length=8)
+    assert ret == 1
+    iovec = iovec_t()
+    assert vfu_sgl_get(new, sg, iovec) == 0
+    assert c.string_at(iovec.iov_base, 8) == b"handover"
+    vfu_sgl_put(new, sg, iovec)
+
+    assert vfu_irq_trigger(new, 1) == 0
+    assert os.read(irq_fd, 8) == struct.pack("Q", 1)
+
+    # the old context has let go of everything
+    assert vfu_irq_trigger(old, 1) == -1
+    assert c.get_errno() == errno.ENOENT
+    # not vfu_destroy_ctx(), which removes the socket the new context uses
+    lib.vfu_destroy_ctx(old)
+    assert resets == []
+
+
+def test_handover_reconnect():
+    global sock
+
+    # reconnects go to the socket the client knew about
+    disconnect_client(new, sock)
+    assert resets == [new]
+    sock = connect_client(new)
+    del resets[:]
+
+
+def test_handover_mismatch():
+    other = setup_ctx(SOCK_PATH + b".other", nr_irqs=8)
+
+    assert handover(new, other) == (-1, errno.EINVAL)
+    assert vfu_irq_trigger(other, 0) == -1
+
+    vfu_destroy_ctx(other)
+    os.remove(SOCK_PATH + b".other")
+
+
+def test_handover_cleanup():
+    sock.close()
+    vfu_destroy_ctx(new)
+    os.close(dma_fd)
+    os.close(irq_fd)
+    os.remove(NEW_SOCK_PATH)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,166 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+import socket
+import struct
+
+ctx = None
+sock = None
+rfd = None
+
+BAR0_SIZE = 0x1000
+bar0 = bytearray(BAR0_SIZE)
+accesses = []
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    accesses.append((offset, count, is_write))
+    if is_write:
+        bar0[offset:offset + count] = c.string_at(buf, count)
+    else:
+        c.memmove(buf, bytes(bar0[offset:offset + count]), count)
+    return count
+
+
+def frame(cmd, size, offset, data=0, resp=False):
+    info = cmd | ((size.bit_length() - 1) << VFIO_USER_IOREGIONFD_SIZE_SHIFT)
+    if resp:
+        info |= VFIO_USER_IOREGIONFD_RESP
+    return struct.pack("IIQQQ", info, 0, 0xfeed, offset, data)
+
+
+def read_resp():
+    resp = rfd.recv(32, socket.MSG_WAITALL)
+    assert len(resp) == 32
+    return struct.unpack("Q", resp[:8])[0]
+
+
+def test_ioregionfd_setup():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                           size=BAR0_SIZE, cb=bar0_access,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+
+def test_ioregionfd_bad():
+    # not a BAR
+    assert vfu_create_ioregionfd(ctx, VFU_PCI_DEV_CFG_REGION_IDX, 0, 8) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # no callback
+    assert vfu_create_ioregionfd(ctx, VFU_PCI_DEV_BAR1_REGION_IDX, 0, 8) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_create_ioregionfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX,
+                                 BAR0_SIZE - 4, 8) == -1
+    assert c.get_errno() == errno.EINVAL
+
+
+def test_ioregionfd_get_fds():
+    global rfd
+
+    assert vfu_create_ioregionfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, 0x100,
+                                 0x100, user_data=0xfeed) == 0
+
+    payload = vfio_user_region_io_fds_request(
+                argsz=len(vfio_user_region_io_fds_reply()) +
+                len(vfio_user_sub_region_ioregionfd()), flags=0,
+                index=VFU_PCI_DEV_BAR0_REGION_IDX, count=0)
+
+    newfds, ret = msg_fds(ctx, sock, VFIO_USER_DEVICE_GET_REGION_IO_FDS,
+                          payload)
+    assert len(newfds) == 1
+
+    reply, ret = vfio_user_region_io_fds_reply.pop_from_buffer(ret)
+    assert reply.count == 1
+
+    sub, ret = vfio_user_sub_region_ioregionfd.pop_from_buffer(ret)
+    assert sub.offset == 0x100
+    assert sub.size == 0x100
+    assert sub.fd_index == 0
+    assert sub.type == VFIO_USER_IO_FD_TYPE_IOREGIONFD
+    assert sub.user_data == 0xfeed
+
+    rfd = socket.socket(fileno=newfds[0])
+
+
+def test_ioregionfd_access():
+    accesses.clear()
+
+    # no vfu_run_ctx() needed: the library's own thread serves these
+    rfd.send(frame(VFIO_USER_IOREGIONFD_CMD_WRITE, 4, 0x10, 0xdeadbeef,
+                   resp=True))
+    assert read_resp() == 0
+
+    rfd.send(frame(VFIO_USER_IOREGIONFD_CMD_READ, 4, 0x10))
+    assert read_resp() == 0xdeadbeef
+
+    # several frames queued at once, only the read is answered
+    rfd.send(frame(VFIO_USER_IOREGIONFD_CMD_WRITE, 8, 0x20, 0x1122334455667788) +
+             frame(VFIO_USER_IOREGIONFD_CMD_WRITE, 1, 0x28, 0x99) +
+             frame(VFIO_USER_IOREGIONFD_CMD_READ, 2, 0x27))
+    assert read_resp() == 0x9911
+
+    assert accesses == [(0x110, 4, True), (0x110, 4, False),
+                        (0x120, 8, True), (0x128, 1, True), (0x127, 2, False)]
+    assert bar0[0x110:0x114] == b"\xef\xbe\xad\xde"
+
+
+def test_ioregionfd_out_of_bounds():
+    accesses.clear()
+
+    rfd.send(frame(VFIO_USER_IOREGIONFD_CMD_READ, 8, 0xfc))
+    assert read_resp() == 0xffffffffffffffff
+
+    rfd.send(frame(VFIO_USER_IOREGIONFD_CMD_WRITE, 8, 0x100, resp=True))
+    assert read_resp() == 0
+
+    assert accesses == []
+
+
+def test_ioregionfd_cleanup():
+    rfd.close()
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,140 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+from libvfio_user import *
+import ctypes as c
+import errno
+import threading
+import time
+
+ctx = None
+sock = None
+msgs = []
+msg_threads = set()
+block_log = False
+log_blocked = threading.Event()
+log_release = threading.Event()
+
+
+@vfu_log_fn_t
+def async_log(ctx, level, msg):
+    if block_log:
+        log_blocked.set()
+        log_release.wait(timeout=10)
+    msgs.append(msg.decode())
+    msg_threads.add(threading.get_ident())
+
+
+def wait_for_msg(text):
+    for _ in range(1000):
+        if any(text in m for m in msgs):
+            return
+        time.sleep(0.01)
+    assert False, text
+
+
+def bad_dma_map():
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=0x100, offset=0, addr=0x10000, size=0x1000)
+    msg(ctx, sock, VFIO_USER_DMA_MAP, payload, expect=errno.EINVAL)
+
+
+def test_log_async_setup():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    assert vfu_setup_log(ctx, async_log) == 0
+
+    # nothing to stop
+    assert vfu_setup_log_async(ctx, 0) == 0
+
+    assert vfu_setup_log_async(ctx, 1 << 17) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_log_async(ctx, 4) == 0
+    assert vfu_setup_log_async(ctx, 4) == -1
+    assert c.get_errno() == errno.EBUSY
+
+    sock = connect_client(ctx)
+
+
+def test_log_async():
+    msgs.clear()
+    msg_threads.clear()
+
+    bad_dma_map()
+
+    wait_for_msg("bad flags=0x100")
+    assert threading.get_ident() not in msg_threads
+
+
+def test_log_async_full():
+    global block_log
+
+    msgs.clear()
+    block_log = True
+    log_blocked.clear()
+    log_release.clear()
+
+    bad_dma_map()
+    assert log_blocked.wait(timeout=10)
+
+    # the logger thread is stuck, but requests are still handled
+    for i in range(5):
+        bad_dma_map()
+
+    block_log = False
+    log_release.set()
+
+    wait_for_msg("log messages dropped")
+
+
+def test_log_async_stop():
+    msgs.clear()
+    msg_threads.clear()
+
+    assert vfu_setup_log_async(ctx, 0) == 0
+
+    bad_dma_map()
+
+    assert any("bad flags=0x100" in m for m in msgs)
+    assert msg_threads == {threading.get_ident()}
+
+
+def test_log_async_cleanup():
+    # the logger thread is stopped by vfu_destroy_ctx()
+    assert vfu_setup_log_async(ctx, 16) == 0
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
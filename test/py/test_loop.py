@@ -0,0 +1,231 @@
+#
+# Copyright (c) 2022 Nutanix Inc. All rights reserved.
+#
+# Authors: John Levon <john.levon@nutanix.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import os
+import threading
+
+NR_CTXS = 4
+
+loop = None
+ctxs = []
+socks = []
+quiesce_started = threading.Event()
+quiesce_busy = False
+quiesce_early = False
+
+
+def sock_path(i):
+    return SOCK_PATH + b".%d" % i
+
+
+@vfu_device_quiesce_cb_t
+def loop_quiesce_cb(ctx):
+    quiesce_started.set()
+    if quiesce_early:
+        t = threading.Thread(target=vfu_device_quiesced, args=(ctx, 0))
+        t.start()
+        t.join()
+        c.set_errno(errno.EBUSY)
+        return -1
+    if quiesce_busy:
+        c.set_errno(errno.EBUSY)
+        return -1
+    return 0
+
+
+def loop_connect(path):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(path)
+
+    payload = struct.pack("HH", LIBVFIO_USER_MAJOR, LIBVFIO_USER_MINOR)
+    hdr = vfio_user_header(VFIO_USER_VERSION, size=len(payload))
+    sock.send(hdr + payload)
+    loop_reply(sock)
+    return sock
+
+
+def loop_reply(sock, expect=0):
+    """Read exactly one reply, as several may be queued on the socket."""
+    hdr = sock.recv(SIZEOF_VFIO_USER_HEADER, socket.MSG_WAITALL)
+    (msg_id, cmd, msg_size, flags, err) = struct.unpack("HHIII", hdr)
+    assert (flags & VFIO_USER_F_TYPE_REPLY) != 0
+    assert err == expect
+    if msg_size == SIZEOF_VFIO_USER_HEADER:
+        return b""
+    return sock.recv(msg_size - SIZEOF_VFIO_USER_HEADER, socket.MSG_WAITALL)
+
+
+def loop_msg(sock, cmd, payload=bytearray(), expect=0):
+    sock.send(vfio_user_header(cmd, size=len(payload)) + payload)
+    return loop_reply(sock, expect=expect)
+
+
+def test_loop_create_bad():
+    ctx = vfu_create_ctx()
+    assert ctx is not None
+    lp = vfu_loop_create()
+    assert lp is not None
+
+    # not realized, then not non-blocking
+    assert vfu_loop_add_ctx(lp, ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_realize_ctx(ctx) == 0
+    assert vfu_loop_add_ctx(lp, ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_loop_remove_ctx(lp, ctx) == -1
+    assert c.get_errno() == errno.ENOENT
+
+    vfu_loop_destroy(lp)
+    vfu_destroy_ctx(ctx)
+
+
+def test_loop_setup():
+    global loop
+
+    loop = vfu_loop_create(nr_threads=2, max_reqs_per_turn=2, cpus=[0])
+    assert loop is not None
+
+    for i in range(NR_CTXS):
+        ctx = vfu_create_ctx(sock_path=sock_path(i),
+                             flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+        assert ctx is not None
+        vfu_setup_device_quiesce_cb(ctx, quiesce_cb=loop_quiesce_cb)
+        assert vfu_setup_device_reset_cb(ctx) == 0
+        assert vfu_realize_ctx(ctx) == 0
+        assert vfu_loop_add_ctx(loop, ctx) == 0
+        ctxs.append(ctx)
+
+    # already in a loop
+    assert vfu_loop_add_ctx(loop, ctxs[0]) == -1
+    assert c.get_errno() == errno.EBUSY
+
+    assert vfu_loop_start(loop) == 0
+    assert vfu_loop_start(loop) == -1
+    assert c.get_errno() == errno.EALREADY
+
+    for i in range(NR_CTXS):
+        socks.append(loop_connect(sock_path(i)))
+
+
+def test_loop_requests():
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+
+    # Several requests in flight per context, more than one turn's worth.
+    for sock in socks:
+        for i in range(5):
+            sock.send(vfio_user_header(VFIO_USER_DEVICE_GET_INFO,
+                                       size=len(payload)) + payload)
+
+    for sock in socks:
+        for i in range(5):
+            result = loop_reply(sock)
+            (argsz, flags, num_regions, num_irqs) = \
+                struct.unpack("IIII", result[:16])
+            assert num_regions == VFU_PCI_DEV_NUM_REGIONS
+
+
+def test_loop_async_quiesce():
+    global quiesce_busy
+
+    quiesce_busy = True
+    quiesce_started.clear()
+
+    socks[0].send(vfio_user_header(VFIO_USER_DEVICE_RESET, size=0))
+    assert quiesce_started.wait(timeout=10)
+
+    # The context is parked: this one must wait for vfu_device_quiesced().
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+    socks[0].send(vfio_user_header(VFIO_USER_DEVICE_GET_INFO,
+                                   size=len(payload)) + payload)
+
+    # Other contexts keep running meanwhile.
+    loop_msg(socks[1], VFIO_USER_DEVICE_GET_INFO, payload)
+
+    socks[0].setblocking(False)
+    try:
+        socks[0].recv(4096)
+        assert False
+    except BlockingIOError:
+        pass
+    socks[0].setblocking(True)
+
+    quiesce_busy = False
+    assert vfu_device_quiesced(ctxs[0], 0) == 0
+
+    # reset reply, then the queued request
+    loop_reply(socks[0])
+    loop_reply(socks[0])
+
+
+def test_loop_quiesced_during_cb():
+    global quiesce_early
+
+    # The device calls vfu_device_quiesced() from another thread before the
+    # callback has even returned EBUSY.
+    quiesce_early = True
+    loop_msg(socks[0], VFIO_USER_DEVICE_RESET)
+    quiesce_early = False
+
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+    loop_msg(socks[0], VFIO_USER_DEVICE_GET_INFO, payload)
+
+
+def test_loop_reconnect():
+    socks[2].close()
+    socks[2] = loop_connect(sock_path(2))
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+    loop_msg(socks[2], VFIO_USER_DEVICE_GET_INFO, payload)
+
+
+def test_loop_stop_start():
+    vfu_loop_stop(loop)
+    assert vfu_loop_start(loop) == 0
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+    loop_msg(socks[3], VFIO_USER_DEVICE_GET_INFO, payload)
+
+
+def test_loop_cleanup():
+    assert vfu_loop_remove_ctx(loop, ctxs[0]) == 0
+
+    for sock in socks:
+        sock.close()
+
+    vfu_loop_stop(loop)
+
+    # vfu_destroy_ctx() removes the others implicitly
+    for i, ctx in enumerate(ctxs):
+        vfu_destroy_ctx(ctx)
+        os.remove(sock_path(i))
+
+    vfu_loop_destroy(loop)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
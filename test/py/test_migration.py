@@ -163,4 +163,104 @@ def test_migration_trans_async_err(mock_trans, mock_quiesce):
     get_reply(sock, errno.ENOTTY)
     print("received reply")
 
+
+@patch('libvfio_user.quiesce_cb', return_value=0)
+@patch('libvfio_user.migr_trans_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_migration_trans_deferred(mock_trans, mock_quiesce):
+    """
+    Tests the device completing a transition with vfu_migr_done().
+    """
+
+    global ctx, sock
+
+    data = VFIO_DEVICE_STATE_V1_SAVING.to_bytes(c.sizeof(c.c_int), 'little')
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                 count=len(data), data=data, rsp=False, busy=True)
+
+    # not quiesced, so vfu_device_quiesced() is the wrong call
+    assert vfu_device_quiesced(ctx, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_migr_done(ctx, 0) == 0
+    get_reply(sock)
+
+    mock_trans.side_effect = None
+    mock_trans.return_value = 0
+    data = read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                       count=4)
+    assert int.from_bytes(data, 'little') == VFIO_DEVICE_STATE_V1_SAVING
+
+
+@patch('libvfio_user.quiesce_cb', side_effect=fail_with_errno(errno.EBUSY))
+@patch('libvfio_user.migr_trans_cb', side_effect=fail_with_errno(errno.EBUSY))
+def test_migration_trans_async_deferred(mock_trans, mock_quiesce):
+    """
+    Tests the device quiescing asynchronously, then deferring the transition,
+    and finally failing it.
+    """
+
+    global ctx, sock
+
+    data = VFIO_DEVICE_STATE_V1_SAVING.to_bytes(c.sizeof(c.c_int), 'little')
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                 count=len(data), data=data, rsp=False, busy=True)
+
+    assert vfu_device_quiesced(ctx, 0) == 0
+    mock_trans.assert_called_once()
+    vfu_run_ctx(ctx, errno.EBUSY)
+
+    assert vfu_migr_done(ctx, errno.ENOTTY) == 0
+    get_reply(sock, errno.ENOTTY)
+
+    mock_quiesce.side_effect = None
+    mock_quiesce.return_value = 0
+    data = read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                       count=4)
+    assert int.from_bytes(data, 'little') == VFIO_DEVICE_STATE_V1_RUNNING
+
+
+@patch('libvfio_user.quiesce_cb', return_value=0)
+@patch('libvfio_user.migr_get_pending_bytes_cb', return_value=0x3000)
+@patch('libvfio_user.migr_trans_cb', return_value=0)
+def test_migration_stats(mock_trans, mock_pending, mock_quiesce):
+    """
+    Tests the pending bytes history and per-state times.
+    """
+
+    global ctx, sock
+
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    assert stats.nr_iterations == 0
+    assert stats.state_ns[VFU_MIGR_STATE_RUNNING] > 0
+    assert stats.state_ns[VFU_MIGR_STATE_STOP] == 0
+    assert stats.state_ns[VFU_MIGR_STATE_STOP_AND_COPY] == 0
+    # no dirty page logging
+    assert stats.dirty_pages == 0 and stats.dirty_rate == 0
+
+    data = VFIO_DEVICE_STATE_V1_SAVING.to_bytes(c.sizeof(c.c_int), 'little')
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                 count=len(data), data=data)
+
+    pending = read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=8,
+                          count=8)
+    assert int.from_bytes(pending, 'little') == 0x3000
+
+    # cached within the iteration, so not recorded again
+    read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=8, count=8)
+
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    assert stats.nr_iterations == 1
+    assert stats.nr_pending == 1
+    assert stats.pending_bytes[0] == 0x3000
+    assert stats.state_ns[VFU_MIGR_STATE_STOP_AND_COPY] > 0
+
+    running_ns = stats.state_ns[VFU_MIGR_STATE_RUNNING]
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert stats.state_ns[VFU_MIGR_STATE_RUNNING] == running_ns
+
+    ret = lib.vfu_migr_get_stats(ctx, None)
+    assert ret == -1 and c.get_errno() == errno.EINVAL
+
 # ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
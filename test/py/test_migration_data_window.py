@@ -0,0 +1,281 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+import errno
+
+#
+# The data section of the migration region is backed by a file the client can
+# map, so the device doesn't need read_data/write_data callbacks.
+#
+
+ctx = None
+sock = None
+backing = None
+window = None
+
+REG_SIZE = 0x1000
+DATA_SIZE = 0x1000
+
+chunks = []
+prepared = []
+written = []
+
+mig_prepare_data_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p,
+                                    c.POINTER(c.c_uint64),
+                                    c.POINTER(c.c_uint64))
+mig_data_cb_t = c.CFUNCTYPE(c.c_ssize_t, c.c_void_p, c.c_void_p, c.c_uint64,
+                            c.c_uint64)
+mig_data_written_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, c.c_uint64)
+
+
+class migration_callbacks(Structure):
+    _fields_ = [
+        ("version", c.c_int),
+        ("transition", transition_cb_t),
+        ("get_pending_bytes", get_pending_bytes_cb_t),
+        ("prepare_data", mig_prepare_data_cb_t),
+        ("read_data", mig_data_cb_t),
+        ("write_data", mig_data_cb_t),
+        ("data_written", mig_data_written_cb_t),
+    ]
+
+
+@transition_cb_t
+def transition(ctx, state):
+    return 0
+
+
+@get_pending_bytes_cb_t
+def get_pending_bytes(ctx):
+    # the previously prepared chunk has been consumed
+    if prepared:
+        chunks.pop(0)
+        prepared.clear()
+    return sum(len(x) for x in chunks)
+
+
+@mig_prepare_data_cb_t
+def prepare_data(ctx, offset, size):
+    offset[0] = 0
+    if size:
+        # saving: place the next chunk at the start of the data section
+        window[REG_SIZE:REG_SIZE + len(chunks[0])] = chunks[0]
+        size[0] = len(chunks[0])
+        prepared.append(True)
+    return 0
+
+
+@mig_data_written_cb_t
+def data_written(ctx, count):
+    written.append(bytes(window[REG_SIZE:REG_SIZE + count]))
+    return 0
+
+
+def setup_function(function):
+    global ctx, sock, backing, window
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    backing = tempfile.TemporaryFile()
+    backing.truncate(REG_SIZE + DATA_SIZE)
+    window = mmap.mmap(backing.fileno(), REG_SIZE + DATA_SIZE)
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_MIGR_REGION_IDX,
+                           size=REG_SIZE + DATA_SIZE, flags=VFU_REGION_FLAG_RW,
+                           mmap_areas=[(REG_SIZE, DATA_SIZE)],
+                           fd=backing.fileno())
+    assert ret == 0
+
+    cbs = migration_callbacks()
+    cbs.version = VFU_MIGR_CALLBACKS_VERS
+    cbs.transition = transition
+    cbs.get_pending_bytes = get_pending_bytes
+    cbs.prepare_data = prepare_data
+    cbs.data_written = data_written
+    assert setup_migration(ctx, cbs) == 0
+
+    assert vfu_realize_ctx(ctx) == 0
+
+    sock = connect_client(ctx)
+
+    chunks[:] = [b"first chunk", b"x" * 0x800, b"last"]
+    prepared.clear()
+    written.clear()
+
+
+def teardown_function(function):
+    vfu_destroy_ctx(ctx)
+    window.close()
+    backing.close()
+
+
+def setup_migration(ctx, cbs):
+    return lib.vfu_setup_device_migration_callbacks(ctx,
+        c.cast(c.pointer(cbs), c.POINTER(vfu_migration_callbacks_t)), REG_SIZE)
+
+
+def set_state(state, expect=0):
+    data = state.to_bytes(c.sizeof(c.c_int), 'little')
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                 count=len(data), data=data, expect=expect)
+
+
+def read_iteration():
+    """Reads pending_bytes, data_offset and data_size in one access."""
+    result = read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX,
+                         offset=8, count=24)
+    return struct.unpack("QQQ", result)
+
+
+def test_migration_window_needs_callbacks_or_fd():
+    ctx2 = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx2 is not None
+    assert vfu_setup_region(ctx2, index=VFU_PCI_DEV_MIGR_REGION_IDX,
+                            size=REG_SIZE + DATA_SIZE,
+                            flags=VFU_REGION_FLAG_RW) == 0
+
+    cbs = migration_callbacks()
+    cbs.version = VFU_MIGR_CALLBACKS_VERS
+    cbs.transition = transition
+    cbs.get_pending_bytes = get_pending_bytes
+    cbs.prepare_data = prepare_data
+    cbs.data_written = data_written
+    assert setup_migration(ctx2, cbs) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    vfu_destroy_ctx(ctx2)
+
+
+def test_migration_window_save():
+    expected = list(chunks)
+    set_state(VFIO_DEVICE_STATE_V1_SAVING)
+
+    saved = []
+    while True:
+        pending, offset, size = read_iteration()
+        if pending == 0:
+            assert (offset, size) == (0, 0)
+            break
+        assert offset == REG_SIZE
+        # the data is both in the client's mapping and readable by message
+        assert bytes(window[offset:offset + size]) == expected[len(saved)]
+        data = read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX,
+                           offset=offset, count=size)
+        saved.append(data)
+
+    assert saved == expected
+
+
+def test_migration_window_iteration_bad_state():
+    read_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=8, count=24,
+                expect=errno.EINVAL)
+
+
+def test_migration_stream_save():
+    expected = list(chunks)
+    set_state(VFIO_DEVICE_STATE_V1_SAVING)
+
+    r, w = os.pipe()
+    limit = struct.pack("Q", 0)
+    payload = struct.pack("QII", 24, VFU_PCI_DEV_MIGR_REGION_IDX, 8) + limit
+    msg(ctx, sock, VFIO_USER_REGION_WRITE, payload, fds=[w])
+    os.close(w)
+
+    stream = b""
+    while True:
+        buf = os.read(r, 0x10000)
+        if not buf:
+            break
+        stream += buf
+    os.close(r)
+
+    saved = []
+    while stream:
+        size = struct.unpack("Q", stream[:8])[0]
+        saved.append(stream[8:8 + size])
+        stream = stream[8 + size:]
+    assert saved == expected
+
+    # all of it was sent
+    assert read_iteration() == (0, 0, 0)
+
+
+def test_migration_stream_save_limit():
+    set_state(VFIO_DEVICE_STATE_V1_SAVING)
+
+    r, w = os.pipe()
+    payload = struct.pack("QII", 24, VFU_PCI_DEV_MIGR_REGION_IDX, 8) + \
+        struct.pack("Q", 1)
+    msg(ctx, sock, VFIO_USER_REGION_WRITE, payload, fds=[w])
+    os.close(w)
+
+    stream = os.read(r, 0x10000)
+    os.close(r)
+    assert stream == struct.pack("Q", 11) + b"first chunk"
+
+    # the rest can still be read the usual way
+    pending, offset, size = read_iteration()
+    assert pending == 0x804
+    assert size == 0x800
+
+
+def test_migration_stream_load():
+    set_state(VFIO_DEVICE_STATE_V1_RESUMING)
+
+    data = [b"one", b"y" * 0x1000, b"three"]
+    r, w = os.pipe()
+    for d in data:
+        os.write(w, struct.pack("Q", len(d)) + d)
+    os.close(w)
+
+    payload = struct.pack("QII", 24, VFU_PCI_DEV_MIGR_REGION_IDX, 8) + \
+        struct.pack("Q", 0)
+    msg(ctx, sock, VFIO_USER_REGION_WRITE, payload, fds=[r])
+    os.close(r)
+
+    assert written == data
+
+
+def test_migration_stream_load_too_big():
+    set_state(VFIO_DEVICE_STATE_V1_RESUMING)
+
+    r, w = os.pipe()
+    os.write(w, struct.pack("Q", DATA_SIZE + 1))
+    os.close(w)
+
+    payload = struct.pack("QII", 24, VFU_PCI_DEV_MIGR_REGION_IDX, 8) + \
+        struct.pack("Q", 0)
+    msg(ctx, sock, VFIO_USER_REGION_WRITE, payload, fds=[r],
+        expect=errno.EINVAL)
+    os.close(r)
+
+    assert written == []
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
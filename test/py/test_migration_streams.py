@@ -0,0 +1,245 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+from unittest.mock import patch
+import errno
+
+#
+# Parallel migration streams: each stream is transferred over its own file
+# descriptor by a separate server thread.
+#
+
+VFIO_USER_MIG_STREAMS_F_BUSY = 1 << 0
+
+ctx = None
+sock = None
+trans_patch = patch('libvfio_user.migr_trans_cb', return_value=0)
+
+NR_STREAMS = 3
+FRAME_SIZE = 1000
+
+stream_read_cb_t = c.CFUNCTYPE(c.c_ssize_t, c.c_void_p, c.c_uint32,
+                               c.c_void_p, c.c_uint64)
+stream_write_cb_t = c.CFUNCTYPE(c.c_ssize_t, c.c_void_p, c.c_uint32,
+                                c.c_uint64, c.c_void_p, c.c_uint64)
+
+lib.vfu_setup_migration_streams.argtypes = (c.c_void_p, c.c_uint32,
+                                            stream_read_cb_t,
+                                            stream_write_cb_t)
+
+# two frames' worth of data per stream
+pending = {}
+written = []
+
+
+@stream_read_cb_t
+def read_stream(ctx, stream, buf, count):
+    data = pending[stream][:min(count, FRAME_SIZE)]
+    pending[stream] = pending[stream][len(data):]
+    c.memmove(buf, data, len(data))
+    return len(data)
+
+
+@stream_write_cb_t
+def write_stream(ctx, stream, seq, buf, count):
+    written.append((stream, seq, c.string_at(buf, count)))
+    return count
+
+
+def stream_data(stream):
+    return bytes([ord("a") + stream]) * (2 * FRAME_SIZE)
+
+
+def setup_function(function):
+    global ctx, sock
+
+    trans_patch.start()
+
+    for i in range(NR_STREAMS):
+        pending[i] = stream_data(i)
+    written.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_MIGR_REGION_IDX,
+                            size=0x2000, flags=VFU_REGION_FLAG_RW) == 0
+    assert vfu_setup_device_migration_callbacks(ctx) == 0
+    assert lib.vfu_setup_migration_streams(ctx, NR_STREAMS, read_stream,
+                                           write_stream) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    sock = connect_client(ctx)
+
+
+def teardown_function(function):
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+    trans_patch.stop()
+
+
+def set_state(state):
+    data = state.to_bytes(c.sizeof(c.c_int), 'little')
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0,
+                 count=len(data), data=data)
+
+
+def streams(fds=None, expect=0):
+    payload = struct.pack("IIIIQ", 24, 0, 0, 0, 0)
+    reply = msg(ctx, sock, VFIO_USER_MIG_STREAMS, payload, fds=fds,
+                expect=expect)
+    if expect != 0:
+        return None
+    argsz, flags, nr_streams, _, size = struct.unpack("IIIIQ", reply)
+    assert argsz == 24
+    return nr_streams, flags, size
+
+
+def wait_streams():
+    while True:
+        nr_streams, flags, size = streams()
+        if not flags & VFIO_USER_MIG_STREAMS_F_BUSY:
+            return nr_streams, size
+
+
+def parse_frames(data):
+    frames = []
+    while data:
+        stream, _, seq, size = struct.unpack("IIQQ", data[:24])
+        frames.append((stream, seq, data[24:24 + size]))
+        data = data[24 + size:]
+    return frames
+
+
+def save():
+    set_state(VFIO_DEVICE_STATE_V1_SAVING)
+
+    pipes = [os.pipe() for _ in range(NR_STREAMS)]
+    nr_streams, _, _ = streams(fds=[w for _, w in pipes])
+    assert nr_streams == NR_STREAMS
+
+    frames = []
+    for r, w in pipes:
+        os.close(w)
+        data = b""
+        while True:
+            buf = os.read(r, 65536)
+            if not buf:
+                break
+            data += buf
+        os.close(r)
+        frames.append(parse_frames(data))
+
+    assert wait_streams() == (NR_STREAMS, NR_STREAMS * 2 * FRAME_SIZE)
+    return frames
+
+
+def test_migration_streams_query():
+    assert streams() == (NR_STREAMS, 0, 0)
+
+
+def test_migration_streams_bad_state():
+    r, w = os.pipe()
+    streams(fds=[w], expect=errno.EINVAL)
+    os.close(r)
+    os.close(w)
+
+
+def test_migration_streams_save():
+    frames = save()
+
+    for i in range(NR_STREAMS):
+        data = stream_data(i)
+        assert frames[i] == [(i, 0, data[:FRAME_SIZE]),
+                             (i, 1, data[FRAME_SIZE:])]
+
+    # one fd per stream is needed
+    r, w = os.pipe()
+    streams(fds=[w], expect=errno.EINVAL)
+    os.close(r)
+    os.close(w)
+
+
+def test_migration_streams_resume_out_of_order():
+    frames = save()
+
+    set_state(VFIO_DEVICE_STATE_V1_RUNNING)
+    set_state(VFIO_DEVICE_STATE_V1_RESUMING)
+
+    # all the frames over two fds, each in reverse order
+    all_frames = [f for s in frames for f in s]
+    halves = [all_frames[:3][::-1], all_frames[3:][::-1]]
+    pipes = [os.pipe() for _ in halves]
+    for (r, w), half in zip(pipes, halves):
+        for stream, seq, data in half:
+            os.write(w, struct.pack("IIQQ", stream, 0, seq, len(data)) + data)
+        os.close(w)
+
+    streams(fds=[r for r, _ in pipes])
+    for r, _ in pipes:
+        os.close(r)
+    assert wait_streams() == (NR_STREAMS, NR_STREAMS * 2 * FRAME_SIZE)
+    assert sorted(written) == sorted(all_frames)
+
+
+def test_migration_streams_resume_bad_frame():
+    set_state(VFIO_DEVICE_STATE_V1_RESUMING)
+
+    r, w = os.pipe()
+    os.write(w, struct.pack("IIQQ", NR_STREAMS, 0, 0, 4) + b"abcd")
+    os.close(w)
+    streams(fds=[r])
+    os.close(r)
+
+    # the state transition waits for the transfer, which failed
+    set_state(VFIO_DEVICE_STATE_V1_RUNNING)
+    streams(expect=errno.EINVAL)
+    assert written == []
+
+
+def test_migration_streams_in_flight():
+    set_state(VFIO_DEVICE_STATE_V1_RESUMING)
+
+    # the transfer can't finish until the write end is closed
+    r, w = os.pipe()
+    _, flags, _ = streams(fds=[r])
+    assert flags & VFIO_USER_MIG_STREAMS_F_BUSY
+
+    r2, w2 = os.pipe()
+    streams(fds=[r2], expect=errno.EALREADY)
+    os.close(r2)
+    os.close(w2)
+
+    data = b"x" * 16
+    os.write(w, struct.pack("IIQQ", 1, 0, 0, len(data)) + data)
+    os.close(w)
+    os.close(r)
+    assert wait_streams() == (NR_STREAMS, len(data))
+    assert written == [(1, 0, data)]
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,460 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import threading
+
+#
+# VFIO migration v2: states are driven with VFIO_USER_DEVICE_FEATURE, and
+# device state is read and written with VFIO_USER_MIG_DATA_READ/WRITE.
+#
+
+ctx = None
+sock = None
+
+VFU_MIGR_V2_CALLBACKS_VERS = 1
+VFU_MIGR_V2_FLAG_PRE_COPY = 1 << 0
+
+VFIO_DEVICE_FEATURE_GET = 1 << 16
+VFIO_DEVICE_FEATURE_SET = 1 << 17
+VFIO_DEVICE_FEATURE_PROBE = 1 << 18
+VFIO_DEVICE_FEATURE_MIGRATION = 1
+VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE = 2
+VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO = 0x8000
+
+VFIO_MIGRATION_STOP_COPY = 1 << 0
+VFIO_MIGRATION_PRE_COPY = 1 << 2
+
+VFIO_USER_DEVICE_STATE_ERROR = 0
+VFIO_USER_DEVICE_STATE_STOP = 1
+VFIO_USER_DEVICE_STATE_RUNNING = 2
+VFIO_USER_DEVICE_STATE_STOP_COPY = 3
+VFIO_USER_DEVICE_STATE_RESUMING = 4
+VFIO_USER_DEVICE_STATE_RUNNING_P2P = 5
+VFIO_USER_DEVICE_STATE_PRE_COPY = 6
+
+VFU_MIGR_STATE_STOP = 0
+VFU_MIGR_STATE_RUNNING = 1
+VFU_MIGR_STATE_STOP_AND_COPY = 2
+VFU_MIGR_STATE_PRE_COPY = 3
+VFU_MIGR_STATE_RESUME = 4
+
+v2_transition_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p, c.c_int,
+                                 use_errno=True)
+v2_data_cb_t = c.CFUNCTYPE(c.c_ssize_t, c.c_void_p, c.c_void_p, c.c_uint64)
+v2_precopy_info_cb_t = c.CFUNCTYPE(c.c_int, c.c_void_p,
+                                   c.POINTER(c.c_uint64),
+                                   c.POINTER(c.c_uint64))
+
+
+class vfu_migration_v2_callbacks_t(Structure):
+    _fields_ = [
+        ("version", c.c_int),
+        ("transition", v2_transition_cb_t),
+        ("read_data", v2_data_cb_t),
+        ("write_data", v2_data_cb_t),
+        ("precopy_info", v2_precopy_info_cb_t),
+    ]
+
+
+lib.vfu_setup_device_migration_v2.argtypes = (
+    c.c_void_p, c.c_uint64, c.POINTER(vfu_migration_v2_callbacks_t))
+
+
+transitions = []
+fail_transition = []
+busy_transition = []
+# states completed with vfu_migr_done() from another thread, before the
+# callback has returned EBUSY
+early_transition = {}
+# device state still to be saved, and state restored
+source = bytearray()
+restored = bytearray()
+
+
+@v2_transition_cb_t
+def transition(ctx, state):
+    if state in fail_transition:
+        c.set_errno(errno.EIO)
+        return -1
+    transitions.append(state)
+    if state in early_transition:
+        t = threading.Thread(target=vfu_migr_done,
+                             args=(ctx, early_transition[state]))
+        t.start()
+        t.join()
+        c.set_errno(errno.EBUSY)
+        return -1
+    if state in busy_transition:
+        c.set_errno(errno.EBUSY)
+        return -1
+    return 0
+
+
+@v2_data_cb_t
+def read_data(ctx, buf, count):
+    # hand out at most 100 bytes at a time, the library has to loop
+    n = min(count, len(source), 100)
+    c.memmove(buf, bytes(source[:n]), n)
+    del source[:n]
+    return n
+
+
+@v2_data_cb_t
+def write_data(ctx, buf, count):
+    restored.extend(c.string_at(buf, count))
+    return count
+
+
+@v2_precopy_info_cb_t
+def precopy_info(ctx, initial_bytes, dirty_bytes):
+    initial_bytes[0] = len(source)
+    dirty_bytes[0] = 0x1234
+    return 0
+
+
+def setup_function(function):
+    global ctx, sock
+
+    transitions.clear()
+    fail_transition.clear()
+    busy_transition.clear()
+    early_transition.clear()
+    source[:] = bytes(range(256)) * 4
+    restored.clear()
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    cbs = vfu_migration_v2_callbacks_t(VFU_MIGR_V2_CALLBACKS_VERS,
+                                       transition, read_data, write_data,
+                                       precopy_info)
+    assert lib.vfu_setup_device_migration_v2(ctx, VFU_MIGR_V2_FLAG_PRE_COPY,
+                                             cbs) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    sock = connect_client(ctx)
+
+
+def teardown_function(function):
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+
+def feature(flags, data=b"", expect=0):
+    payload = struct.pack("II", 8 + len(data), flags) + data
+    reply = msg(ctx, sock, VFIO_USER_DEVICE_FEATURE, payload, expect=expect)
+    if expect != 0:
+        return None
+    argsz, rflags = struct.unpack("II", reply[:8])
+    assert argsz == len(reply)
+    assert rflags == flags
+    return reply[8:]
+
+
+def get_state():
+    data = feature(VFIO_DEVICE_FEATURE_GET |
+                   VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE)
+    state, data_fd = struct.unpack("II", data)
+    assert data_fd == 0xffffffff
+    return state
+
+
+def set_state(state, expect=0):
+    data = feature(VFIO_DEVICE_FEATURE_SET |
+                   VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE,
+                   struct.pack("II", state, 0), expect=expect)
+    if expect == 0:
+        assert struct.unpack("II", data)[0] == state
+
+
+def mig_data(cmd, size, data=b"", fds=None, expect=0):
+    payload = struct.pack("II", 8 + len(data), size) + data
+    reply = msg(ctx, sock, cmd, payload, fds=fds, expect=expect)
+    if expect != 0:
+        return None
+    argsz, rsize = struct.unpack("II", reply[:8])
+    assert argsz == len(reply)
+    return rsize, reply[8:]
+
+
+def test_migration_v2_setup_exclusive():
+    cbs = vfu_migration_v2_callbacks_t(VFU_MIGR_V2_CALLBACKS_VERS,
+                                       transition, read_data, write_data,
+                                       precopy_info)
+    assert lib.vfu_setup_device_migration_v2(ctx, 0, cbs) == -1
+    assert c.get_errno() == errno.EEXIST
+
+
+def test_migration_v2_stats():
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert ret == 0
+    assert stats.state_ns[VFU_MIGR_STATE_RUNNING] > 0
+    assert stats.state_ns[VFU_MIGR_STATE_STOP] == 0
+
+    set_state(VFIO_USER_DEVICE_STATE_STOP)
+    ret, stats = vfu_migr_get_stats(ctx)
+    assert stats.state_ns[VFU_MIGR_STATE_STOP] > 0
+
+
+def test_migration_v2_feature_get():
+    data = feature(VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_MIGRATION)
+    assert struct.unpack("Q", data)[0] == \
+        VFIO_MIGRATION_STOP_COPY | VFIO_MIGRATION_PRE_COPY
+    assert get_state() == VFIO_USER_DEVICE_STATE_RUNNING
+
+
+def test_migration_v2_feature_probe():
+    assert feature(VFIO_DEVICE_FEATURE_PROBE | VFIO_DEVICE_FEATURE_SET |
+                   VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE) == b""
+    # the migration feature can't be set
+    feature(VFIO_DEVICE_FEATURE_PROBE | VFIO_DEVICE_FEATURE_SET |
+            VFIO_DEVICE_FEATURE_MIGRATION, expect=errno.ENOTSUP)
+    feature(VFIO_DEVICE_FEATURE_PROBE | 0x1234, expect=errno.ENOTSUP)
+
+
+def test_migration_v2_feature_bad():
+    # neither get nor set
+    feature(VFIO_DEVICE_FEATURE_MIGRATION, expect=errno.EINVAL)
+    # both
+    feature(VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_SET |
+            VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE, expect=errno.EINVAL)
+    # set without a state
+    feature(VFIO_DEVICE_FEATURE_SET | VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE,
+            expect=errno.EINVAL)
+    # unsupported states
+    set_state(VFIO_USER_DEVICE_STATE_RUNNING_P2P, expect=errno.EINVAL)
+    set_state(VFIO_USER_DEVICE_STATE_ERROR, expect=errno.EINVAL)
+    set_state(100, expect=errno.EINVAL)
+    assert transitions == []
+
+
+def test_migration_v2_transitions():
+    # combination transitions take the intermediate states
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_STOP_AND_COPY]
+
+    transitions.clear()
+    set_state(VFIO_USER_DEVICE_STATE_RESUMING)
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_RESUME]
+
+    transitions.clear()
+    set_state(VFIO_USER_DEVICE_STATE_PRE_COPY)
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_RUNNING,
+                           VFU_MIGR_STATE_PRE_COPY]
+
+    transitions.clear()
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    assert transitions == [VFU_MIGR_STATE_STOP_AND_COPY]
+
+    transitions.clear()
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    assert transitions == []
+    assert get_state() == VFIO_USER_DEVICE_STATE_STOP_COPY
+
+    # other commands are refused in stop-and-copy
+    msg(ctx, sock, VFIO_USER_DEVICE_GET_INFO,
+        struct.pack("I", 32), expect=errno.EINVAL)
+
+    # there's no way back to pre-copy once stop-and-copy has begun
+    transitions.clear()
+    set_state(VFIO_USER_DEVICE_STATE_PRE_COPY, expect=errno.EINVAL)
+    assert transitions == []
+    assert get_state() == VFIO_USER_DEVICE_STATE_STOP_COPY
+
+
+def test_migration_v2_transition_fails():
+    fail_transition.append(VFU_MIGR_STATE_STOP_AND_COPY)
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY, expect=errno.EIO)
+    assert transitions == [VFU_MIGR_STATE_STOP]
+    assert get_state() == VFIO_USER_DEVICE_STATE_ERROR
+
+    # stuck until reset
+    set_state(VFIO_USER_DEVICE_STATE_RUNNING, expect=errno.EINVAL)
+    msg(ctx, sock, VFIO_USER_DEVICE_RESET)
+    assert get_state() == VFIO_USER_DEVICE_STATE_RUNNING
+
+
+def test_migration_v2_transition_async():
+    busy_transition.extend([VFU_MIGR_STATE_STOP,
+                            VFU_MIGR_STATE_STOP_AND_COPY])
+
+    payload = struct.pack("II", 16, VFIO_DEVICE_FEATURE_SET |
+                          VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE) + \
+        struct.pack("II", VFIO_USER_DEVICE_STATE_STOP_COPY, 0)
+    msg(ctx, sock, VFIO_USER_DEVICE_FEATURE, payload, busy=True)
+    assert transitions == [VFU_MIGR_STATE_STOP]
+
+    # nothing else is handled meanwhile
+    vfu_run_ctx(ctx, errno.EBUSY)
+
+    # the next step is deferred too
+    assert vfu_migr_done(ctx, 0) == 0
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_STOP_AND_COPY]
+
+    assert vfu_migr_done(ctx, 0) == 0
+    data = get_reply(sock)
+    assert struct.unpack("II", data[8:16])[0] == \
+        VFIO_USER_DEVICE_STATE_STOP_COPY
+
+    assert get_state() == VFIO_USER_DEVICE_STATE_STOP_COPY
+
+    assert vfu_migr_done(ctx, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+
+def test_migration_v2_transition_async_fails():
+    busy_transition.append(VFU_MIGR_STATE_STOP)
+
+    payload = struct.pack("II", 16, VFIO_DEVICE_FEATURE_SET |
+                          VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE) + \
+        struct.pack("II", VFIO_USER_DEVICE_STATE_STOP_COPY, 0)
+    msg(ctx, sock, VFIO_USER_DEVICE_FEATURE, payload, busy=True)
+
+    assert vfu_migr_done(ctx, errno.EIO) == 0
+    get_reply(sock, expect=errno.EIO)
+    assert transitions == [VFU_MIGR_STATE_STOP]
+    assert get_state() == VFIO_USER_DEVICE_STATE_ERROR
+
+
+def test_migration_v2_transition_done_during_cb():
+    # both steps complete before their callbacks return: no deferral at all
+    early_transition[VFU_MIGR_STATE_STOP] = 0
+    early_transition[VFU_MIGR_STATE_STOP_AND_COPY] = 0
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_STOP_AND_COPY]
+    assert vfu_migr_done(ctx, 0) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # the first step completes early, the next one is deferred
+    transitions.clear()
+    early_transition.clear()
+    early_transition[VFU_MIGR_STATE_STOP] = 0
+    busy_transition.append(VFU_MIGR_STATE_RESUME)
+    payload = struct.pack("II", 16, VFIO_DEVICE_FEATURE_SET |
+                          VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE) + \
+        struct.pack("II", VFIO_USER_DEVICE_STATE_RESUMING, 0)
+    msg(ctx, sock, VFIO_USER_DEVICE_FEATURE, payload, busy=True)
+    assert transitions == [VFU_MIGR_STATE_STOP, VFU_MIGR_STATE_RESUME]
+    assert vfu_migr_done(ctx, 0) == 0
+    get_reply(sock)
+    assert get_state() == VFIO_USER_DEVICE_STATE_RESUMING
+
+
+def test_migration_v2_transition_fails_during_cb():
+    early_transition[VFU_MIGR_STATE_STOP] = errno.EIO
+    set_state(VFIO_USER_DEVICE_STATE_STOP, expect=errno.EIO)
+    assert get_state() == VFIO_USER_DEVICE_STATE_ERROR
+
+
+def test_migration_v2_precopy_info():
+    # only in pre-copy
+    feature(VFIO_DEVICE_FEATURE_GET |
+            VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO, expect=errno.EINVAL)
+
+    set_state(VFIO_USER_DEVICE_STATE_PRE_COPY)
+    data = feature(VFIO_DEVICE_FEATURE_GET |
+                   VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO)
+    assert struct.unpack("QQ", data) == (len(source), 0x1234)
+
+    size, data = mig_data(VFIO_USER_MIG_DATA_READ, 300)
+    assert size == 300
+    data = feature(VFIO_DEVICE_FEATURE_GET |
+                   VFIO_USER_DEVICE_FEATURE_MIG_PRECOPY_INFO)
+    assert struct.unpack("QQ", data)[0] == 1024 - 300
+
+
+def test_migration_v2_data_in_band():
+    expected = bytes(source)
+
+    # no data outside of the saving states
+    mig_data(VFIO_USER_MIG_DATA_READ, 16, expect=errno.EINVAL)
+
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    saved = b""
+    while True:
+        size, data = mig_data(VFIO_USER_MIG_DATA_READ, 512)
+        assert size == len(data)
+        if size == 0:
+            break
+        saved += data
+    assert saved == expected
+
+    # can't write while saving
+    mig_data(VFIO_USER_MIG_DATA_WRITE, 4, b"abcd", expect=errno.EINVAL)
+
+    set_state(VFIO_USER_DEVICE_STATE_RESUMING)
+    size, _ = mig_data(VFIO_USER_MIG_DATA_WRITE, 512, saved[:512])
+    assert size == 512
+    size, _ = mig_data(VFIO_USER_MIG_DATA_WRITE, 512, saved[512:])
+    assert size == 512
+    assert bytes(restored) == expected
+
+    # size doesn't match the payload
+    mig_data(VFIO_USER_MIG_DATA_WRITE, 8, b"abcd", expect=errno.EINVAL)
+
+
+def test_migration_v2_data_fd():
+    expected = bytes(source)
+
+    set_state(VFIO_USER_DEVICE_STATE_STOP_COPY)
+    r, w = os.pipe()
+    # the pipe can hold all the data, so the server doesn't block
+    size, data = mig_data(VFIO_USER_MIG_DATA_READ, 0, fds=[w])
+    os.close(w)
+    assert size == len(expected)
+    assert data == b""
+    saved = os.read(r, 4096)
+    os.close(r)
+    assert saved == expected
+
+    set_state(VFIO_USER_DEVICE_STATE_RESUMING)
+    r, w = os.pipe()
+    os.write(w, saved)
+    os.close(w)
+    size, _ = mig_data(VFIO_USER_MIG_DATA_WRITE, len(saved), fds=[r])
+    os.close(r)
+    assert size == len(saved)
+    assert bytes(restored) == expected
+
+
+def test_migration_v2_data_fd_limit():
+    set_state(VFIO_USER_DEVICE_STATE_PRE_COPY)
+    r, w = os.pipe()
+    size, _ = mig_data(VFIO_USER_MIG_DATA_READ, 150, fds=[w])
+    os.close(w)
+    assert size == 150
+    assert os.read(r, 4096) == bytes(range(150))
+    os.close(r)
+
+
+def test_migration_v2_no_region():
+    # there's no migration region to access
+    write_region(ctx, sock, VFU_PCI_DEV_MIGR_REGION_IDX, offset=0, count=4,
+                 data=b"\0" * 4, expect=errno.EINVAL)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -0,0 +1,222 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+import os
+import select
+
+ctx = None
+sock = None
+cap_off = None
+efds = []
+mask_changes = []
+
+NR_VECTORS = 4
+PBA_OFF = 0x800
+PCI_MSIX_ENTRY_VECTOR_CTRL = 0xc
+
+
+@vfu_region_access_cb_t
+def bar2_access(ctx, buf, count, offset, is_write):
+    # everything in the BAR is emulated
+    assert False
+
+
+@vfu_dev_irq_state_cb_t
+def msix_state(ctx, start, count, mask):
+    mask_changes.append((start, count, mask))
+
+
+def fired(i):
+    if not select.select([efds[i]], [], [], 0)[0]:
+        return False
+    os.read(efds[i], 8)
+    return True
+
+
+def set_msix_ctrl(flags):
+    write_region(ctx, sock, VFU_PCI_DEV_CFG_REGION_IDX,
+                 offset=cap_off + PCI_MSIX_FLAGS, count=2,
+                 data=struct.pack("H", (NR_VECTORS - 1) | flags))
+
+
+def set_vector_mask(vector, masked):
+    write_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX,
+                 offset=vector * 16 + PCI_MSIX_ENTRY_VECTOR_CTRL, count=4,
+                 data=struct.pack("I", 1 if masked else 0))
+
+
+def read_pba():
+    return struct.unpack("Q", read_region(ctx, sock,
+                                          VFU_PCI_DEV_BAR2_REGION_IDX,
+                                          offset=PBA_OFF, count=8))[0]
+
+
+def test_msix_setup():
+    global ctx, sock, cap_off
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    # no capability yet
+    assert vfu_setup_msix_table(ctx) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR2_REGION_IDX,
+                           size=0x1000, cb=bar2_access,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    # table in BAR2 at 0, PBA in BAR2 at PBA_OFF
+    cap_off = vfu_pci_add_capability(ctx, pos=0, flags=0,
+        data=struct.pack("ccHII", to_byte(PCI_CAP_ID_MSIX), b'\0',
+                         NR_VECTORS - 1, VFU_PCI_DEV_BAR2_REGION_IDX,
+                         PBA_OFF | VFU_PCI_DEV_BAR2_REGION_IDX))
+    assert cap_off > 0
+
+    assert vfu_setup_msix_table(ctx) == 0
+    assert vfu_setup_msix_table(ctx) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    ret = vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, NR_VECTORS)
+    assert ret == 0
+    vfu_setup_irq_state_callback(ctx, VFU_DEV_MSIX_IRQ, cb=msix_state)
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+    for i in range(NR_VECTORS):
+        efds.append(eventfd())
+
+    payload = vfio_irq_set(argsz=len(vfio_irq_set()),
+                           flags=VFIO_IRQ_SET_ACTION_TRIGGER |
+                           VFIO_IRQ_SET_DATA_EVENTFD, index=VFU_DEV_MSIX_IRQ,
+                           start=0, count=NR_VECTORS)
+    msg(ctx, sock, VFIO_USER_DEVICE_SET_IRQS, payload, fds=efds)
+
+
+def test_msix_table_access():
+    # vectors start out masked
+    for i in range(NR_VECTORS):
+        # accesses larger than a qword aren't allowed
+        read_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX, offset=i * 16,
+                    count=16, expect=errno.EINVAL)
+        result = read_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX,
+                             offset=i * 16 + 8, count=8)
+        assert struct.unpack("II", result) == (0, 1)
+
+    data = struct.pack("Q", 0xfee00000deadbeef)
+    write_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX, offset=16, count=8,
+                 data=data)
+    result = read_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX, offset=16,
+                         count=8)
+    assert result == data
+
+    # unaligned
+    write_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX, offset=18, count=4,
+                 data=b"\0\0\0\0", expect=errno.EINVAL)
+
+    # PBA writes are ignored
+    write_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX, offset=PBA_OFF,
+                 count=8, data=struct.pack("Q", 0xf))
+    assert read_pba() == 0
+
+
+def test_msix_trigger_disabled():
+    # MSI-X not enabled: masks don't apply
+    assert vfu_irq_trigger(ctx, 0) == 0
+    assert fired(0)
+    assert read_pba() == 0
+
+
+def test_msix_trigger_masked():
+    set_msix_ctrl(PCI_MSIX_FLAGS_ENABLE)
+
+    assert vfu_irq_trigger(ctx, 1) == 0
+    assert vfu_irq_trigger(ctx, 3) == 0
+    assert not fired(1)
+    assert not fired(3)
+    assert read_pba() == 0b1010
+
+    mask_changes.clear()
+    set_vector_mask(1, False)
+    assert mask_changes == [(1, 1, False)]
+    assert fired(1)
+    assert not fired(3)
+    assert read_pba() == 0b1000
+
+    # unmasked: straight through
+    assert vfu_irq_trigger(ctx, 1) == 0
+    assert fired(1)
+
+    set_vector_mask(1, True)
+    assert mask_changes == [(1, 1, False), (1, 1, True)]
+
+
+def test_msix_function_mask():
+    set_vector_mask(2, False)
+    set_msix_ctrl(PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL)
+
+    assert vfu_irq_trigger(ctx, 2) == 0
+    assert not fired(2)
+    assert read_pba() == 0b1100
+
+    set_msix_ctrl(PCI_MSIX_FLAGS_ENABLE)
+    assert fired(2)
+    # vector 3 is still masked
+    assert not fired(3)
+    assert read_pba() == 0b1000
+
+
+def test_msix_reset():
+    global sock
+
+    disconnect_client(ctx, sock)
+    sock = connect_client(ctx)
+
+    assert read_pba() == 0
+    result = read_region(ctx, sock, VFU_PCI_DEV_BAR2_REGION_IDX,
+                         offset=2 * 16 + 8, count=8)
+    assert struct.unpack("II", result) == (0, 1)
+
+
+def test_msix_cleanup():
+    for fd in efds:
+        os.close(fd)
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
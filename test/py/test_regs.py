@@ -0,0 +1,215 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+
+ctx = None
+sock = None
+generic_accesses = []
+writes = []
+counter = 0
+
+BAR = VFU_PCI_DEV_BAR0_REGION_IDX
+REG_ID = 0x0        # 4-byte RO
+REG_CTRL = 0x4      # 4-byte RW, write handler
+REG_STATUS = 0x8    # 2-byte W1C
+REG_COUNTER = 0x10  # 8-byte RO, read handler
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    generic_accesses.append((offset, count, is_write))
+    if not is_write:
+        c.memset(buf, 0xab, count)
+    return count
+
+
+@vfu_reg_write_cb_t
+def ctrl_write(ctx, offset, val):
+    writes.append((offset, val))
+
+
+@vfu_reg_read_cb_t
+def counter_read(ctx, offset):
+    global counter
+    counter += 1
+    return counter
+
+
+# not in offset order, the library sorts them
+REGS = [
+    vfu_reg_t(offset=REG_STATUS, width=2, type=VFU_REG_W1C, value=0),
+    vfu_reg_t(offset=REG_ID, width=4, type=VFU_REG_RO, value=0x1234abcd),
+    vfu_reg_t(offset=REG_COUNTER, width=8, type=VFU_REG_RO,
+              read=counter_read),
+    vfu_reg_t(offset=REG_CTRL, width=4, type=VFU_REG_RW, value=0,
+              write=ctrl_write),
+]
+
+
+def read_reg(offset, fmt):
+    data = read_region(ctx, sock, BAR, offset=offset,
+                       count=struct.calcsize(fmt))
+    return struct.unpack(fmt, data)[0]
+
+
+def write_reg(offset, fmt, val):
+    write_region(ctx, sock, BAR, offset=offset, count=struct.calcsize(fmt),
+                 data=struct.pack(fmt, val))
+
+
+def test_regs_setup():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    # region not set up yet
+    assert vfu_setup_region_regs(ctx, BAR, REGS) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    ret = vfu_setup_region(ctx, index=BAR, size=0x100, cb=bar0_access,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    bad = [
+        # misaligned
+        [vfu_reg_t(offset=0x2, width=4, type=VFU_REG_RW)],
+        # bad width
+        [vfu_reg_t(offset=0x0, width=3, type=VFU_REG_RW)],
+        # beyond the region
+        [vfu_reg_t(offset=0x100, width=4, type=VFU_REG_RW)],
+        # bad type
+        [vfu_reg_t(offset=0x0, width=4, type=3)],
+        # overlapping
+        [vfu_reg_t(offset=0x0, width=8, type=VFU_REG_RW),
+         vfu_reg_t(offset=0x4, width=4, type=VFU_REG_RW)],
+        [vfu_reg_t(offset=0x4, width=4, type=VFU_REG_RW),
+         vfu_reg_t(offset=0x0, width=8, type=VFU_REG_RW)],
+        [vfu_reg_t(offset=0x8, width=4, type=VFU_REG_RW),
+         vfu_reg_t(offset=0x8, width=4, type=VFU_REG_RW)],
+    ]
+    for regs in bad:
+        assert vfu_setup_region_regs(ctx, BAR, regs) == -1
+        assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_region_regs(ctx, VFU_PCI_DEV_CFG_REGION_IDX, REGS) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_region_regs(ctx, BAR, REGS) == 0
+    assert vfu_setup_region_regs(ctx, BAR, REGS) == -1
+    assert c.get_errno() == errno.EEXIST
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+
+def test_regs_ro():
+    assert read_reg(REG_ID, "I") == 0x1234abcd
+    write_reg(REG_ID, "I", 0)
+    assert read_reg(REG_ID, "I") == 0x1234abcd
+    assert generic_accesses == []
+
+
+def test_regs_rw():
+    write_reg(REG_CTRL, "I", 0xdeadbeef)
+    assert writes == [(REG_CTRL, 0xdeadbeef)]
+    assert read_reg(REG_CTRL, "I") == 0xdeadbeef
+    assert vfu_reg_get(ctx, BAR, REG_CTRL) == 0xdeadbeef
+    assert generic_accesses == []
+
+
+def test_regs_w1c():
+    assert vfu_reg_set_bits(ctx, BAR, REG_STATUS, 0x10005) == 0
+    # truncated to the register's width
+    assert read_reg(REG_STATUS, "H") == 0x5
+    write_reg(REG_STATUS, "H", 0x4)
+    assert read_reg(REG_STATUS, "H") == 0x1
+    assert generic_accesses == []
+
+
+def test_regs_read_handler():
+    assert read_reg(REG_COUNTER, "Q") == 1
+    assert read_reg(REG_COUNTER, "Q") == 2
+
+
+def test_regs_fallback():
+    # partial access to a register
+    assert read_reg(REG_COUNTER, "I") == 0xabababab
+    # no register at this offset
+    write_reg(0x20, "I", 0x1)
+    assert generic_accesses == [(REG_COUNTER, 4, False), (0x20, 4, True)]
+
+
+def test_regs_get_set():
+    assert vfu_reg_set(ctx, BAR, REG_ID, 0x5678) == 0
+    assert vfu_reg_get(ctx, BAR, REG_ID) == 0x5678
+    assert read_reg(REG_ID, "I") == 0x5678
+
+    assert vfu_reg_get(ctx, BAR, REG_ID + 1) is None
+    assert c.get_errno() == errno.ENOENT
+    assert vfu_reg_set(ctx, BAR, 0x20, 0) == -1
+    assert c.get_errno() == errno.ENOENT
+    assert vfu_reg_set_bits(ctx, VFU_PCI_DEV_BAR1_REGION_IDX, 0, 0) == -1
+    assert c.get_errno() == errno.ENOENT
+
+
+def test_regs_cleanup():
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+
+def test_regs_sparse():
+    # memory doesn't depend on how far apart the registers are
+    size = 1 << 30
+    sparse = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert sparse is not None
+    assert vfu_pci_init(sparse) == 0
+    assert vfu_setup_region(sparse, index=BAR, size=size, cb=bar0_access,
+                            flags=VFU_REGION_FLAG_RW) == 0
+
+    before = vfu_ctx_memory_usage(sparse)
+    regs = [vfu_reg_t(offset=0, width=8, type=VFU_REG_RW),
+            vfu_reg_t(offset=size - 8, width=8, type=VFU_REG_RW, value=42)]
+    assert vfu_setup_region_regs(sparse, BAR, regs) == 0
+    assert vfu_ctx_memory_usage(sparse) - before < 4096
+
+    assert vfu_reg_get(sparse, BAR, size - 8) == 42
+    assert vfu_reg_get(sparse, BAR, size - 16) is None
+
+    vfu_destroy_ctx(sparse)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
@@ -31,6 +31,7 @@ from unittest.mock import patch
 from libvfio_user import *
 import errno
 import os
+import threading
 
 ctx = None
 sock = None
@@ -110,6 +111,14 @@ def test_bad_command():
     get_reply(sock, expect=errno.EINVAL)
 
 
+def test_bad_ext_command():
+    hdr = vfio_user_header(VFIO_USER_EXT_MAX, size=1)
+
+    sock.send(hdr + b'\0')
+    vfu_run_ctx(ctx)
+    get_reply(sock, expect=errno.EINVAL)
+
+
 def test_no_payload():
     hdr = vfio_user_header(VFIO_USER_DEVICE_SET_IRQS, size=0)
     sock.send(hdr)
@@ -117,6 +126,22 @@ def test_no_payload():
     get_reply(sock, expect=errno.EINVAL)
 
 
+def test_body_in_pieces():
+    payload = bytes(vfio_region_info(argsz=len(vfio_region_info()), flags=0,
+                                     index=VFU_PCI_DEV_MIGR_REGION_IDX,
+                                     cap_offset=0, size=0, offset=0))
+    hdr = vfio_user_header(VFIO_USER_DEVICE_GET_REGION_INFO,
+                           size=len(payload))
+    sock.send(hdr + payload[:8])
+
+    # the rest of the body arrives while the server is reading it
+    timer = threading.Timer(0.1, sock.send, args=(payload[8:],))
+    timer.start()
+    vfu_run_ctx(ctx)
+    timer.join()
+    get_reply(sock, expect=0)
+
+
 def test_bad_request_closes_fds():
     payload = vfio_irq_set(argsz=argsz, flags=VFIO_IRQ_SET_ACTION_TRIGGER |
                            VFIO_IRQ_SET_DATA_BOOL, index=VFU_DEV_MSIX_IRQ,
@@ -0,0 +1,181 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+import threading
+
+ctx = None
+sock = None
+accesses = []
+
+BAR = VFU_PCI_DEV_BAR0_REGION_IDX
+ID_OFF = 0x0
+ID_SIZE = 8
+STATUS_OFF = 0x10
+STATUS_SIZE = 4
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    accesses.append((offset, count, is_write))
+    if not is_write:
+        c.memset(buf, 0xff, count)
+    return count
+
+
+def read_bar(offset, count):
+    return read_region(ctx, sock, BAR, offset=offset, count=count)
+
+
+def test_shadow_setup():
+    global ctx
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+
+    ret = vfu_setup_region(ctx, index=BAR, size=0x100, cb=bar0_access,
+                           flags=(VFU_REGION_FLAG_RW | VFU_REGION_FLAG_MEM))
+    assert ret == 0
+
+    # beyond the region, config space
+    assert vfu_region_shadow_range(ctx, BAR, 0xf8, 0x10) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_region_shadow_range(ctx, VFU_PCI_DEV_CFG_REGION_IDX, 0,
+                                   4) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_region_shadow_range(ctx, BAR, ID_OFF, ID_SIZE) == 0
+    assert vfu_region_shadow_range(ctx, BAR, STATUS_OFF, STATUS_SIZE) == 0
+
+    # overlapping
+    assert vfu_region_shadow_range(ctx, BAR, ID_OFF + 4, 8) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    assert vfu_region_shadow_range(ctx, BAR, 0x20, 4) == -1
+    assert c.get_errno() == errno.EBUSY
+
+
+def test_shadow_not_yet_valid():
+    global sock
+
+    sock = connect_client(ctx)
+
+    assert read_bar(ID_OFF, 4) == b'\xff' * 4
+    assert accesses == [(ID_OFF, 4, False)]
+    accesses.clear()
+
+    # a partial write doesn't make the range valid
+    assert vfu_region_shadow_write(ctx, BAR, ID_OFF, b'\x01\x02') == 0
+    assert read_bar(ID_OFF, 2) == b'\xff' * 2
+    assert accesses == [(ID_OFF, 2, False)]
+    accesses.clear()
+
+
+def test_shadow_read():
+    assert vfu_region_shadow_write(ctx, BAR, ID_OFF,
+                                   b'\x01\x02\x03\x04\x05\x06\x07\x08') == 0
+    assert read_bar(ID_OFF, 8) == b'\x01\x02\x03\x04\x05\x06\x07\x08'
+    assert read_bar(ID_OFF + 2, 4) == b'\x03\x04\x05\x06'
+
+    # a partial update of a valid range
+    assert vfu_region_shadow_write(ctx, BAR, ID_OFF + 7, b'\x10') == 0
+    assert read_bar(ID_OFF + 4, 4) == b'\x05\x06\x07\x10'
+    assert accesses == []
+
+    # straddling the end of the range
+    assert read_bar(ID_OFF + 4, 8) == b'\xff' * 8
+    assert accesses == [(ID_OFF + 4, 8, False)]
+    accesses.clear()
+
+    # outside any range
+    assert vfu_region_shadow_write(ctx, BAR, 0x40, b'\x00') == -1
+    assert c.get_errno() == errno.ENOENT
+
+
+def test_shadow_client_write_invalidates():
+    assert vfu_region_shadow_write(ctx, BAR, STATUS_OFF, b'\xaa' * 4) == 0
+    assert read_bar(STATUS_OFF, 4) == b'\xaa' * 4
+
+    write_region(ctx, sock, BAR, offset=STATUS_OFF + 2, count=1,
+                 data=b'\x00')
+    assert accesses == [(STATUS_OFF + 2, 1, True)]
+    accesses.clear()
+
+    assert read_bar(STATUS_OFF, 4) == b'\xff' * 4
+    assert accesses == [(STATUS_OFF, 4, False)]
+    accesses.clear()
+
+    # the other range is still valid
+    assert read_bar(ID_OFF, 2) == b'\x01\x02'
+    assert accesses == []
+
+
+def test_shadow_invalidate():
+    assert vfu_region_shadow_invalidate(ctx, BAR, 0, 0x100) == 0
+    assert read_bar(ID_OFF, 2) == b'\xff' * 2
+    assert accesses == [(ID_OFF, 2, False)]
+    accesses.clear()
+
+
+def test_shadow_concurrent_updates():
+    # Values are always one repeated byte; a torn read would show two.
+    stop = threading.Event()
+
+    def updater():
+        i = 0
+        while not stop.is_set():
+            vfu_region_shadow_write(ctx, BAR, ID_OFF, bytes([i % 256]) * 8)
+            i += 1
+
+    assert vfu_region_shadow_write(ctx, BAR, ID_OFF, b'\x00' * 8) == 0
+    t = threading.Thread(target=updater)
+    t.start()
+    try:
+        for _ in range(200):
+            data = read_bar(ID_OFF, 8)
+            assert len(set(data)) == 1
+    finally:
+        stop.set()
+        t.join()
+    assert accesses == []
+
+
+def test_shadow_cleanup():
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab:
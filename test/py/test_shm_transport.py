@@ -0,0 +1,222 @@
+#
+# Copyright (c) 2022 Nutanix Inc. All rights reserved.
+#
+# Authors: John Levon <john.levon@nutanix.com>
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+from libvfio_user import *
+import errno
+import os
+
+ctx = None
+sock = None
+shm = None
+
+RING_SIZE = 4096
+# struct vfio_user_shm_ring: head, pad, tail, pad, data[]
+RING_HDR_SIZE = 128
+
+
+class Ring:
+    """One direction of the shared-memory transport, as seen by the client."""
+
+    def __init__(self, mm, idx):
+        self.mm = mm
+        self.base = idx * (RING_HDR_SIZE + RING_SIZE)
+        self.data = self.base + RING_HDR_SIZE
+
+    def get(self, off):
+        return struct.unpack_from("I", self.mm, self.base + off)[0]
+
+    def set(self, off, val):
+        struct.pack_into("I", self.mm, self.base + off, val & 0xffffffff)
+
+    def put(self, buf):
+        tail = self.get(64)
+        for i, b in enumerate(buf):
+            self.mm[self.data + ((tail + i) % RING_SIZE)] = b
+        self.set(64, tail + len(buf))
+
+    def take(self, count):
+        head = self.get(0)
+        buf = bytes(self.mm[self.data + ((head + i) % RING_SIZE)]
+                    for i in range(count))
+        self.set(0, head + count)
+        return buf
+
+    def used(self):
+        return (self.get(64) - self.get(0)) & 0xffffffff
+
+
+def shm_setup(ring_size=RING_SIZE, expect=0):
+    memfd = os.memfd_create("vfio-user-shm")
+    os.ftruncate(memfd, 2 * (RING_HDR_SIZE + RING_SIZE))
+    c2s = eventfd()
+    s2c = eventfd()
+
+    payload = struct.pack("IIQ", 16, 0, ring_size)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=expect,
+        fds=[memfd, c2s, s2c])
+
+    mm = mmap.mmap(memfd, 2 * (RING_HDR_SIZE + RING_SIZE))
+    os.close(memfd)
+    return SimpleNamespace(mm=mm, tx=Ring(mm, 0), rx=Ring(mm, 1),
+                           c2s=c2s, s2c=s2c)
+
+
+def shm_msg(cmd, payload, expect=0):
+    shm.tx.put(vfio_user_header(cmd, size=len(payload)) + payload)
+    os.write(shm.c2s, struct.pack("Q", 1))
+
+    vfu_run_ctx(ctx)
+
+    assert struct.unpack("Q", os.read(shm.s2c, 8))[0] >= 1
+    hdr = shm.rx.take(SIZEOF_VFIO_USER_HEADER)
+    (msg_id, rcmd, msg_size, flags, err) = struct.unpack("HHIII", hdr)
+    assert rcmd == cmd
+    assert (flags & VFIO_USER_F_TYPE_REPLY) != 0
+    assert err == expect
+    return shm.rx.take(msg_size - SIZEOF_VFIO_USER_HEADER)
+
+
+def test_shm_setup_unsupported():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+    payload = struct.pack("IIQ", 16, 0, RING_SIZE)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.ENOTSUP)
+
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+
+def test_shm_setup():
+    global ctx, sock, shm
+
+    ctx = vfu_create_ctx(trans=VFU_TRANS_SHM,
+                         flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    ret = vfu_pci_init(ctx)
+    assert ret == 0
+    ret = vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX, size=4096,
+                           flags=VFU_REGION_FLAG_RW)
+    assert ret == 0
+    ret = vfu_realize_ctx(ctx)
+    assert ret == 0
+
+    sock = connect_client(ctx)
+
+    # too small, then not a power of two
+    payload = struct.pack("IIQ", 16, 0, 1024)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EINVAL)
+    payload = struct.pack("IIQ", 16, 0, RING_SIZE + 1)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EINVAL)
+
+    # would overflow the ring offsets
+    payload = struct.pack("IIQ", 16, 0, 1 << 63)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EINVAL)
+
+    # missing fds
+    payload = struct.pack("IIQ", 16, 0, RING_SIZE)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EINVAL)
+
+    # memfd only big enough for one ring
+    memfd = os.memfd_create("vfio-user-shm")
+    os.ftruncate(memfd, RING_HDR_SIZE + RING_SIZE)
+    c2s = eventfd()
+    s2c = eventfd()
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EINVAL,
+        fds=[memfd, c2s, s2c])
+    for fd in [memfd, c2s, s2c]:
+        os.close(fd)
+
+    shm = shm_setup()
+
+
+def test_shm_device_get_info():
+    payload = struct.pack("IIII", len(vfio_user_device_info()), 0, 0, 0)
+
+    result = shm_msg(VFIO_USER_DEVICE_GET_INFO, payload)
+
+    (argsz, flags, num_regions, num_irqs) = struct.unpack("IIII", result)
+    assert num_regions == VFU_PCI_DEV_NUM_REGIONS
+
+    # nothing was sent over the socket
+    sock.setblocking(False)
+    try:
+        sock.recv(4096)
+        assert False
+    except BlockingIOError:
+        pass
+    sock.setblocking(True)
+
+
+def test_shm_region_access_wraps():
+    # Enough round trips to wrap both rings several times.
+    for i in range(64):
+        payload = struct.pack("QII", 0, VFU_PCI_DEV_CFG_REGION_IDX, 4)
+        result = shm_msg(VFIO_USER_REGION_READ, payload)
+        assert len(result) == 16 + 4
+
+    assert shm.tx.used() == 0
+    assert shm.rx.used() == 0
+
+
+def test_shm_bad_request():
+    # A bad request still gets its error reply through the ring.
+    shm_msg(VFIO_USER_DEVICE_GET_INFO, struct.pack("II", 0, 0),
+            expect=errno.EINVAL)
+
+
+def test_shm_setup_twice():
+    memfd = os.memfd_create("vfio-user-shm")
+    os.ftruncate(memfd, 2 * (RING_HDR_SIZE + RING_SIZE))
+    c2s = eventfd()
+    s2c = eventfd()
+    payload = struct.pack("IIQ", 16, 0, RING_SIZE)
+    msg(ctx, sock, VFIO_USER_SHM_SETUP, payload, expect=errno.EEXIST,
+        fds=[memfd, c2s, s2c])
+    os.close(memfd)
+    os.close(c2s)
+    os.close(s2c)
+
+
+def test_shm_cleanup():
+    disconnect_client(ctx, sock)
+    shm.mm.close()
+    os.close(shm.c2s)
+    os.close(shm.s2c)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
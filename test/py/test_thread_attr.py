@@ -0,0 +1,122 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+
+from libvfio_user import *
+import errno
+import glob
+import os
+
+ctx = None
+sock = None
+
+SCHED_FIFO = 1
+
+
+@vfu_region_access_cb_t
+def bar0_access(ctx, buf, count, offset, is_write):
+    return count
+
+
+def find_thread(name):
+    for comm in glob.glob("/proc/self/task/*/comm"):
+        with open(comm) as f:
+            if f.read().strip() == name:
+                return os.path.dirname(comm)
+    return None
+
+
+def cpus_allowed(task):
+    with open(os.path.join(task, "status")) as f:
+        for line in f:
+            if line.startswith("Cpus_allowed_list:"):
+                return line.split()[1]
+    return None
+
+
+def test_thread_attr_bad():
+    global ctx
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+
+    attr = vfu_thread_attr_t(nr_cpus=1, numa_node=-1)
+    assert lib.vfu_setup_thread_attr(ctx, attr) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_thread_attr(ctx, cpus=[-1]) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_thread_attr(ctx, numa_node=-2) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # no such node
+    assert vfu_setup_thread_attr(ctx, numa_node=1023) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_setup_thread_attr(ctx, sched_policy=1234) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # real-time policies need a priority, others mustn't have one
+    assert vfu_setup_thread_attr(ctx, sched_policy=SCHED_FIFO) == -1
+    assert c.get_errno() == errno.EINVAL
+    assert vfu_setup_thread_attr(ctx, sched_priority=1) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    # back to the defaults
+    assert lib.vfu_setup_thread_attr(ctx, None) == 0
+
+
+def test_thread_attr_ioregionfd():
+    global sock
+
+    node = 0 if os.path.exists("/sys/devices/system/node/node0") else -1
+    assert vfu_setup_thread_attr(ctx, cpus=[0], numa_node=node,
+                                 name=b"vfut") == 0
+
+    assert vfu_setup_region(ctx, index=VFU_PCI_DEV_BAR0_REGION_IDX,
+                            size=0x1000, cb=bar0_access,
+                            flags=(VFU_REGION_FLAG_RW |
+                                   VFU_REGION_FLAG_MEM)) == 0
+    assert vfu_realize_ctx(ctx) == 0
+    sock = connect_client(ctx)
+
+    assert vfu_create_ioregionfd(ctx, VFU_PCI_DEV_BAR0_REGION_IDX, 0,
+                                 0x100) == 0
+
+    task = find_thread("vfut-ioregfd")
+    assert task is not None
+    assert cpus_allowed(task) == "0"
+
+
+def test_thread_attr_cleanup():
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -0,0 +1,124 @@
+#
+# Copyright (c) 2023 Nutanix Inc. All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#      * Redistributions of source code must retain the above copyright
+#        notice, this list of conditions and the following disclaimer.
+#      * Redistributions in binary form must reproduce the above copyright
+#        notice, this list of conditions and the following disclaimer in the
+#        documentation and/or other materials provided with the distribution.
+#      * Neither the name of Nutanix nor the names of its contributors may be
+#        used to endorse or promote products derived from this software without
+#        specific prior written permission.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+#  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+#  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+#  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+#  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+#  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+#  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+#  DAMAGE.
+#
+
+
+from libvfio_user import *
+from libvfio_user import *
+import ctypes as c
+import errno
+import json
+import tempfile
+
+ctx = None
+sock = None
+
+
+def test_trace_bad():
+    assert vfu_trace_start(1 << 25) == -1
+    assert c.get_errno() == errno.EINVAL
+
+    assert vfu_trace_start() == 0
+    assert vfu_trace_start() == -1
+    assert c.get_errno() == errno.EBUSY
+
+    assert vfu_trace_export(b"/dev/null") == -1
+    assert c.get_errno() == errno.EBUSY
+
+    vfu_trace_stop()
+
+
+def test_trace_setup():
+    global ctx, sock
+
+    ctx = vfu_create_ctx(flags=LIBVFIO_USER_FLAG_ATTACH_NB)
+    assert ctx is not None
+    assert vfu_pci_init(ctx) == 0
+    assert vfu_setup_device_dma(ctx) == 0
+    vfu_setup_device_quiesce_cb(ctx)
+    assert vfu_setup_device_nr_irqs(ctx, VFU_DEV_MSIX_IRQ, 1) == 0
+    assert vfu_realize_ctx(ctx) == 0
+
+    sock = connect_client(ctx)
+
+
+def test_trace_export():
+    assert vfu_trace_start(16) == 0
+
+    payload = vfio_user_dma_map(argsz=len(vfio_user_dma_map()),
+        flags=(VFIO_USER_F_DMA_REGION_READ | VFIO_USER_F_DMA_REGION_WRITE),
+        offset=0, addr=0x10000, size=0x1000)
+    msg(ctx, sock, VFIO_USER_DMA_MAP, payload)
+
+    vfu_irq_trigger(ctx, 0)
+
+    vfu_trace_stop()
+
+    # not recorded
+    vfu_irq_trigger(ctx, 0)
+
+    with tempfile.NamedTemporaryFile(mode="r") as f:
+        assert vfu_trace_export(f.name.encode()) == 0
+        trace = json.load(f)
+
+    events = [(e["name"], e["ph"]) for e in trace["traceEvents"]]
+
+    assert ("get_request", "B") in events
+    assert ("get_request", "E") in events
+    assert ("handle_request", "B") in events
+    assert ("handle_request", "E") in events
+    assert ("quiesce_cb", "B") in events
+    assert ("dma_map", "B") in events
+    assert events.count(("irq_trigger", "i")) == 1
+
+    for e in trace["traceEvents"]:
+        if e["name"] == "dma_map":
+            assert e["args"]["iova"] == "0x10000"
+        if e["name"] == "handle_request" and e["ph"] == "B":
+            assert e["args"]["cmd"] == hex(VFIO_USER_DMA_MAP)
+
+
+def test_trace_overwrite():
+    assert vfu_trace_start(4) == 0
+
+    for i in range(10):
+        vfu_irq_trigger(ctx, 0)
+
+    vfu_trace_stop()
+
+    with tempfile.NamedTemporaryFile(mode="r") as f:
+        assert vfu_trace_export(f.name.encode()) == 0
+        trace = json.load(f)
+
+    events = [e["name"] for e in trace["traceEvents"] if e["ph"] != "M"]
+    assert events == ["irq_trigger"] * 4
+
+
+def test_trace_cleanup():
+    disconnect_client(ctx, sock)
+    vfu_destroy_ctx(ctx)
+
+# ex: set tabstop=4 shiftwidth=4 softtabstop=4 expandtab: #
@@ -45,13 +45,15 @@
 #include "irq.h"
 #include "libvfio-user.h"
 #include "migration.h"
+#include "migration_enc.h"
 #include "migration_priv.h"
 #include "mocks.h"
 #include "pci.h"
 #include "private.h"
 #include "tran_sock.h"
 
-#define DMACSIZE (sizeof(dma_controller_t) + sizeof(dma_memory_region_t) * 5)
+#define DMACSIZE (sizeof(dma_controller_t))
+#define DMA_NR_REGIONS 10
 
 /*
  * These globals are used in the unit tests; they're re-initialized each time by
@@ -59,6 +61,7 @@
  * boiler-plate.
  */
 static char dmacbuf[DMACSIZE];
+static dma_memory_region_t dmaregions[DMA_NR_REGIONS];
 static vfu_ctx_t vfu_ctx;
 static vfu_msg_t msg;
 static size_t nr_fds;
@@ -99,8 +102,12 @@ setup(void **state UNUSED)
 
     memset(dmacbuf, 0, DMACSIZE);
 
+    memset(dmaregions, 0, sizeof(dmaregions));
+
     vfu_ctx.dma = (void *)dmacbuf;
-    vfu_ctx.dma->max_regions = 10;
+    vfu_ctx.dma->max_regions = DMA_NR_REGIONS;
+    vfu_ctx.dma->regions = dmaregions;
+    vfu_ctx.dma->nr_alloced = DMA_NR_REGIONS;
     vfu_ctx.dma->vfu_ctx = &vfu_ctx;
 
     memset(&msg, 0, sizeof(msg));
@@ -383,6 +390,74 @@ test_dma_addr_to_sgl(void **state UNUSED)
     /* TODO test more scenarios */
 }
 
+static void
+test_dma_addrs_to_sgl(void **state UNUSED)
+{
+    dma_memory_region_t *r, *r1;
+    vfu_dma_desc_t descs[] = {
+        { (vfu_dma_addr_t)0x2000, 0x400, PROT_READ },
+        { (vfu_dma_addr_t)0x2400, 0x400, PROT_WRITE },
+        /* spans both regions */
+        { (vfu_dma_addr_t)0x4000, 0x2000, PROT_READ },
+        { (vfu_dma_addr_t)0x1000, 0, PROT_READ },
+    };
+    struct iovec iov[4] = { };
+    dma_sg_t sg[4];
+    int ret;
+
+    vfu_ctx.dma->nregions = 2;
+    r = &vfu_ctx.dma->regions[0];
+    r->info.iova.iov_base = (void *)0x1000;
+    r->info.iova.iov_len = 0x4000;
+    r->info.vaddr = (void *)0xdeadbeef;
+    r->info.prot = PROT_READ|PROT_WRITE;
+    r1 = &vfu_ctx.dma->regions[1];
+    r1->info.iova.iov_base = (void *)0x5000;
+    r1->info.iova.iov_len = 0x2000;
+    r1->info.vaddr = (void *)0xcafebabe;
+    r1->info.prot = PROT_READ;
+
+    ret = dma_addrs_to_sgl(vfu_ctx.dma, descs, 4, sg, iov, 4);
+    assert_int_equal(4, ret);
+    assert_int_equal(0, sg[0].region);
+    assert_int_equal(0x1000, sg[0].offset);
+    assert_int_equal(0x400, sg[0].length);
+    assert_false(sg[0].writeable);
+    assert_int_equal(0x1400, sg[1].offset);
+    assert_true(sg[1].writeable);
+    assert_int_equal(0, sg[2].region);
+    assert_int_equal(0x3000, sg[2].offset);
+    assert_int_equal(0x1000, sg[2].length);
+    assert_int_equal(1, sg[3].region);
+    assert_int_equal(0, sg[3].offset);
+    assert_int_equal(0x1000, sg[3].length);
+    assert_int_equal(r->info.vaddr + 0x1400, iov[1].iov_base);
+    assert_int_equal(0x400, iov[1].iov_len);
+    assert_int_equal(r1->info.vaddr, iov[3].iov_base);
+    assert_int_equal(0x1000, iov[3].iov_len);
+
+    /* too small: the number of entries needed */
+    ret = dma_addrs_to_sgl(vfu_ctx.dma, descs, 4, sg, NULL, 2);
+    assert_int_equal(-4 - 1, ret);
+
+    /* protection violation in the second region */
+    descs[2].prot = PROT_WRITE;
+    ret = dma_addrs_to_sgl(vfu_ctx.dma, descs, 4, sg, NULL, 4);
+    assert_int_equal(-1, ret);
+    assert_int_equal(EACCES, errno);
+
+    descs[2].dma_addr = (vfu_dma_addr_t)0x8000;
+    ret = dma_addrs_to_sgl(vfu_ctx.dma, descs, 4, sg, NULL, 4);
+    assert_int_equal(-1, ret);
+    assert_int_equal(ENOENT, errno);
+
+    /* not mappable */
+    r->info.vaddr = NULL;
+    ret = dma_addrs_to_sgl(vfu_ctx.dma, descs, 1, sg, iov, 4);
+    assert_int_equal(-1, ret);
+    assert_int_equal(EFAULT, errno);
+}
+
 static void
 test_vfu_setup_device_dma(void **state UNUSED)
 {
@@ -393,11 +468,6 @@ test_vfu_setup_device_dma(void **state UNUSED)
     free(vfu_ctx.dma);
 }
 
-typedef struct {
-    int fd;
-    int conn_fd;
-} tran_sock_t;
-
 static void
 test_migration_state_transitions(void **state UNUSED)
 {
@@ -581,7 +651,7 @@ test_device_is_stopped_and_copying(UNUSED void **state)
     assert_false(device_is_stopped(vfu_ctx.migration));
 
     size_t i;
-    struct migration migration;
+    struct migration migration = { { 0 } };
 #if !defined(__clang__)
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpragmas"
@@ -609,6 +679,15 @@ test_device_is_stopped_and_copying(UNUSED void **state)
             assert_false(r);
         }
     }
+
+    migration.is_v2 = true;
+    for (i = 0; i < VFIO_USER_DEVICE_NUM_STATES; i++) {
+        migration.v2.state = i;
+        assert_int_equal(i == VFIO_USER_DEVICE_STATE_STOP_COPY,
+                         device_is_stopped_and_copying(vfu_ctx.migration));
+        assert_int_equal(i == VFIO_USER_DEVICE_STATE_STOP,
+                         device_is_stopped(vfu_ctx.migration));
+    }
 }
 
 static void
@@ -616,10 +695,17 @@ test_cmd_allowed_when_stopped_and_copying(UNUSED void **state)
 {
     size_t i;
 
-    for (i = 0; i < VFIO_USER_MAX; i++) {
-        bool r = cmd_allowed_when_stopped_and_copying(i);
+    for (i = 0; i < VFIO_USER_EXT_MAX; i++) {
+        bool r;
+
+        if (i == VFIO_USER_MAX) {
+            i = VFIO_USER_EXT_BASE;
+        }
+        r = cmd_allowed_when_stopped_and_copying(i);
         if (i == VFIO_USER_REGION_READ || i == VFIO_USER_REGION_WRITE ||
-            i == VFIO_USER_DIRTY_PAGES) {
+            i == VFIO_USER_DIRTY_PAGES || i == VFIO_USER_DEVICE_FEATURE ||
+            i == VFIO_USER_MIG_DATA_READ || i == VFIO_USER_MIG_DATA_WRITE ||
+            i == VFIO_USER_MIG_STREAMS) {
             assert_true(r);
         } else {
             assert_false(r);
@@ -669,6 +755,101 @@ test_should_exec_command(UNUSED void **state)
     assert_true(should_exec_command(&vfu_ctx, 0xbeef));
 }
 
+static void
+test_migration_encoding(UNUSED void **state)
+{
+    const size_t pgsize = 0x1000, size = 4 * pgsize + 0x10;
+    struct migr_enc *src, *dst;
+    char *raw, *enc, *out;
+    ssize_t len, enc_len;
+    uint64_t pos;
+
+    src = migr_enc_create(VFU_MIGR_ENC_ZERO_PAGES |
+                          VFU_MIGR_ENC_UNCHANGED_PAGES, pgsize, 8 * pgsize);
+    dst = migr_enc_create(VFU_MIGR_ENC_ZERO_PAGES |
+                          VFU_MIGR_ENC_UNCHANGED_PAGES, pgsize, 8 * pgsize);
+    assert_non_null(src);
+    assert_non_null(dst);
+    raw = calloc(1, size);
+    enc = malloc(migr_enc_bound(src, size));
+    out = malloc(size);
+
+    /* page 0 and the partial page have data, pages 1-3 are zero */
+    memset(raw, 'a', pgsize);
+    memset(raw + 4 * pgsize, 'b', 0x10);
+    enc_len = migr_encode(src, pgsize, raw, size, enc,
+                          migr_enc_bound(src, size));
+    assert_int_equal(sizeof(struct migr_enc_hdr) +
+                     3 * sizeof(struct migr_enc_rec) + pgsize + 0x10, enc_len);
+    len = migr_decode(dst, enc, enc_len, out, size, &pos);
+    assert_int_equal(size, len);
+    assert_int_equal(pgsize, pos);
+    assert_memory_equal(raw, out, size);
+
+    /* only page 2 changes, all other whole pages are elided */
+    memset(raw + 2 * pgsize, 'c', pgsize);
+    enc_len = migr_encode(src, pgsize, raw, size, enc,
+                          migr_enc_bound(src, size));
+    assert_int_equal(sizeof(struct migr_enc_hdr) +
+                     5 * sizeof(struct migr_enc_rec) + pgsize + 0x10, enc_len);
+    memset(out, 0, size);
+    len = migr_decode(dst, enc, enc_len, out, size, &pos);
+    assert_int_equal(size, len);
+    assert_memory_equal(raw, out, size);
+
+    /* the receiver has forgotten the unchanged pages */
+    migr_enc_reset(dst);
+    assert_int_equal(-1, migr_decode(dst, enc, enc_len, out, size, &pos));
+    assert_int_equal(EINVAL, errno);
+    migr_enc_reset(src);
+    enc_len = migr_encode(src, pgsize, raw, size, enc,
+                          migr_enc_bound(src, size));
+    assert_int_equal(size, migr_decode(dst, enc, enc_len, out, size, &pos));
+
+    /* the receiver has different contents for them */
+    memset(raw, 'd', pgsize);
+    migr_enc_reset(src);
+    migr_encode(src, pgsize, raw, size, enc, migr_enc_bound(src, size));
+    enc_len = migr_encode(src, pgsize, raw, size, enc,
+                          migr_enc_bound(src, size));
+    assert_int_equal(-1, migr_decode(dst, enc, enc_len, out, size, &pos));
+    assert_int_equal(EBADMSG, errno);
+
+    /* truncated */
+    assert_int_equal(-1, migr_decode(dst, enc, enc_len - 1, out, size, &pos));
+    /* doesn't fit */
+    assert_int_equal(-1, migr_encode(src, 0, raw, size, enc, pgsize));
+    assert_int_equal(EOVERFLOW, errno);
+
+    free(raw);
+    free(enc);
+    free(out);
+    migr_enc_destroy(src);
+    migr_enc_destroy(dst);
+}
+
+static void
+test_log_ratelimit(UNUSED void **state)
+{
+    struct log_ratelimit rl = { 0 };
+    uint64_t suppressed;
+    int i;
+
+    for (i = 0; i < LOG_RATELIMIT_BURST; i++) {
+        assert_true(log_ratelimit(&rl, &suppressed));
+        assert_int_equal(0, suppressed);
+    }
+    assert_false(log_ratelimit(&rl, &suppressed));
+    assert_false(log_ratelimit(&rl, &suppressed));
+
+    /* the next interval reports what was dropped in this one */
+    rl.begin_ns -= LOG_RATELIMIT_INTERVAL_NS;
+    assert_true(log_ratelimit(&rl, &suppressed));
+    assert_int_equal(2, suppressed);
+    assert_true(log_ratelimit(&rl, &suppressed));
+    assert_int_equal(0, suppressed);
+}
+
 int
 main(void)
 {
@@ -681,6 +862,7 @@ main(void)
         cmocka_unit_test_setup(test_dma_controller_remove_region_mapped, setup),
         cmocka_unit_test_setup(test_dma_controller_remove_region_unmapped, setup),
         cmocka_unit_test_setup(test_dma_addr_to_sgl, setup),
+        cmocka_unit_test_setup(test_dma_addrs_to_sgl, setup),
         cmocka_unit_test_setup(test_vfu_setup_device_dma, setup),
         cmocka_unit_test_setup(test_migration_state_transitions, setup),
         cmocka_unit_test_setup_teardown(test_setup_migration_region_size_ok,
@@ -701,6 +883,8 @@ main(void)
         cmocka_unit_test_setup(test_device_is_stopped_and_copying, setup),
         cmocka_unit_test_setup(test_cmd_allowed_when_stopped_and_copying, setup),
         cmocka_unit_test_setup(test_should_exec_command, setup),
+        cmocka_unit_test(test_migration_encoding),
+        cmocka_unit_test(test_log_ratelimit),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);